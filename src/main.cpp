@@ -2,9 +2,58 @@
 #include <fstream>
 #include <vector>
 #include <variant>
+#include <algorithm>
+#include <string>
+#include <memory>
+#include <queue>
+#include <atomic>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+#include <chrono>
+#include <cstdint>
+#include <cmath>
+#include <unordered_map>
+#include <filesystem>
+#include <deque>
+#include <cstring>
+#include <cstdlib>
+#include <cerrno>
+#include <type_traits>
+#include <functional>
+#include <list>
+#include <bit>
+#include <iomanip>
+
+#ifdef _WIN32
+	#ifndef NOMINMAX
+		#define NOMINMAX
+	#endif
+	#include <windows.h>
+#else
+	#include <fcntl.h>
+	#include <sys/mman.h>
+	#include <unistd.h>
+	#include <netdb.h>
+	#include <netinet/in.h>
+	#include <netinet/tcp.h>
+	#include <poll.h>
+	#include <spawn.h>
+	#include <sys/socket.h>
+	#include <sys/un.h>
+	#include <sys/wait.h>
+	#include <csignal>
+	#include <pthread.h>
+#endif
 
 #include <glm/glm.hpp>
 
+// SSE2 is always there on x86-64
+#if defined(__SSE2__) || defined(_M_X64)
+	#define SIMPLERAY_SSE
+	#include <emmintrin.h>
+#endif
+
 using namespace glm;
 
 struct global_vars_t;
@@ -25,13 +74,353 @@ double math_convert_radians_to_degrees(double radians)
 
 #include <random>
 
+// splitmix64 finalizer, good enough to turn pixel indices and seeds into
+// uncorrelated generator seeds
+std::uint64_t math_hash(std::uint64_t value)
+{
+	value += 0x9e3779b97f4a7c15ull;
+	value = (value ^ (value >> 30)) * 0xbf58476d1ce4e5b9ull;
+	value = (value ^ (value >> 27)) * 0x94d049bb133111ebull;
+	return value ^ (value >> 31);
+}
+
+/// @brief xoshiro256** generator, it satisfies UniformRandomBitGenerator so it
+/// works with std distributions. Unlike std::mt19937 it can be re-seeded for
+/// every pixel almost for free (four splitmix64 steps instead of 624 words)
+class random_generator_t
+{
+public:
+	using result_type = std::uint64_t;
+
+	random_generator_t() { this->seed(0); }
+	~random_generator_t() {}
+
+	static constexpr result_type min() { return 0; }
+	static constexpr result_type max() { return ~result_type(0); }
+
+	void seed(std::uint64_t value)
+	{
+		for (auto& state : this->m_state)
+		{
+			value = math_hash(value);
+			state = value;
+		}
+	}
+
+	result_type operator()()
+	{
+		auto result = rotl(this->m_state[1] * 5, 7) * 9;
+		auto t = this->m_state[1] << 17;
+
+		this->m_state[2] ^= this->m_state[0];
+		this->m_state[3] ^= this->m_state[1];
+		this->m_state[1] ^= this->m_state[2];
+		this->m_state[0] ^= this->m_state[3];
+		this->m_state[2] ^= t;
+		this->m_state[3] = rotl(this->m_state[3], 45);
+
+		return result;
+	}
+
+private:
+	static std::uint64_t rotl(std::uint64_t value, int shift)
+	{
+		return (value << shift) | (value >> (64 - shift));
+	}
+
+private:
+	std::uint64_t m_state[4];
+};
+
+/// @brief four xoshiro128+ generators, one per SSE lane, which fill buffers
+/// of uniform floats, unit vectors and hemisphere directions four at a time,
+/// for code which needs many random numbers at once. The scalar fallback
+/// gives the same numbers for the same seed
+class random_batch_generator_t
+{
+public:
+	static constexpr int kWidth = 4;
+
+	random_batch_generator_t() { this->seed(0); }
+	~random_batch_generator_t() {}
+
+	void seed(std::uint64_t value)
+	{
+		for (auto& words : this->m_state)
+		{
+			for (int lane = 0; lane < kWidth; lane += 2)
+			{
+				value = math_hash(value);
+				words[lane] = static_cast<std::uint32_t>(value);
+				words[lane + 1] = static_cast<std::uint32_t>(value >> 32);
+			}
+		}
+	}
+
+	// [0, 1) with 23 bits of precision
+	void fill_uniform(float* p_values, int count)
+	{
+		for (int i = 0; i < count; i += kWidth)
+		{
+			alignas(16) float values[kWidth];
+			this->next(values);
+
+			auto lane_count = (std::min)(kWidth, count - i);
+
+			for (int lane = 0; lane < lane_count; ++lane)
+				p_values[i + lane] = values[lane];
+		}
+	}
+
+	// uniformly distributed on the unit sphere
+	void fill_unit_vectors(float* p_x, float* p_y, float* p_z, int count)
+	{
+		this->fill_directions(p_x, p_y, p_z, count, false);
+	}
+
+	// cosine weighted around +z, so the caller only rotates them to the
+	// normal and doesn't divide by the pdf of lambertian surfaces
+	void fill_hemisphere_directions(
+		float* p_x, float* p_y, float* p_z, int count)
+	{
+		this->fill_directions(p_x, p_y, p_z, count, true);
+	}
+
+private:
+	// x = r * cos(phi), y = r * sin(phi) with a uniform phi and r, z by
+	// the distribution: z = 1 - 2u and r = sqrt(1 - z^2) for the sphere,
+	// r = sqrt(u) and z = sqrt(1 - u) for the cosine weighted hemisphere
+	void fill_directions(
+		float* p_x, float* p_y, float* p_z, int count, bool is_hemisphere)
+	{
+		for (int i = 0; i < count; i += kWidth)
+		{
+			alignas(16) float u[kWidth];
+			alignas(16) float turns[kWidth];
+			alignas(16) float x[kWidth];
+			alignas(16) float y[kWidth];
+			alignas(16) float z[kWidth];
+
+			this->next(u);
+			this->next(turns);
+
+#ifdef SIMPLERAY_SSE
+			auto u4 = _mm_load_ps(u);
+			auto one = _mm_set1_ps(1.0f);
+			auto zero = _mm_setzero_ps();
+			__m128 r4;
+			__m128 z4;
+
+			if (is_hemisphere)
+			{
+				r4 = _mm_sqrt_ps(u4);
+				z4 = _mm_sqrt_ps(_mm_max_ps(zero, _mm_sub_ps(one, u4)));
+			}
+			else
+			{
+				z4 = _mm_sub_ps(one, _mm_add_ps(u4, u4));
+				r4 = _mm_sqrt_ps(
+					_mm_max_ps(zero, _mm_sub_ps(one, _mm_mul_ps(z4, z4))));
+			}
+
+			// sin and cos of half of the angle by their series, the half
+			// angle is in [-pi / 2, pi / 2) where a few terms are enough
+			auto half_angle = _mm_sub_ps(
+				_mm_mul_ps(_mm_load_ps(turns), _mm_set1_ps(kHalfTurn)),
+				_mm_set1_ps(0.5f * kHalfTurn));
+			auto square = _mm_mul_ps(half_angle, half_angle);
+
+			auto sin4 = _mm_set1_ps(kSin[4]);
+			for (int k = 3; k >= 0; --k)
+			{
+				sin4 = _mm_add_ps(
+					_mm_mul_ps(sin4, square), _mm_set1_ps(kSin[k]));
+			}
+			sin4 = _mm_mul_ps(sin4, half_angle);
+
+			auto cos4 = _mm_set1_ps(kCos[5]);
+			for (int k = 4; k >= 0; --k)
+			{
+				cos4 = _mm_add_ps(
+					_mm_mul_ps(cos4, square), _mm_set1_ps(kCos[k]));
+			}
+
+			// double angle, it is uniform in [-pi, pi)
+			auto cos_angle =
+				_mm_sub_ps(_mm_mul_ps(cos4, cos4), _mm_mul_ps(sin4, sin4));
+			auto sin_angle = _mm_mul_ps(_mm_add_ps(sin4, sin4), cos4);
+
+			_mm_store_ps(x, _mm_mul_ps(r4, cos_angle));
+			_mm_store_ps(y, _mm_mul_ps(r4, sin_angle));
+			_mm_store_ps(z, z4);
+#else
+			for (int lane = 0; lane < kWidth; ++lane)
+			{
+				float r{};
+
+				if (is_hemisphere)
+				{
+					r = std::sqrt(u[lane]);
+					z[lane] = std::sqrt((std::max)(0.0f, 1.0f - u[lane]));
+				}
+				else
+				{
+					z[lane] = 1.0f - (u[lane] + u[lane]);
+					r = std::sqrt((std::max)(0.0f, 1.0f - z[lane] * z[lane]));
+				}
+
+				auto half_angle = turns[lane] * kHalfTurn - 0.5f * kHalfTurn;
+				auto square = half_angle * half_angle;
+
+				auto sin_half = kSin[4];
+				for (int k = 3; k >= 0; --k)
+					sin_half = sin_half * square + kSin[k];
+				sin_half *= half_angle;
+
+				auto cos_half = kCos[5];
+				for (int k = 4; k >= 0; --k)
+					cos_half = cos_half * square + kCos[k];
+
+				x[lane] = r * (cos_half * cos_half - sin_half * sin_half);
+				y[lane] = r * ((sin_half + sin_half) * cos_half);
+			}
+#endif
+
+			auto lane_count = (std::min)(kWidth, count - i);
+
+			for (int lane = 0; lane < lane_count; ++lane)
+			{
+				p_x[i + lane] = x[lane];
+				p_y[i + lane] = y[lane];
+				p_z[i + lane] = z[lane];
+			}
+		}
+	}
+
+	// one step of every lane, the upper 23 bits of a result become the
+	// mantissa of a float in [1, 2)
+	void next(float* p_values)
+	{
+#ifdef SIMPLERAY_SSE
+		auto* p_state = reinterpret_cast<__m128i*>(this->m_state);
+
+		auto s0 = _mm_load_si128(p_state + 0);
+		auto s1 = _mm_load_si128(p_state + 1);
+		auto s2 = _mm_load_si128(p_state + 2);
+		auto s3 = _mm_load_si128(p_state + 3);
+
+		auto result = _mm_add_epi32(s0, s3);
+		auto t = _mm_slli_epi32(s1, 9);
+
+		s2 = _mm_xor_si128(s2, s0);
+		s3 = _mm_xor_si128(s3, s1);
+		s1 = _mm_xor_si128(s1, s2);
+		s0 = _mm_xor_si128(s0, s3);
+		s2 = _mm_xor_si128(s2, t);
+		s3 = _mm_or_si128(_mm_slli_epi32(s3, 11), _mm_srli_epi32(s3, 21));
+
+		_mm_store_si128(p_state + 0, s0);
+		_mm_store_si128(p_state + 1, s1);
+		_mm_store_si128(p_state + 2, s2);
+		_mm_store_si128(p_state + 3, s3);
+
+		auto mantissa = _mm_or_si128(
+			_mm_srli_epi32(result, 9), _mm_set1_epi32(0x3f800000));
+
+		_mm_store_ps(p_values,
+			_mm_sub_ps(_mm_castsi128_ps(mantissa), _mm_set1_ps(1.0f)));
+#else
+		for (int lane = 0; lane < kWidth; ++lane)
+		{
+			auto& s0 = this->m_state[0][lane];
+			auto& s1 = this->m_state[1][lane];
+			auto& s2 = this->m_state[2][lane];
+			auto& s3 = this->m_state[3][lane];
+
+			auto result = s0 + s3;
+			auto t = s1 << 9;
+
+			s2 ^= s0;
+			s3 ^= s1;
+			s1 ^= s2;
+			s0 ^= s3;
+			s2 ^= t;
+			s3 = (s3 << 11) | (s3 >> 21);
+
+			p_values[lane] =
+				std::bit_cast<float>((result >> 9) | 0x3f800000u) - 1.0f;
+		}
+#endif
+	}
+
+private:
+	static constexpr float kHalfTurn = static_cast<float>(kPI);
+	// taylor series of sin(x) / x and cos(x) by x^2
+	static constexpr float kSin[5] = {
+		1.0f, -1.0f / 6.0f, 1.0f / 120.0f, -1.0f / 5040.0f, 1.0f / 362880.0f};
+	static constexpr float kCos[6] = {1.0f, -1.0f / 2.0f, 1.0f / 24.0f,
+		-1.0f / 720.0f, 1.0f / 40320.0f, -1.0f / 3628800.0f};
+
+	// word by lane, so a word of all lanes is one SSE register
+	alignas(16) std::uint32_t m_state[4][kWidth];
+};
+
+/// @brief uniform floats of random_batch_generator_t handed out one by one,
+/// a block of them is generated at once when the previous one is used up
+class random_stream_t
+{
+public:
+	random_stream_t() : m_index{kBlockSize} {}
+	~random_stream_t() {}
+
+	// the block generated for the previous seed is dropped, so a seed always
+	// gives the same numbers
+	void seed(std::uint64_t value)
+	{
+		this->m_generator.seed(value);
+		this->m_index = kBlockSize;
+	}
+
+	float next()
+	{
+		if (this->m_index == kBlockSize)
+		{
+			this->m_generator.fill_uniform(this->m_values, kBlockSize);
+			this->m_index = 0;
+		}
+
+		return this->m_values[this->m_index++];
+	}
+
+	random_batch_generator_t& get_generator() { return this->m_generator; }
+
+private:
+	// a sample seeds its own stream and takes a few dozens of numbers
+	static constexpr int kBlockSize = 16;
+
+	random_batch_generator_t m_generator;
+	alignas(16) float m_values[kBlockSize];
+	int m_index;
+};
+
+// every thread has its own stream, so renders from different threads don't
+// race on it
+random_stream_t& math_random_stream()
+{
+	thread_local random_stream_t stream;
+	return stream;
+}
+
+void math_random_seed(std::uint64_t seed)
+{
+	math_random_stream().seed(seed);
+}
+
 // custom stuff
 // if nothing passed it generates from 0.0 to 1.0
 double math_random_double(double from = 0.0, double to = 1.0)
 {
-	static std::uniform_real_distribution<double> distribution(0.0, 1.0);
-	static std::mt19937 generator;
-	return distribution(generator);
+	return math_random_stream().next();
 }
 
 glm::dvec3 math_random_vector3(double from = 0.0, double to = 1.0)
@@ -86,6 +475,297 @@ bool math_is_near_zero(const glm::dvec3& vec)
 		(fabs(vec.z) < epsilon));
 }
 
+// z-order curve index of the cell, bits of x and y interleaved
+std::uint64_t math_morton_code(std::uint32_t x, std::uint32_t y)
+{
+	auto spread = [](std::uint64_t value) {
+		value = (value | (value << 16)) & 0x0000ffff0000ffffull;
+		value = (value | (value << 8)) & 0x00ff00ff00ff00ffull;
+		value = (value | (value << 4)) & 0x0f0f0f0f0f0f0f0full;
+		value = (value | (value << 2)) & 0x3333333333333333ull;
+		value = (value | (value << 1)) & 0x5555555555555555ull;
+		return value;
+	};
+
+	return spread(x) | (spread(y) << 1);
+}
+
+// index of the cell along the hilbert curve which fills size x size cells,
+// size is a power of two. Unlike the z-order curve the next cell is always a
+// neighbour of the previous one
+std::uint64_t math_hilbert_code(
+	std::uint32_t size, std::uint32_t x, std::uint32_t y)
+{
+	std::uint64_t result{};
+
+	for (std::uint32_t half = size / 2; half > 0; half /= 2)
+	{
+		std::uint32_t rx = (x & half) ? 1 : 0;
+		std::uint32_t ry = (y & half) ? 1 : 0;
+
+		result += std::uint64_t(half) * half * ((3 * rx) ^ ry);
+
+		// rotates the quadrant, so the curve in it starts where the previous
+		// one ends
+		if (!ry)
+		{
+			if (rx)
+			{
+				x = size - 1 - x;
+				y = size - 1 - y;
+			}
+
+			std::swap(x, y);
+		}
+	}
+
+	return result;
+}
+
+/* trace */
+
+/// @brief span of work on one thread. Name, category and argument name must
+/// be string literals, only pointers are kept
+struct trace_event_t
+{
+	const char* m_p_name;
+	const char* m_p_category;
+	// nullptr when the span has no argument
+	const char* m_p_argument_name;
+	std::int64_t m_argument;
+	// nanoseconds since the trace was started
+	std::int64_t m_start;
+	std::int64_t m_duration;
+};
+
+/// @brief the last kCapacity spans of one thread, older ones are overwritten.
+/// Only its thread writes it, it is read once the threads are done
+class trace_buffer_t
+{
+public:
+	static constexpr std::size_t kCapacity = 64 * 1024;
+
+	trace_buffer_t(int thread_index, std::string thread_name) :
+		m_thread_index{thread_index}, m_thread_name{std::move(thread_name)},
+		m_count{}
+	{
+		this->m_events.resize(kCapacity);
+	}
+	~trace_buffer_t() {}
+
+	void push(const trace_event_t& event)
+	{
+		this->m_events[this->m_count % kCapacity] = event;
+		++this->m_count;
+	}
+
+	int get_thread_index() const { return this->m_thread_index; }
+
+	const std::string& get_thread_name() const { return this->m_thread_name; }
+	void set_thread_name(std::string name)
+	{
+		this->m_thread_name = std::move(name);
+	}
+
+	// oldest first
+	template <typename Function>
+	void for_each(Function&& function) const
+	{
+		auto first = this->m_count > kCapacity ? this->m_count - kCapacity : 0;
+
+		for (auto i = first; i < this->m_count; ++i)
+			function(this->m_events[i % kCapacity]);
+	}
+
+	// events which didn't fit
+	std::size_t get_lost_count() const
+	{
+		return this->m_count > kCapacity ? this->m_count - kCapacity : 0;
+	}
+
+private:
+	int m_thread_index;
+	std::string m_thread_name;
+	std::size_t m_count;
+	std::vector<trace_event_t> m_events;
+};
+
+/// @brief optional tracing of where the time goes: render threads, the
+/// writer, builds of acceleration structures and scene loads record spans
+/// into buffers of their threads, which are written as a Chrome trace (JSON
+/// for chrome://tracing or ui.perfetto.dev) at the end. When it is not
+/// started a span costs one relaxed load
+class trace_t
+{
+public:
+	trace_t() : m_is_enabled{} {}
+	~trace_t() {}
+
+	void start()
+	{
+		std::lock_guard<std::mutex> lock(this->m_mutex);
+
+		this->m_start_time = std::chrono::steady_clock::now();
+		this->m_is_enabled.store(true, std::memory_order_release);
+	}
+
+	bool is_enabled() const
+	{
+		return this->m_is_enabled.load(std::memory_order_relaxed);
+	}
+
+	// nanoseconds since start()
+	std::int64_t get_time() const
+	{
+		return std::chrono::duration_cast<std::chrono::nanoseconds>(
+			std::chrono::steady_clock::now() - this->m_start_time)
+			.count();
+	}
+
+	void record(const trace_event_t& event)
+	{
+		this->get_thread_buffer().push(event);
+	}
+
+	// shown instead of "thread <index>", e.g. "render 3"
+	void set_thread_name(std::string name)
+	{
+		if (this->is_enabled())
+			this->get_thread_buffer().set_thread_name(std::move(name));
+	}
+
+	// stops recording and writes all buffers, threads which record spans
+	// must be done by then
+	bool write(const std::string& file_name)
+	{
+		this->m_is_enabled.store(false, std::memory_order_release);
+
+		std::lock_guard<std::mutex> lock(this->m_mutex);
+
+		std::ofstream file(file_name);
+
+		if (!file.good())
+		{
+			std::cout << "failed to write trace " << file_name << std::endl;
+			return false;
+		}
+
+		// timestamps are microseconds, nanoseconds go after the point
+		auto write_time = [&file](std::int64_t time) {
+			file << time / 1000 << '.' << std::setw(3) << std::setfill('0')
+				 << time % 1000;
+		};
+
+		file << "{\"displayTimeUnit\": \"ns\", \"traceEvents\": [";
+
+		bool is_first{true};
+		std::size_t lost_count{};
+
+		for (const auto& p_buffer : this->m_buffers)
+		{
+			file << (is_first ? "" : ",")
+				 << "\n{\"name\": \"thread_name\", \"ph\": \"M\", \"pid\": 1, "
+					"\"tid\": "
+				 << p_buffer->get_thread_index()
+				 << ", \"args\": {\"name\": \"" << p_buffer->get_thread_name()
+				 << "\"}}";
+
+			is_first = false;
+			lost_count += p_buffer->get_lost_count();
+
+			p_buffer->for_each([&](const trace_event_t& event) {
+				file << ",\n{\"name\": \"" << event.m_p_name
+					 << "\", \"cat\": \"" << event.m_p_category
+					 << "\", \"ph\": \"X\", \"pid\": 1, \"tid\": "
+					 << p_buffer->get_thread_index() << ", \"ts\": ";
+				write_time(event.m_start);
+				file << ", \"dur\": ";
+				write_time(event.m_duration);
+
+				if (event.m_p_argument_name)
+				{
+					file << ", \"args\": {\"" << event.m_p_argument_name
+						 << "\": " << event.m_argument << "}";
+				}
+
+				file << "}";
+			});
+		}
+
+		file << "\n]}\n";
+
+		if (lost_count)
+		{
+			std::cout << "trace " << file_name << " lost " << lost_count
+					  << " oldest spans" << std::endl;
+		}
+
+		return file.good();
+	}
+
+private:
+	// created on the first span of the thread and kept after it exits
+	trace_buffer_t& get_thread_buffer()
+	{
+		thread_local trace_buffer_t* p_buffer{};
+
+		if (!p_buffer)
+		{
+			std::lock_guard<std::mutex> lock(this->m_mutex);
+
+			auto thread_index = static_cast<int>(this->m_buffers.size());
+
+			this->m_buffers.push_back(std::make_unique<trace_buffer_t>(
+				thread_index, "thread " + std::to_string(thread_index)));
+			p_buffer = this->m_buffers.back().get();
+		}
+
+		return *p_buffer;
+	}
+
+private:
+	std::atomic<bool> m_is_enabled;
+	std::chrono::steady_clock::time_point m_start_time;
+	std::mutex m_mutex;
+	std::vector<std::unique_ptr<trace_buffer_t>> m_buffers;
+};
+
+trace_t& trace_get()
+{
+	static trace_t trace;
+	return trace;
+}
+
+/// @brief records the span from its construction to its destruction into the
+/// trace, nothing when the trace wasn't started
+class trace_span_t
+{
+public:
+	trace_span_t(const char* p_name, const char* p_category,
+		const char* p_argument_name = nullptr, std::int64_t argument = 0) :
+		m_event{p_name, p_category, p_argument_name, argument, -1, 0}
+	{
+		if (trace_get().is_enabled())
+			this->m_event.m_start = trace_get().get_time();
+	}
+
+	~trace_span_t()
+	{
+		if (this->m_event.m_start < 0)
+			return;
+
+		this->m_event.m_duration =
+			trace_get().get_time() - this->m_event.m_start;
+		trace_get().record(this->m_event);
+	}
+
+	trace_span_t(const trace_span_t&) = delete;
+	trace_span_t& operator=(const trace_span_t&) = delete;
+
+private:
+	trace_event_t m_event;
+};
+
 /* image types */
 class image_ppm_t
 {
@@ -188,6 +868,37 @@ public:
 		return this->m_is_opened;
 	}
 
+	// already quantized rgb triplets, formatted the same way as
+	// write(color, samples_per_pixel) does but through a lookup table of
+	// "0".."255" strings and one stream write for the whole block
+	void write(const std::uint8_t* p_pixels, std::size_t pixel_count)
+	{
+		if (!this->m_is_opened)
+			return;
+
+		static const auto kNumbers = [] {
+			std::vector<std::string> result(256);
+			for (int i = 0; i < 256; ++i)
+				result[i] = std::to_string(i);
+			return result;
+		}();
+
+		std::string text;
+		text.reserve(pixel_count * 12);
+
+		for (std::size_t i = 0; i < pixel_count; ++i)
+		{
+			text += kNumbers[p_pixels[i * 3 + 0]];
+			text += ' ';
+			text += kNumbers[p_pixels[i * 3 + 1]];
+			text += ' ';
+			text += kNumbers[p_pixels[i * 3 + 2]];
+			text += '\n';
+		}
+
+		this->m_file.write(text.data(), text.size());
+	}
+
 	bool is_opened() const { return this->m_is_opened; }
 
 private:
@@ -197,25 +908,198 @@ private:
 	std::ofstream m_file;
 };
 
-/* math types */
-
-/// @brief mathematical
-class ray_t
+/// @brief binary ppm (P6) whose whole size is allocated on open and mapped
+/// into memory, so tiles can be written in any order straight into their
+/// final place in the file. Dirty pages are flushed by the OS, so resident
+/// memory doesn't depend on the image resolution
+class image_mapped_ppm_t
 {
 public:
-	ray_t() {}
-	ray_t(const dvec3& origin, const dvec3& direction) :
-		m_origin{origin}, m_direction{direction}
+	image_mapped_ppm_t() :
+		m_width{}, m_height{}, m_header_size{}, m_size{}, m_p_data{}
+#ifdef _WIN32
+		,
+		m_file{INVALID_HANDLE_VALUE}, m_mapping{}
+#else
+		,
+		m_file{-1}
+#endif
 	{
 	}
+	~image_mapped_ppm_t() { this->close(); }
 
-	~ray_t() {}
+	image_mapped_ppm_t(const image_mapped_ppm_t&) = delete;
+	image_mapped_ppm_t& operator=(const image_mapped_ppm_t&) = delete;
 
-	const dvec3& get_origin() const { return this->m_origin; }
-	dvec3& get_origin() { return this->m_origin; }
+	bool open(const char* p_file_name, int width, int height)
+	{
+		this->close();
 
-	const dvec3& get_direction() const { return this->m_direction; }
-	dvec3& get_direction() { return this->m_direction; }
+		if (!p_file_name || width <= 0 || height <= 0)
+		{
+			std::cout << "failed to open mapped file because of invalid name "
+						 "or size"
+					  << std::endl;
+			return false;
+		}
+
+		auto header = "P6\n" + std::to_string(width) + ' ' +
+			std::to_string(height) + "\n255\n";
+
+		this->m_width = width;
+		this->m_height = height;
+		this->m_header_size = header.size();
+		this->m_size =
+			header.size() + static_cast<std::size_t>(width) * height * 3;
+
+#ifdef _WIN32
+		this->m_file = CreateFileA(p_file_name, GENERIC_READ | GENERIC_WRITE,
+			0, nullptr, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, nullptr);
+
+		if (this->m_file != INVALID_HANDLE_VALUE)
+		{
+			this->m_mapping = CreateFileMappingA(this->m_file, nullptr,
+				PAGE_READWRITE, static_cast<DWORD>(this->m_size >> 32),
+				static_cast<DWORD>(this->m_size & 0xffffffff), nullptr);
+
+			if (this->m_mapping)
+			{
+				this->m_p_data = static_cast<std::uint8_t*>(MapViewOfFile(
+					this->m_mapping, FILE_MAP_WRITE, 0, 0, this->m_size));
+			}
+		}
+#else
+		this->m_file = ::open(p_file_name, O_RDWR | O_CREAT | O_TRUNC, 0644);
+
+		// posix_fallocate reserves the blocks so we don't get SIGBUS on a
+		// full disk in the middle of the render, ftruncate is the fallback
+		// for file systems which don't support it
+		if (this->m_file >= 0 &&
+			(!posix_fallocate(
+				 this->m_file, 0, static_cast<off_t>(this->m_size)) ||
+				!ftruncate(this->m_file, static_cast<off_t>(this->m_size))))
+		{
+			auto* p_data = mmap(nullptr, this->m_size, PROT_READ | PROT_WRITE,
+				MAP_SHARED, this->m_file, 0);
+
+			if (p_data != MAP_FAILED)
+				this->m_p_data = static_cast<std::uint8_t*>(p_data);
+		}
+#endif
+
+		if (!this->m_p_data)
+		{
+			std::cout << "failed to map file " << p_file_name << std::endl;
+			this->close();
+			return false;
+		}
+
+		std::copy(header.begin(), header.end(), this->m_p_data);
+
+		return true;
+	}
+
+	void close()
+	{
+#ifdef _WIN32
+		if (this->m_p_data)
+			UnmapViewOfFile(this->m_p_data);
+
+		if (this->m_mapping)
+			CloseHandle(this->m_mapping);
+
+		if (this->m_file != INVALID_HANDLE_VALUE)
+			CloseHandle(this->m_file);
+
+		this->m_mapping = nullptr;
+		this->m_file = INVALID_HANDLE_VALUE;
+#else
+		if (this->m_p_data)
+			munmap(this->m_p_data, this->m_size);
+
+		if (this->m_file >= 0)
+			::close(this->m_file);
+
+		this->m_file = -1;
+#endif
+		this->m_p_data = nullptr;
+	}
+
+	bool is_opened() const { return this->m_p_data != nullptr; }
+
+	int get_width() const { return this->m_width; }
+	int get_height() const { return this->m_height; }
+
+	// rgb triplets of the pixel (x, y), y = 0 is the top row
+	std::uint8_t* get_pixels(int x, int y)
+	{
+		return this->m_p_data + this->m_header_size +
+			(static_cast<std::size_t>(y) * this->m_width + x) * 3;
+	}
+
+private:
+	int m_width;
+	int m_height;
+	std::size_t m_header_size;
+	std::size_t m_size;
+	std::uint8_t* m_p_data;
+#ifdef _WIN32
+	HANDLE m_file;
+	HANDLE m_mapping;
+#else
+	int m_file;
+#endif
+};
+
+// converts sums of samples to 8 bit exactly like image_ppm_t::write(color,
+// samples_per_pixel, is_use_gamma_correction) does. It is a branch free loop
+// over plain arrays of components so the compiler vectorizes it (sqrt needs
+// -fno-math-errno for that, see CMakeLists.txt)
+void image_quantize(const double* p_colors, std::uint8_t* p_pixels,
+	std::size_t component_count, int samples_per_pixel,
+	bool is_use_gamma_correction)
+{
+	auto scale = 1.0 / samples_per_pixel;
+
+	if (is_use_gamma_correction)
+	{
+		for (std::size_t i = 0; i < component_count; ++i)
+		{
+			auto value = std::sqrt(scale * p_colors[i]);
+			value = value < 0.0 ? 0.0 : (value > 0.999 ? 0.999 : value);
+			p_pixels[i] = static_cast<std::uint8_t>(256 * value);
+		}
+	}
+	else
+	{
+		for (std::size_t i = 0; i < component_count; ++i)
+		{
+			auto value = scale * p_colors[i];
+			value = value < 0.0 ? 0.0 : (value > 0.999 ? 0.999 : value);
+			p_pixels[i] = static_cast<std::uint8_t>(256 * value);
+		}
+	}
+}
+
+/* math types */
+
+/// @brief mathematical
+class ray_t
+{
+public:
+	ray_t() {}
+	ray_t(const dvec3& origin, const dvec3& direction) :
+		m_origin{origin}, m_direction{direction}
+	{
+	}
+
+	~ray_t() {}
+
+	const dvec3& get_origin() const { return this->m_origin; }
+	dvec3& get_origin() { return this->m_origin; }
+
+	const dvec3& get_direction() const { return this->m_direction; }
+	dvec3& get_direction() { return this->m_direction; }
 
 	dvec3 at(double t) const { return this->m_origin + t * this->m_direction; }
 
@@ -224,6 +1108,87 @@ private:
 	dvec3 m_direction;
 };
 
+/// @brief axis aligned bounding box, default one is empty (min > max)
+class aabb_t
+{
+public:
+	aabb_t() : m_min{kInfinityDouble}, m_max{-kInfinityDouble} {}
+	aabb_t(const dvec3& min, const dvec3& max) : m_min{min}, m_max{max} {}
+	~aabb_t() {}
+
+	const dvec3& get_min() const { return this->m_min; }
+	const dvec3& get_max() const { return this->m_max; }
+
+	bool is_empty() const { return this->m_min.x > this->m_max.x; }
+
+	void expand(const aabb_t& box)
+	{
+		this->m_min = glm::min(this->m_min, box.m_min);
+		this->m_max = glm::max(this->m_max, box.m_max);
+	}
+
+	void expand(const dvec3& point)
+	{
+		this->m_min = glm::min(this->m_min, point);
+		this->m_max = glm::max(this->m_max, point);
+	}
+
+	dvec3 get_center() const { return 0.5 * (this->m_min + this->m_max); }
+
+	double get_surface_area() const
+	{
+		if (this->is_empty())
+			return 0.0;
+
+		auto extent = this->m_max - this->m_min;
+
+		return 2.0 *
+			(extent.x * extent.y + extent.y * extent.z + extent.z * extent.x);
+	}
+
+	int get_longest_axis() const
+	{
+		auto extent = this->m_max - this->m_min;
+
+		if (extent.x > extent.y && extent.x > extent.z)
+			return 0;
+
+		return extent.y > extent.z ? 1 : 2;
+	}
+
+	// slab test, inv_direction is 1 / ray direction and it is computed once
+	// per ray by the caller. On success t_min is the entry distance
+	bool hit(const dvec3& origin, const dvec3& inv_direction, double& t_min,
+		double t_max) const
+	{
+		for (int axis = 0; axis < 3; ++axis)
+		{
+			auto t0 = (this->m_min[axis] - origin[axis]) * inv_direction[axis];
+			auto t1 = (this->m_max[axis] - origin[axis]) * inv_direction[axis];
+
+			if (inv_direction[axis] < 0.0)
+				std::swap(t0, t1);
+
+			t_min = t0 > t_min ? t0 : t_min;
+			t_max = t1 < t_max ? t1 : t_max;
+
+			if (t_max < t_min)
+				return false;
+		}
+
+		return true;
+	}
+
+	bool operator==(const aabb_t& box) const
+	{
+		return this->m_min == box.m_min && this->m_max == box.m_max;
+	}
+
+private:
+	dvec3 m_min;
+	dvec3 m_max;
+};
+
 enum eMaterialType : int
 {
 	kMaterialType_Diffuse,
@@ -293,13 +1258,13 @@ class hit_record_t
 public:
 	hit_record_t() :
 		m_is_hitted{}, m_is_front_face{},
-		m_draw_normal_map{}, m_t{}, m_p_color{}
+		m_draw_normal_map{}, m_entity_index{-1}, m_t{}, m_p_color{}
 	{
 	}
 
 	hit_record_t(const material_t& material) :
-		m_is_hitted{}, m_is_front_face{},
-		m_draw_normal_map{}, m_t{}, m_p_color{}, m_material{material}
+		m_is_hitted{}, m_is_front_face{}, m_draw_normal_map{},
+		m_entity_index{-1}, m_t{}, m_p_color{}, m_material{material}
 	{
 	}
 
@@ -323,6 +1288,10 @@ public:
 	bool is_draw_normal_map() const { return this->m_draw_normal_map; }
 	void set_draw_normal_map(bool status) { this->m_draw_normal_map = status; }
 
+	// slot of the hit entity in world_t
+	int get_entity_index() const { return this->m_entity_index; }
+	void set_entity_index(int index) { this->m_entity_index = index; }
+
 	const glm::dvec3* get_color() const { return this->m_p_color; }
 	void set_color(const glm::dvec3* p_color) { this->m_p_color = p_color; }
 
@@ -340,6 +1309,7 @@ private:
 	bool m_is_hitted;
 	bool m_is_front_face;
 	bool m_draw_normal_map;
+	int m_entity_index;
 	double m_t;
 	const glm::dvec3* m_p_color;
 	glm::dvec3 m_point;
@@ -451,44 +1421,32 @@ public:
 		return std::get<sphere_data_t>(this->m_data);
 	}
 
+	sphere_data_t& get_sphere_data()
+	{
+		return std::get<sphere_data_t>(this->m_data);
+	}
+
 	eEntityType get_type(void) const { return this->m_type; }
 	void set_type(eEntityType type) { this->m_type = type; }
 
-private:
-	eEntityType m_type;
-	std::variant<sphere_data_t> m_data;
-};
-
-class world_t
-{
-public:
-	world_t() {}
-	~world_t() {}
-
-	void clear() { this->m_entities; }
-	void add(const entity_t& object) { this->m_entities.push_back(object); }
-
-	hit_record_t hit(
-		const entity_t& entity, const ray_t& ray, double t_min, double t_max)
+	aabb_t get_bounds() const
 	{
-		hit_record_t result;
+		aabb_t result;
 
-		switch (entity.get_type())
-		{
-		case eEntityType::kEntityType_Triangle:
+		switch (this->m_type)
 		{
-			break;
-		}
 		case eEntityType::kEntityType_Sphere:
 		{
-			result = this->hit_sphere(entity, ray, t_min, t_max);
-			break;
-		}
-		case eEntityType::kEntityType_Box:
-		{
+			const auto& sphere_data = this->get_sphere_data();
+
+			// radius can be negative (hollow glass sphere trick)
+			glm::dvec3 extent(fabs(sphere_data.get_radius()));
+
+			result = aabb_t(sphere_data.get_position() - extent,
+				sphere_data.get_position() + extent);
 			break;
 		}
-		case eEntityType::kEntityType_Unknown:
+		default:
 		{
 			break;
 		}
@@ -497,1153 +1455,9778 @@ public:
 		return result;
 	}
 
-	const std::vector<entity_t>& get_entities() const
+private:
+	eEntityType m_type;
+	std::variant<sphere_data_t> m_data;
+};
+
+/// @brief handle of the entity stored in world_t, generation protects us from
+/// using handle of the removed entity whose slot was reused by another one
+struct entity_handle_t
+{
+	entity_handle_t() : m_index{-1}, m_generation{} {}
+	entity_handle_t(int index, unsigned int generation) :
+		m_index{index}, m_generation{generation}
 	{
-		return this->m_entities;
 	}
+	~entity_handle_t() {}
 
-private:
-	// in order to detect the sphere hit we need to solve this quadratic
-	// equation (p(t) - c) * (p(t) - c) = r^2 where p(t) is our ray's formula a
-	// + tb. So it goes like this (a + tb - c) * (a + tb - c) = r^2 and after
-	// the final operations t^2⋅b⋅b + 2tb⋅(A−C) + (A−C)⋅(A−C)−r2=0 but for
-	// better reading we re-write to general form of quadratic equation t^2 * a
-	// + 2t * b + c = 0 so we need to define our a,b,c variables, but for sphere
-	// we have b=2h situation that means we can reduce amount of computation,
-	// because we just need half_b instead of squared b
-	hit_record_t hit_sphere(
-		const entity_t& entity, const ray_t& ray, double t_min, double t_max)
-	{
-		hit_record_t result;
+	bool is_valid() const { return this->m_index >= 0; }
 
-		const auto& sphere_data = entity.get_sphere_data();
+	int m_index;
+	unsigned int m_generation;
+};
 
-		auto oc = ray.get_origin() - sphere_data.get_position();
+struct bvh_node_t
+{
+	bvh_node_t() : m_first{}, m_count{}, m_parent{-1} {}
+	~bvh_node_t() {}
 
-		// t^2*b*b or the a coefficient at t^2 in general form
-		auto a = glm::dot(ray.get_direction(), ray.get_direction());
+	bool is_leaf() const { return this->m_count > 0; }
 
-		// b * (A - C)
-		auto half_b = glm::dot(oc, ray.get_direction());
+	aabb_t m_bounds;
+	// for leaf it is the first primitive in bvh_t::m_primitives, otherwise
+	// it is the left child and the right one is always m_first + 1
+	int m_first;
+	int m_count;
+	int m_parent;
+};
 
-		auto c = glm::dot(oc, oc) -
-			sphere_data.get_radius() * sphere_data.get_radius();
+/// @brief binary bvh over world_t entity slots. Primitives are referenced by
+/// slot index, so the tree stays valid while entities move around and we just
+/// refit the bounds of the leaves which contain changed slots
+class bvh_t
+{
+public:
+	bvh_t() : m_built_surface_area{} {}
+	~bvh_t() {}
 
-		auto discriminant = half_b * half_b - a * c;
+	void clear()
+	{
+		this->m_nodes.clear();
+		this->m_primitives.clear();
+		this->m_leaf_of_slot.clear();
+		this->m_built_surface_area = 0.0;
+	}
 
-		if (discriminant < 0)
-		{
-			result.set_hitted(false);
-			return result;
-		}
+	// binned SAH. Subtrees of big nodes at the top levels are built by their
+	// own threads, every split takes its two nodes from a shared counter
+	void build(const std::vector<aabb_t>& bounds, const std::vector<int>& slots)
+	{
+		this->clear();
 
-		auto sqrtd = sqrt(discriminant);
+		if (slots.empty())
+			return;
 
-		auto root = (-half_b - sqrtd) / a;
+		this->m_primitives = slots;
+		this->m_leaf_of_slot.assign(bounds.size(), -1);
 
-		if (root < t_min || t_max < root)
-		{
-			root = (-half_b + sqrtd) / a;
+		// both children of a split are never empty, so there are at most
+		// slots.size() leaves
+		this->m_nodes.resize(2 * slots.size() - 1);
 
-			if (root < t_min || t_max < root)
-			{
-				result.set_hitted(false);
-				return result;
-			}
-		}
+		std::atomic<int> node_count{1};
+		auto thread_count = (std::max)(1u, std::thread::hardware_concurrency());
 
-		result.set_t(root);
-		result.set_point(ray.at(root));
+		// twice as many subtrees as threads, so they are balanced a bit
+		this->subdivide(bounds, 0, 0, static_cast<int>(slots.size()),
+			node_count, static_cast<int>(std::bit_width(thread_count)));
 
-		auto outward_normal =
-			(result.get_point() - sphere_data.get_position()) /
-			sphere_data.get_radius();
+		this->m_nodes.resize(node_count);
 
-		if (glm::dot(outward_normal, ray.get_direction()) < 0)
-		{
-			result.set_normal(outward_normal);
-			result.set_front_face(true);
-		}
-		else
+		this->m_built_surface_area =
+			this->m_nodes[0].m_bounds.get_surface_area();
+	}
+
+	// recomputes bounds from the leaves of changed slots up to the root and
+	// stops as soon as a node didn't change
+	void refit(const std::vector<aabb_t>& bounds, const std::vector<int>& slots)
+	{
+		for (auto slot : slots)
 		{
-			result.set_normal(-outward_normal);
-			result.set_front_face(false);
-		}
+			auto node_index = this->get_leaf(slot);
 
-		result.set_hitted(true);
-		result.set_draw_normal_map(sphere_data.is_draw_normal_map());
-		result.set_color(&sphere_data.get_color());
+			if (node_index < 0)
+				continue;
 
-		result.set_material(sphere_data.get_material());
+			auto& leaf = this->m_nodes[node_index];
 
-		return result;
-	}
+			aabb_t leaf_bounds;
+			for (int i = 0; i < leaf.m_count; ++i)
+				leaf_bounds.expand(bounds[this->m_primitives[leaf.m_first + i]]);
 
-	hit_record_t hit_triangle(
-		const entity_t& entity, const ray_t& ray, double t_min, double t_max)
-	{
-		hit_record_t result;
+			if (leaf_bounds == leaf.m_bounds)
+				continue;
 
-		return result;
-	}
+			leaf.m_bounds = leaf_bounds;
+			node_index = leaf.m_parent;
 
-private:
-	std::vector<entity_t> m_entities;
-};
+			while (node_index >= 0)
+			{
+				auto& node = this->m_nodes[node_index];
 
-class camera_t
-{
-public:
-	camera_t() {}
-	camera_t(const glm::dvec3& origin, double aspect_ratio,
-		double viewport_height, double focal_length = 1.0) :
-		m_origin{origin}
-	{
-		double viewport_width = aspect_ratio * viewport_height;
+				aabb_t node_bounds = this->m_nodes[node.m_first].m_bounds;
+				node_bounds.expand(this->m_nodes[node.m_first + 1].m_bounds);
 
-		this->m_horizontal = glm::dvec3(viewport_width, 0.0, 0.0);
-		this->m_vertical = glm::dvec3(0.0, viewport_height, 0.0);
+				if (node_bounds == node.m_bounds)
+					break;
 
-		this->m_lower_left_corner = this->m_origin -
-			(this->m_horizontal / 2.0) - (this->m_vertical / 2.0) -
-			glm::dvec3(0.0, 0.0, focal_length);
+				node.m_bounds = node_bounds;
+				node_index = node.m_parent;
+			}
+		}
 	}
-	~camera_t() {}
 
-	const glm::dvec3& get_origin() const { return this->m_origin; }
-	void set_origin(const glm::dvec3& origin) { this->m_origin = origin; }
+	// root is the first one, empty when there are no primitives
+	const std::vector<bvh_node_t>& get_nodes() const { return this->m_nodes; }
 
-	const glm::dvec3& get_lower_left_corner() const
+	const std::vector<int>& get_primitives() const
 	{
-		return this->m_lower_left_corner;
+		return this->m_primitives;
 	}
-	void set_lower_left_corner(const glm::dvec3& coord)
+
+	int get_leaf(int slot) const
 	{
-		this->m_lower_left_corner = coord;
+		if (slot < 0 || slot >= static_cast<int>(this->m_leaf_of_slot.size()))
+			return -1;
+
+		return this->m_leaf_of_slot[slot];
 	}
 
-	const glm::dvec3& get_horizontal() const { return this->m_horizontal; }
-	void set_horizontal(const glm::dvec3& coord) { this->m_horizontal = coord; }
+	bool is_empty() const { return this->m_nodes.empty(); }
 
-	const glm::dvec3& get_vertical() const { return this->m_vertical; }
-	void set_vertical(const glm::dvec3& coord) { this->m_vertical = coord; }
+	int get_primitive_count() const
+	{
+		return static_cast<int>(this->m_primitives.size());
+	}
 
-	ray_t get_ray(double u, double v)
+	// bytes
+	std::size_t get_memory_usage() const
 	{
-		return ray_t(this->m_origin,
-			(this->m_lower_left_corner + u * this->m_horizontal +
-				v * this->m_vertical) -
-				this->m_origin);
+		return this->m_nodes.capacity() * sizeof(bvh_node_t) +
+			(this->m_primitives.capacity() + this->m_leaf_of_slot.capacity()) *
+			sizeof(int);
 	}
 
-private:
-	glm::dvec3 m_origin;
-	glm::dvec3 m_lower_left_corner;
-	glm::dvec3 m_horizontal;
-	glm::dvec3 m_vertical;
-};
+	// expected cost of a ray through the tree: traversal steps of inner nodes
+	// and intersection tests of leaves weighted by the probability to hit
+	// them (their surface area relative to the root), lower is better
+	double get_sah_cost() const
+	{
+		if (this->m_nodes.empty())
+			return 0.0;
 
-struct global_vars_t
-{
-	global_vars_t() : m_samples_per_pixel{}, m_depth_count{} {}
-	~global_vars_t() {}
-
-	int m_samples_per_pixel;
-	int m_depth_count;
-	camera_t m_camera;
-};
+		auto root_area = this->m_nodes[0].m_bounds.get_surface_area();
 
-/* init */
-void init_window(global_vars_t& gvars) {}
+		if (root_area <= 0.0)
+			return 0.0;
 
-void init(global_vars_t& gvars)
-{
-	init_window(gvars);
-}
+		double result{};
 
-/* draw functions */
+		for (const auto& node : this->m_nodes)
+		{
+			auto probability = node.m_bounds.get_surface_area() / root_area;
 
-bool scatter_diffuse(const material_t& material, const ray_t& r_in,
-	const hit_record_t& rec, glm::dvec3& attenuation, ray_t& scattered)
-{
-	bool result{true};
+			result += node.is_leaf()
+				? probability * node.m_count * kIntersectionCost
+				: probability * kTraversalCost;
+		}
 
-	auto scatter_direction = rec.get_normal() + math_random_unit_vector();
+		return result;
+	}
 
-	if (math_is_near_zero(scatter_direction))
-		scatter_direction = rec.get_normal();
+	// how much the root grew since the build, refitting a tree whose
+	// entities flew far away from their original places makes nodes overlap
+	// a lot so at some point it is cheaper to rebuild it
+	double get_refit_degradation() const
+	{
+		if (this->m_nodes.empty() || this->m_built_surface_area <= 0.0)
+			return 1.0;
 
-	scattered = ray_t(rec.get_point(), scatter_direction);
-	attenuation = material.get_albedo();
+		return this->m_nodes[0].m_bounds.get_surface_area() /
+			this->m_built_surface_area;
+	}
 
-	return result;
-}
+private:
+	// threads work on separate ranges of m_primitives and separate nodes
+	void subdivide(const std::vector<aabb_t>& bounds, int node_index,
+		int first, int count, std::atomic<int>& node_count, int thread_depth)
+	{
+		aabb_t node_bounds;
+		aabb_t centroid_bounds;
 
-bool scatter_metal(const material_t& material, const ray_t& r_in,
-	const hit_record_t& rec, glm::dvec3& attenuation, ray_t& scattered)
-{
-	bool result{true};
+		for (int i = first; i < first + count; ++i)
+		{
+			const auto& primitive_bounds = bounds[this->m_primitives[i]];
+			node_bounds.expand(primitive_bounds);
+			centroid_bounds.expand(primitive_bounds.get_center());
+		}
 
-	auto reflected = math_reflect(r_in.get_direction(), rec.get_normal());
-	scattered = ray_t(rec.get_point(),
-		reflected + material.get_fuzz() * math_random_vector3_in_unit_sphere());
-	attenuation = material.get_albedo();
+		this->m_nodes[node_index].m_bounds = node_bounds;
 
-	return (glm::dot(scattered.get_direction(), rec.get_normal()) > 0.0);
-}
+		auto axis = centroid_bounds.get_longest_axis();
 
-bool scatter_dielectric(const material_t& material, const ray_t& r_in,
-	const hit_record_t& rec, glm::dvec3& attenuation, ray_t& scattered)
-{
-	bool result{true};
+		if (count <= kLeafSize ||
+			centroid_bounds.get_max()[axis] <= centroid_bounds.get_min()[axis])
+		{
+			this->m_nodes[node_index].m_first = first;
+			this->m_nodes[node_index].m_count = count;
 
-	attenuation = glm::dvec3(1.0, 1.0, 1.0);
-	double refraction_ratio = rec.is_front_face()
-		? (1.0 / material.get_refraction_index())
-		: material.get_refraction_index();
+			for (int i = first; i < first + count; ++i)
+				this->m_leaf_of_slot[this->m_primitives[i]] = node_index;
 
-	glm::dvec3 unit_direction = glm::normalize(r_in.get_direction());
-	glm::dvec3 refracted =
-		math_refract(unit_direction, rec.get_normal(), refraction_ratio);
+			return;
+		}
 
-	scattered = ray_t(rec.get_point(), refracted);
+		auto middle = this->split(bounds, first, count, centroid_bounds);
 
-	return result;
-}
+		auto left = node_count.fetch_add(2);
 
-// just linear interpolation between two colors
-glm::dvec3 draw_gradient(
-	double value, const glm::dvec3& from, const glm::dvec3& to)
-{
-	return (1.0 - value) * from + value * to;
-}
+		this->m_nodes[node_index].m_first = left;
+		this->m_nodes[node_index].m_count = 0;
+		this->m_nodes[left].m_parent = node_index;
+		this->m_nodes[left + 1].m_parent = node_index;
 
-// normalizing result of normal + color because color RGB components can't be
-// higher than 1.0 for that case we multiply on 0.5
-glm::dvec3 draw_normal(const glm::dvec3& normal)
-{
-	return 0.5 * (normal + glm::dvec3(1.0, 1.0, 1.0));
-}
+		if (thread_depth > 0 && count >= kThreadPrimitiveCount)
+		{
+			std::thread thread([&, left, first, middle]() {
+				this->subdivide(bounds, left, first, middle - first,
+					node_count, thread_depth - 1);
+			});
 
-glm::dvec3 draw_diffuse(const ray_t& ray, world_t& world, int depth)
-{
-	if (depth <= 0)
-		return {0.0, 0.0, 0.0};
+			this->subdivide(bounds, left + 1, middle, first + count - middle,
+				node_count, thread_depth - 1);
 
-	for (auto entity : world.get_entities())
-	{
-		const auto& hit_result = world.hit(entity, ray, 0.001, kInfinityDouble);
-		if (hit_result.is_hitted())
+			thread.join();
+		}
+		else
 		{
-			auto target = hit_result.get_point() + hit_result.get_normal() +
-				math_random_vector3_in_unit_sphere();
-
-			return 0.5 *
-				draw_diffuse(ray_t(hit_result.get_point(),
-								 target - hit_result.get_point()),
-					world, depth - 1);
+			this->subdivide(
+				bounds, left, first, middle - first, node_count, 0);
+			this->subdivide(bounds, left + 1, middle, first + count - middle,
+				node_count, 0);
 		}
 	}
 
-	auto t = 0.5 * (glm::normalize(ray.get_direction()).y + 1.0);
-	return draw_gradient(t, {1.0, 1.0, 1.0}, {0.5, 0.7, 1.0});
-}
-
-glm::dvec3 draw_diffuse_with_lambert(
-	const ray_t& ray, world_t& world, int depth)
-{
-	if (depth <= 0)
-		return {0.0, 0.0, 0.0};
-
-	for (auto entity : world.get_entities())
+	// the cheapest by SAH of the planes between kBinCount bins of centroids
+	// on every axis, primitives are partitioned by it and the first one of
+	// the right side is returned. Falls back to the median split of the
+	// longest axis when all centroids end up in one bin
+	int split(const std::vector<aabb_t>& bounds, int first, int count,
+		const aabb_t& centroid_bounds)
 	{
-		const auto& hit_result = world.hit(entity, ray, 0.001, kInfinityDouble);
-		if (hit_result.is_hitted())
+		struct bin_t
 		{
-			auto target = hit_result.get_point() + hit_result.get_normal() +
-				math_random_unit_vector();
+			bin_t() : m_count{} {}
+			~bin_t() {}
 
-			return 0.5 *
-				draw_diffuse(ray_t(hit_result.get_point(),
-								 target - hit_result.get_point()),
-					world, depth - 1);
-		}
-	}
+			aabb_t m_bounds;
+			int m_count;
+		};
 
-	auto t = 0.5 * (glm::normalize(ray.get_direction()).y + 1.0);
-	return draw_gradient(t, {1.0, 1.0, 1.0}, {0.5, 0.7, 1.0});
-}
+		auto get_bin = [&centroid_bounds](const aabb_t& primitive_bounds,
+						   int axis, double scale) {
+			auto bin = static_cast<int>(
+				(primitive_bounds.get_center()[axis] -
+					centroid_bounds.get_min()[axis]) *
+				scale);
 
-glm::dvec3 draw_with_materials(const ray_t& ray, world_t& world, int depth)
-{
-	if (depth <= 0)
-		return {0.0, 0.0, 0.0};
+			return (std::min)(bin, kBinCount - 1);
+		};
 
-	for (auto entity : world.get_entities())
-	{
-		const auto& hit_result = world.hit(entity, ray, 0.001, kInfinityDouble);
-		if (hit_result.is_hitted())
+		auto best_cost = kInfinityDouble;
+		int best_axis{-1};
+		int best_bin{};
+
+		for (int axis = 0; axis < 3; ++axis)
 		{
-			const auto& material = hit_result.get_material();
+			auto extent = centroid_bounds.get_max()[axis] -
+				centroid_bounds.get_min()[axis];
 
-			ray_t scattered;
-			glm::dvec3 attenuation;
+			if (extent <= 0.0)
+				continue;
 
-			switch (material.get_material_type())
-			{
-			case eMaterialType::kMaterialType_Diffuse:
+			auto scale = kBinCount / extent;
+			bin_t bins[kBinCount];
+
+			for (int i = first; i < first + count; ++i)
 			{
-				if (scatter_diffuse(
-						material, ray, hit_result, attenuation, scattered))
-				{
-					return attenuation *
-						draw_with_materials(scattered, world, depth - 1);
-				}
+				const auto& primitive_bounds = bounds[this->m_primitives[i]];
+				auto& bin = bins[get_bin(primitive_bounds, axis, scale)];
 
-				return glm::dvec3(0.0, 0.0, 0.0);
+				++bin.m_count;
+				bin.m_bounds.expand(primitive_bounds);
 			}
-			case eMaterialType::kMaterialType_Metal:
-			{
-				if (scatter_metal(
-						material, ray, hit_result, attenuation, scattered))
-				{
-					return attenuation *
-						draw_with_materials(scattered, world, depth - 1);
-				}
 
-				return glm::dvec3(0.0, 0.0, 0.0);
+			// cost of the right side of the plane before bin i
+			double right_costs[kBinCount]{};
+			aabb_t right_bounds;
+			int right_count{};
+
+			for (int i = kBinCount - 1; i > 0; --i)
+			{
+				right_bounds.expand(bins[i].m_bounds);
+				right_count += bins[i].m_count;
+				right_costs[i] = right_count
+					? right_bounds.get_surface_area() * right_count
+					: kInfinityDouble;
 			}
-			case eMaterialType::kMaterialType_Dielectric:
+
+			aabb_t left_bounds;
+			int left_count{};
+
+			for (int i = 1; i < kBinCount; ++i)
 			{
-				if (scatter_dielectric(
-						material, ray, hit_result, attenuation, scattered))
+				left_bounds.expand(bins[i - 1].m_bounds);
+				left_count += bins[i - 1].m_count;
+
+				if (!left_count)
+					continue;
+
+				auto cost = left_bounds.get_surface_area() * left_count +
+					right_costs[i];
+
+				if (cost < best_cost)
 				{
-					return attenuation *
-						draw_with_materials(scattered, world, depth - 1);
+					best_cost = cost;
+					best_axis = axis;
+					best_bin = i;
 				}
-
-				return glm::dvec3(0.0, 0.0, 0.0);
-			}
-			default:
-				return glm::dvec3(0.0, 0.0, 0.0);
 			}
 		}
-	}
-
-	auto t = 0.5 * (glm::normalize(ray.get_direction()).y + 1.0);
-	return draw_gradient(t, {1.0, 1.0, 1.0}, {0.5, 0.7, 1.0});
-}
 
-/* simulation */
+		if (best_axis < 0)
+		{
+			auto axis = centroid_bounds.get_longest_axis();
+			auto middle = first + count / 2;
+
+			std::nth_element(this->m_primitives.begin() + first,
+				this->m_primitives.begin() + middle,
+				this->m_primitives.begin() + first + count,
+				[&bounds, axis](int left, int right) {
+					return bounds[left].get_center()[axis] <
+						bounds[right].get_center()[axis];
+				});
+
+			return middle;
+		}
 
-bool hit_sphere(const glm::dvec3& center, double radius, const ray_t& ray)
-{
-	auto oc = ray.get_origin() - center;
+		auto scale = kBinCount /
+			(centroid_bounds.get_max()[best_axis] -
+				centroid_bounds.get_min()[best_axis]);
 
-	auto a = glm::dot(ray.get_direction(), ray.get_direction());
-	auto b = 2.0 * glm::dot(oc, ray.get_direction());
-	auto c = glm::dot(oc, oc) - radius * radius;
+		auto middle = std::partition(this->m_primitives.begin() + first,
+			this->m_primitives.begin() + first + count, [&](int slot) {
+				return get_bin(bounds[slot], best_axis, scale) < best_bin;
+			});
 
-	auto discriminant = (b * b) - (4 * a * c);
+		return static_cast<int>(middle - this->m_primitives.begin());
+	}
 
-	return (discriminant > 0);
-}
+private:
+	static constexpr int kLeafSize = 2;
+	static constexpr int kBinCount = 16;
+	// smaller subtrees are not worth a thread
+	static constexpr int kThreadPrimitiveCount = 16 * 1024;
+	static constexpr double kTraversalCost = 1.0;
+	static constexpr double kIntersectionCost = 1.0;
+
+	double m_built_surface_area;
+	std::vector<bvh_node_t> m_nodes;
+	std::vector<int> m_primitives;
+	std::vector<int> m_leaf_of_slot;
+};
 
-void test_image(global_vars_t& gvars)
+/// @brief node of wide_bvh_t, one cache line. Child boxes are stored per
+/// axis for all children (SoA) as 8 bit steps of a power of two scale from the
+/// origin, rounded outwards, so they still contain what the binary bounds
+/// contained
+struct alignas(64) wide_bvh_node_t
 {
-	std::cout << "writing test image" << std::endl;
-
-	image_ppm_t img(256, 256);
-
-	auto status = img.open("test1_gradient.ppm");
-
-	if (status)
+	static constexpr int kWidth = 4;
+	static constexpr float kExitScale =
+		1.0f + 4.0f * std::numeric_limits<float>::epsilon();
+	// m_children of unused lanes, their boxes are inverted and never hit
+	static constexpr std::int32_t kEmptyChild =
+		(std::numeric_limits<std::int32_t>::min)();
+
+	wide_bvh_node_t() : m_origin{}, m_scale{}
 	{
-		auto total_size = img.get_width() * img.get_height();
-		for (int i = 1; i <= total_size; ++i)
+		for (int axis = 0; axis < 3; ++axis)
 		{
-			img.write({double(i) / total_size, double(i) / total_size,
-				double(i) / total_size});
+			for (int lane = 0; lane < kWidth; ++lane)
+			{
+				this->m_min[axis][lane] = 255;
+				this->m_max[axis][lane] = 0;
+			}
 		}
+
+		for (int lane = 0; lane < kWidth; ++lane)
+			this->m_children[lane] = kEmptyChild;
 	}
+	~wide_bvh_node_t() {}
+
+	// slab test of all used children at once in float, one SSE register
+	// holds the distances of all lanes (a plain loop over the lanes is the
+	// fallback). The ray is given as origin and inverse direction converted
+	// to float once per traversal, exit distances are scaled up a bit so
+	// float rounding never misses a box that the ray grazes. Returns the mask
+	// of the hit lanes and their entry distances
+	int hit(const float* p_origin, const float* p_inv_direction, float t_min,
+		float t_max, float* p_t_entries) const
+	{
+#ifdef SIMPLERAY_SSE
+		auto zero = _mm_setzero_si128();
 
-	std::cout << "test.ppm was created" << std::endl;
-}
+		// 4 bytes of the lanes to 4 floats
+		auto load = [zero](const std::uint8_t* p_values) {
+			std::int32_t values{};
+			std::memcpy(&values, p_values, sizeof(values));
 
-void test_simple_ray(global_vars_t& gvars)
-{
-	auto aspect_ratio = 16.0 / 9.0;
-	auto width = 400;
-	auto height = width / aspect_ratio;
+			auto words = _mm_unpacklo_epi8(_mm_cvtsi32_si128(values), zero);
+			return _mm_cvtepi32_ps(_mm_unpacklo_epi16(words, zero));
+		};
 
-	auto viewport_height = 2.0;
-	auto viewport_width = aspect_ratio * viewport_height;
-	auto focal_length = 1.0;
+		auto t_entries = _mm_set1_ps(t_min);
+		auto t_exits = _mm_set1_ps(t_max);
 
-	auto origin = glm::dvec3(0, 0, 0);
+		for (int axis = 0; axis < 3; ++axis)
+		{
+			auto inverse = p_inv_direction[axis];
+			auto offset = _mm_set1_ps(
+				(this->m_origin[axis] - p_origin[axis]) * inverse);
+			auto step = _mm_set1_ps(this->m_scale[axis] * inverse);
+
+			auto near = load(
+				inverse < 0.0f ? this->m_max[axis] : this->m_min[axis]);
+			auto far = load(
+				inverse < 0.0f ? this->m_min[axis] : this->m_max[axis]);
+
+			// max/min return the second operand for NaN (0 * inf), so such
+			// planes are ignored like in aabb_t::hit
+			t_entries = _mm_max_ps(
+				_mm_add_ps(offset, _mm_mul_ps(near, step)), t_entries);
+			t_exits =
+				_mm_min_ps(_mm_add_ps(offset, _mm_mul_ps(far, step)), t_exits);
+		}
 
-	auto horizontal = glm::dvec3(viewport_width, 0, 0);
-	auto vertical = glm::dvec3(0, viewport_height, 0);
-	auto lower_left_corner = origin - (horizontal / 2.0) - (vertical / 2.0) -
-		glm::dvec3(0, 0, focal_length);
+		_mm_storeu_ps(p_t_entries, t_entries);
 
-	image_ppm_t img(width, height);
+		auto is_empty = _mm_cmpeq_epi32(
+			_mm_loadu_si128(reinterpret_cast<const __m128i*>(this->m_children)),
+			_mm_set1_epi32(kEmptyChild));
 
-	img.open("test2_background.ppm");
+		return _mm_movemask_ps(_mm_cmple_ps(t_entries,
+				   _mm_mul_ps(t_exits, _mm_set1_ps(kExitScale)))) &
+			~_mm_movemask_ps(_mm_castsi128_ps(is_empty));
+#else
+		float t_entries[kWidth];
+		float t_exits[kWidth];
 
-	for (int j = height - 1; j >= 0; --j)
-	{
-		for (int i = 0; i < width; ++i)
+		for (int lane = 0; lane < kWidth; ++lane)
 		{
-			auto u = double(i) / (width - 1);
-			auto v = double(j) / (height - 1);
+			t_entries[lane] = t_min;
+			t_exits[lane] = t_max;
+		}
 
-			ray_t ray(origin,
-				lower_left_corner + (u * horizontal) + (v * vertical) - origin);
+		for (int axis = 0; axis < 3; ++axis)
+		{
+			auto inverse = p_inv_direction[axis];
+			auto offset = (this->m_origin[axis] - p_origin[axis]) * inverse;
+			auto step = this->m_scale[axis] * inverse;
 
-			auto norm_dir = glm::normalize(ray.get_direction());
+			const auto* p_near =
+				inverse < 0.0f ? this->m_max[axis] : this->m_min[axis];
+			const auto* p_far =
+				inverse < 0.0f ? this->m_min[axis] : this->m_max[axis];
 
-			auto t = 0.5 * (norm_dir.y + 1.0);
+			for (int lane = 0; lane < kWidth; ++lane)
+			{
+				auto t0 = offset + float(p_near[lane]) * step;
+				auto t1 = offset + float(p_far[lane]) * step;
 
-			auto color = (1.0 - t) * glm::dvec3(1.0, 1.0, 1.0) +
-				t * glm::dvec3(0.5, 0.7, 1.0);
+				t_entries[lane] = t0 > t_entries[lane] ? t0 : t_entries[lane];
+				t_exits[lane] = t1 < t_exits[lane] ? t1 : t_exits[lane];
+			}
+		}
 
-			img.write(color);
+		int result{};
+
+		for (int lane = 0; lane < kWidth; ++lane)
+		{
+			bool is_hitted = t_entries[lane] <= t_exits[lane] * kExitScale &&
+				this->m_children[lane] != kEmptyChild;
+
+			p_t_entries[lane] = t_entries[lane];
+			result |= (is_hitted ? 1 : 0) << lane;
 		}
+
+		return result;
+#endif
 	}
-}
 
-void test_simple_sphere(global_vars_t& gvars)
+	float m_origin[3];
+	float m_scale[3];
+	std::uint8_t m_min[3][kWidth];
+	std::uint8_t m_max[3][kWidth];
+	// inner node index, ~leaf index in wide_bvh_t::m_leaves or kEmptyChild
+	std::int32_t m_children[kWidth];
+};
+
+static_assert(sizeof(wide_bvh_node_t) == 64);
+
+/// @brief bvh_t collapsed into a 4 wide tree for traversal: every node tests
+/// four children at once and the quantized nodes take a fraction of the
+/// memory of binary ones. bvh_t stays the source of truth which is built and
+/// refitted, this one is converted from it after every change
+class wide_bvh_t
 {
-	auto aspect_ratio = 16.0 / 9.0;
-	auto width = 400;
-	auto height = width / aspect_ratio;
+	struct leaf_t
+	{
+		int m_first;
+		int m_count;
+	};
 
-	auto viewport_height = 2.0;
-	auto viewport_width = aspect_ratio * viewport_height;
-	auto focal_length = 1.0;
+	// binary nodes whose boxes the lanes of a wide node hold, -1 for unused
+	// lanes
+	struct lanes_t
+	{
+		std::int32_t m_nodes[wide_bvh_node_t::kWidth];
+	};
 
-	auto origin = glm::dvec3(0, 0, 0);
+public:
+	wide_bvh_t() {}
+	~wide_bvh_t() {}
 
-	auto horizontal = glm::dvec3(viewport_width, 0, 0);
-	auto vertical = glm::dvec3(0, viewport_height, 0);
-	auto lower_left_corner = origin - (horizontal / 2.0) - (vertical / 2.0) -
-		glm::dvec3(0, 0, focal_length);
+	void clear()
+	{
+		this->m_nodes.clear();
+		this->m_lanes.clear();
+		this->m_lane_owners.clear();
+		this->m_leaves.clear();
+		this->m_primitives.clear();
+	}
 
-	image_ppm_t img(width, height);
+	// every wide node takes the biggest (by surface area) inner nodes of the
+	// binary subtree until it has kWidth children
+	void build(const bvh_t& bvh)
+	{
+		this->clear();
 
-	img.open("test3_sphere.ppm");
+		const auto& nodes = bvh.get_nodes();
 
-	for (int j = height - 1; j >= 0; --j)
+		if (nodes.empty())
+			return;
+
+		this->m_primitives = bvh.get_primitives();
+		this->m_nodes.reserve(nodes.size() / 2 + 1);
+		this->m_lanes.reserve(nodes.size() / 2 + 1);
+		this->m_leaves.reserve(nodes.size() / 2 + 1);
+		this->m_lane_owners.assign(nodes.size(), -1);
+		this->m_nodes.emplace_back();
+		this->m_lanes.emplace_back();
+
+		this->convert(nodes, 0, 0);
+	}
+
+	// bvh was refitted for the slots since this was built from it, the
+	// topology is the same, so only wide nodes with a lane on the path from
+	// a changed leaf to the root get their boxes quantized again
+	void refit(const bvh_t& bvh, const std::vector<int>& slots)
 	{
-		for (int i = 0; i < width; ++i)
+		const auto& nodes = bvh.get_nodes();
+		std::vector<int> refitted;
+
+		for (auto slot : slots)
 		{
-			auto u = double(i) / (width - 1);
-			auto v = double(j) / (height - 1);
+			for (auto binary_index = bvh.get_leaf(slot); binary_index >= 0;
+				 binary_index = nodes[binary_index].m_parent)
+			{
+				auto wide_index = this->m_lane_owners[binary_index];
 
-			ray_t ray(origin,
-				lower_left_corner + (u * horizontal) + (v * vertical) - origin);
+				if (wide_index >= 0)
+					refitted.push_back(wide_index);
+			}
+		}
 
-			glm::dvec3 color;
-			if (hit_sphere({0, 0, -1}, 0.5, ray))
+		std::sort(refitted.begin(), refitted.end());
+		refitted.erase(
+			std::unique(refitted.begin(), refitted.end()), refitted.end());
+
+		for (auto wide_index : refitted)
+		{
+			const auto* p_lanes = this->m_lanes[wide_index].m_nodes;
+			int child_count{};
+			aabb_t bounds;
+
+			while (child_count < wide_bvh_node_t::kWidth &&
+				p_lanes[child_count] >= 0)
 			{
-				color = {1, 0, 0};
+				bounds.expand(nodes[p_lanes[child_count++]].m_bounds);
 			}
-			else
-			{
-				auto norm_dir = glm::normalize(ray.get_direction());
 
-				auto t = 0.5 * (norm_dir.y + 1.0);
+			// boxes of lanes whose primitives were all removed are inverted
+			// again
+			const auto& old_node = this->m_nodes[wide_index];
+			wide_bvh_node_t node;
 
-				color = (1.0 - t) * glm::dvec3(1.0, 1.0, 1.0) +
-					t * glm::dvec3(0.5, 0.7, 1.0);
-			}
+			for (int lane = 0; lane < wide_bvh_node_t::kWidth; ++lane)
+				node.m_children[lane] = old_node.m_children[lane];
 
-			img.write(color);
+			this->quantize(node, bounds, nodes, p_lanes, child_count);
+			this->m_nodes[wide_index] = node;
 		}
 	}
-}
 
-void test_world_sphere(global_vars_t& gvars)
-{
-	auto aspect_ratio = 16.0 / 9.0;
-	auto width = 400;
-	auto height = width / aspect_ratio;
+	// calls visitor(slot) for every primitive in the leaves that the ray
+	// touches, visitor can shrink t_max (closest hit) or return true to stop
+	// the whole traversal (any hit). Returns true if it was stopped
+	template <typename Visitor>
+	bool traverse(
+		const ray_t& ray, double t_min, double& t_max, Visitor&& visitor) const
+	{
+		if (this->m_nodes.empty())
+			return false;
 
-	auto viewport_height = 2.0;
-	auto viewport_width = aspect_ratio * viewport_height;
-	auto focal_length = 1.0;
+		float origin[3];
+		float inv_direction[3];
 
-	auto origin = glm::dvec3(0, 0, 0);
+		for (int axis = 0; axis < 3; ++axis)
+		{
+			origin[axis] = static_cast<float>(ray.get_origin()[axis]);
+			inv_direction[axis] =
+				static_cast<float>(1.0 / ray.get_direction()[axis]);
+		}
 
-	auto horizontal = glm::dvec3(viewport_width, 0, 0);
-	auto vertical = glm::dvec3(0, viewport_height, 0);
-	auto lower_left_corner = origin - (horizontal / 2.0) - (vertical / 2.0) -
-		glm::dvec3(0, 0, focal_length);
+		struct entry_t
+		{
+			std::int32_t m_child;
+			float m_t_entry;
+		};
 
-	world_t world;
-	world.add(entity_t(eEntityType::kEntityType_Sphere,
-		sphere_data_t(true, 0.5, {0.0, 0.0, -1.0}, {1.0, 0.0, 0.0})));
+		entry_t stack[kStackSize];
+		int stack_size{};
+		stack[stack_size++] = {0, static_cast<float>(t_min)};
 
-	image_ppm_t img(width, height);
+		while (stack_size)
+		{
+			auto entry = stack[--stack_size];
 
-	img.open("test4_world_sphere.ppm");
+			// t_max shrank since it was pushed
+			if (entry.m_t_entry > t_max)
+				continue;
 
-	constexpr double inf = std::numeric_limits<double>::infinity();
+			if (entry.m_child < 0)
+			{
+				const auto& leaf = this->m_leaves[~entry.m_child];
 
-	for (int j = height - 1; j >= 0; --j)
-	{
-		for (int i = 0; i < width; ++i)
-		{
-			auto u = double(i) / (width - 1);
-			auto v = double(j) / (height - 1);
+				for (int i = 0; i < leaf.m_count; ++i)
+				{
+					if (visitor(this->m_primitives[leaf.m_first + i]))
+						return true;
+				}
 
-			ray_t ray(origin,
-				lower_left_corner + (u * horizontal) + (v * vertical) - origin);
+				continue;
+			}
 
-			// it works only for one entity
-			for (const auto& entity : world.get_entities())
+			const auto& node = this->m_nodes[entry.m_child];
+
+			float t_entries[wide_bvh_node_t::kWidth];
+			auto mask = node.hit(origin, inv_direction,
+				static_cast<float>(t_min), static_cast<float>(t_max), t_entries);
+
+			// hit children are pushed sorted by distance, the farthest one
+			// first, so the nearest is popped first and shrinks t_max for
+			// closest hit queries
+			auto first = stack_size;
+
+			for (; mask; mask &= mask - 1)
 			{
-				const auto& hit_result = world.hit(entity, ray, 0.0, inf);
+				auto lane = std::countr_zero(static_cast<unsigned int>(mask));
+				entry_t child{node.m_children[lane], t_entries[lane]};
 
-				if (hit_result.is_hitted())
+				auto i = stack_size++;
+
+				for (; i > first && stack[i - 1].m_t_entry < child.m_t_entry;
+					 --i)
 				{
-					if (hit_result.is_draw_normal_map())
-					{
-						img.write(draw_normal(hit_result.get_normal()));
-					}
+					stack[i] = stack[i - 1];
 				}
-				else
+
+				stack[i] = child;
+			}
+		}
+
+		return false;
+	}
+
+	// bytes
+	std::size_t get_memory_usage() const
+	{
+		return this->m_nodes.capacity() * sizeof(wide_bvh_node_t) +
+			this->m_lanes.capacity() * sizeof(lanes_t) +
+			this->m_lane_owners.capacity() * sizeof(std::int32_t) +
+			this->m_leaves.capacity() * sizeof(leaf_t) +
+			this->m_primitives.capacity() * sizeof(int);
+	}
+
+private:
+	void convert(const std::vector<bvh_node_t>& nodes, int binary_index,
+		int wide_index)
+	{
+		int children[wide_bvh_node_t::kWidth];
+		int child_count{};
+
+		if (nodes[binary_index].is_leaf())
+		{
+			children[child_count++] = binary_index;
+		}
+		else
+		{
+			children[child_count++] = nodes[binary_index].m_first;
+			children[child_count++] = nodes[binary_index].m_first + 1;
+		}
+
+		while (child_count < wide_bvh_node_t::kWidth)
+		{
+			int biggest = -1;
+			double biggest_area{-1.0};
+
+			for (int i = 0; i < child_count; ++i)
+			{
+				const auto& node = nodes[children[i]];
+				auto area = node.m_bounds.get_surface_area();
+
+				if (!node.is_leaf() && area > biggest_area)
 				{
-					auto t =
-						0.5 * (glm::normalize(ray.get_direction()).y + 1.0);
-					img.write(
-						draw_gradient(t, {1.0, 1.0, 1.0}, {0.5, 0.7, 1.0}));
+					biggest = i;
+					biggest_area = area;
 				}
 			}
+
+			if (biggest < 0)
+				break;
+
+			auto opened = nodes[children[biggest]].m_first;
+			children[biggest] = opened;
+			children[child_count++] = opened + 1;
+		}
+
+		aabb_t bounds;
+
+		for (int i = 0; i < child_count; ++i)
+			bounds.expand(nodes[children[i]].m_bounds);
+
+		wide_bvh_node_t node;
+		this->quantize(node, bounds, nodes, children, child_count);
+
+		for (int i = 0; i < child_count; ++i)
+		{
+			const auto& child = nodes[children[i]];
+
+			if (child.is_leaf())
+			{
+				node.m_children[i] =
+					~static_cast<std::int32_t>(this->m_leaves.size());
+				this->m_leaves.push_back({child.m_first, child.m_count});
+			}
+			else
+			{
+				node.m_children[i] =
+					static_cast<std::int32_t>(this->m_nodes.size());
+				this->m_nodes.emplace_back();
+				this->m_lanes.emplace_back();
+			}
+		}
+
+		this->m_nodes[wide_index] = node;
+
+		for (int i = 0; i < wide_bvh_node_t::kWidth; ++i)
+		{
+			this->m_lanes[wide_index].m_nodes[i] =
+				i < child_count ? children[i] : -1;
+
+			if (i < child_count)
+				this->m_lane_owners[children[i]] = wide_index;
+		}
+
+		for (int i = 0; i < child_count; ++i)
+		{
+			if (node.m_children[i] >= 0)
+				this->convert(nodes, children[i], node.m_children[i]);
+		}
+	}
+
+	void quantize(wide_bvh_node_t& node, const aabb_t& bounds,
+		const std::vector<bvh_node_t>& nodes, const int* p_children,
+		int child_count) const
+	{
+		// leaves whose primitives were all removed, lanes stay inverted
+		if (bounds.is_empty())
+			return;
+
+		// normal float powers of two
+		static constexpr int kMinExponent = -126;
+		static constexpr int kMaxExponent = 127;
+
+		for (int axis = 0; axis < 3; ++axis)
+		{
+			auto min = bounds.get_min()[axis];
+			auto max = bounds.get_max()[axis];
+
+			auto origin = static_cast<float>(min);
+			if (origin > min)
+			{
+				origin = std::nextafter(
+					origin, -std::numeric_limits<float>::infinity());
+			}
+
+			// the smallest power of two step whose 255 steps cover the box
+			auto exponent = max > origin
+				? (std::max)(std::ilogb((max - origin) / 255.0), kMinExponent)
+				: kMinExponent;
+
+			while (exponent < kMaxExponent &&
+				origin + 255.0 * std::ldexp(1.0, exponent) < max)
+			{
+				++exponent;
+			}
+
+			auto scale = std::ldexp(1.0, exponent);
+
+			node.m_origin[axis] = origin;
+			node.m_scale[axis] = static_cast<float>(scale);
+
+			for (int i = 0; i < child_count; ++i)
+			{
+				const auto& child_bounds = nodes[p_children[i]].m_bounds;
+
+				if (child_bounds.is_empty())
+					continue;
+
+				auto child_min = child_bounds.get_min()[axis];
+				auto child_max = child_bounds.get_max()[axis];
+
+				auto lower =
+					(std::max)(std::floor((child_min - origin) / scale), 0.0);
+				auto upper =
+					(std::min)(std::ceil((child_max - origin) / scale), 255.0);
+
+				// division rounding may be off by one step
+				while (lower > 0.0 && origin + lower * scale > child_min)
+					lower -= 1.0;
+
+				while (upper < 255.0 && origin + upper * scale < child_max)
+					upper += 1.0;
+
+				node.m_min[axis][i] = static_cast<std::uint8_t>(lower);
+				node.m_max[axis][i] = static_cast<std::uint8_t>(upper);
+			}
+		}
+	}
+
+private:
+	// every node pushes at most three more entries than it pops
+	static constexpr int kStackSize = 256;
+
+	std::vector<wide_bvh_node_t> m_nodes;
+	// of m_nodes, for refit()
+	std::vector<lanes_t> m_lanes;
+	// wide node which has the binary node as a lane, -1 for binary nodes
+	// collapsed into their wide node
+	std::vector<std::int32_t> m_lane_owners;
+	std::vector<leaf_t> m_leaves;
+	std::vector<int> m_primitives;
+};
+
+/// @brief uniform grid over entity bounds, a cell is a range of one array of
+/// slots, so the grid is built in O(N) by a counting sort and is cheap enough
+/// to be rebuilt every frame. Rays walk the cells they pass with 3D-DDA.
+/// Entities much bigger than a typical one (the ground sphere) would be put
+/// into most of the cells and stretch the grid, they are kept aside and tested
+/// by every ray
+class grid_t
+{
+public:
+	grid_t() : m_resolution{}, m_cell_size{}, m_inv_cell_size{} {}
+	~grid_t() {}
+
+	void clear()
+	{
+		this->m_bounds = aabb_t();
+		this->m_resolution = glm::ivec3(0);
+		this->m_cell_size = glm::dvec3(0.0);
+		this->m_inv_cell_size = glm::dvec3(0.0);
+		this->m_cell_starts.clear();
+		this->m_slots.clear();
+		this->m_large_slots.clear();
+	}
+
+	// slots with empty bounds are skipped
+	void build(const std::vector<aabb_t>& bounds, const std::vector<int>& slots)
+	{
+		this->clear();
+
+		// typical size is the median of the largest extents
+		std::vector<double> sizes;
+		sizes.reserve(slots.size());
+
+		for (auto slot : slots)
+		{
+			if (!bounds[slot].is_empty())
+				sizes.push_back(get_size(bounds[slot]));
+		}
+
+		if (sizes.empty())
+			return;
+
+		auto middle = sizes.begin() + sizes.size() / 2;
+		std::nth_element(sizes.begin(), middle, sizes.end());
+
+		auto large_size = kLargeSize * *middle;
+		int count{};
+
+		for (auto slot : slots)
+		{
+			const auto& slot_bounds = bounds[slot];
+
+			if (slot_bounds.is_empty())
+				continue;
+
+			if (large_size > 0.0 && get_size(slot_bounds) > large_size)
+			{
+				this->m_large_slots.push_back(slot);
+				continue;
+			}
+
+			this->m_bounds.expand(slot_bounds);
+			++count;
+		}
+
+		if (!count)
+			return;
+
+		// kCellsPerEntity cells per entity, as cubic as the bounds allow
+		auto extent = this->m_bounds.get_max() - this->m_bounds.get_min();
+		auto max_extent = (std::max)({extent.x, extent.y, extent.z});
+		auto cell_count = static_cast<double>(kCellsPerEntity) * count;
+		auto volume = extent.x * extent.y * extent.z;
+		auto cell_size = volume > 0.0 ? std::cbrt(volume / cell_count)
+									  : max_extent / std::cbrt(cell_count);
+
+		for (int axis = 0; axis < 3; ++axis)
+		{
+			auto resolution = cell_size > 0.0
+				? std::ceil(extent[axis] / cell_size)
+				: 1.0;
+
+			this->m_resolution[axis] = static_cast<int>(
+				std::clamp(resolution, 1.0, double(kMaxResolution)));
+			this->m_cell_size[axis] = extent[axis] / this->m_resolution[axis];
+			this->m_inv_cell_size[axis] = extent[axis] > 0.0
+				? this->m_resolution[axis] / extent[axis]
+				: 0.0;
+		}
+
+		// counts of slots per cell summed up to their ends, filling from the
+		// back moves every end to the start of the cell
+		auto total_cell_count = static_cast<std::size_t>(
+									this->m_resolution.x) *
+			this->m_resolution.y * this->m_resolution.z;
+
+		this->m_cell_starts.assign(total_cell_count + 1, 0);
+
+		for (auto slot : slots)
+		{
+			this->for_each_cell(bounds[slot], large_size,
+				[this](std::size_t cell) { ++this->m_cell_starts[cell]; });
+		}
+
+		for (std::size_t cell = 1; cell <= total_cell_count; ++cell)
+			this->m_cell_starts[cell] += this->m_cell_starts[cell - 1];
+
+		this->m_slots.resize(this->m_cell_starts[total_cell_count]);
+
+		// backwards so slots of a cell stay in ascending order
+		for (auto i = slots.size(); i-- > 0;)
+		{
+			auto slot = slots[i];
+
+			this->for_each_cell(bounds[slot], large_size,
+				[this, slot](std::size_t cell) {
+					this->m_slots[--this->m_cell_starts[cell]] = slot;
+				});
+		}
+	}
+
+	// calls visitor(slot) for every slot of the large entities and of the
+	// cells that the ray passes in order of distance, visitor can shrink
+	// t_max (closest hit) or return true to stop the whole traversal (any
+	// hit). Returns true if it was stopped. A slot which overlaps several
+	// cells is visited once for each of them
+	template <typename Visitor>
+	bool traverse(
+		const ray_t& ray, double t_min, double& t_max, Visitor&& visitor) const
+	{
+		// the ground usually is hit first, so t_max shrinks before the walk
+		for (auto slot : this->m_large_slots)
+		{
+			if (visitor(slot))
+				return true;
+		}
+
+		if (this->m_cell_starts.empty())
+			return false;
+
+		const auto& origin = ray.get_origin();
+		const auto& direction = ray.get_direction();
+
+		auto t_entry = t_min;
+		auto t_exit = t_max;
+
+		for (int axis = 0; axis < 3; ++axis)
+		{
+			auto inv_direction = 1.0 / direction[axis];
+			auto t0 =
+				(this->m_bounds.get_min()[axis] - origin[axis]) * inv_direction;
+			auto t1 =
+				(this->m_bounds.get_max()[axis] - origin[axis]) * inv_direction;
+
+			if (inv_direction < 0.0)
+				std::swap(t0, t1);
+
+			t_entry = t0 > t_entry ? t0 : t_entry;
+			t_exit = t1 < t_exit ? t1 : t_exit;
+
+			if (t_exit < t_entry)
+				return false;
+		}
+
+		// the cell of the entry point, distances to the next cell boundary
+		// and between boundaries along every axis
+		glm::ivec3 cell;
+		glm::ivec3 step;
+		glm::ivec3 end;
+		glm::dvec3 t_next;
+		glm::dvec3 t_delta;
+
+		auto entry_point = origin + direction * t_entry;
+
+		for (int axis = 0; axis < 3; ++axis)
+		{
+			cell[axis] = this->get_cell(entry_point[axis], axis);
+
+			auto inv_direction = 1.0 / direction[axis];
+			auto cell_min = this->m_bounds.get_min()[axis] +
+				cell[axis] * this->m_cell_size[axis];
+
+			if (direction[axis] > 0.0)
+			{
+				step[axis] = 1;
+				end[axis] = this->m_resolution[axis];
+				t_next[axis] = (cell_min + this->m_cell_size[axis] -
+								   origin[axis]) *
+					inv_direction;
+				t_delta[axis] = this->m_cell_size[axis] * inv_direction;
+			}
+			else if (direction[axis] < 0.0)
+			{
+				step[axis] = -1;
+				end[axis] = -1;
+				t_next[axis] = (cell_min - origin[axis]) * inv_direction;
+				t_delta[axis] = -this->m_cell_size[axis] * inv_direction;
+			}
+			else
+			{
+				step[axis] = 0;
+				end[axis] = -1;
+				t_next[axis] = kInfinityDouble;
+				t_delta[axis] = kInfinityDouble;
+			}
+		}
+
+		for (;;)
+		{
+			auto index = (static_cast<std::size_t>(cell.z) *
+								 this->m_resolution.y +
+							 cell.y) *
+					this->m_resolution.x +
+				cell.x;
+
+			for (auto i = this->m_cell_starts[index];
+				 i < this->m_cell_starts[index + 1]; ++i)
+			{
+				if (visitor(this->m_slots[i]))
+					return true;
+			}
+
+			int axis = t_next.x < t_next.y ? (t_next.x < t_next.z ? 0 : 2)
+										   : (t_next.y < t_next.z ? 1 : 2);
+
+			// the closest hit is inside of the cell, farther cells can't
+			// have a closer one
+			if (t_next[axis] >= t_max || t_next[axis] > t_exit)
+				break;
+
+			cell[axis] += step[axis];
+
+			if (cell[axis] == end[axis])
+				break;
+
+			t_next[axis] += t_delta[axis];
+		}
+
+		return false;
+	}
+
+	int get_large_count() const
+	{
+		return static_cast<int>(this->m_large_slots.size());
+	}
+
+	// bytes
+	std::size_t get_memory_usage() const
+	{
+		return (this->m_cell_starts.capacity() + this->m_slots.capacity() +
+				   this->m_large_slots.capacity()) *
+			sizeof(int);
+	}
+
+private:
+	static double get_size(const aabb_t& bounds)
+	{
+		auto extent = bounds.get_max() - bounds.get_min();
+
+		return (std::max)({extent.x, extent.y, extent.z});
+	}
+
+	int get_cell(double coordinate, int axis) const
+	{
+		auto cell = static_cast<int>(
+			(coordinate - this->m_bounds.get_min()[axis]) *
+			this->m_inv_cell_size[axis]);
+
+		return std::clamp(cell, 0, this->m_resolution[axis] - 1);
+	}
+
+	// cells overlapped by the bounds of a slot which is in the cells
+	template <typename Function>
+	void for_each_cell(
+		const aabb_t& bounds, double large_size, Function&& function) const
+	{
+		if (bounds.is_empty() ||
+			(large_size > 0.0 && get_size(bounds) > large_size))
+		{
+			return;
+		}
+
+		glm::ivec3 first;
+		glm::ivec3 last;
+
+		for (int axis = 0; axis < 3; ++axis)
+		{
+			first[axis] = this->get_cell(bounds.get_min()[axis], axis);
+			last[axis] = this->get_cell(bounds.get_max()[axis], axis);
+		}
+
+		for (auto z = first.z; z <= last.z; ++z)
+		{
+			for (auto y = first.y; y <= last.y; ++y)
+			{
+				auto row = (static_cast<std::size_t>(z) * this->m_resolution.y +
+							   y) *
+					this->m_resolution.x;
+
+				for (auto x = first.x; x <= last.x; ++x)
+					function(row + x);
+			}
 		}
 	}
+
+private:
+	// an entity is large when it is kLargeSize times bigger than the median
+	static constexpr double kLargeSize = 16.0;
+	static constexpr int kCellsPerEntity = 2;
+	static constexpr int kMaxResolution = 4096;
+
+	aabb_t m_bounds;
+	glm::ivec3 m_resolution;
+	glm::dvec3 m_cell_size;
+	glm::dvec3 m_inv_cell_size;
+	// cell_count + 1 offsets into m_slots, x is the fastest axis
+	std::vector<int> m_cell_starts;
+	std::vector<int> m_slots;
+	std::vector<int> m_large_slots;
+};
+
+/// @brief sphere geometry as world_t keeps it, float center and radius in 16
+/// bytes, so four spheres of a bvh leaf fit one cache line. Intersections are
+/// still computed in double from them
+struct compact_sphere_t
+{
+	compact_sphere_t() : m_center{0.0f, 0.0f, 0.0f}, m_radius{} {}
+	compact_sphere_t(const glm::dvec3& center, double radius) :
+		m_center{center}, m_radius{static_cast<float>(radius)}
+	{
+	}
+	~compact_sphere_t() {}
+
+	glm::dvec3 get_center() const { return glm::dvec3(this->m_center); }
+	double get_radius() const { return this->m_radius; }
+
+	bool operator==(const compact_sphere_t& sphere) const
+	{
+		return this->m_center == sphere.m_center &&
+			this->m_radius == sphere.m_radius;
+	}
+
+	glm::vec3 m_center;
+	float m_radius;
+};
+
+static_assert(sizeof(compact_sphere_t) == 16);
+
+/// @brief everything of sphere_data_t except the geometry, spheres which look
+/// the same share one through their index
+struct sphere_surface_t
+{
+	sphere_surface_t() : m_is_draw_normal_map{} {}
+	sphere_surface_t(const sphere_data_t& sphere_data) :
+		m_is_draw_normal_map{sphere_data.is_draw_normal_map()},
+		m_color{sphere_data.get_color()}, m_material{sphere_data.get_material()}
+	{
+	}
+	~sphere_surface_t() {}
+
+	bool operator==(const sphere_surface_t& surface) const
+	{
+		const auto& material = surface.m_material;
+
+		return this->m_is_draw_normal_map == surface.m_is_draw_normal_map &&
+			this->m_color == surface.m_color &&
+			this->m_material.get_material_type() ==
+			material.get_material_type() &&
+			this->m_material.get_refraction_index() ==
+			material.get_refraction_index() &&
+			this->m_material.get_fuzz() == material.get_fuzz() &&
+			this->m_material.get_albedo() == material.get_albedo();
+	}
+
+	std::uint64_t get_hash() const
+	{
+		auto hash = [](std::uint64_t seed, double value) {
+			std::uint64_t bits{};
+			std::memcpy(&bits, &value, sizeof(bits));
+			return math_hash(seed ^ bits);
+		};
+
+		auto result = math_hash(this->m_is_draw_normal_map);
+		result = hash(result, double(this->m_material.get_material_type()));
+		result = hash(result, this->m_material.get_refraction_index());
+		result = hash(result, this->m_material.get_fuzz());
+
+		for (const auto* p_color :
+			{&this->m_color, &this->m_material.get_albedo()})
+		{
+			result = hash(result, p_color->x);
+			result = hash(result, p_color->y);
+			result = hash(result, p_color->z);
+		}
+
+		return result;
+	}
+
+	bool m_is_draw_normal_map;
+	glm::dvec3 m_color;
+	material_t m_material;
+};
+
+/// @brief static spheres of a scene file which is memory mapped instead of
+/// loaded, so the scene may be bigger than RAM. The file has a small top bvh
+/// whose leaves are treelets: blocks with their own bvh over a few thousand
+/// spheres, the spheres and their surface indices. Traversal pins a treelet
+/// while it reads it, the OS pages it in on the first touch and treelets that
+/// weren't used recently are dropped from memory as soon as the resident ones
+/// take more than the budget
+class mapped_scene_t
+{
+	struct node_t
+	{
+		aabb_t get_bounds() const
+		{
+			return aabb_t(dvec3(this->m_min[0], this->m_min[1], this->m_min[2]),
+				dvec3(this->m_max[0], this->m_max[1], this->m_max[2]));
+		}
+
+		bool is_leaf() const { return this->m_count > 0; }
+
+		float m_min[3];
+		float m_max[3];
+		// like bvh_node_t, leaves of the top bvh have the treelet index here
+		std::int32_t m_first;
+		std::int32_t m_count;
+	};
+
+	struct header_t
+	{
+		char m_magic[8];
+		std::uint32_t m_version;
+		std::uint32_t m_surface_count;
+		std::uint32_t m_top_node_count;
+		std::uint32_t m_treelet_count;
+		std::uint64_t m_sphere_count;
+	};
+
+	struct surface_record_t
+	{
+		double m_color[3];
+		double m_albedo[3];
+		double m_refraction_index;
+		double m_fuzz;
+		std::int32_t m_material_type;
+		std::int32_t m_is_draw_normal_map;
+	};
+
+	// the block at m_offset is node_t[m_node_count], then
+	// compact_sphere_t[m_sphere_count] and std::uint32_t[m_sphere_count]
+	// surface indices
+	struct treelet_t
+	{
+		std::size_t get_size() const
+		{
+			return this->m_node_count * sizeof(node_t) +
+				this->m_sphere_count *
+				(sizeof(compact_sphere_t) + sizeof(std::uint32_t));
+		}
+
+		std::uint64_t m_offset;
+		std::uint32_t m_node_count;
+		std::uint32_t m_sphere_count;
+	};
+
+	// every traversal pins, stamps and counts the treelet without the
+	// mutex, m_is_checked and setting the other flags need it
+	struct treelet_state_t
+	{
+		treelet_state_t() :
+			m_pin_count{}, m_hit_count{}, m_last_use{}, m_is_resident{},
+			m_is_broken{}, m_is_checked{}
+		{
+		}
+		~treelet_state_t() {}
+
+		std::atomic<int> m_pin_count;
+		std::atomic<std::uint64_t> m_hit_count;
+		// m_clock when the treelet was used last
+		std::atomic<std::uint64_t> m_last_use;
+		std::atomic<bool> m_is_resident;
+		std::atomic<bool> m_is_broken;
+		bool m_is_checked;
+	};
+
+	static_assert(sizeof(node_t) == 32);
+	static_assert(sizeof(header_t) == 32);
+	static_assert(sizeof(surface_record_t) == 72);
+	static_assert(sizeof(treelet_t) == 16);
+
+public:
+	struct statistics_t
+	{
+		statistics_t() :
+			m_fault_count{}, m_hit_count{}, m_eviction_count{},
+			m_resident_size{}, m_file_size{}, m_treelet_count{}
+		{
+		}
+		~statistics_t() {}
+
+		// acquired treelets which weren't resident and were paged in
+		std::uint64_t m_fault_count;
+		std::uint64_t m_hit_count;
+		std::uint64_t m_eviction_count;
+		// bytes
+		std::size_t m_resident_size;
+		std::size_t m_file_size;
+		int m_treelet_count;
+	};
+
+	static constexpr std::size_t kDefaultResidentBudget = 256 * 1024 * 1024;
+
+	mapped_scene_t() :
+		m_size{}, m_p_data{}, m_resident_budget{}, m_p_top_nodes{},
+		m_p_treelets{}, m_top_node_count{}, m_treelet_count{}, m_clock{},
+		m_resident_size{}
+#ifdef _WIN32
+		,
+		m_file{INVALID_HANDLE_VALUE}, m_mapping{}
+#else
+		,
+		m_file{-1}
+#endif
+	{
+	}
+	~mapped_scene_t() { this->close(); }
+
+	mapped_scene_t(const mapped_scene_t&) = delete;
+	mapped_scene_t& operator=(const mapped_scene_t&) = delete;
+
+	// spheres[i] uses surfaces[surface_indices[i]]. The top bvh is split into
+	// treelets of up to kTreeletSphereCount spheres by a median split, so
+	// they are about the same size
+	static bool write(const char* p_file_name,
+		const std::vector<compact_sphere_t>& spheres,
+		const std::vector<std::uint32_t>& surface_indices,
+		const std::vector<sphere_surface_t>& surfaces)
+	{
+		trace_span_t span("write scene", "scene", "spheres",
+			static_cast<std::int64_t>(spheres.size()));
+
+		std::ofstream file(p_file_name, std::ios::binary | std::ios::trunc);
+
+		if (!file)
+		{
+			std::cout << "failed to create scene file " << p_file_name
+					  << std::endl;
+			return false;
+		}
+
+		std::vector<aabb_t> bounds(spheres.size());
+		std::vector<int> primitives(spheres.size());
+
+		for (std::size_t i = 0; i < spheres.size(); ++i)
+		{
+			// radius can be negative (hollow glass sphere trick)
+			glm::dvec3 extent(fabs(spheres[i].get_radius()));
+
+			bounds[i] = aabb_t(spheres[i].get_center() - extent,
+				spheres[i].get_center() + extent);
+			primitives[i] = static_cast<int>(i);
+		}
+
+		std::vector<node_t> top_nodes;
+
+		if (!spheres.empty())
+		{
+			top_nodes.emplace_back();
+			build_nodes(bounds, primitives, 0, static_cast<int>(spheres.size()),
+				kTreeletSphereCount, top_nodes, 0);
+		}
+
+		// every leaf of the top bvh becomes a treelet
+		std::vector<treelet_t> treelets;
+		std::vector<int> treelet_firsts;
+
+		for (auto& node : top_nodes)
+		{
+			if (!node.is_leaf())
+				continue;
+
+			treelet_t treelet{};
+			treelet.m_sphere_count = static_cast<std::uint32_t>(node.m_count);
+
+			treelet_firsts.push_back(node.m_first);
+			node.m_first = static_cast<std::int32_t>(treelets.size());
+			treelets.push_back(treelet);
+		}
+
+		header_t header{};
+		std::memcpy(header.m_magic, kMagic, sizeof(header.m_magic));
+		header.m_version = kVersion;
+		header.m_surface_count = static_cast<std::uint32_t>(surfaces.size());
+		header.m_top_node_count = static_cast<std::uint32_t>(top_nodes.size());
+		header.m_treelet_count = static_cast<std::uint32_t>(treelets.size());
+		header.m_sphere_count = spheres.size();
+
+		file.write(reinterpret_cast<const char*>(&header), sizeof(header));
+
+		for (const auto& surface : surfaces)
+		{
+			surface_record_t record{};
+
+			for (int i = 0; i < 3; ++i)
+			{
+				record.m_color[i] = surface.m_color[i];
+				record.m_albedo[i] = surface.m_material.get_albedo()[i];
+			}
+
+			record.m_refraction_index =
+				surface.m_material.get_refraction_index();
+			record.m_fuzz = surface.m_material.get_fuzz();
+			record.m_material_type = surface.m_material.get_material_type();
+			record.m_is_draw_normal_map = surface.m_is_draw_normal_map;
+
+			file.write(reinterpret_cast<const char*>(&record), sizeof(record));
+		}
+
+		file.write(reinterpret_cast<const char*>(top_nodes.data()),
+			top_nodes.size() * sizeof(node_t));
+
+		// the table is written again once the offsets are known
+		auto table_offset = static_cast<std::uint64_t>(file.tellp());
+		file.write(reinterpret_cast<const char*>(treelets.data()),
+			treelets.size() * sizeof(treelet_t));
+
+		auto offset = table_offset + treelets.size() * sizeof(treelet_t);
+		std::vector<char> padding(kBlockAlignment);
+
+		for (std::size_t treelet_index = 0; treelet_index < treelets.size();
+			 ++treelet_index)
+		{
+			auto& treelet = treelets[treelet_index];
+			auto first = treelet_firsts[treelet_index];
+			auto count = static_cast<int>(treelet.m_sphere_count);
+
+			std::vector<int> local_primitives(primitives.begin() + first,
+				primitives.begin() + first + count);
+			std::vector<node_t> nodes(1);
+			build_nodes(bounds, local_primitives, 0, count, kLeafSize, nodes, 0);
+
+			auto block_offset = (offset + kBlockAlignment - 1) /
+				kBlockAlignment * kBlockAlignment;
+			file.write(padding.data(), block_offset - offset);
+
+			treelet.m_offset = block_offset;
+			treelet.m_node_count = static_cast<std::uint32_t>(nodes.size());
+
+			file.write(reinterpret_cast<const char*>(nodes.data()),
+				nodes.size() * sizeof(node_t));
+
+			for (auto primitive : local_primitives)
+			{
+				file.write(reinterpret_cast<const char*>(&spheres[primitive]),
+					sizeof(compact_sphere_t));
+			}
+
+			for (auto primitive : local_primitives)
+			{
+				file.write(
+					reinterpret_cast<const char*>(&surface_indices[primitive]),
+					sizeof(std::uint32_t));
+			}
+
+			offset = block_offset + treelet.get_size();
+		}
+
+		file.seekp(static_cast<std::streamoff>(table_offset));
+		file.write(reinterpret_cast<const char*>(treelets.data()),
+			treelets.size() * sizeof(treelet_t));
+		file.close();
+
+		if (!file)
+		{
+			std::cout << "failed to write scene file " << p_file_name
+					  << std::endl;
+			return false;
+		}
+
+		return true;
+	}
+
+	bool open(const char* p_file_name, std::size_t resident_budget)
+	{
+		trace_span_t span("map scene", "scene");
+
+		this->close();
+
+		if (!p_file_name)
+			return false;
+
+#ifdef _WIN32
+		this->m_file = CreateFileA(p_file_name, GENERIC_READ, FILE_SHARE_READ,
+			nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+
+		LARGE_INTEGER file_size{};
+
+		if (this->m_file != INVALID_HANDLE_VALUE &&
+			GetFileSizeEx(this->m_file, &file_size) && file_size.QuadPart > 0)
+		{
+			this->m_size = static_cast<std::size_t>(file_size.QuadPart);
+			this->m_mapping = CreateFileMappingA(
+				this->m_file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+
+			if (this->m_mapping)
+			{
+				this->m_p_data = static_cast<const std::uint8_t*>(
+					MapViewOfFile(this->m_mapping, FILE_MAP_READ, 0, 0, 0));
+			}
+		}
+#else
+		this->m_file = ::open(p_file_name, O_RDONLY);
+
+		auto file_size = this->m_file >= 0 ? lseek(this->m_file, 0, SEEK_END)
+										   : off_t(-1);
+
+		if (file_size > 0)
+		{
+			this->m_size = static_cast<std::size_t>(file_size);
+
+			auto* p_data = mmap(nullptr, this->m_size, PROT_READ, MAP_SHARED,
+				this->m_file, 0);
+
+			if (p_data != MAP_FAILED)
+			{
+				this->m_p_data = static_cast<const std::uint8_t*>(p_data);
+
+				// treelets are paged in as a whole by acquire(), read ahead
+				// around a fault would page in the neighbours too
+				madvise(p_data, this->m_size, MADV_RANDOM);
+			}
+		}
+#endif
+
+		if (!this->m_p_data || !this->read_tables())
+		{
+			std::cout << "failed to open scene file " << p_file_name
+					  << std::endl;
+			this->close();
+			return false;
+		}
+
+		this->m_file_name = p_file_name;
+		this->m_resident_budget = resident_budget;
+		this->m_p_states =
+			std::make_unique<treelet_state_t[]>(this->m_treelet_count);
+
+		return true;
+	}
+
+	void close()
+	{
+#ifdef _WIN32
+		if (this->m_p_data)
+			UnmapViewOfFile(this->m_p_data);
+
+		if (this->m_mapping)
+			CloseHandle(this->m_mapping);
+
+		if (this->m_file != INVALID_HANDLE_VALUE)
+			CloseHandle(this->m_file);
+
+		this->m_mapping = nullptr;
+		this->m_file = INVALID_HANDLE_VALUE;
+#else
+		if (this->m_p_data)
+			munmap(const_cast<std::uint8_t*>(this->m_p_data), this->m_size);
+
+		if (this->m_file >= 0)
+			::close(this->m_file);
+
+		this->m_file = -1;
+#endif
+		this->m_p_data = nullptr;
+		this->m_size = 0;
+		this->m_p_top_nodes = nullptr;
+		this->m_p_treelets = nullptr;
+		this->m_top_node_count = 0;
+		this->m_treelet_count = 0;
+		this->m_surfaces.clear();
+		this->m_file_name.clear();
+		this->m_p_states.reset();
+		this->m_resident.clear();
+		this->m_clock = 0;
+		this->m_resident_size = 0;
+		this->m_statistics = statistics_t();
+	}
+
+	bool is_opened() const { return this->m_p_data != nullptr; }
+
+	const std::string& get_file_name() const { return this->m_file_name; }
+
+	std::size_t get_resident_budget() const { return this->m_resident_budget; }
+
+	statistics_t get_statistics() const
+	{
+		std::lock_guard lock(this->m_mutex);
+
+		auto result = this->m_statistics;
+
+		for (int i = 0; i < this->m_treelet_count; ++i)
+		{
+			result.m_hit_count += this->m_p_states[i].m_hit_count.load(
+				std::memory_order_relaxed);
+		}
+
+		result.m_resident_size = this->m_resident_size;
+		result.m_file_size = this->m_size;
+		result.m_treelet_count = this->m_treelet_count;
+
+		return result;
+	}
+
+	// calls visitor(sphere, surface) for every sphere in the leaves that the
+	// ray touches, the same contract as bvh_t::traverse
+	template <typename Visitor>
+	bool traverse(
+		const ray_t& ray, double t_min, double& t_max, Visitor&& visitor) const
+	{
+		if (!this->m_top_node_count)
+			return false;
+
+		const auto& origin = ray.get_origin();
+		auto inv_direction = 1.0 / ray.get_direction();
+
+		auto treelet_visitor = [&](const node_t& top_leaf) {
+			auto treelet_index = top_leaf.m_first;
+			const auto* p_block = this->acquire(treelet_index);
+
+			if (!p_block)
+				return false;
+
+			const auto& treelet = this->m_p_treelets[treelet_index];
+			const auto* p_nodes = reinterpret_cast<const node_t*>(p_block);
+			const auto* p_spheres = reinterpret_cast<const compact_sphere_t*>(
+				p_nodes + treelet.m_node_count);
+			const auto* p_surface_indices =
+				reinterpret_cast<const std::uint32_t*>(
+					p_spheres + treelet.m_sphere_count);
+
+			bool is_broken{};
+			auto is_stopped = traverse_nodes(p_nodes, origin, inv_direction,
+				t_min, t_max, is_broken, [&](const node_t& leaf) {
+					for (int i = leaf.m_first; i < leaf.m_first + leaf.m_count;
+						 ++i)
+					{
+						if (visitor(p_spheres[i],
+								this->m_surfaces[p_surface_indices[i]]))
+						{
+							return true;
+						}
+					}
+
+					return false;
+				});
+
+			if (is_broken)
+				this->set_broken(treelet_index);
+
+			this->release(treelet_index);
+
+			return is_stopped;
+		};
+
+		// the top nodes are checked when the file is opened
+		bool is_broken{};
+
+		return traverse_nodes(this->m_p_top_nodes, origin, inv_direction, t_min,
+			t_max, is_broken, treelet_visitor);
+	}
+
+private:
+	static constexpr char kMagic[8] = {'S', 'R', 'S', 'C', 'E', 'N', 'E', '1'};
+	static constexpr std::uint32_t kVersion = 1;
+	static constexpr int kTreeletSphereCount = 4096;
+	static constexpr int kLeafSize = 2;
+	static constexpr int kStackSize = 64;
+	// treelets start at multiples of it, so they can be dropped from memory
+	// without touching their neighbours with any page size (and it is the
+	// allocation granularity of windows)
+	static constexpr std::uint64_t kBlockAlignment = 64 * 1024;
+
+	// median split by the longest axis of centroids. Bounds are rounded
+	// outwards to float
+	static void build_nodes(const std::vector<aabb_t>& bounds,
+		std::vector<int>& primitives, int first, int count, int leaf_size,
+		std::vector<node_t>& nodes, int node_index)
+	{
+		aabb_t node_bounds;
+		aabb_t centroid_bounds;
+
+		for (int i = first; i < first + count; ++i)
+		{
+			const auto& primitive_bounds = bounds[primitives[i]];
+			node_bounds.expand(primitive_bounds);
+			centroid_bounds.expand(primitive_bounds.get_center());
+		}
+
+		for (int axis = 0; axis < 3; ++axis)
+		{
+			auto min = static_cast<float>(node_bounds.get_min()[axis]);
+			auto max = static_cast<float>(node_bounds.get_max()[axis]);
+
+			if (min > node_bounds.get_min()[axis])
+			{
+				min = std::nextafter(
+					min, -std::numeric_limits<float>::infinity());
+			}
+
+			if (max < node_bounds.get_max()[axis])
+			{
+				max = std::nextafter(
+					max, std::numeric_limits<float>::infinity());
+			}
+
+			nodes[node_index].m_min[axis] = min;
+			nodes[node_index].m_max[axis] = max;
+		}
+
+		auto axis = centroid_bounds.get_longest_axis();
+
+		if (count <= leaf_size ||
+			centroid_bounds.get_max()[axis] <= centroid_bounds.get_min()[axis])
+		{
+			nodes[node_index].m_first = first;
+			nodes[node_index].m_count = count;
+			return;
+		}
+
+		auto middle = first + count / 2;
+
+		std::nth_element(primitives.begin() + first,
+			primitives.begin() + middle, primitives.begin() + first + count,
+			[&bounds, axis](int left, int right) {
+				return bounds[left].get_center()[axis] <
+					bounds[right].get_center()[axis];
+			});
+
+		auto left = static_cast<int>(nodes.size());
+		nodes.emplace_back();
+		nodes.emplace_back();
+
+		nodes[node_index].m_first = left;
+		nodes[node_index].m_count = 0;
+
+		build_nodes(
+			bounds, primitives, first, middle - first, leaf_size, nodes, left);
+		build_nodes(bounds, primitives, middle, first + count - middle,
+			leaf_size, nodes, left + 1);
+	}
+
+	// near child first traversal of bvh_t::traverse, visitor(leaf) returns
+	// true to stop it. check_depth() keeps the stack from filling up, nodes
+	// which would overflow it anyway set is_broken and stop the traversal
+	template <typename Visitor>
+	static bool traverse_nodes(const node_t* p_nodes, const dvec3& origin,
+		const dvec3& inv_direction, double t_min, double& t_max,
+		bool& is_broken, Visitor&& visitor)
+	{
+		int stack[kStackSize];
+		int stack_size{};
+		stack[stack_size++] = 0;
+
+		while (stack_size)
+		{
+			const auto& node = p_nodes[stack[--stack_size]];
+
+			auto t_entry = t_min;
+			if (!node.get_bounds().hit(origin, inv_direction, t_entry, t_max))
+				continue;
+
+			if (node.is_leaf())
+			{
+				if (visitor(node))
+					return true;
+
+				continue;
+			}
+
+			if (stack_size + 2 > kStackSize)
+			{
+				is_broken = true;
+				return false;
+			}
+
+			auto t_left = t_min;
+			auto t_right = t_min;
+			auto is_left_hitted = p_nodes[node.m_first].get_bounds().hit(
+				origin, inv_direction, t_left, t_max);
+			auto is_right_hitted = p_nodes[node.m_first + 1].get_bounds().hit(
+				origin, inv_direction, t_right, t_max);
+
+			if (is_left_hitted && is_right_hitted)
+			{
+				if (t_left <= t_right)
+				{
+					stack[stack_size++] = node.m_first + 1;
+					stack[stack_size++] = node.m_first;
+				}
+				else
+				{
+					stack[stack_size++] = node.m_first;
+					stack[stack_size++] = node.m_first + 1;
+				}
+			}
+			else if (is_left_hitted)
+			{
+				stack[stack_size++] = node.m_first;
+			}
+			else if (is_right_hitted)
+			{
+				stack[stack_size++] = node.m_first + 1;
+			}
+		}
+
+		return false;
+	}
+
+	// everything except the treelets themselves, they are checked on their
+	// first use, so opening doesn't page in the whole file
+	bool read_tables()
+	{
+		header_t header{};
+
+		if (this->m_size < sizeof(header))
+			return false;
+
+		std::memcpy(&header, this->m_p_data, sizeof(header));
+
+		if (std::memcmp(header.m_magic, kMagic, sizeof(kMagic)) ||
+			header.m_version != kVersion)
+		{
+			return false;
+		}
+
+		std::uint64_t offset = sizeof(header);
+		auto tables_size =
+			std::uint64_t(header.m_surface_count) * sizeof(surface_record_t) +
+			std::uint64_t(header.m_top_node_count) * sizeof(node_t) +
+			std::uint64_t(header.m_treelet_count) * sizeof(treelet_t);
+
+		if (offset + tables_size > this->m_size)
+			return false;
+
+		this->m_surfaces.resize(header.m_surface_count);
+
+		for (auto& surface : this->m_surfaces)
+		{
+			surface_record_t record{};
+			std::memcpy(&record, this->m_p_data + offset, sizeof(record));
+			offset += sizeof(record);
+
+			surface.m_is_draw_normal_map = record.m_is_draw_normal_map != 0;
+			surface.m_color = glm::dvec3(
+				record.m_color[0], record.m_color[1], record.m_color[2]);
+			surface.m_material = material_t(
+				static_cast<eMaterialType>(record.m_material_type),
+				record.m_refraction_index, record.m_fuzz,
+				glm::dvec3(
+					record.m_albedo[0], record.m_albedo[1], record.m_albedo[2]));
+		}
+
+		this->m_p_top_nodes =
+			reinterpret_cast<const node_t*>(this->m_p_data + offset);
+		this->m_top_node_count = static_cast<int>(header.m_top_node_count);
+		offset += header.m_top_node_count * sizeof(node_t);
+
+		this->m_p_treelets =
+			reinterpret_cast<const treelet_t*>(this->m_p_data + offset);
+		this->m_treelet_count = static_cast<int>(header.m_treelet_count);
+
+		for (int i = 0; i < this->m_top_node_count; ++i)
+		{
+			const auto& node = this->m_p_top_nodes[i];
+
+			bool is_valid = node.is_leaf()
+				? node.m_first >= 0 && node.m_first < this->m_treelet_count
+				: node.m_first > i && node.m_first + 1 < this->m_top_node_count;
+
+			if (!is_valid)
+				return false;
+		}
+
+		if (!check_depth(this->m_p_top_nodes, this->m_top_node_count))
+			return false;
+
+		for (int i = 0; i < this->m_treelet_count; ++i)
+		{
+			const auto& treelet = this->m_p_treelets[i];
+
+			if (treelet.m_offset % kBlockAlignment || !treelet.m_node_count ||
+				treelet.m_offset > this->m_size ||
+				treelet.get_size() > this->m_size - treelet.m_offset)
+			{
+				return false;
+			}
+		}
+
+		return true;
+	}
+
+	// children follow their parents (so nodes can't form a cycle) and no leaf
+	// is deeper than the traversal stack allows, every visited inner node
+	// leaves at most one child on the stack
+	static bool check_depth(const node_t* p_nodes, int node_count)
+	{
+		std::vector<std::uint8_t> depths(node_count);
+
+		for (int i = 0; i < node_count; ++i)
+		{
+			const auto& node = p_nodes[i];
+
+			if (node.is_leaf())
+				continue;
+
+			if (depths[i] + 2 >= kStackSize)
+				return false;
+
+			for (int child = node.m_first; child < node.m_first + 2; ++child)
+			{
+				depths[child] = (std::max)(
+					depths[child], static_cast<std::uint8_t>(depths[i] + 1));
+			}
+		}
+
+		return true;
+	}
+
+	// child and sphere indices of the treelet must stay inside of it and
+	// children must follow their parents
+	bool check_treelet(int treelet_index) const
+	{
+		const auto& treelet = this->m_p_treelets[treelet_index];
+		const auto* p_nodes =
+			reinterpret_cast<const node_t*>(this->m_p_data + treelet.m_offset);
+		const auto* p_surface_indices = reinterpret_cast<const std::uint32_t*>(
+			this->m_p_data + treelet.m_offset +
+			treelet.m_node_count * sizeof(node_t) +
+			treelet.m_sphere_count * sizeof(compact_sphere_t));
+
+		for (std::uint32_t i = 0; i < treelet.m_node_count; ++i)
+		{
+			const auto& node = p_nodes[i];
+
+			bool is_valid = node.is_leaf()
+				? node.m_first >= 0 &&
+					std::uint32_t(node.m_first) + std::uint32_t(node.m_count) <=
+						treelet.m_sphere_count
+				: node.m_first > static_cast<std::int32_t>(i) &&
+					std::uint32_t(node.m_first) + 1 < treelet.m_node_count;
+
+			if (!is_valid)
+				return false;
+		}
+
+		if (!check_depth(p_nodes, static_cast<int>(treelet.m_node_count)))
+			return false;
+
+		for (std::uint32_t i = 0; i < treelet.m_sphere_count; ++i)
+		{
+			if (p_surface_indices[i] >= this->m_surfaces.size())
+				return false;
+		}
+
+		return true;
+	}
+
+	// pins the treelet and returns its block, nullptr for a broken one. A
+	// resident treelet is only pinned and stamped, the mutex is taken when
+	// it has to be paged in
+	const std::uint8_t* acquire(int treelet_index) const
+	{
+		auto& state = this->m_p_states[treelet_index];
+		const auto& treelet = this->m_p_treelets[treelet_index];
+
+		// pinned before its residency is read, evict() does it the other way
+		// around, so one of them sees the other
+		++state.m_pin_count;
+
+		if (state.m_is_resident)
+		{
+			state.m_hit_count.fetch_add(1, std::memory_order_relaxed);
+
+			// a shared line is written only once per fault
+			auto clock = this->m_clock.load(std::memory_order_relaxed);
+
+			if (state.m_last_use.load(std::memory_order_relaxed) != clock)
+				state.m_last_use.store(clock, std::memory_order_relaxed);
+		}
+		else
+		{
+			this->fault(treelet_index);
+		}
+
+		return state.m_is_broken ? nullptr
+								 : this->m_p_data + treelet.m_offset;
+	}
+
+	void release(int treelet_index) const
+	{
+		--this->m_p_states[treelet_index].m_pin_count;
+	}
+
+	// pages in the pinned treelet and drops others until the resident ones
+	// fit the budget
+	void fault(int treelet_index) const
+	{
+		std::lock_guard lock(this->m_mutex);
+
+		auto& state = this->m_p_states[treelet_index];
+		const auto& treelet = this->m_p_treelets[treelet_index];
+
+		// another thread paged it in or evict() put it back meanwhile
+		if (state.m_is_resident)
+		{
+			state.m_hit_count.fetch_add(1, std::memory_order_relaxed);
+			return;
+		}
+
+		++this->m_statistics.m_fault_count;
+
+#ifndef _WIN32
+		madvise(const_cast<std::uint8_t*>(this->m_p_data + treelet.m_offset),
+			treelet.get_size(), MADV_WILLNEED);
+#endif
+
+		if (!state.m_is_checked)
+		{
+			state.m_is_checked = true;
+
+			if (!this->check_treelet(treelet_index))
+			{
+				state.m_is_broken = true;
+
+				std::cout << "treelet " << treelet_index << " of "
+						  << this->m_file_name << " is broken" << std::endl;
+			}
+		}
+
+		// treelets used since the previous fault are the most recent ones
+		state.m_last_use.store(this->m_clock.fetch_add(1) + 1);
+		this->m_resident.push_back(treelet_index);
+		this->m_resident_size += treelet.get_size();
+		state.m_is_resident = true;
+
+		this->evict();
+	}
+
+	// for treelets which passed check_treelet() but still can't be traversed
+	void set_broken(int treelet_index) const
+	{
+		std::lock_guard lock(this->m_mutex);
+
+		auto& state = this->m_p_states[treelet_index];
+
+		if (state.m_is_broken)
+			return;
+
+		state.m_is_broken = true;
+
+		std::cout << "treelet " << treelet_index << " of " << this->m_file_name
+				  << " is broken" << std::endl;
+	}
+
+	// drops least recently used treelets which nobody reads right now until
+	// the resident ones fit the budget, called with m_mutex locked
+	void evict() const
+	{
+		if (this->m_resident_size <= this->m_resident_budget)
+			return;
+
+		// stamps change while traversals go on, so they are sorted as they
+		// are now
+		std::vector<std::pair<std::uint64_t, int>> candidates;
+		candidates.reserve(this->m_resident.size());
+
+		for (auto treelet_index : this->m_resident)
+		{
+			const auto& state = this->m_p_states[treelet_index];
+
+			candidates.emplace_back(
+				state.m_last_use.load(std::memory_order_relaxed), treelet_index);
+		}
+
+		std::sort(candidates.begin(), candidates.end());
+
+		for (const auto& candidate : candidates)
+		{
+			if (this->m_resident_size <= this->m_resident_budget)
+				break;
+
+			auto treelet_index = candidate.second;
+			auto& state = this->m_p_states[treelet_index];
+
+			if (state.m_pin_count)
+				continue;
+
+			state.m_is_resident = false;
+
+			// a traversal pinned it before seeing that and reads it already
+			if (state.m_pin_count)
+			{
+				state.m_is_resident = true;
+				continue;
+			}
+
+			const auto& treelet = this->m_p_treelets[treelet_index];
+			auto* p_block =
+				const_cast<std::uint8_t*>(this->m_p_data + treelet.m_offset);
+
+#ifdef _WIN32
+			// unlocking pages which aren't locked removes them from the
+			// working set
+			VirtualUnlock(p_block, treelet.get_size());
+#else
+			madvise(p_block, treelet.get_size(), MADV_DONTNEED);
+#endif
+
+			this->m_resident_size -= treelet.get_size();
+			++this->m_statistics.m_eviction_count;
+		}
+
+		this->m_resident.erase(
+			std::remove_if(this->m_resident.begin(), this->m_resident.end(),
+				[this](int treelet_index) {
+					return !this->m_p_states[treelet_index].m_is_resident;
+				}),
+			this->m_resident.end());
+	}
+
+private:
+	std::string m_file_name;
+	std::size_t m_size;
+	const std::uint8_t* m_p_data;
+	std::size_t m_resident_budget;
+	std::vector<sphere_surface_t> m_surfaces;
+
+	const node_t* m_p_top_nodes;
+	const treelet_t* m_p_treelets;
+	int m_top_node_count;
+	int m_treelet_count;
+
+	// guards faults, evictions and the members below m_clock
+	mutable std::mutex m_mutex;
+	std::unique_ptr<treelet_state_t[]> m_p_states;
+	// advanced by every fault
+	mutable std::atomic<std::uint64_t> m_clock;
+	// resident treelets in no particular order
+	mutable std::vector<int> m_resident;
+	mutable std::size_t m_resident_size;
+	// hits are counted by the treelets
+	mutable statistics_t m_statistics;
+
+#ifdef _WIN32
+	HANDLE m_file;
+	HANDLE m_mapping;
+#else
+	int m_file;
+#endif
+};
+
+// what world_t traces rays through
+enum class eAccelerator : int
+{
+	// every entity is tested by every ray, nothing to build
+	kAccelerator_Linear,
+	// grid_t, rebuilt from scratch on every commit with edits, for dense
+	// evenly spread entities which change every frame
+	kAccelerator_Grid,
+	// bvh_t, refitted on edits and rebuilt only when it gets too loose
+	kAccelerator_BVH,
+
+	kAccelerator_Unknown = -1
+};
+
+/// @brief entities are stored by their slots in parallel arrays: type,
+/// compact_sphere_t and the index of the sphere_surface_t. Traversal touches
+/// only the 16 byte spheres, the surface is read once for the closest hit.
+/// entity_t is what the interface takes and gives back
+class world_t
+{
+public:
+	world_t() :
+		m_live_count{}, m_accelerator{eAccelerator::kAccelerator_BVH}
+	{
+	}
+	~world_t() {}
+
+	// removes all entities, slots are kept so old handles become invalid
+	void clear()
+	{
+		for (int slot = 0; slot < this->get_slot_count(); ++slot)
+		{
+			if (this->m_types[slot] != eEntityType::kEntityType_Unknown)
+				this->release_slot(slot);
+		}
+
+		this->m_pending.clear();
+		this->m_is_pending.assign(this->m_types.size(), false);
+		this->m_dirty.clear();
+		this->m_is_dirty.assign(this->m_types.size(), false);
+		this->m_bvh.clear();
+		this->m_wide_bvh.clear();
+		this->m_grid.clear();
+		this->m_p_mapped_scene.reset();
+	}
+
+	// for generated scenes, so the arrays don't grow twice as big as needed
+	void reserve(std::size_t entity_count)
+	{
+		this->m_types.reserve(entity_count);
+		this->m_spheres.reserve(entity_count);
+		this->m_surface_indices.reserve(entity_count);
+		this->m_generations.reserve(entity_count);
+		this->m_revisions.reserve(entity_count);
+		this->m_bounds.reserve(entity_count);
+		this->m_is_pending.reserve(entity_count);
+		this->m_is_dirty.reserve(entity_count);
+		this->m_pending.reserve(entity_count);
+	}
+
+	entity_handle_t add(const entity_t& object)
+	{
+		int slot{};
+
+		if (this->m_free_slots.empty())
+		{
+			slot = this->get_slot_count();
+
+			this->m_types.push_back(eEntityType::kEntityType_Unknown);
+			this->m_spheres.emplace_back();
+			this->m_surface_indices.push_back(0);
+			this->m_generations.push_back(0);
+			this->m_revisions.push_back(0);
+			this->m_bounds.emplace_back();
+			this->m_is_pending.push_back(false);
+			this->m_is_dirty.push_back(false);
+		}
+		else
+		{
+			slot = this->m_free_slots.back();
+			this->m_free_slots.pop_back();
+		}
+
+		this->store(slot, object);
+
+		++this->m_live_count;
+		this->mark_dirty(slot);
+
+		return entity_handle_t(slot, this->m_generations[slot]);
+	}
+
+	bool remove(const entity_handle_t& handle)
+	{
+		if (!this->is_alive(handle))
+			return false;
+
+		this->release_slot(handle.m_index);
+
+		return true;
+	}
+
+	bool update(const entity_handle_t& handle, const entity_t& object)
+	{
+		if (!this->is_alive(handle))
+			return false;
+
+		this->store(handle.m_index, object);
+		this->mark_dirty(handle.m_index);
+
+		return true;
+	}
+
+	bool set_sphere_position(
+		const entity_handle_t& handle, const glm::dvec3& position)
+	{
+		if (!this->is_sphere(handle))
+			return false;
+
+		auto& sphere = this->m_spheres[handle.m_index];
+		sphere = compact_sphere_t(position, sphere.get_radius());
+		this->mark_dirty(handle.m_index);
+
+		return true;
+	}
+
+	bool set_sphere_radius(const entity_handle_t& handle, double radius)
+	{
+		if (!this->is_sphere(handle))
+			return false;
+
+		auto& sphere = this->m_spheres[handle.m_index];
+		sphere = compact_sphere_t(sphere.get_center(), radius);
+		this->mark_dirty(handle.m_index);
+
+		return true;
+	}
+
+	// material doesn't affect bounds so acceleration structure is untouched
+	bool set_material(const entity_handle_t& handle, const material_t& material)
+	{
+		if (!this->is_sphere(handle))
+			return false;
+
+		auto old_index = this->m_surface_indices[handle.m_index];
+		auto surface = this->m_surfaces[old_index];
+		surface.m_material = material;
+
+		// the new one is taken first, so an unchanged material doesn't free
+		// the surface it keeps using
+		this->m_surface_indices[handle.m_index] = this->find_surface(surface);
+		this->release_surface(old_index);
+		++this->m_revisions[handle.m_index];
+
+		return true;
+	}
+
+	bool is_alive(const entity_handle_t& handle) const
+	{
+		return handle.is_valid() &&
+			handle.m_index < this->get_slot_count() &&
+			this->m_generations[handle.m_index] == handle.m_generation &&
+			this->m_types[handle.m_index] != eEntityType::kEntityType_Unknown;
+	}
+
+	// kEntityType_Unknown when the handle is not alive
+	entity_t get_entity(const entity_handle_t& handle) const
+	{
+		if (!this->is_alive(handle))
+			return entity_t();
+
+		return this->get_entity(handle.m_index);
+	}
+
+	// the entity in the slot as it is stored, floats of its geometry
+	// converted back to double. kEntityType_Unknown for free slots
+	entity_t get_entity(int slot) const
+	{
+		if (this->m_types[slot] != eEntityType::kEntityType_Sphere)
+			return entity_t();
+
+		const auto& sphere = this->m_spheres[slot];
+		const auto& surface = this->m_surfaces[this->m_surface_indices[slot]];
+
+		return entity_t(eEntityType::kEntityType_Sphere,
+			sphere_data_t(surface.m_is_draw_normal_map, sphere.get_radius(),
+				sphere.get_center(), surface.m_color, surface.m_material));
+	}
+
+	// applies all edits made since the last commit to the acceleration
+	// structure. With the bvh moved/resized entities only refit their leaves
+	// up to the root, new entities are tested linearly until there are too
+	// many of them (or the refitted tree got too loose) and only then we
+	// rebuild. The grid is rebuilt on any edit, edited entities are never
+	// dirty for it as it has no leaves, they are all pending
+	void commit()
+	{
+		switch (this->m_accelerator)
+		{
+		case eAccelerator::kAccelerator_BVH:
+		{
+			auto pending_limit =
+				(std::max)(kPendingMin, this->m_bvh.get_primitive_count() / 8);
+
+			bool is_need_rebuild = static_cast<int>(this->m_pending.size()) >
+					pending_limit ||
+				(this->m_bvh.is_empty() && !this->m_pending.empty()) ||
+				this->m_bvh.get_primitive_count() > 2 * this->m_live_count ||
+				this->m_bvh.get_refit_degradation() > kMaxRefitDegradation;
+
+			if (is_need_rebuild)
+			{
+				this->rebuild();
+			}
+			else if (!this->m_dirty.empty())
+			{
+				trace_span_t span("refit bvh", "accelerator", "entities",
+					static_cast<std::int64_t>(this->m_dirty.size()));
+
+				this->m_bvh.refit(this->m_bounds, this->m_dirty);
+				this->m_wide_bvh.refit(this->m_bvh, this->m_dirty);
+			}
+
+			break;
+		}
+		default:
+		{
+			if (!this->m_pending.empty())
+				this->rebuild();
+
+			break;
+		}
+		}
+
+		for (auto slot : this->m_dirty)
+			this->m_is_dirty[slot] = false;
+
+		this->m_dirty.clear();
+	}
+
+	void rebuild()
+	{
+		std::vector<int> slots;
+		slots.reserve(this->m_live_count);
+
+		for (int slot = 0; slot < this->get_slot_count(); ++slot)
+		{
+			if (this->m_types[slot] != eEntityType::kEntityType_Unknown)
+				slots.push_back(slot);
+
+			this->m_is_pending[slot] = false;
+		}
+
+		this->m_pending.clear();
+
+		switch (this->m_accelerator)
+		{
+		case eAccelerator::kAccelerator_Grid:
+		{
+			trace_span_t span("build grid", "accelerator", "entities",
+				static_cast<std::int64_t>(slots.size()));
+
+			this->m_grid.build(this->m_bounds, slots);
+			break;
+		}
+		case eAccelerator::kAccelerator_BVH:
+		{
+			trace_span_t span("build bvh", "accelerator", "entities",
+				static_cast<std::int64_t>(slots.size()));
+
+			this->m_bvh.build(this->m_bounds, slots);
+			this->m_wide_bvh.build(this->m_bvh);
+			break;
+		}
+		default:
+		{
+			break;
+		}
+		}
+	}
+
+	// drops the current acceleration structure and builds the new one with
+	// all edits made so far
+	void set_accelerator(eAccelerator accelerator)
+	{
+		if (accelerator == this->m_accelerator)
+			return;
+
+		this->m_accelerator = accelerator;
+		this->m_bvh.clear();
+		this->m_wide_bvh.clear();
+		this->m_grid.clear();
+
+		for (auto slot : this->m_dirty)
+			this->m_is_dirty[slot] = false;
+
+		this->m_dirty.clear();
+		this->rebuild();
+	}
+
+	eAccelerator get_accelerator() const { return this->m_accelerator; }
+
+	// static spheres of a scene file which are hit along with the entities,
+	// copies of the world share them
+	void set_mapped_scene(std::shared_ptr<const mapped_scene_t> p_scene)
+	{
+		this->m_p_mapped_scene = std::move(p_scene);
+	}
+
+	const std::shared_ptr<const mapped_scene_t>& get_mapped_scene() const
+	{
+		return this->m_p_mapped_scene;
+	}
+
+	// spheres of the world as a scene file for mapped_scene_t
+	bool write_scene_file(const char* p_file_name) const
+	{
+		std::vector<compact_sphere_t> spheres;
+		std::vector<std::uint32_t> surface_indices;
+
+		spheres.reserve(this->m_live_count);
+		surface_indices.reserve(this->m_live_count);
+
+		for (int slot = 0; slot < this->get_slot_count(); ++slot)
+		{
+			if (this->m_types[slot] != eEntityType::kEntityType_Sphere)
+				continue;
+
+			spheres.push_back(this->m_spheres[slot]);
+			surface_indices.push_back(this->m_surface_indices[slot]);
+		}
+
+		return mapped_scene_t::write(
+			p_file_name, spheres, surface_indices, this->m_surfaces);
+	}
+
+	// closest hit through the acceleration structure plus entities that were
+	// added after the last commit
+	hit_record_t hit(const ray_t& ray, double t_min, double t_max) const
+	{
+		++get_thread_ray_count();
+
+		hit_record_t result;
+		auto closest = t_max;
+
+		auto visitor = [&](int slot) {
+			auto hit_result = this->hit(slot, ray, t_min, closest);
+
+			if (hit_result.is_hitted())
+			{
+				closest = hit_result.get_t();
+				result = hit_result;
+				result.set_entity_index(slot);
+			}
+
+			return false;
+		};
+
+		this->traverse(ray, t_min, closest, visitor);
+
+		for (auto slot : this->m_pending)
+			visitor(slot);
+
+		// hits of the mapped scene have no slot, the entity index stays -1
+		if (this->m_p_mapped_scene)
+		{
+			this->m_p_mapped_scene->traverse(ray, t_min, closest,
+				[&](const compact_sphere_t& sphere,
+					const sphere_surface_t& surface) {
+					auto hit_result = this->hit_sphere(sphere.get_center(),
+						sphere.get_radius(), ray, t_min, closest);
+
+					if (hit_result.is_hitted())
+					{
+						closest = hit_result.get_t();
+						result = hit_result;
+						this->set_surface(result, surface);
+					}
+
+					return false;
+				});
+		}
+
+		return result;
+	}
+
+	// the record hit() returns for an already known intersection with the
+	// entity in the slot, the intersection test itself is skipped
+	hit_record_t make_hit(int slot, const ray_t& ray, double t,
+		const glm::dvec3& normal, bool is_front_face) const
+	{
+		hit_record_t result;
+
+		if (slot < 0)
+			return result;
+
+		result.set_t(t);
+		result.set_point(ray.at(t));
+		result.set_normal(normal);
+		result.set_front_face(is_front_face);
+		result.set_hitted(true);
+		result.set_entity_index(slot);
+
+		if (this->m_types[slot] == eEntityType::kEntityType_Sphere)
+			this->set_surface(result, slot);
+
+		return result;
+	}
+
+	// the record hit() returns when the entity in the slot is already known
+	// to be the closest one, only its intersection is computed
+	hit_record_t hit_known(
+		int slot, const ray_t& ray, double t_min, double t_max) const
+	{
+		auto result = this->hit(slot, ray, t_min, t_max);
+
+		if (result.is_hitted())
+			result.set_entity_index(slot);
+
+		return result;
+	}
+
+	// the entity doesn't have to be in the world, the hit points to its
+	// color, so it must outlive the hit
+	hit_record_t hit(const entity_t& entity, const ray_t& ray, double t_min,
+		double t_max) const
+	{
+		hit_record_t result;
+
+		switch (entity.get_type())
+		{
+		case eEntityType::kEntityType_Triangle:
+		{
+			break;
+		}
+		case eEntityType::kEntityType_Sphere:
+		{
+			const auto& sphere_data = entity.get_sphere_data();
+
+			result = this->hit_sphere(sphere_data.get_position(),
+				sphere_data.get_radius(), ray, t_min, t_max);
+
+			if (result.is_hitted())
+			{
+				result.set_draw_normal_map(sphere_data.is_draw_normal_map());
+				result.set_color(&sphere_data.get_color());
+				result.set_material(sphere_data.get_material());
+			}
+
+			break;
+		}
+		case eEntityType::kEntityType_Box:
+		{
+			break;
+		}
+		case eEntityType::kEntityType_Unknown:
+		{
+			break;
+		}
+		}
+
+		return result;
+	}
+
+	// any-hit query for shadow/visibility rays, we just need to know that
+	// something is between t_min and t_max so we stop on the first found
+	// intersection and don't compute point, normal and material at all
+	bool occluded(const ray_t& ray, double t_min, double t_max) const
+	{
+		++get_thread_ray_count();
+
+		auto visitor = [&](int slot) {
+			return this->m_types[slot] == eEntityType::kEntityType_Sphere &&
+				this->occluded_sphere(this->m_spheres[slot].get_center(),
+					this->m_spheres[slot].get_radius(), ray, t_min, t_max);
+		};
+
+		if (this->traverse(ray, t_min, t_max, visitor))
+			return true;
+
+		for (auto slot : this->m_pending)
+		{
+			if (visitor(slot))
+				return true;
+		}
+
+		return this->m_p_mapped_scene &&
+			this->m_p_mapped_scene->traverse(ray, t_min, t_max,
+				[&](const compact_sphere_t& sphere, const sphere_surface_t&) {
+					return this->occluded_sphere(sphere.get_center(),
+						sphere.get_radius(), ray, t_min, t_max);
+				});
+	}
+
+	bool occluded(const entity_t& entity, const ray_t& ray, double t_min,
+		double t_max) const
+	{
+		bool result{};
+
+		switch (entity.get_type())
+		{
+		case eEntityType::kEntityType_Sphere:
+		{
+			const auto& sphere_data = entity.get_sphere_data();
+
+			result = this->occluded_sphere(sphere_data.get_position(),
+				sphere_data.get_radius(), ray, t_min, t_max);
+			break;
+		}
+		default:
+		{
+			break;
+		}
+		}
+
+		return result;
+	}
+
+	// copies of all slots, for small worlds, big ones should go slot by slot
+	// through get_entity(slot)
+	std::vector<entity_t> get_entities() const
+	{
+		std::vector<entity_t> result;
+		result.reserve(this->m_types.size());
+
+		for (int slot = 0; slot < this->get_slot_count(); ++slot)
+			result.push_back(this->get_entity(slot));
+
+		return result;
+	}
+
+	int get_slot_count() const
+	{
+		return static_cast<int>(this->m_types.size());
+	}
+
+	eEntityType get_type(int slot) const { return this->m_types[slot]; }
+
+	// only for slots of kEntityType_Sphere
+	const compact_sphere_t& get_sphere(int slot) const
+	{
+		return this->m_spheres[slot];
+	}
+
+	// rays traced by hit() and occluded() of any world on this thread
+	static std::uint64_t& get_thread_ray_count()
+	{
+		thread_local std::uint64_t ray_count{};
+		return ray_count;
+	}
+
+	// quality of the acceleration structure, see bvh_t::get_sah_cost()
+	double get_sah_cost() const { return this->m_bvh.get_sah_cost(); }
+
+	// bytes, approximately, the mapped scene isn't counted
+	std::size_t get_memory_usage() const
+	{
+		return sizeof(world_t) +
+			this->m_types.capacity() * sizeof(eEntityType) +
+			this->m_spheres.capacity() * sizeof(compact_sphere_t) +
+			(this->m_surface_indices.capacity() +
+				this->m_surface_uses.capacity() +
+				this->m_free_surfaces.capacity()) *
+			sizeof(std::uint32_t) +
+			this->m_surfaces.capacity() * sizeof(sphere_surface_t) +
+			this->m_bounds.capacity() * sizeof(aabb_t) +
+			(this->m_generations.capacity() + this->m_revisions.capacity() +
+				this->m_free_slots.capacity() + this->m_pending.capacity() +
+				this->m_dirty.capacity()) *
+			sizeof(int) +
+			this->m_bvh.get_memory_usage() +
+			this->m_wide_bvh.get_memory_usage() +
+			this->m_grid.get_memory_usage();
+	}
+
+	// changes on every edit of the slot, copies of the world can be compared
+	// slot by slot to find out what was edited in one of them
+	std::uint32_t get_revision(int slot) const
+	{
+		return this->m_revisions[slot];
+	}
+
+	// true when every entity of the world copy has the same shape and place,
+	// so any ray hits the same entities at the same points in both of them,
+	// only materials may differ. Worlds with a mapped scene never are, its
+	// hits have no slot, so the first hit cache can't keep them
+	bool is_same_geometry(const world_t& world) const
+	{
+		if (this->get_slot_count() != world.get_slot_count() ||
+			this->m_p_mapped_scene || world.m_p_mapped_scene)
+		{
+			return false;
+		}
+
+		for (int slot = 0; slot < this->get_slot_count(); ++slot)
+		{
+			if (this->m_revisions[slot] == world.m_revisions[slot])
+				continue;
+
+			if (this->m_types[slot] != world.m_types[slot])
+				return false;
+
+			if (this->m_types[slot] == eEntityType::kEntityType_Sphere &&
+				!(this->m_spheres[slot] == world.m_spheres[slot]))
+			{
+				return false;
+			}
+		}
+
+		return true;
+	}
+
+private:
+	// visitor(slot) for the slots of the acceleration structure which the ray
+	// may hit, see wide_bvh_t::traverse
+	template <typename Visitor>
+	bool traverse(
+		const ray_t& ray, double t_min, double& t_max, Visitor&& visitor) const
+	{
+		switch (this->m_accelerator)
+		{
+		case eAccelerator::kAccelerator_Linear:
+		{
+			for (int slot = 0; slot < this->get_slot_count(); ++slot)
+			{
+				if (visitor(slot))
+					return true;
+			}
+
+			return false;
+		}
+		case eAccelerator::kAccelerator_Grid:
+		{
+			return this->m_grid.traverse(ray, t_min, t_max, visitor);
+		}
+		default:
+		{
+			return this->m_wide_bvh.traverse(ray, t_min, t_max, visitor);
+		}
+		}
+	}
+
+	// in order to detect the sphere hit we need to solve this quadratic
+	// equation (p(t) - c) * (p(t) - c) = r^2 where p(t) is our ray's formula a
+	// + tb. So it goes like this (a + tb - c) * (a + tb - c) = r^2 and after
+	// the final operations t^2⋅b⋅b + 2tb⋅(A−C) + (A−C)⋅(A−C)−r2=0 but for
+	// better reading we re-write to general form of quadratic equation t^2 * a
+	// + 2t * b + c = 0 so we need to define our a,b,c variables, but for sphere
+	// we have b=2h situation that means we can reduce amount of computation,
+	// because we just need half_b instead of squared b
+	// geometry only, the caller sets the surface of the hit
+	hit_record_t hit_sphere(const glm::dvec3& center, double radius,
+		const ray_t& ray, double t_min, double t_max) const
+	{
+		hit_record_t result;
+
+		auto oc = ray.get_origin() - center;
+
+		// t^2*b*b or the a coefficient at t^2 in general form
+		auto a = glm::dot(ray.get_direction(), ray.get_direction());
+
+		// b * (A - C)
+		auto half_b = glm::dot(oc, ray.get_direction());
+
+		auto c = glm::dot(oc, oc) - radius * radius;
+
+		auto discriminant = half_b * half_b - a * c;
+
+		if (discriminant < 0)
+		{
+			result.set_hitted(false);
+			return result;
+		}
+
+		auto sqrtd = sqrt(discriminant);
+
+		auto root = (-half_b - sqrtd) / a;
+
+		if (root < t_min || t_max < root)
+		{
+			root = (-half_b + sqrtd) / a;
+
+			if (root < t_min || t_max < root)
+			{
+				result.set_hitted(false);
+				return result;
+			}
+		}
+
+		result.set_t(root);
+		result.set_point(ray.at(root));
+
+		auto outward_normal = (result.get_point() - center) / radius;
+
+		if (glm::dot(outward_normal, ray.get_direction()) < 0)
+		{
+			result.set_normal(outward_normal);
+			result.set_front_face(true);
+		}
+		else
+		{
+			result.set_normal(-outward_normal);
+			result.set_front_face(false);
+		}
+
+		result.set_hitted(true);
+
+		return result;
+	}
+
+	// the same quadratic equation as in hit_sphere, but we only check that
+	// one of the roots lies in [t_min, t_max]
+	bool occluded_sphere(const glm::dvec3& center, double radius,
+		const ray_t& ray, double t_min, double t_max) const
+	{
+		auto oc = ray.get_origin() - center;
+
+		auto a = glm::dot(ray.get_direction(), ray.get_direction());
+		auto half_b = glm::dot(oc, ray.get_direction());
+		auto c = glm::dot(oc, oc) - radius * radius;
+
+		auto discriminant = half_b * half_b - a * c;
+
+		if (discriminant < 0)
+			return false;
+
+		auto sqrtd = sqrt(discriminant);
+
+		auto root = (-half_b - sqrtd) / a;
+
+		if (root >= t_min && root <= t_max)
+			return true;
+
+		root = (-half_b + sqrtd) / a;
+
+		return (root >= t_min && root <= t_max);
+	}
+
+	hit_record_t hit_triangle(const entity_t& entity, const ray_t& ray,
+		double t_min, double t_max) const
+	{
+		hit_record_t result;
+
+		return result;
+	}
+
+	hit_record_t hit(int slot, const ray_t& ray, double t_min, double t_max) const
+	{
+		hit_record_t result;
+
+		if (this->m_types[slot] != eEntityType::kEntityType_Sphere)
+			return result;
+
+		const auto& sphere = this->m_spheres[slot];
+
+		result = this->hit_sphere(
+			sphere.get_center(), sphere.get_radius(), ray, t_min, t_max);
+
+		if (result.is_hitted())
+			this->set_surface(result, slot);
+
+		return result;
+	}
+
+	void set_surface(hit_record_t& hit, int slot) const
+	{
+		this->set_surface(hit, this->m_surfaces[this->m_surface_indices[slot]]);
+	}
+
+	void set_surface(hit_record_t& hit, const sphere_surface_t& surface) const
+	{
+		hit.set_draw_normal_map(surface.m_is_draw_normal_map);
+		hit.set_color(&surface.m_color);
+		hit.set_material(surface.m_material);
+	}
+
+private:
+	void store(int slot, const entity_t& object)
+	{
+		auto old_type = this->m_types[slot];
+		auto old_index = this->m_surface_indices[slot];
+
+		this->m_types[slot] = object.get_type();
+
+		if (object.get_type() == eEntityType::kEntityType_Sphere)
+		{
+			const auto& sphere_data = object.get_sphere_data();
+
+			this->m_spheres[slot] = compact_sphere_t(
+				sphere_data.get_position(), sphere_data.get_radius());
+			this->m_surface_indices[slot] =
+				this->find_surface(sphere_surface_t(sphere_data));
+		}
+
+		if (old_type == eEntityType::kEntityType_Sphere)
+			this->release_surface(old_index);
+	}
+
+	// surfaces are shared by spheres which look the same and counted, every
+	// sphere slot holds one reference. A surface nobody uses any more gives
+	// its index back for the next new one, so endless material edits don't
+	// grow the array
+	std::uint32_t find_surface(const sphere_surface_t& surface)
+	{
+		auto hash = surface.get_hash();
+		auto found = this->m_surface_lookup.find(hash);
+
+		if (found != this->m_surface_lookup.end() &&
+			this->m_surfaces[found->second] == surface)
+		{
+			++this->m_surface_uses[found->second];
+			return found->second;
+		}
+
+		std::uint32_t result{};
+
+		if (this->m_free_surfaces.empty())
+		{
+			result = static_cast<std::uint32_t>(this->m_surfaces.size());
+			this->m_surfaces.push_back(surface);
+			this->m_surface_uses.push_back(1);
+		}
+		else
+		{
+			result = this->m_free_surfaces.back();
+			this->m_free_surfaces.pop_back();
+			this->m_surfaces[result] = surface;
+			this->m_surface_uses[result] = 1;
+		}
+
+		// a hash collision just keeps the first surface in the lookup
+		this->m_surface_lookup.emplace(hash, result);
+
+		return result;
+	}
+
+	void release_surface(std::uint32_t index)
+	{
+		if (--this->m_surface_uses[index])
+			return;
+
+		auto found =
+			this->m_surface_lookup.find(this->m_surfaces[index].get_hash());
+
+		if (found != this->m_surface_lookup.end() && found->second == index)
+			this->m_surface_lookup.erase(found);
+
+		this->m_free_surfaces.push_back(index);
+	}
+
+	void mark_dirty(int slot)
+	{
+		++this->m_revisions[slot];
+
+		if (this->m_types[slot] == eEntityType::kEntityType_Sphere)
+		{
+			const auto& sphere = this->m_spheres[slot];
+
+			// radius can be negative (hollow glass sphere trick)
+			glm::dvec3 extent(fabs(sphere.get_radius()));
+
+			this->m_bounds[slot] = aabb_t(
+				sphere.get_center() - extent, sphere.get_center() + extent);
+		}
+		else
+		{
+			this->m_bounds[slot] = aabb_t();
+		}
+
+		if (this->m_bvh.get_leaf(slot) >= 0)
+		{
+			if (!this->m_is_dirty[slot])
+			{
+				this->m_is_dirty[slot] = true;
+				this->m_dirty.push_back(slot);
+			}
+		}
+		else if (!this->m_is_pending[slot])
+		{
+			this->m_is_pending[slot] = true;
+			this->m_pending.push_back(slot);
+		}
+	}
+
+	void release_slot(int slot)
+	{
+		if (this->m_types[slot] == eEntityType::kEntityType_Sphere)
+			this->release_surface(this->m_surface_indices[slot]);
+
+		this->m_types[slot] = eEntityType::kEntityType_Unknown;
+		++this->m_generations[slot];
+		--this->m_live_count;
+		this->m_free_slots.push_back(slot);
+		this->mark_dirty(slot);
+	}
+
+	bool is_sphere(const entity_handle_t& handle) const
+	{
+		return this->is_alive(handle) &&
+			this->m_types[handle.m_index] == eEntityType::kEntityType_Sphere;
+	}
+
+private:
+	static constexpr int kPendingMin = 8;
+	static constexpr double kMaxRefitDegradation = 2.0;
+
+	int m_live_count;
+	// slots, removed entities have kEntityType_Unknown type
+	std::vector<eEntityType> m_types;
+	std::vector<compact_sphere_t> m_spheres;
+	std::vector<std::uint32_t> m_surface_indices;
+	std::vector<sphere_surface_t> m_surfaces;
+	// sphere slots which use the surface, 0 for free ones
+	std::vector<std::uint32_t> m_surface_uses;
+	std::vector<std::uint32_t> m_free_surfaces;
+	std::unordered_map<std::uint64_t, std::uint32_t> m_surface_lookup;
+	std::vector<unsigned int> m_generations;
+	std::vector<std::uint32_t> m_revisions;
+	std::vector<int> m_free_slots;
+	std::vector<aabb_t> m_bounds;
+
+	// slots which are not in the bvh yet, they are tested linearly
+	std::vector<int> m_pending;
+	std::vector<bool> m_is_pending;
+
+	// slots in the bvh whose bounds changed since the last commit
+	std::vector<int> m_dirty;
+	std::vector<bool> m_is_dirty;
+
+	eAccelerator m_accelerator;
+
+	// m_bvh is built and refitted, m_wide_bvh is converted from it and
+	// traversed
+	bvh_t m_bvh;
+	wide_bvh_t m_wide_bvh;
+	grid_t m_grid;
+
+	std::shared_ptr<const mapped_scene_t> m_p_mapped_scene;
+};
+
+class camera_t
+{
+public:
+	camera_t() {}
+	camera_t(const glm::dvec3& origin, double aspect_ratio,
+		double viewport_height, double focal_length = 1.0) :
+		m_origin{origin}
+	{
+		double viewport_width = aspect_ratio * viewport_height;
+
+		this->m_horizontal = glm::dvec3(viewport_width, 0.0, 0.0);
+		this->m_vertical = glm::dvec3(0.0, viewport_height, 0.0);
+
+		this->m_lower_left_corner = this->m_origin -
+			(this->m_horizontal / 2.0) - (this->m_vertical / 2.0) -
+			glm::dvec3(0.0, 0.0, focal_length);
+	}
+	~camera_t() {}
+
+	const glm::dvec3& get_origin() const { return this->m_origin; }
+	void set_origin(const glm::dvec3& origin) { this->m_origin = origin; }
+
+	const glm::dvec3& get_lower_left_corner() const
+	{
+		return this->m_lower_left_corner;
+	}
+	void set_lower_left_corner(const glm::dvec3& coord)
+	{
+		this->m_lower_left_corner = coord;
+	}
+
+	const glm::dvec3& get_horizontal() const { return this->m_horizontal; }
+	void set_horizontal(const glm::dvec3& coord) { this->m_horizontal = coord; }
+
+	const glm::dvec3& get_vertical() const { return this->m_vertical; }
+	void set_vertical(const glm::dvec3& coord) { this->m_vertical = coord; }
+
+	bool operator==(const camera_t& camera) const
+	{
+		return this->m_origin == camera.m_origin &&
+			this->m_lower_left_corner == camera.m_lower_left_corner &&
+			this->m_horizontal == camera.m_horizontal &&
+			this->m_vertical == camera.m_vertical;
+	}
+
+	ray_t get_ray(double u, double v) const
+	{
+		return ray_t(this->m_origin,
+			(this->m_lower_left_corner + u * this->m_horizontal +
+				v * this->m_vertical) -
+				this->m_origin);
+	}
+
+private:
+	glm::dvec3 m_origin;
+	glm::dvec3 m_lower_left_corner;
+	glm::dvec3 m_horizontal;
+	glm::dvec3 m_vertical;
+};
+
+/* draw functions */
+
+/// @brief collects entities hit by the primary ray and the first bounce of the
+/// samples rendered by the current thread, render_job_t uses them to find
+/// tiles which depend on an edited entity. Deeper bounces aren't recorded,
+/// they would make almost every tile depend on almost everything
+struct draw_dependency_recorder_t
+{
+	static constexpr int kRecordedHitCount = 2;
+
+	draw_dependency_recorder_t(std::vector<int>& slots) :
+		m_remaining_hit_count{}, m_slots{slots}
+	{
+	}
+	~draw_dependency_recorder_t() {}
+
+	// hits of the current sample which are still recorded
+	int m_remaining_hit_count;
+	std::vector<int>& m_slots;
+};
+
+draw_dependency_recorder_t*& draw_get_dependency_recorder()
+{
+	thread_local draw_dependency_recorder_t* p_recorder{};
+	return p_recorder;
+}
+
+void draw_record_hit(const hit_record_t& hit_result)
+{
+	auto* p_recorder = draw_get_dependency_recorder();
+
+	// hits of the mapped scene have no slot, it is never edited anyway
+	if (!p_recorder || p_recorder->m_remaining_hit_count <= 0 ||
+		hit_result.get_entity_index() < 0)
+	{
+		return;
+	}
+
+	--p_recorder->m_remaining_hit_count;
+
+	if (p_recorder->m_slots.empty() ||
+		p_recorder->m_slots.back() != hit_result.get_entity_index())
+	{
+		p_recorder->m_slots.push_back(hit_result.get_entity_index());
+	}
+}
+
+bool scatter_diffuse(const material_t& material, const ray_t& r_in,
+	const hit_record_t& rec, glm::dvec3& attenuation, ray_t& scattered)
+{
+	bool result{true};
+
+	auto scatter_direction = rec.get_normal() + math_random_unit_vector();
+
+	if (math_is_near_zero(scatter_direction))
+		scatter_direction = rec.get_normal();
+
+	scattered = ray_t(rec.get_point(), scatter_direction);
+	attenuation = material.get_albedo();
+
+	return result;
+}
+
+bool scatter_metal(const material_t& material, const ray_t& r_in,
+	const hit_record_t& rec, glm::dvec3& attenuation, ray_t& scattered)
+{
+	bool result{true};
+
+	auto reflected = math_reflect(r_in.get_direction(), rec.get_normal());
+	scattered = ray_t(rec.get_point(),
+		reflected + material.get_fuzz() * math_random_vector3_in_unit_sphere());
+	attenuation = material.get_albedo();
+
+	return (glm::dot(scattered.get_direction(), rec.get_normal()) > 0.0);
+}
+
+bool scatter_dielectric(const material_t& material, const ray_t& r_in,
+	const hit_record_t& rec, glm::dvec3& attenuation, ray_t& scattered)
+{
+	bool result{true};
+
+	attenuation = glm::dvec3(1.0, 1.0, 1.0);
+	double refraction_ratio = rec.is_front_face()
+		? (1.0 / material.get_refraction_index())
+		: material.get_refraction_index();
+
+	glm::dvec3 unit_direction = glm::normalize(r_in.get_direction());
+	glm::dvec3 refracted =
+		math_refract(unit_direction, rec.get_normal(), refraction_ratio);
+
+	scattered = ray_t(rec.get_point(), refracted);
+
+	return result;
+}
+
+// just linear interpolation between two colors
+glm::dvec3 draw_gradient(
+	double value, const glm::dvec3& from, const glm::dvec3& to)
+{
+	return (1.0 - value) * from + value * to;
+}
+
+// false color of a value from 0.0 to 1.0: dark blue, blue, cyan, yellow,
+// red and dark red
+glm::dvec3 draw_jet(double value)
+{
+	auto channel = [value](double center) {
+		return glm::clamp(1.5 - fabs(4.0 * value - center), 0.0, 1.0);
+	};
+
+	return glm::dvec3(channel(3.0), channel(2.0), channel(1.0));
+}
+
+// normalizing result of normal + color because color RGB components can't be
+// higher than 1.0 for that case we multiply on 0.5
+glm::dvec3 draw_normal(const glm::dvec3& normal)
+{
+	return 0.5 * (normal + glm::dvec3(1.0, 1.0, 1.0));
+}
+
+glm::dvec3 draw_diffuse(const ray_t& ray, const world_t& world, int depth)
+{
+	if (depth <= 0)
+		return {0.0, 0.0, 0.0};
+
+	const auto& hit_result = world.hit(ray, 0.001, kInfinityDouble);
+	if (hit_result.is_hitted())
+	{
+		draw_record_hit(hit_result);
+
+		auto target = hit_result.get_point() + hit_result.get_normal() +
+			math_random_vector3_in_unit_sphere();
+
+		return 0.5 *
+			draw_diffuse(ray_t(hit_result.get_point(),
+							 target - hit_result.get_point()),
+				world, depth - 1);
+	}
+
+	auto t = 0.5 * (glm::normalize(ray.get_direction()).y + 1.0);
+	return draw_gradient(t, {1.0, 1.0, 1.0}, {0.5, 0.7, 1.0});
+}
+
+glm::dvec3 draw_diffuse_with_lambert(
+	const ray_t& ray, const world_t& world, int depth)
+{
+	if (depth <= 0)
+		return {0.0, 0.0, 0.0};
+
+	const auto& hit_result = world.hit(ray, 0.001, kInfinityDouble);
+	if (hit_result.is_hitted())
+	{
+		draw_record_hit(hit_result);
+
+		auto target = hit_result.get_point() + hit_result.get_normal() +
+			math_random_unit_vector();
+
+		return 0.5 *
+			draw_diffuse(ray_t(hit_result.get_point(),
+							 target - hit_result.get_point()),
+				world, depth - 1);
+	}
+
+	auto t = 0.5 * (glm::normalize(ray.get_direction()).y + 1.0);
+	return draw_gradient(t, {1.0, 1.0, 1.0}, {0.5, 0.7, 1.0});
+}
+
+glm::dvec3 draw_with_materials(
+	const ray_t& ray, const world_t& world, int depth);
+
+// shading of the ray whose closest hit is already known, paths which start
+// from the first hit cache begin here
+glm::dvec3 draw_with_materials_from_hit(const ray_t& ray,
+	const hit_record_t& hit_result, const world_t& world, int depth)
+{
+	if (hit_result.is_hitted())
+	{
+		draw_record_hit(hit_result);
+
+		const auto& material = hit_result.get_material();
+
+		ray_t scattered;
+		glm::dvec3 attenuation;
+
+		switch (material.get_material_type())
+		{
+		case eMaterialType::kMaterialType_Diffuse:
+		{
+			if (scatter_diffuse(
+					material, ray, hit_result, attenuation, scattered))
+			{
+				return attenuation *
+					draw_with_materials(scattered, world, depth - 1);
+			}
+
+			return glm::dvec3(0.0, 0.0, 0.0);
+		}
+		case eMaterialType::kMaterialType_Metal:
+		{
+			if (scatter_metal(
+					material, ray, hit_result, attenuation, scattered))
+			{
+				return attenuation *
+					draw_with_materials(scattered, world, depth - 1);
+			}
+
+			return glm::dvec3(0.0, 0.0, 0.0);
+		}
+		case eMaterialType::kMaterialType_Dielectric:
+		{
+			if (scatter_dielectric(
+					material, ray, hit_result, attenuation, scattered))
+			{
+				return attenuation *
+					draw_with_materials(scattered, world, depth - 1);
+			}
+
+			return glm::dvec3(0.0, 0.0, 0.0);
+		}
+		default:
+			return glm::dvec3(0.0, 0.0, 0.0);
+		}
+	}
+
+	auto t = 0.5 * (glm::normalize(ray.get_direction()).y + 1.0);
+	return draw_gradient(t, {1.0, 1.0, 1.0}, {0.5, 0.7, 1.0});
+}
+
+glm::dvec3 draw_with_materials(
+	const ray_t& ray, const world_t& world, int depth)
+{
+	if (depth <= 0)
+		return {0.0, 0.0, 0.0};
+
+	return draw_with_materials_from_hit(
+		ray, world.hit(ray, 0.001, kInfinityDouble), world, depth);
+}
+
+glm::dvec3 draw_normal_map(const ray_t& ray, const world_t& world)
+{
+	const auto& hit_result = world.hit(ray, 0.0, kInfinityDouble);
+	if (hit_result.is_hitted())
+	{
+		draw_record_hit(hit_result);
+		return draw_normal(hit_result.get_normal());
+	}
+
+	auto t = 0.5 * (glm::normalize(ray.get_direction()).y + 1.0);
+	return draw_gradient(t, {1.0, 1.0, 1.0}, {0.5, 0.7, 1.0});
+}
+
+/* render */
+
+enum class eOutputType : int
+{
+	// text ppm (P3) streamed top to bottom band by band
+	kOutputType_Stream,
+	// binary ppm (P6) preallocated and memory mapped, tiles are written in
+	// place in any order, for images which don't fit in memory
+	kOutputType_Mapped,
+	// RGB8 pixels kept in render_job_t, for callers which send the image
+	// somewhere instead of saving it
+	kOutputType_Memory,
+
+	kOutputType_Unknown = -1
+};
+
+enum class eRenderMode : int
+{
+	kRenderMode_NormalMap,
+	kRenderMode_Diffuse,
+	kRenderMode_DiffuseLambert,
+	kRenderMode_Materials,
+
+	kRenderMode_Unknown = -1
+};
+
+// order in which tiles of the image and pixels of a tile are rendered, it
+// doesn't change the image
+enum class eTraversalOrder : int
+{
+	// rows from the top
+	kTraversalOrder_Scanline,
+	// z-order curve
+	kTraversalOrder_Morton,
+	// rays which are traced one after another start from neighbouring
+	// pixels, so they mostly visit the same bvh nodes and entities
+	kTraversalOrder_Hilbert,
+
+	kTraversalOrder_Unknown = -1
+};
+
+// what render_settings_t::m_is_output_cost measures for every pixel
+enum class eCostMetric : int
+{
+	// nanoseconds spent on the samples of the pixel
+	kCostMetric_Time,
+	// rays traced for the pixel: primary ones and bounces, it doesn't depend
+	// on the machine and its load
+	kCostMetric_Rays,
+
+	kCostMetric_Unknown = -1
+};
+
+/// @brief rectangle of the image, m_y = 0 is the top row of the image (the
+/// first one written to the file)
+struct render_tile_t
+{
+	render_tile_t() : m_x{}, m_y{}, m_width{}, m_height{} {}
+	render_tile_t(int x, int y, int width, int height) :
+		m_x{x}, m_y{y}, m_width{width}, m_height{height}
+	{
+	}
+	~render_tile_t() {}
+
+	bool is_empty() const { return this->m_width <= 0 || this->m_height <= 0; }
+
+	// empty when they don't overlap
+	render_tile_t get_intersection(const render_tile_t& tile) const
+	{
+		auto x = (std::max)(this->m_x, tile.m_x);
+		auto y = (std::max)(this->m_y, tile.m_y);
+
+		return render_tile_t(x, y,
+			(std::min)(this->m_x + this->m_width, tile.m_x + tile.m_width) - x,
+			(std::min)(this->m_y + this->m_height, tile.m_y + tile.m_height) -
+				y);
+	}
+
+	int m_x;
+	int m_y;
+	int m_width;
+	int m_height;
+};
+
+struct render_settings_t
+{
+	render_settings_t() :
+		m_width{}, m_height{}, m_samples_per_pixel{1}, m_depth_count{1},
+		m_tile_size{16}, m_samples_per_pass{}, m_seed{},
+		m_checkpoint_interval{60.0}, m_time_budget{},
+		m_is_use_gamma_correction{},
+		m_is_use_denoiser{}, m_is_output_features{},
+		m_is_track_dependencies{}, m_is_cache_first_hits{},
+		m_is_crop_output{}, m_is_output_cost{}, m_is_rasterize_primary{},
+		m_mode{eRenderMode::kRenderMode_Materials},
+		m_output_type{eOutputType::kOutputType_Stream},
+		m_traversal_order{eTraversalOrder::kTraversalOrder_Hilbert},
+		m_cost_metric{eCostMetric::kCostMetric_Time}
+	{
+	}
+	~render_settings_t() {}
+
+	int m_width;
+	int m_height;
+	int m_samples_per_pixel;
+	int m_depth_count;
+	int m_tile_size;
+	// 0 means all samples of a tile are rendered at once
+	int m_samples_per_pass;
+	std::uint64_t m_seed;
+	// seconds
+	double m_checkpoint_interval;
+	// seconds, when it is set the image is rendered progressively (a coarse
+	// preview, then passes of 1, 1, 2, 4... samples for the whole image) and
+	// the job stops at the first pass boundary of every tile after the budget
+	// is over, m_samples_per_pixel is the upper limit then and
+	// m_samples_per_pass limits the pass size, so how much the budget is
+	// overrun. The budget counts from the first rendered tile
+	double m_time_budget;
+	bool m_is_use_gamma_correction;
+	// filters the image with denoiser_t guided by the first hit features,
+	// 8-16 samples per pixel are enough for diffuse and fuzzy metal scenes
+	bool m_is_use_denoiser;
+	// writes normal, albedo and depth next to the image as
+	// <name>_normal.ppm, <name>_albedo.ppm and <name>_depth.ppm
+	bool m_is_output_features;
+	// remembers which entities every tile depends on and keeps the image,
+	// so a job for the edited scene re-renders only affected tiles
+	bool m_is_track_dependencies;
+	// keeps the first hit of every sample (kRenderMode_Materials only), a job
+	// made from this one for the same camera and geometry starts its paths
+	// from the second bounce. Costs 24 bytes per sample
+	bool m_is_cache_first_hits;
+	// the written image is m_crop only instead of the whole image with black
+	// pixels outside of m_crop
+	bool m_is_crop_output;
+	// writes m_cost_metric of every pixel next to the image as
+	// <name>_cost.ppm, a false color map from dark blue (the cheapest) to dark
+	// red (the 1% most expensive pixels). Only samples rendered by this
+	// process count
+	bool m_is_output_cost;
+	// primary rays of kRenderMode_Materials aren't traced, spheres are
+	// rasterized into a visibility buffer of the tile and paths start from
+	// its hits (see render_rasterizer_t). The image is the same as the
+	// traced one. Falls back to tracing with the first hit cache or a mapped
+	// scene
+	bool m_is_rasterize_primary;
+	eRenderMode m_mode;
+	eOutputType m_output_type;
+	eTraversalOrder m_traversal_order;
+	eCostMetric m_cost_metric;
+	// when it is set the accumulation buffer is saved there every
+	// m_checkpoint_interval and the job resumes from it
+	std::string m_checkpoint_file_name;
+	// the only rendered part of the image, empty means the whole image.
+	// Pixels are seeded by their place in the whole image, so the crop is the
+	// same as this part of the full render
+	render_tile_t m_crop;
+	// tiles which overlap it go first in every pass
+	render_tile_t m_priority_region;
+};
+
+// cells of the width x height grid (index y * width + x) in the order they
+// are visited
+std::vector<int> render_get_traversal_order(
+	int width, int height, eTraversalOrder order)
+{
+	std::uint32_t size = 1;
+	while (size < std::uint32_t((std::max)(width, height)))
+		size <<= 1;
+
+	std::vector<std::pair<std::uint64_t, int>> cells;
+	cells.reserve(static_cast<std::size_t>(width) * height);
+
+	for (int y = 0; y < height; ++y)
+	{
+		for (int x = 0; x < width; ++x)
+		{
+			auto index = y * width + x;
+
+			switch (order)
+			{
+			case eTraversalOrder::kTraversalOrder_Morton:
+			{
+				cells.emplace_back(math_morton_code(x, y), index);
+				break;
+			}
+			case eTraversalOrder::kTraversalOrder_Hilbert:
+			{
+				cells.emplace_back(math_hilbert_code(size, x, y), index);
+				break;
+			}
+			default:
+			{
+				cells.emplace_back(index, index);
+				break;
+			}
+			}
+		}
+	}
+
+	std::sort(cells.begin(), cells.end());
+
+	std::vector<int> result;
+	result.reserve(cells.size());
+
+	for (const auto& cell : cells)
+		result.push_back(cell.second);
+
+	return result;
+}
+
+// binds the calling thread to the logical core (modulo their count), so the
+// memory it touches first stays on the NUMA node of that core and the thread
+// doesn't migrate away from it. False when the platform doesn't support it
+bool render_pin_thread(int core)
+{
+	auto core_count = (std::max)(1u, std::thread::hardware_concurrency());
+	core = static_cast<int>(core % core_count);
+
+#ifdef _WIN32
+	// the first processor group only
+	return core < 64 &&
+		SetThreadAffinityMask(GetCurrentThread(), DWORD_PTR(1) << core) != 0;
+#elif defined(__linux__)
+	cpu_set_t cores;
+	CPU_ZERO(&cores);
+	CPU_SET(core, &cores);
+
+	return !pthread_setaffinity_np(pthread_self(), sizeof(cores), &cores);
+#else
+	return false;
+#endif
+}
+
+glm::dvec3 render_sample(
+	const ray_t& ray, const world_t& world, const render_settings_t& settings)
+{
+	switch (settings.m_mode)
+	{
+	case eRenderMode::kRenderMode_NormalMap:
+	{
+		return draw_normal_map(ray, world);
+	}
+	case eRenderMode::kRenderMode_Diffuse:
+	{
+		return draw_diffuse(ray, world, settings.m_depth_count);
+	}
+	case eRenderMode::kRenderMode_DiffuseLambert:
+	{
+		return draw_diffuse_with_lambert(ray, world, settings.m_depth_count);
+	}
+	case eRenderMode::kRenderMode_Materials:
+	{
+		return draw_with_materials(ray, world, settings.m_depth_count);
+	}
+	default:
+		return kErrorColor;
+	}
+}
+
+/// @brief closest hit of the primary ray of one sample, enough to continue
+/// the path without tracing that ray again
+struct render_first_hit_t
+{
+	render_first_hit_t() :
+		m_t{}, m_normal{}, m_entity_index{-1}, m_is_front_face{}
+	{
+	}
+	~render_first_hit_t() {}
+
+	float m_t;
+	// faces the ray like hit_record_t::get_normal()
+	float m_normal[3];
+	// -1 when the ray hit nothing
+	std::int32_t m_entity_index;
+	bool m_is_front_face;
+};
+
+std::uint64_t render_get_pixel_seed(
+	const render_settings_t& settings, int x, int y)
+{
+	return math_hash(settings.m_seed ^
+		math_hash(static_cast<std::uint64_t>(y) * settings.m_width + x));
+}
+
+// the ray through the point (jitter_x, jitter_y) of the pixel (x, y), the
+// jitter is in [0, 1)
+ray_t render_get_jittered_ray(const camera_t& camera,
+	const render_settings_t& settings, int x, int y, double jitter_x,
+	double jitter_y)
+{
+	auto u = (double(x) + jitter_x) / (settings.m_width - 1);
+	auto v = (double(settings.m_height - 1 - y) + jitter_y) /
+		(settings.m_height - 1);
+
+	return camera.get_ray(u, v);
+}
+
+// seeds the random generator for the sample and jitters its primary ray
+// inside the pixel (x, y), the rest of the path continues the same sequence
+ray_t render_get_primary_ray(const camera_t& camera,
+	const render_settings_t& settings, int x, int y, std::uint64_t pixel_seed,
+	int sample_index)
+{
+	math_random_seed(pixel_seed + sample_index);
+
+	auto jitter_x = math_random_double();
+	auto jitter_y = math_random_double();
+
+	return render_get_jittered_ray(camera, settings, x, y, jitter_x, jitter_y);
+}
+
+// sum of samples [sample_from, sample_to) of the pixel (x, y), random generator
+// is seeded from the pixel and the sample index so the result doesn't depend on
+// the thread, the order in which pixels are rendered or how samples are split
+// into passes. First hits of the pixel's samples (indexed by the sample) are
+// stored to p_record_hits or taken from p_cached_hits instead of tracing the
+// primary rays, p_visible_slots (indexed by the sample - sample_from) are
+// slots of the closest spheres found by render_rasterizer_t, all of them are
+// for kRenderMode_Materials only
+glm::dvec3 render_pixel(const world_t& world, const camera_t& camera,
+	const render_settings_t& settings, int x, int y, int sample_from,
+	int sample_to, render_first_hit_t* p_record_hits = nullptr,
+	const render_first_hit_t* p_cached_hits = nullptr,
+	const std::int32_t* p_visible_slots = nullptr)
+{
+	auto pixel_seed = render_get_pixel_seed(settings, x, y);
+
+	glm::dvec3 output_color(0.0, 0.0, 0.0);
+	auto* p_recorder = draw_get_dependency_recorder();
+
+	for (int sample_index = sample_from; sample_index < sample_to;
+		 ++sample_index)
+	{
+		if (p_recorder)
+		{
+			p_recorder->m_remaining_hit_count =
+				draw_dependency_recorder_t::kRecordedHitCount;
+		}
+
+		auto ray = render_get_primary_ray(
+			camera, settings, x, y, pixel_seed, sample_index);
+
+		if (p_visible_slots && settings.m_depth_count > 0)
+		{
+			auto slot = p_visible_slots[sample_index - sample_from];
+			hit_record_t hit_result;
+
+			if (slot >= 0)
+				hit_result = world.hit_known(slot, ray, 0.001, kInfinityDouble);
+
+			output_color += draw_with_materials_from_hit(
+				ray, hit_result, world, settings.m_depth_count);
+		}
+		else if (p_cached_hits && settings.m_depth_count > 0)
+		{
+			const auto& first_hit = p_cached_hits[sample_index];
+
+			output_color += draw_with_materials_from_hit(ray,
+				world.make_hit(first_hit.m_entity_index, ray, first_hit.m_t,
+					glm::dvec3(first_hit.m_normal[0], first_hit.m_normal[1],
+						first_hit.m_normal[2]),
+					first_hit.m_is_front_face),
+				world, settings.m_depth_count);
+		}
+		else if (p_record_hits && settings.m_depth_count > 0)
+		{
+			const auto& hit_result = world.hit(ray, 0.001, kInfinityDouble);
+			auto& first_hit = p_record_hits[sample_index];
+
+			first_hit = render_first_hit_t();
+
+			if (hit_result.is_hitted())
+			{
+				const auto& normal = hit_result.get_normal();
+
+				first_hit.m_t = static_cast<float>(hit_result.get_t());
+				first_hit.m_normal[0] = static_cast<float>(normal.x);
+				first_hit.m_normal[1] = static_cast<float>(normal.y);
+				first_hit.m_normal[2] = static_cast<float>(normal.z);
+				first_hit.m_entity_index = hit_result.get_entity_index();
+				first_hit.m_is_front_face = hit_result.is_front_face();
+			}
+
+			output_color += draw_with_materials_from_hit(
+				ray, hit_result, world, settings.m_depth_count);
+		}
+		else
+		{
+			output_color += render_sample(ray, world, settings);
+		}
+	}
+
+	return output_color;
+}
+
+/// @brief finds the closest spheres of primary rays without tracing them,
+/// which is possible because camera_t is a pinhole. Every sphere is projected
+/// to a screen rectangle which bounds it and binned into cells of the tile
+/// size, so a tile tests only spheres of its cells and only for the samples
+/// inside their rectangles. Spheres of a cell go front to back, a pixel skips
+/// those behind all of its samples and the cell stops at the first one behind
+/// all of its pixels. The depth test uses the exact ray-sphere distance and
+/// the rays are jittered like render_pixel() does, so the visibility is the
+/// same as traced
+class render_rasterizer_t
+{
+public:
+	// samples whose rays and depths are kept at once, rows of the rectangle
+	// are rasterized in bands of about this size
+	static constexpr int kBandSampleCount = 1 << 14;
+
+	render_rasterizer_t() : m_cell_size{}, m_column_count{}, m_row_count{} {}
+	~render_rasterizer_t() {}
+
+	void build(const world_t& world, const camera_t& camera,
+		const render_settings_t& settings)
+	{
+		trace_span_t span("bin spheres", "render");
+
+		this->m_cell_size = (std::max)(1, settings.m_tile_size);
+		this->m_column_count =
+			(settings.m_width + this->m_cell_size - 1) / this->m_cell_size;
+		this->m_row_count =
+			(settings.m_height + this->m_cell_size - 1) / this->m_cell_size;
+
+		this->m_spheres.clear();
+		this->m_cell_starts.assign(
+			static_cast<std::size_t>(this->m_column_count) * this->m_row_count +
+				1,
+			0);
+		this->m_cell_entries.clear();
+
+		// (u, v) and the depth of a point are its coordinates in the basis of
+		// the camera's horizontal, vertical and lower left corner vectors, the
+		// depth of a primary ray's point is its t
+		const auto& horizontal = camera.get_horizontal();
+		const auto& vertical = camera.get_vertical();
+		auto forward = camera.get_lower_left_corner() - camera.get_origin();
+
+		auto determinant = glm::dot(horizontal, glm::cross(vertical, forward));
+
+		if (determinant == 0.0)
+			return;
+
+		this->m_origin = camera.get_origin();
+		this->m_to_u = glm::cross(vertical, forward) / determinant;
+		this->m_to_v = glm::cross(forward, horizontal) / determinant;
+		this->m_to_depth = glm::cross(horizontal, vertical) / determinant;
+
+		for (int slot = 0; slot < world.get_slot_count(); ++slot)
+		{
+			if (world.get_type(slot) != eEntityType::kEntityType_Sphere)
+				continue;
+
+			binned_sphere_t binned;
+
+			if (this->bin(world.get_sphere(slot), settings, binned))
+			{
+				binned.m_slot = slot;
+				this->m_spheres.push_back(binned);
+			}
+		}
+
+		std::sort(this->m_spheres.begin(), this->m_spheres.end(),
+			[](const binned_sphere_t& left, const binned_sphere_t& right) {
+				return left.m_min_depth < right.m_min_depth;
+			});
+
+		// counting sort by the cells the spheres overlap, it keeps the order
+		auto for_each_cell = [this](const render_tile_t& rect, auto&& visitor) {
+			for (int row = rect.m_y / this->m_cell_size;
+				 row <= (rect.m_y + rect.m_height - 1) / this->m_cell_size;
+				 ++row)
+			{
+				for (int column = rect.m_x / this->m_cell_size;
+					 column <= (rect.m_x + rect.m_width - 1) / this->m_cell_size;
+					 ++column)
+				{
+					visitor(row * this->m_column_count + column);
+				}
+			}
+		};
+
+		for (const auto& binned : this->m_spheres)
+		{
+			for_each_cell(binned.m_rect,
+				[this](int cell) { ++this->m_cell_starts[cell + 1]; });
+		}
+
+		for (std::size_t cell = 1; cell < this->m_cell_starts.size(); ++cell)
+			this->m_cell_starts[cell] += this->m_cell_starts[cell - 1];
+
+		this->m_cell_entries.resize(this->m_cell_starts.back());
+
+		auto offsets = this->m_cell_starts;
+
+		for (std::uint32_t entry = 0; entry < this->m_spheres.size(); ++entry)
+		{
+			for_each_cell(this->m_spheres[entry].m_rect, [&](int cell) {
+				this->m_cell_entries[offsets[cell]++] = entry;
+			});
+		}
+	}
+
+	// visible_slots gets the slot of the closest sphere (-1 when the ray hits
+	// nothing) of samples [sample_from, sample_to) of every pixel of rect,
+	// pixel by pixel row by row
+	void rasterize(const world_t& world, const camera_t& camera,
+		const render_settings_t& settings, const render_tile_t& rect,
+		int sample_from, int sample_to,
+		std::vector<std::int32_t>& visible_slots) const
+	{
+		auto sample_count = sample_to - sample_from;
+
+		visible_slots.assign(static_cast<std::size_t>(rect.m_width) *
+				rect.m_height * sample_count,
+			-1);
+
+		if (sample_count <= 0)
+			return;
+
+		auto band_height = (std::max)(1,
+			kBandSampleCount / (std::max)(1, rect.m_width * sample_count));
+
+		std::vector<glm::dvec3> directions;
+		std::vector<double> depths;
+		std::vector<double> max_depths;
+		random_batch_generator_t generator;
+
+		for (int band_y = rect.m_y; band_y < rect.m_y + rect.m_height;
+			 band_y += band_height)
+		{
+			render_tile_t band(rect.m_x, band_y, rect.m_width,
+				(std::min)(band_height, rect.m_y + rect.m_height - band_y));
+
+			// band is the prefix of rect from band_y, so its samples are
+			// placed the same way
+			auto* p_band_slots = visible_slots.data() +
+				static_cast<std::size_t>(band_y - rect.m_y) * rect.m_width *
+					sample_count;
+
+			directions.resize(
+				static_cast<std::size_t>(band.m_width) * band.m_height *
+				sample_count);
+			depths.assign(directions.size(), kInfinityDouble);
+			max_depths.assign(
+				static_cast<std::size_t>(band.m_width) * band.m_height,
+				kInfinityDouble);
+
+			auto* p_direction = directions.data();
+
+			for (int y = band.m_y; y < band.m_y + band.m_height; ++y)
+			{
+				for (int x = band.m_x; x < band.m_x + band.m_width; ++x)
+				{
+					auto pixel_seed = render_get_pixel_seed(settings, x, y);
+
+					for (int sample_index = sample_from;
+						 sample_index < sample_to; ++sample_index)
+					{
+						// the first numbers math_random_seed() gives, without
+						// generating the whole block of the stream
+						alignas(16) float
+							jitter[random_batch_generator_t::kWidth];
+
+						generator.seed(pixel_seed + sample_index);
+						generator.fill_uniform(jitter, 2);
+
+						*p_direction++ = render_get_jittered_ray(camera,
+							settings, x, y, jitter[0], jitter[1])
+											 .get_direction();
+					}
+				}
+			}
+
+			this->rasterize_band(world, band, sample_count, directions.data(),
+				depths.data(), max_depths.data(), p_band_slots);
+		}
+	}
+
+private:
+	struct binned_sphere_t
+	{
+		binned_sphere_t() : m_min_depth{}, m_slot{-1} {}
+		~binned_sphere_t() {}
+
+		// pixels whose samples can hit the sphere
+		render_tile_t m_rect;
+		// a little closer than the sphere, so rounding never skips it when
+		// it is visible
+		double m_min_depth;
+		std::int32_t m_slot;
+	};
+
+	// false when no primary ray can hit the sphere. Corners of the bounding
+	// box bound the projection of the sphere when they are all in front of
+	// the camera, a sphere which crosses the camera plane may cover any pixel
+	bool bin(const compact_sphere_t& sphere, const render_settings_t& settings,
+		binned_sphere_t& binned) const
+	{
+		// the nearest hit render_pixel() accepts
+		static constexpr double kNearDepth = 0.001;
+
+		auto radius = sphere.get_radius();
+		auto center_depth =
+			glm::dot(sphere.get_center() - this->m_origin, this->m_to_depth);
+		auto depth_radius = radius * glm::length(this->m_to_depth);
+
+		if (center_depth + depth_radius < kNearDepth)
+			return false;
+
+		binned.m_min_depth = center_depth - depth_radius;
+		binned.m_min_depth -= fabs(binned.m_min_depth) * 1e-9;
+
+		render_tile_t screen(0, 0, settings.m_width, settings.m_height);
+
+		auto u_min = kInfinityDouble;
+		auto u_max = -kInfinityDouble;
+		auto v_min = kInfinityDouble;
+		auto v_max = -kInfinityDouble;
+
+		for (int corner = 0; corner < 8; ++corner)
+		{
+			auto point = sphere.get_center() +
+				glm::dvec3((corner & 1) ? radius : -radius,
+					(corner & 2) ? radius : -radius,
+					(corner & 4) ? radius : -radius);
+			auto offset = point - this->m_origin;
+			auto depth = glm::dot(offset, this->m_to_depth);
+
+			if (depth < kNearDepth)
+			{
+				binned.m_rect = screen;
+				return true;
+			}
+
+			auto u = glm::dot(offset, this->m_to_u) / depth;
+			auto v = glm::dot(offset, this->m_to_v) / depth;
+
+			u_min = (std::min)(u_min, u);
+			u_max = (std::max)(u_max, u);
+			v_min = (std::min)(v_min, v);
+			v_max = (std::max)(v_max, v);
+		}
+
+		// a sample of the pixel column i has u in [i, i + 1) / (width - 1),
+		// the bounds are widened a little so rounding never loses a pixel
+		auto to_pixel = [](double coordinate, int size, double margin) {
+			return static_cast<int>(
+				std::floor(glm::clamp(coordinate * (size - 1) + margin, -2.0,
+					static_cast<double>(size) + 1.0)));
+		};
+
+		static constexpr double kMargin = 1e-6;
+
+		auto x_min = to_pixel(u_min, settings.m_width, -kMargin);
+		auto x_max = to_pixel(u_max, settings.m_width, kMargin);
+		auto j_min = to_pixel(v_min, settings.m_height, -kMargin);
+		auto j_max = to_pixel(v_max, settings.m_height, kMargin);
+
+		binned.m_rect = screen.get_intersection(render_tile_t(x_min,
+			settings.m_height - 1 - j_max, x_max - x_min + 1,
+			j_max - j_min + 1));
+
+		return !binned.m_rect.is_empty();
+	}
+
+	// the same quadratic equation as world_t::hit_sphere(), the closest root
+	// in [0.001, depth] wins. p_max_depths is the farthest sample depth of
+	// every pixel of the band
+	void rasterize_band(const world_t& world, const render_tile_t& band,
+		int sample_count, const glm::dvec3* p_directions, double* p_depths,
+		double* p_max_depths, std::int32_t* p_slots) const
+	{
+		for (int row = band.m_y / this->m_cell_size;
+			 row <= (band.m_y + band.m_height - 1) / this->m_cell_size; ++row)
+		{
+			for (int column = band.m_x / this->m_cell_size;
+				 column <= (band.m_x + band.m_width - 1) / this->m_cell_size;
+				 ++column)
+			{
+				auto cell = row * this->m_column_count + column;
+				auto cell_rect = band.get_intersection(
+					render_tile_t(column * this->m_cell_size,
+						row * this->m_cell_size, this->m_cell_size,
+						this->m_cell_size));
+
+				auto cell_max_depth = kInfinityDouble;
+
+				for (auto entry_index = this->m_cell_starts[cell];
+					 entry_index < this->m_cell_starts[cell + 1]; ++entry_index)
+				{
+					const auto& binned =
+						this->m_spheres[this->m_cell_entries[entry_index]];
+
+					if (binned.m_min_depth > cell_max_depth)
+						break;
+
+					auto area = cell_rect.get_intersection(binned.m_rect);
+
+					if (area.is_empty())
+						continue;
+
+					const auto& sphere = world.get_sphere(binned.m_slot);
+
+					auto oc = this->m_origin - sphere.get_center();
+					auto c = glm::dot(oc, oc) -
+						sphere.get_radius() * sphere.get_radius();
+					bool is_changed{};
+
+					for (int y = area.m_y; y < area.m_y + area.m_height; ++y)
+					{
+						for (int x = area.m_x; x < area.m_x + area.m_width; ++x)
+						{
+							auto pixel =
+								static_cast<std::size_t>(y - band.m_y) *
+									band.m_width +
+								x - band.m_x;
+
+							if (binned.m_min_depth > p_max_depths[pixel])
+								continue;
+
+							auto first = pixel * sample_count;
+							double max_depth{};
+
+							for (auto sample = first;
+								 sample < first + sample_count; ++sample)
+							{
+								const auto& direction = p_directions[sample];
+
+								auto a = glm::dot(direction, direction);
+								auto half_b = glm::dot(oc, direction);
+								auto discriminant = half_b * half_b - a * c;
+
+								if (discriminant >= 0)
+								{
+									auto sqrtd = sqrt(discriminant);
+									auto root = (-half_b - sqrtd) / a;
+
+									if (root < 0.001 || p_depths[sample] < root)
+										root = (-half_b + sqrtd) / a;
+
+									if (root >= 0.001 &&
+										root <= p_depths[sample])
+									{
+										p_depths[sample] = root;
+										p_slots[sample] = binned.m_slot;
+										is_changed = true;
+									}
+								}
+
+								max_depth =
+									(std::max)(max_depth, p_depths[sample]);
+							}
+
+							p_max_depths[pixel] = max_depth;
+						}
+					}
+
+					if (!is_changed)
+						continue;
+
+					cell_max_depth = 0.0;
+
+					for (int y = cell_rect.m_y;
+						 y < cell_rect.m_y + cell_rect.m_height; ++y)
+					{
+						auto* p_row = p_max_depths +
+							static_cast<std::size_t>(y - band.m_y) *
+								band.m_width +
+							cell_rect.m_x - band.m_x;
+
+						cell_max_depth = (std::max)(cell_max_depth,
+							*std::max_element(p_row, p_row + cell_rect.m_width));
+					}
+				}
+			}
+		}
+	}
+
+	int m_cell_size;
+	int m_column_count;
+	int m_row_count;
+	glm::dvec3 m_origin;
+	glm::dvec3 m_to_u;
+	glm::dvec3 m_to_v;
+	glm::dvec3 m_to_depth;
+	// front to back
+	std::vector<binned_sphere_t> m_spheres;
+	// indices of m_spheres overlapping the cell (index row * m_column_count +
+	// column) are m_cell_entries[m_cell_starts[cell], m_cell_starts[cell + 1])
+	std::vector<std::uint32_t> m_cell_starts;
+	std::vector<std::uint32_t> m_cell_entries;
+};
+
+/// @brief what the first hit of the pixel looks like, the denoiser uses it to
+/// tell edges of objects from noise. Everything is averaged over a few
+/// jittered primary rays, so the buffers are antialiased like the color is
+struct render_features_t
+{
+	// depth of pixels which hit nothing, far enough to not be blended with
+	// any geometry and small enough to be squared in float
+	static constexpr float kMissDepth = 1e4f;
+
+	render_features_t() : m_normal{}, m_albedo{}, m_depth{} {}
+	~render_features_t() {}
+
+	glm::vec3 m_normal;
+	glm::vec3 m_albedo;
+	// distance from the camera
+	float m_depth;
+};
+
+render_features_t render_pixel_features(const world_t& world,
+	const camera_t& camera, const render_settings_t& settings, int x, int y)
+{
+	constexpr int kFeatureSampleCount = 4;
+	// own seed stream, the color samples of the pixel stay the same whether
+	// features are rendered or not
+	constexpr std::uint64_t kFeatureSeed = 0x6665617475726573ull;
+
+	auto i = x;
+	auto j = settings.m_height - 1 - y;
+
+	math_random_seed(math_hash(settings.m_seed ^ kFeatureSeed ^
+		math_hash(static_cast<std::uint64_t>(y) * settings.m_width + x)));
+
+	glm::dvec3 normal(0.0, 0.0, 0.0);
+	glm::dvec3 albedo(0.0, 0.0, 0.0);
+	double depth{};
+
+	for (int sample_index = 0; sample_index < kFeatureSampleCount;
+		 ++sample_index)
+	{
+		auto u = (double(i) + math_random_double()) / (settings.m_width - 1);
+		auto v = (double(j) + math_random_double()) / (settings.m_height - 1);
+
+		auto ray = camera.get_ray(u, v);
+		const auto& hit_result = world.hit(ray, 0.001, kInfinityDouble);
+
+		if (hit_result.is_hitted())
+		{
+			const auto& material = hit_result.get_material();
+
+			normal += hit_result.get_normal();
+			// glass doesn't absorb anything
+			albedo += material.get_material_type() ==
+					eMaterialType::kMaterialType_Dielectric
+				? glm::dvec3(1.0, 1.0, 1.0)
+				: material.get_albedo();
+			depth += hit_result.get_t() * glm::length(ray.get_direction());
+		}
+		else
+		{
+			auto t = 0.5 * (glm::normalize(ray.get_direction()).y + 1.0);
+
+			albedo += draw_gradient(t, {1.0, 1.0, 1.0}, {0.5, 0.7, 1.0});
+			depth += render_features_t::kMissDepth;
+		}
+	}
+
+	render_features_t result;
+	result.m_normal = glm::vec3(normal / double(kFeatureSampleCount));
+	result.m_albedo = glm::vec3(albedo / double(kFeatureSampleCount));
+	result.m_depth = static_cast<float>(depth / kFeatureSampleCount);
+
+	return result;
+}
+
+/// @brief running sums of samples and number of samples for every pixel, this
+/// is what a checkpoint stores. Sums are float to keep the file compact, we
+/// need ~7 digits only to add a few thousands of samples of [0, 1] colors
+class accumulation_buffer_t
+{
+public:
+	accumulation_buffer_t() : m_width{}, m_height{}, m_seed{} {}
+	~accumulation_buffer_t() {}
+
+	void resize(int width, int height, std::uint64_t seed)
+	{
+		this->m_width = width;
+		this->m_height = height;
+		this->m_seed = seed;
+		this->m_colors.assign(
+			static_cast<std::size_t>(width) * height * 3, 0.0f);
+		this->m_sample_counts.assign(
+			static_cast<std::size_t>(width) * height, 0);
+	}
+
+	int get_width() const { return this->m_width; }
+	int get_height() const { return this->m_height; }
+	std::uint64_t get_seed() const { return this->m_seed; }
+
+	std::uint32_t get_sample_count(int x, int y) const
+	{
+		return this->m_sample_counts[this->get_index(x, y)];
+	}
+
+	glm::dvec3 get_color(int x, int y) const
+	{
+		const auto* p_color = &this->m_colors[this->get_index(x, y) * 3];
+		return glm::dvec3(p_color[0], p_color[1], p_color[2]);
+	}
+
+	void add(int x, int y, const glm::dvec3& color, std::uint32_t sample_count)
+	{
+		auto index = this->get_index(x, y);
+		auto* p_color = &this->m_colors[index * 3];
+
+		p_color[0] += static_cast<float>(color.x);
+		p_color[1] += static_cast<float>(color.y);
+		p_color[2] += static_cast<float>(color.z);
+
+		this->m_sample_counts[index] += sample_count;
+	}
+
+	void clear(int x, int y)
+	{
+		auto index = this->get_index(x, y);
+		auto* p_color = &this->m_colors[index * 3];
+
+		p_color[0] = p_color[1] = p_color[2] = 0.0f;
+		this->m_sample_counts[index] = 0;
+	}
+
+	// width x height pixels of the source from (source_x, source_y) to (x, y)
+	void copy(const accumulation_buffer_t& source, int source_x, int source_y,
+		int x, int y, int width, int height)
+	{
+		for (int row = 0; row < height; ++row)
+		{
+			auto from = source.get_index(source_x, source_y + row);
+			auto to = this->get_index(x, y + row);
+
+			std::copy_n(source.m_colors.begin() + from * 3, width * 3,
+				this->m_colors.begin() + to * 3);
+			std::copy_n(source.m_sample_counts.begin() + from, width,
+				this->m_sample_counts.begin() + to);
+		}
+	}
+
+	// writes to a temporary file first and then renames it, so if the
+	// process is killed in the middle of saving the previous checkpoint
+	// stays intact
+	bool save(const std::string& file_name) const
+	{
+		auto temporary_file_name = file_name + ".tmp";
+
+		{
+			std::ofstream file(temporary_file_name, std::ios::binary);
+
+			if (!file.good())
+			{
+				std::cout << "failed to save checkpoint " << file_name
+						  << std::endl;
+				return false;
+			}
+
+			header_t header{};
+			std::copy(kMagic, kMagic + sizeof(kMagic), header.m_magic);
+			header.m_version = kVersion;
+			header.m_width = this->m_width;
+			header.m_height = this->m_height;
+			header.m_seed = this->m_seed;
+
+			file.write(reinterpret_cast<const char*>(&header), sizeof(header));
+			file.write(reinterpret_cast<const char*>(this->m_colors.data()),
+				this->m_colors.size() * sizeof(float));
+			file.write(
+				reinterpret_cast<const char*>(this->m_sample_counts.data()),
+				this->m_sample_counts.size() * sizeof(std::uint32_t));
+
+			if (!file.good())
+				return false;
+		}
+
+		std::error_code error;
+		std::filesystem::rename(temporary_file_name, file_name, error);
+
+		return !error;
+	}
+
+	bool load(const std::string& file_name)
+	{
+		std::ifstream file(file_name, std::ios::binary);
+
+		if (!file.good())
+			return false;
+
+		header_t header;
+		file.read(reinterpret_cast<char*>(&header), sizeof(header));
+
+		if (!file.good() ||
+			!std::equal(kMagic, kMagic + sizeof(kMagic), header.m_magic) ||
+			header.m_version != kVersion || header.m_width <= 0 ||
+			header.m_height <= 0)
+		{
+			std::cout << "checkpoint " << file_name << " is corrupted"
+					  << std::endl;
+			return false;
+		}
+
+		// the size has to match the header before anything is allocated, a
+		// damaged header with huge dimensions would throw bad_alloc instead
+		// of letting the job render from scratch
+		std::error_code error;
+		auto file_size = std::filesystem::file_size(file_name, error);
+		auto pixel_count = std::uint64_t(header.m_width) * header.m_height;
+
+		if (error ||
+			file_size != sizeof(header) +
+					pixel_count *
+						(3 * sizeof(float) + sizeof(std::uint32_t)))
+		{
+			std::cout << "checkpoint " << file_name
+					  << " doesn't match the size in its header"
+					  << std::endl;
+			return false;
+		}
+
+		this->resize(header.m_width, header.m_height, header.m_seed);
+
+		file.read(reinterpret_cast<char*>(this->m_colors.data()),
+			this->m_colors.size() * sizeof(float));
+		file.read(reinterpret_cast<char*>(this->m_sample_counts.data()),
+			this->m_sample_counts.size() * sizeof(std::uint32_t));
+
+		if (!file.good())
+		{
+			std::cout << "checkpoint " << file_name << " is truncated"
+					  << std::endl;
+			this->resize(0, 0, 0);
+			return false;
+		}
+
+		return true;
+	}
+
+private:
+	struct header_t
+	{
+		char m_magic[8];
+		std::uint32_t m_version;
+		std::int32_t m_width;
+		std::int32_t m_height;
+		std::uint32_t m_reserved;
+		std::uint64_t m_seed;
+	};
+
+	std::size_t get_index(int x, int y) const
+	{
+		return static_cast<std::size_t>(y) * this->m_width + x;
+	}
+
+private:
+	static constexpr char kMagic[8] = {'S', 'R', 'A', 'C', 'C', 'U', 'M', 0};
+	static constexpr std::uint32_t kVersion = 1;
+
+	int m_width;
+	int m_height;
+	std::uint64_t m_seed;
+	std::vector<float> m_colors;
+	std::vector<std::uint32_t> m_sample_counts;
+};
+
+/// @brief self-contained render: scene, camera, settings and the output file.
+/// The image is split into tiles which are rendered by render_scheduler_t
+/// workers and handed over to image_writer_t. When m_samples_per_pass or a
+/// checkpoint file is set, every tile is rendered in several passes which are
+/// added to its own accumulation_buffer_t, allocated by the thread which
+/// renders its first pass, and the tiles are periodically gathered into one
+/// buffer and saved, so a killed render resumes from the last checkpoint and
+/// a finished one can be extended with more samples. With
+/// m_is_track_dependencies a job for an edited copy of the scene can be made
+/// from the finished one, it re-renders only tiles which depend on the edited
+/// entities
+class render_job_t
+{
+public:
+	render_job_t(const world_t& world, const camera_t& camera,
+		const render_settings_t& settings, const char* p_output_file_name,
+		int priority = 0) :
+		render_job_t(std::make_shared<world_t>(world), camera, settings,
+			p_output_file_name, priority)
+	{
+	}
+
+	// the world is shared instead of copied, e.g. with other jobs of the same
+	// scene, it must not be edited while the job is rendered
+	render_job_t(std::shared_ptr<const world_t> p_world,
+		const camera_t& camera, const render_settings_t& settings,
+		const char* p_output_file_name, int priority = 0) :
+		m_priority{priority},
+		m_finished_tile_count{}, m_last_checkpoint_time{},
+		m_ray_count{}, m_is_written{}, m_output_file_name{p_output_file_name},
+		m_p_world{std::move(p_world)}, m_world{*this->m_p_world},
+		m_camera{camera}, m_settings{settings}, m_is_first_hits_cached{},
+		m_is_first_hits_complete{}
+	{
+		this->init_tiles();
+		this->init_first_hits(nullptr);
+		this->init_rasterizer();
+
+		if (this->is_accumulating())
+		{
+			this->init_accumulation();
+			this->resume_from_checkpoint();
+		}
+	}
+
+	// the edited scene (world is a copy of the previous job's world with some
+	// entities changed). Tiles whose primary rays or first bounces touched an
+	// edited entity, or touch a moved one now, are rendered again, the rest
+	// is taken from the previous job. Different camera, unfinished previous
+	// job or one without m_is_track_dependencies means the full render. When
+	// only materials were edited the first hit cache of the previous job is
+	// reused as well
+	render_job_t(const render_job_t& previous, const world_t& world,
+		const camera_t& camera, const char* p_output_file_name,
+		int priority = 0) :
+		m_priority{priority},
+		m_finished_tile_count{}, m_last_checkpoint_time{},
+		m_ray_count{}, m_is_written{}, m_output_file_name{p_output_file_name},
+		m_p_world{std::make_shared<world_t>(world)}, m_world{*this->m_p_world},
+		m_camera{camera}, m_settings{previous.m_settings},
+		m_is_first_hits_cached{}, m_is_first_hits_complete{}
+	{
+		this->init_tiles();
+		this->init_first_hits(&previous);
+		this->init_rasterizer();
+
+		if (this->is_accumulating())
+			this->init_accumulation();
+
+		if (!this->m_settings.m_is_track_dependencies || !previous.is_done() ||
+			!(camera == previous.m_camera))
+		{
+			return;
+		}
+
+		auto changed_tiles = this->find_changed_tiles(previous);
+		int changed_tile_count{};
+
+		this->m_accumulation = previous.get_accumulation_snapshot();
+
+		for (int tile_index = 0; tile_index < this->get_tile_count();
+			 ++tile_index)
+		{
+			const auto& tile = this->m_tiles[tile_index];
+
+			if (changed_tiles[tile_index])
+			{
+				for (int y = tile.m_y; y < tile.m_y + tile.m_height; ++y)
+				{
+					for (int x = tile.m_x; x < tile.m_x + tile.m_width; ++x)
+						this->m_accumulation.clear(x, y);
+				}
+
+				++changed_tile_count;
+				continue;
+			}
+
+			this->m_tile_samples[tile_index] =
+				previous.m_tile_samples[tile_index];
+			this->m_tile_dependencies[tile_index] =
+				previous.m_tile_dependencies[tile_index];
+
+			// the tile doesn't record its first hits
+			if (!this->m_is_first_hits_cached)
+				this->m_is_first_hits_complete = false;
+
+			if (this->is_post_processing())
+			{
+				for (int y = tile.m_y; y < tile.m_y + tile.m_height; ++y)
+				{
+					auto offset =
+						static_cast<std::size_t>(y) * this->m_settings.m_width;
+
+					std::copy(previous.m_features.begin() + offset + tile.m_x,
+						previous.m_features.begin() + offset + tile.m_x +
+							tile.m_width,
+						this->m_features.begin() + offset + tile.m_x);
+				}
+
+				this->m_tile_features_ready[tile_index] = true;
+			}
+		}
+
+		std::cout << this->m_output_file_name << ": " << changed_tile_count
+				  << " of " << this->get_tile_count()
+				  << " tiles depend on the edit" << std::endl;
+	}
+
+	~render_job_t() {}
+
+	int get_priority() const { return this->m_priority; }
+	const std::string& get_output_file_name() const
+	{
+		return this->m_output_file_name;
+	}
+
+	const world_t& get_world() const { return this->m_world; }
+	const camera_t& get_camera() const { return this->m_camera; }
+	const render_settings_t& get_settings() const { return this->m_settings; }
+
+	// the rendered rectangle of the image
+	render_tile_t get_crop() const
+	{
+		render_tile_t image(
+			0, 0, this->m_settings.m_width, this->m_settings.m_height);
+
+		return this->m_settings.m_crop.is_empty()
+			? image
+			: image.get_intersection(this->m_settings.m_crop);
+	}
+
+	// the rectangle of the image which is written
+	render_tile_t get_output_rect() const
+	{
+		return this->m_settings.m_is_crop_output
+			? this->get_crop()
+			: render_tile_t(
+				  0, 0, this->m_settings.m_width, this->m_settings.m_height);
+	}
+
+	int get_tile_count() const { return static_cast<int>(this->m_tiles.size()); }
+	const render_tile_t& get_tile(int tile_index) const
+	{
+		return this->m_tiles[tile_index];
+	}
+
+	bool is_accumulating() const
+	{
+		return this->m_settings.m_samples_per_pass > 0 ||
+			!this->m_settings.m_checkpoint_file_name.empty() ||
+			this->m_settings.m_is_track_dependencies || this->is_progressive();
+	}
+
+	// pass 0 of every tile is the preview, see render_settings_t::m_time_budget
+	bool is_progressive() const { return this->m_settings.m_time_budget > 0.0; }
+
+	// tiles which are not done are finished with the samples they have
+	bool is_over_budget()
+	{
+		if (!this->is_progressive())
+			return false;
+
+		this->mark_started();
+
+		return std::chrono::steady_clock::now() - this->m_start_time >=
+			std::chrono::duration<double>(this->m_settings.m_time_budget);
+	}
+
+	// the image can't be written tile by tile, it is collected by the writer
+	// and written once all tiles are there
+	bool is_caching_first_hits() const
+	{
+		return this->m_settings.m_is_cache_first_hits &&
+			this->m_settings.m_mode == eRenderMode::kRenderMode_Materials;
+	}
+
+	// the first hit cache already skips or records primary rays, the mapped
+	// scene has no slots for the visibility buffer
+	bool is_rasterizing_primary() const
+	{
+		return this->m_settings.m_is_rasterize_primary &&
+			this->m_settings.m_mode == eRenderMode::kRenderMode_Materials &&
+			this->m_settings.m_depth_count > 0 &&
+			!this->is_caching_first_hits() && !this->m_world.get_mapped_scene();
+	}
+
+	bool is_post_processing() const
+	{
+		return this->m_settings.m_is_use_denoiser ||
+			this->m_settings.m_is_output_features;
+	}
+
+	// full image, row by row
+	const std::vector<render_features_t>& get_features() const
+	{
+		return this->m_features;
+	}
+
+	// full image, row by row, only when m_is_output_cost
+	const std::vector<float>& get_costs() const { return this->m_costs; }
+
+	// the first sample of the next pass of the tile
+	int get_tile_sample(int tile_index) const
+	{
+		return this->m_tile_samples[tile_index];
+	}
+
+	// the end (exclusive) of the next pass of the tile
+	int get_tile_pass_end(int tile_index) const
+	{
+		auto samples_per_pass = this->m_settings.m_samples_per_pass > 0
+			? this->m_settings.m_samples_per_pass
+			: this->m_settings.m_samples_per_pixel;
+
+		// every pass doubles the samples of the image
+		if (this->is_progressive())
+		{
+			samples_per_pass = (std::min)(samples_per_pass,
+				(std::max)(1, this->m_tile_samples[tile_index]));
+		}
+
+		return (std::min)(this->m_settings.m_samples_per_pixel,
+			this->m_tile_samples[tile_index] + samples_per_pass);
+	}
+
+	bool is_tile_done(int tile_index) const
+	{
+		return this->m_tile_samples[tile_index] >=
+			this->m_settings.m_samples_per_pixel;
+	}
+
+	// samples which every pixel of the image has
+	int get_sample_count() const
+	{
+		if (this->m_tile_samples.empty())
+			return 0;
+
+		return *std::min_element(
+			this->m_tile_samples.begin(), this->m_tile_samples.end());
+	}
+
+	// from 0.0 to 1.0
+	double get_progress() const
+	{
+		if (this->m_tiles.empty())
+			return 1.0;
+
+		return double(this->m_finished_tile_count.load()) /
+			this->m_tiles.size();
+	}
+
+	bool is_done() const
+	{
+		return this->m_finished_tile_count.load() == this->get_tile_count();
+	}
+
+	void mark_started()
+	{
+		std::call_once(this->m_start_flag,
+			[this] { this->m_start_time = std::chrono::steady_clock::now(); });
+	}
+
+	// p_colors is tile.m_width * tile.m_height sums of samples
+	// [sample_from, sample_to), row by row
+	void render_tile(
+		int tile_index, int sample_from, int sample_to, glm::dvec3* p_colors)
+	{
+		trace_span_t span("render tile", "render", "tile", tile_index);
+
+		this->mark_started();
+
+		const auto& tile = this->m_tiles[tile_index];
+		auto ray_count = world_t::get_thread_ray_count();
+
+		std::vector<int> slots;
+		draw_dependency_recorder_t recorder(slots);
+
+		if (this->m_settings.m_is_track_dependencies)
+			draw_get_dependency_recorder() = &recorder;
+
+		auto* p_first_hits =
+			this->m_p_first_hits ? this->m_p_first_hits->data() : nullptr;
+
+		// tiles on the border of the image or the crop have their own size
+		std::vector<int> pixel_order;
+		const auto* p_pixel_order = &this->m_pixel_order;
+
+		if (tile.m_width * tile.m_height !=
+			static_cast<int>(this->m_pixel_order.size()))
+		{
+			pixel_order = render_get_traversal_order(
+				tile.m_width, tile.m_height, this->m_settings.m_traversal_order);
+			p_pixel_order = &pixel_order;
+		}
+
+		// slots of the closest spheres of the tile's samples, pixel by pixel
+		std::vector<std::int32_t> visible_slots;
+
+		if (this->is_rasterizing_primary())
+		{
+			this->m_rasterizer.rasterize(this->m_world, this->m_camera,
+				this->m_settings, tile, sample_from, sample_to, visible_slots);
+		}
+
+		auto is_measuring_cost = !this->m_costs.empty();
+
+		for (auto pixel : *p_pixel_order)
+		{
+			auto x = tile.m_x + pixel % tile.m_width;
+			auto y = tile.m_y + pixel / tile.m_width;
+
+			auto* p_pixel_hits = p_first_hits
+				? p_first_hits +
+					(static_cast<std::size_t>(y) * this->m_settings.m_width + x) *
+						this->m_settings.m_samples_per_pixel
+				: nullptr;
+
+			std::chrono::steady_clock::time_point pixel_start_time;
+			std::uint64_t pixel_ray_count{};
+
+			if (is_measuring_cost)
+			{
+				pixel_start_time = std::chrono::steady_clock::now();
+				pixel_ray_count = world_t::get_thread_ray_count();
+			}
+
+			p_colors[pixel] = render_pixel(this->m_world, this->m_camera,
+				this->m_settings, x, y, sample_from, sample_to,
+				this->m_is_first_hits_cached ? nullptr : p_pixel_hits,
+				this->m_is_first_hits_cached ? p_pixel_hits : nullptr,
+				visible_slots.empty()
+					? nullptr
+					: visible_slots.data() +
+						static_cast<std::size_t>(pixel) *
+							(sample_to - sample_from));
+
+			// passes of the tile never run at the same time
+			if (is_measuring_cost)
+			{
+				auto cost = this->m_settings.m_cost_metric ==
+						eCostMetric::kCostMetric_Rays
+					? double(world_t::get_thread_ray_count() - pixel_ray_count)
+					: std::chrono::duration<double, std::nano>(
+						  std::chrono::steady_clock::now() - pixel_start_time)
+						  .count();
+
+				this->m_costs[static_cast<std::size_t>(y) *
+						this->m_settings.m_width +
+					x] += static_cast<float>(cost);
+			}
+		}
+
+		draw_get_dependency_recorder() = nullptr;
+
+		this->m_ray_count.fetch_add(
+			world_t::get_thread_ray_count() - ray_count,
+			std::memory_order_relaxed);
+
+		if (this->m_settings.m_is_track_dependencies)
+		{
+			// passes of the tile never run at the same time
+			auto& dependencies = this->m_tile_dependencies[tile_index];
+
+			dependencies.insert(dependencies.end(), slots.begin(), slots.end());
+			std::sort(dependencies.begin(), dependencies.end());
+			dependencies.erase(
+				std::unique(dependencies.begin(), dependencies.end()),
+				dependencies.end());
+		}
+	}
+
+	// one sample for every kPreviewBlockSize x kPreviewBlockSize block of the
+	// tile, pixels without samples are shown from it
+	void render_tile_preview(int tile_index)
+	{
+		trace_span_t span("render preview", "render", "tile", tile_index);
+
+		this->mark_started();
+
+		const auto& tile = this->m_tiles[tile_index];
+
+		for (int block_y = tile.m_y; block_y < tile.m_y + tile.m_height;
+			 block_y += kPreviewBlockSize)
+		{
+			auto block_height = (std::min)(
+				kPreviewBlockSize, tile.m_y + tile.m_height - block_y);
+
+			for (int block_x = tile.m_x; block_x < tile.m_x + tile.m_width;
+				 block_x += kPreviewBlockSize)
+			{
+				auto block_width = (std::min)(
+					kPreviewBlockSize, tile.m_x + tile.m_width - block_x);
+
+				auto color = render_pixel(this->m_world, this->m_camera,
+					this->m_settings, block_x + block_width / 2,
+					block_y + block_height / 2, 0, 1);
+
+				for (int y = block_y; y < block_y + block_height; ++y)
+				{
+					std::fill_n(this->m_preview.begin() +
+							static_cast<std::size_t>(y) *
+								this->m_settings.m_width +
+							block_x,
+						block_width, color);
+				}
+			}
+		}
+	}
+
+	void render_tile_features(int tile_index)
+	{
+		if (!this->is_post_processing() ||
+			this->m_tile_features_ready[tile_index])
+		{
+			return;
+		}
+
+		this->m_tile_features_ready[tile_index] = true;
+
+		trace_span_t span("render features", "render", "tile", tile_index);
+
+		const auto& tile = this->m_tiles[tile_index];
+
+		for (int y = tile.m_y; y < tile.m_y + tile.m_height; ++y)
+		{
+			for (int x = tile.m_x; x < tile.m_x + tile.m_width; ++x)
+			{
+				this->m_features[static_cast<std::size_t>(y) *
+						this->m_settings.m_width +
+					x] = render_pixel_features(this->m_world, this->m_camera,
+					this->m_settings, x, y);
+			}
+		}
+	}
+
+	// adds one pass of the tile to its accumulation buffer, returns true when
+	// the tile has all its samples. The first pass allocates the buffer, so
+	// its pages are on the NUMA node of the rendering thread and no cache
+	// line is shared with another tile
+	bool accumulate_tile(
+		int tile_index, const glm::dvec3* p_colors, int sample_count)
+	{
+		trace_span_t span("accumulate tile", "render", "tile", tile_index);
+
+		const auto& tile = this->m_tiles[tile_index];
+		auto& accumulation = *this->m_tile_accumulations[tile_index];
+
+		{
+			// only a snapshot can wait here, passes of the tile never run
+			// at the same time
+			std::lock_guard<std::mutex> lock(accumulation.m_mutex);
+
+			auto& buffer = accumulation.m_buffer;
+
+			if (!buffer.get_width())
+			{
+				buffer.resize(
+					tile.m_width, tile.m_height, this->m_settings.m_seed);
+
+				if (this->m_accumulation.get_width())
+				{
+					buffer.copy(this->m_accumulation, tile.m_x, tile.m_y, 0, 0,
+						tile.m_width, tile.m_height);
+				}
+			}
+
+			for (int y = 0; y < tile.m_height; ++y)
+			{
+				for (int x = 0; x < tile.m_width; ++x)
+					buffer.add(x, y, *p_colors++, sample_count);
+			}
+		}
+
+		this->m_tile_samples[tile_index] += sample_count;
+
+		return this->is_tile_done(tile_index);
+	}
+
+	// accumulated colors of the tile scaled to m_samples_per_pixel samples,
+	// so the output divides them the same way as non accumulated ones
+	void get_tile_colors(int tile_index, glm::dvec3* p_colors)
+	{
+		const auto& tile = this->m_tiles[tile_index];
+		auto& accumulation = *this->m_tile_accumulations[tile_index];
+
+		std::lock_guard<std::mutex> lock(accumulation.m_mutex);
+
+		// the tile has no passes yet, it is what the checkpoint or the
+		// previous job had
+		const auto* p_buffer = &accumulation.m_buffer;
+		auto offset_x = tile.m_x;
+		auto offset_y = tile.m_y;
+
+		if (!p_buffer->get_width())
+		{
+			p_buffer = &this->m_accumulation;
+			offset_x = 0;
+			offset_y = 0;
+		}
+
+		for (int y = tile.m_y; y < tile.m_y + tile.m_height; ++y)
+		{
+			for (int x = tile.m_x; x < tile.m_x + tile.m_width; ++x)
+			{
+				auto sample_count = p_buffer->get_width()
+					? p_buffer->get_sample_count(x - offset_x, y - offset_y)
+					: 0u;
+
+				if (!sample_count && !this->m_preview.empty())
+				{
+					*p_colors++ = this->m_preview[static_cast<std::size_t>(y) *
+										  this->m_settings.m_width +
+									  x] *
+						double(this->m_settings.m_samples_per_pixel);
+					continue;
+				}
+
+				*p_colors++ = sample_count
+					? p_buffer->get_color(x - offset_x, y - offset_y) *
+						(double(this->m_settings.m_samples_per_pixel) /
+							sample_count)
+					: glm::dvec3(0.0, 0.0, 0.0);
+			}
+		}
+	}
+
+	// only one caller gets true per interval
+	bool is_checkpoint_due()
+	{
+		if (this->m_settings.m_checkpoint_file_name.empty())
+			return false;
+
+		auto now = std::chrono::steady_clock::now().time_since_epoch().count();
+		auto last = this->m_last_checkpoint_time.load();
+		auto interval =
+			std::chrono::duration_cast<std::chrono::steady_clock::duration>(
+				std::chrono::duration<double>(
+					this->m_settings.m_checkpoint_interval))
+				.count();
+
+		return now - last >= interval &&
+			this->m_last_checkpoint_time.compare_exchange_strong(last, now);
+	}
+
+	// all tiles gathered into one buffer of the whole image, big images are
+	// gathered by several threads, every one copies its own range of tiles
+	accumulation_buffer_t get_accumulation_snapshot() const
+	{
+		trace_span_t span("gather accumulation", "render");
+
+		accumulation_buffer_t result;
+
+		if (this->m_accumulation.get_width())
+		{
+			result = this->m_accumulation;
+		}
+		else
+		{
+			result.resize(this->m_settings.m_width, this->m_settings.m_height,
+				this->m_settings.m_seed);
+		}
+
+		auto tile_count =
+			static_cast<int>(this->m_tile_accumulations.size());
+
+		auto gather = [&](int first, int last) {
+			for (int tile_index = first; tile_index < last; ++tile_index)
+			{
+				const auto& tile = this->m_tiles[tile_index];
+				auto& accumulation = *this->m_tile_accumulations[tile_index];
+
+				std::lock_guard<std::mutex> lock(accumulation.m_mutex);
+
+				if (accumulation.m_buffer.get_width())
+				{
+					result.copy(accumulation.m_buffer, 0, 0, tile.m_x,
+						tile.m_y, tile.m_width, tile.m_height);
+				}
+			}
+		};
+
+		auto pixel_count = static_cast<std::size_t>(this->m_settings.m_width) *
+			this->m_settings.m_height;
+		auto thread_count = static_cast<int>((std::min)(
+			pixel_count / kSnapshotPixelsPerThread + 1,
+			static_cast<std::size_t>(
+				(std::max)(1u, std::thread::hardware_concurrency()))));
+
+		std::vector<std::thread> threads;
+
+		for (int i = 1; i < thread_count; ++i)
+		{
+			threads.emplace_back(gather, tile_count * i / thread_count,
+				tile_count * (i + 1) / thread_count);
+		}
+
+		gather(0, tile_count / thread_count);
+
+		for (auto& thread : threads)
+			thread.join();
+
+		return result;
+	}
+
+	// returns true for the last finished tile of the job
+	bool finish_tile()
+	{
+		return this->m_finished_tile_count.fetch_add(1) + 1 ==
+			this->get_tile_count();
+	}
+
+	// RGB8 image of get_output_rect(), row by row, when m_output_type is
+	// kOutputType_Memory
+	const std::vector<std::uint8_t>& get_pixels() const
+	{
+		return this->m_pixels;
+	}
+
+	// (x, y) is relative to get_output_rect()
+	std::uint8_t* get_pixels(int x, int y)
+	{
+		return this->m_pixels.data() +
+			(static_cast<std::size_t>(y) * this->get_output_rect().m_width +
+				x) *
+			3;
+	}
+
+	// blocks until image_writer_t wrote the whole image
+	void wait_written() const
+	{
+		while (!this->m_is_written.load())
+			this->m_is_written.wait(false);
+	}
+
+	void mark_written()
+	{
+		this->m_is_written = true;
+		this->m_is_written.notify_all();
+	}
+
+	// rays traced by render_tile() so far, primary ones and bounces
+	std::uint64_t get_ray_count() const { return this->m_ray_count.load(); }
+
+	std::chrono::milliseconds get_elapsed() const
+	{
+		return std::chrono::duration_cast<std::chrono::milliseconds>(
+			std::chrono::steady_clock::now() - this->m_start_time);
+	}
+
+private:
+	void init_tiles()
+	{
+		auto tile_size = (std::max)(1, this->m_settings.m_tile_size);
+		auto crop = this->get_crop();
+
+		auto column_count = (this->m_settings.m_width + tile_size - 1) / tile_size;
+		auto row_count = (this->m_settings.m_height + tile_size - 1) / tile_size;
+
+		// the grid stays aligned to the whole image, tiles on the border of
+		// the crop are cut by it
+		for (auto cell : render_get_traversal_order(
+				 column_count, row_count, this->m_settings.m_traversal_order))
+		{
+			auto x = (cell % column_count) * tile_size;
+			auto y = (cell / column_count) * tile_size;
+
+			auto tile = crop.get_intersection(render_tile_t(x, y,
+				(std::min)(tile_size, this->m_settings.m_width - x),
+				(std::min)(tile_size, this->m_settings.m_height - y)));
+
+			if (!tile.is_empty())
+				this->m_tiles.push_back(tile);
+		}
+
+		this->m_pixel_order = render_get_traversal_order(
+			tile_size, tile_size, this->m_settings.m_traversal_order);
+
+		// the scheduler takes tiles of a pass by their index
+		if (!this->m_settings.m_priority_region.is_empty())
+		{
+			std::stable_partition(this->m_tiles.begin(), this->m_tiles.end(),
+				[this](const render_tile_t& tile) {
+					return !tile.get_intersection(
+									this->m_settings.m_priority_region)
+								.is_empty();
+				});
+		}
+
+		this->m_tile_samples.assign(this->m_tiles.size(), 0);
+		this->m_tile_dependencies.resize(this->m_tiles.size());
+		this->m_tile_features_ready.assign(this->m_tiles.size(), false);
+
+		if (this->is_post_processing())
+		{
+			this->m_features.resize(
+				static_cast<std::size_t>(this->m_settings.m_width) *
+				this->m_settings.m_height);
+		}
+
+		if (this->is_progressive())
+		{
+			this->m_preview.resize(
+				static_cast<std::size_t>(this->m_settings.m_width) *
+				this->m_settings.m_height);
+		}
+
+		if (this->m_settings.m_is_output_cost)
+		{
+			this->m_costs.resize(
+				static_cast<std::size_t>(this->m_settings.m_width) *
+				this->m_settings.m_height);
+		}
+
+		if (this->m_settings.m_output_type == eOutputType::kOutputType_Memory)
+		{
+			auto output_rect = this->get_output_rect();
+
+			this->m_pixels.resize(
+				static_cast<std::size_t>(output_rect.m_width) *
+				output_rect.m_height * 3);
+		}
+	}
+
+	// takes the complete cache of the previous job when the camera and the
+	// geometry didn't change, otherwise this job records its own
+	void init_first_hits(const render_job_t* p_previous)
+	{
+		if (!this->is_caching_first_hits())
+			return;
+
+		if (p_previous && p_previous->is_done() &&
+			p_previous->m_is_first_hits_complete &&
+			this->m_camera == p_previous->m_camera &&
+			this->m_world.is_same_geometry(p_previous->m_world))
+		{
+			this->m_p_first_hits = p_previous->m_p_first_hits;
+			this->m_is_first_hits_cached = true;
+			this->m_is_first_hits_complete = true;
+			return;
+		}
+
+		this->m_p_first_hits = std::make_shared<std::vector<render_first_hit_t>>(
+			static_cast<std::size_t>(this->m_settings.m_width) *
+			this->m_settings.m_height * this->m_settings.m_samples_per_pixel);
+		this->m_is_first_hits_complete = true;
+	}
+
+	void init_rasterizer()
+	{
+		if (this->is_rasterizing_primary())
+		{
+			this->m_rasterizer.build(
+				this->m_world, this->m_camera, this->m_settings);
+		}
+	}
+
+	// buffers of tiles are allocated by their first passes
+	void init_accumulation()
+	{
+		this->m_tile_accumulations.clear();
+
+		for (int tile_index = 0; tile_index < this->get_tile_count();
+			 ++tile_index)
+		{
+			this->m_tile_accumulations.push_back(
+				std::make_unique<tile_accumulation_t>());
+		}
+
+		this->m_last_checkpoint_time =
+			std::chrono::steady_clock::now().time_since_epoch().count();
+	}
+
+	// tiles of the previous job which have to be rendered again. Material
+	// edits affect tiles which recorded the entity, moved, added or removed
+	// entities also affect tiles which see them at the new place, those are
+	// found by a cheap probe render of primary rays and first bounces
+	std::vector<bool> find_changed_tiles(const render_job_t& previous) const
+	{
+		static constexpr int kProbeSampleCount = 4;
+
+		const auto& old_world = previous.m_world;
+		auto slot_count =
+			(std::max)(this->m_world.get_slot_count(), old_world.get_slot_count());
+
+		std::vector<bool> is_edited(slot_count, false);
+		std::vector<bool> is_moved(slot_count, false);
+		bool is_any_moved{};
+
+		for (int slot = 0; slot < slot_count; ++slot)
+		{
+			auto is_old = slot < old_world.get_slot_count();
+			auto is_new = slot < this->m_world.get_slot_count();
+
+			if (is_old && is_new &&
+				old_world.get_revision(slot) ==
+					this->m_world.get_revision(slot))
+			{
+				continue;
+			}
+
+			// slots past the end of a world are removed entities, they have
+			// no type and empty bounds
+			auto old_type = is_old ? old_world.get_type(slot)
+								   : eEntityType::kEntityType_Unknown;
+			auto new_type = is_new ? this->m_world.get_type(slot)
+								   : eEntityType::kEntityType_Unknown;
+			auto old_bounds =
+				is_old ? old_world.get_entity(slot).get_bounds() : aabb_t();
+			auto new_bounds =
+				is_new ? this->m_world.get_entity(slot).get_bounds() : aabb_t();
+
+			is_edited[slot] = true;
+
+			if (old_type != new_type || !(old_bounds == new_bounds))
+			{
+				is_moved[slot] = true;
+				is_any_moved = true;
+			}
+		}
+
+		std::vector<bool> result(this->m_tiles.size(), false);
+
+		for (int tile_index = 0; tile_index < this->get_tile_count();
+			 ++tile_index)
+		{
+			for (auto slot : previous.m_tile_dependencies[tile_index])
+			{
+				if (is_edited[slot])
+				{
+					result[tile_index] = true;
+					break;
+				}
+			}
+		}
+
+		if (!is_any_moved)
+			return result;
+
+		auto probe_settings = this->m_settings;
+		probe_settings.m_depth_count = (std::min)(probe_settings.m_depth_count,
+			draw_dependency_recorder_t::kRecordedHitCount);
+
+		auto probe_sample_count =
+			(std::min)(probe_settings.m_samples_per_pixel, kProbeSampleCount);
+
+		std::vector<int> slots;
+		draw_dependency_recorder_t recorder(slots);
+		draw_get_dependency_recorder() = &recorder;
+
+		for (int tile_index = 0; tile_index < this->get_tile_count();
+			 ++tile_index)
+		{
+			if (result[tile_index])
+				continue;
+
+			const auto& tile = this->m_tiles[tile_index];
+
+			slots.clear();
+
+			for (int y = tile.m_y; y < tile.m_y + tile.m_height; ++y)
+			{
+				for (int x = tile.m_x; x < tile.m_x + tile.m_width; ++x)
+				{
+					render_pixel(this->m_world, this->m_camera, probe_settings,
+						x, y, 0, probe_sample_count);
+				}
+			}
+
+			result[tile_index] = std::any_of(slots.begin(), slots.end(),
+				[&](int slot) { return is_moved[slot]; });
+		}
+
+		draw_get_dependency_recorder() = nullptr;
+
+		return result;
+	}
+
+	// resumes from the checkpoint if it was made for the same image size and
+	// seed, every tile continues from the number of samples it already has
+	void resume_from_checkpoint()
+	{
+		if (this->m_settings.m_checkpoint_file_name.empty())
+			return;
+
+		accumulation_buffer_t checkpoint;
+
+		if (!checkpoint.load(this->m_settings.m_checkpoint_file_name))
+			return;
+
+		if (checkpoint.get_width() != this->m_settings.m_width ||
+			checkpoint.get_height() != this->m_settings.m_height ||
+			checkpoint.get_seed() != this->m_settings.m_seed)
+		{
+			std::cout << "checkpoint "
+					  << this->m_settings.m_checkpoint_file_name
+					  << " doesn't match the job, rendering from scratch"
+					  << std::endl;
+			return;
+		}
+
+		this->m_accumulation = std::move(checkpoint);
+
+		for (int tile_index = 0; tile_index < this->get_tile_count();
+			 ++tile_index)
+		{
+			const auto& tile = this->m_tiles[tile_index];
+			auto sample_count = (std::numeric_limits<std::uint32_t>::max)();
+
+			for (int y = tile.m_y; y < tile.m_y + tile.m_height; ++y)
+			{
+				for (int x = tile.m_x; x < tile.m_x + tile.m_width; ++x)
+				{
+					sample_count = (std::min)(sample_count,
+						this->m_accumulation.get_sample_count(x, y));
+				}
+			}
+
+			this->m_tile_samples[tile_index] = static_cast<int>(sample_count);
+
+			// samples from the checkpoint have no first hits
+			if (sample_count)
+				this->m_is_first_hits_complete = false;
+		}
+
+		std::cout << "resuming " << this->m_output_file_name << " from "
+				  << this->m_settings.m_checkpoint_file_name << std::endl;
+	}
+
+private:
+	// samples of one tile, see accumulate_tile()
+	struct tile_accumulation_t
+	{
+		tile_accumulation_t() {}
+		~tile_accumulation_t() {}
+
+		std::mutex m_mutex;
+		// tile.m_width x tile.m_height, empty until the first pass
+		accumulation_buffer_t m_buffer;
+	};
+
+private:
+	static constexpr int kPreviewBlockSize = 4;
+	// smaller images are gathered by the calling thread alone
+	static constexpr std::size_t kSnapshotPixelsPerThread = 1024 * 1024;
+
+	int m_priority;
+	std::atomic<int> m_finished_tile_count;
+	std::atomic<std::chrono::steady_clock::rep> m_last_checkpoint_time;
+	std::atomic<std::uint64_t> m_ray_count;
+	std::once_flag m_start_flag;
+	std::chrono::steady_clock::time_point m_start_time;
+	std::atomic<bool> m_is_written;
+	std::string m_output_file_name;
+	std::shared_ptr<const world_t> m_p_world;
+	const world_t& m_world;
+	camera_t m_camera;
+	render_settings_t m_settings;
+	std::vector<render_tile_t> m_tiles;
+	// pixels of a whole tile (index y * tile size + x) in the render order
+	std::vector<int> m_pixel_order;
+	// samples which every tile already has
+	std::vector<int> m_tile_samples;
+	// what the checkpoint or the previous job had, empty otherwise. A tile
+	// starts from it and has its own buffer after the first pass
+	accumulation_buffer_t m_accumulation;
+	std::vector<std::unique_ptr<tile_accumulation_t>> m_tile_accumulations;
+	// sorted slots of entities hit by primary rays and first bounces of every
+	// tile, only when m_is_track_dependencies
+	std::vector<std::vector<int>> m_tile_dependencies;
+	std::vector<std::uint8_t> m_tile_features_ready;
+	// width * height * samples per pixel, shared with the jobs made from
+	// this one while it is only read
+	std::shared_ptr<std::vector<render_first_hit_t>> m_p_first_hits;
+	// kOutputType_Memory
+	std::vector<std::uint8_t> m_pixels;
+	// m_p_first_hits came from the previous job and primary rays are skipped
+	bool m_is_first_hits_cached;
+	// every sample of the image has its first hit in m_p_first_hits
+	bool m_is_first_hits_complete;
+	// spheres binned by tiles, only when is_rasterizing_primary()
+	render_rasterizer_t m_rasterizer;
+	// only when is_post_processing(), every tile fills its own pixels
+	std::vector<render_features_t> m_features;
+	// only when is_progressive(), one sample color of the pixel's block
+	std::vector<glm::dvec3> m_preview;
+	// only when m_is_output_cost, sums of all passes of the pixel
+	std::vector<float> m_costs;
+};
+
+/* denoise */
+
+/// @brief edge-avoiding a-trous wavelet filter (Dammertz et al. 2010). Every
+/// iteration is a 5x5 B3 spline kernel whose taps are 2^iteration pixels
+/// apart, each tap is weighted by how close its color, normal, albedo and
+/// depth are to the center pixel, so edges survive while noise in flat regions
+/// is blurred away. Data lives in separate float planes and every tap is one
+/// exp for the whole row, so inner loops are plain arrays which vectorize
+class denoiser_t
+{
+public:
+	denoiser_t() :
+		m_iteration_count{5}, m_color_sigma{0.5f}, m_normal_sigma{0.3f},
+		m_albedo_sigma{0.1f}, m_depth_sigma{0.1f}
+	{
+	}
+	~denoiser_t() {}
+
+	void set_iteration_count(int count) { this->m_iteration_count = count; }
+	void set_color_sigma(float sigma) { this->m_color_sigma = sigma; }
+
+	// p_colors are means of samples, they are replaced with filtered ones
+	void denoise(glm::dvec3* p_colors, const render_features_t* p_features,
+		int width, int height) const
+	{
+		auto pixel_count = static_cast<std::size_t>(width) * height;
+
+		planes_t planes;
+		planes.resize(pixel_count);
+
+		for (std::size_t i = 0; i < pixel_count; ++i)
+		{
+			const auto& feature = p_features[i];
+
+			planes.m_colors[0][i] = static_cast<float>(p_colors[i].x);
+			planes.m_colors[1][i] = static_cast<float>(p_colors[i].y);
+			planes.m_colors[2][i] = static_cast<float>(p_colors[i].z);
+
+			for (int axis = 0; axis < 3; ++axis)
+			{
+				planes.m_normals[axis][i] = feature.m_normal[axis];
+				planes.m_albedos[axis][i] = feature.m_albedo[axis];
+			}
+
+			planes.m_depths[i] = feature.m_depth;
+			// depth is compared relatively, far pixels may differ more
+			planes.m_depth_scales[i] = 1.0f /
+				(this->m_depth_sigma * this->m_depth_sigma *
+					(feature.m_depth * feature.m_depth + 1e-4f));
+		}
+
+		std::vector<float> output[3];
+		for (auto& channel : output)
+			channel.resize(pixel_count);
+
+		auto thread_count = (std::max)(1u, std::thread::hardware_concurrency());
+
+		for (int iteration = 0; iteration < this->m_iteration_count;
+			 ++iteration)
+		{
+			std::vector<std::thread> threads;
+			auto rows_per_thread =
+				(height + static_cast<int>(thread_count) - 1) /
+				static_cast<int>(thread_count);
+
+			for (int row = 0; row < height; row += rows_per_thread)
+			{
+				threads.emplace_back([&, row, iteration] {
+					this->filter_rows(planes, output, width, height, row,
+						(std::min)(height, row + rows_per_thread), iteration);
+				});
+			}
+
+			for (auto& thread : threads)
+				thread.join();
+
+			for (int channel = 0; channel < 3; ++channel)
+				std::swap(planes.m_colors[channel], output[channel]);
+		}
+
+		for (std::size_t i = 0; i < pixel_count; ++i)
+		{
+			p_colors[i] = glm::dvec3(planes.m_colors[0][i],
+				planes.m_colors[1][i], planes.m_colors[2][i]);
+		}
+	}
+
+private:
+	struct planes_t
+	{
+		void resize(std::size_t size)
+		{
+			for (int axis = 0; axis < 3; ++axis)
+			{
+				this->m_colors[axis].resize(size);
+				this->m_normals[axis].resize(size);
+				this->m_albedos[axis].resize(size);
+			}
+
+			this->m_depths.resize(size);
+			this->m_depth_scales.resize(size);
+		}
+
+		std::vector<float> m_colors[3];
+		std::vector<float> m_normals[3];
+		std::vector<float> m_albedos[3];
+		std::vector<float> m_depths;
+		std::vector<float> m_depth_scales;
+	};
+
+	void filter_rows(const planes_t& planes, std::vector<float>* p_output,
+		int width, int height, int row_from, int row_to, int iteration) const
+	{
+		static constexpr float kKernel[5] = {
+			1.0f / 16.0f, 1.0f / 4.0f, 3.0f / 8.0f, 1.0f / 4.0f, 1.0f / 16.0f};
+
+		auto step = 1 << iteration;
+
+		// color sigma shrinks every iteration because the image is smoother
+		auto color_scale = float(1 << iteration) /
+			(this->m_color_sigma * this->m_color_sigma);
+		auto normal_scale =
+			1.0f / (this->m_normal_sigma * this->m_normal_sigma);
+		auto albedo_scale =
+			1.0f / (this->m_albedo_sigma * this->m_albedo_sigma);
+
+		std::vector<float> sums[3];
+		std::vector<float> weight_sums(width);
+		std::vector<int> tap_columns(width);
+
+		for (auto& sum : sums)
+			sum.resize(width);
+
+		for (int y = row_from; y < row_to; ++y)
+		{
+			for (auto& sum : sums)
+				std::fill(sum.begin(), sum.end(), 0.0f);
+
+			std::fill(weight_sums.begin(), weight_sums.end(), 0.0f);
+
+			const auto center = static_cast<std::size_t>(y) * width;
+
+			for (int dy = -2; dy <= 2; ++dy)
+			{
+				auto tap_y = std::clamp(y + dy * step, 0, height - 1);
+				const auto tap_row = static_cast<std::size_t>(tap_y) * width;
+
+				for (int dx = -2; dx <= 2; ++dx)
+				{
+					auto kernel = kKernel[dy + 2] * kKernel[dx + 2];
+
+					for (int x = 0; x < width; ++x)
+						tap_columns[x] = std::clamp(x + dx * step, 0, width - 1);
+
+					for (int x = 0; x < width; ++x)
+					{
+						auto p = center + x;
+						auto q = tap_row + tap_columns[x];
+
+						float color_distance{};
+						float normal_distance{};
+						float albedo_distance{};
+
+						for (int axis = 0; axis < 3; ++axis)
+						{
+							auto color = planes.m_colors[axis][p] -
+								planes.m_colors[axis][q];
+							auto normal = planes.m_normals[axis][p] -
+								planes.m_normals[axis][q];
+							auto albedo = planes.m_albedos[axis][p] -
+								planes.m_albedos[axis][q];
+
+							color_distance += color * color;
+							normal_distance += normal * normal;
+							albedo_distance += albedo * albedo;
+						}
+
+						auto depth =
+							planes.m_depths[p] - planes.m_depths[q];
+
+						auto weight = kernel *
+							std::exp(-(color_distance * color_scale +
+								normal_distance * normal_scale +
+								albedo_distance * albedo_scale +
+								depth * depth * planes.m_depth_scales[p]));
+
+						sums[0][x] += weight * planes.m_colors[0][q];
+						sums[1][x] += weight * planes.m_colors[1][q];
+						sums[2][x] += weight * planes.m_colors[2][q];
+						weight_sums[x] += weight;
+					}
+				}
+			}
+
+			// the center tap always has weight = kernel, so sum is never 0
+			for (int channel = 0; channel < 3; ++channel)
+			{
+				for (int x = 0; x < width; ++x)
+				{
+					p_output[channel][center + x] =
+						sums[channel][x] / weight_sums[x];
+				}
+			}
+		}
+	}
+
+private:
+	int m_iteration_count;
+	float m_color_sigma;
+	float m_normal_sigma;
+	float m_albedo_sigma;
+	float m_depth_sigma;
+};
+
+/* output */
+
+/// @brief lock-free multi producer single consumer queue (Dmitry Vyukov's
+/// intrusive one), T must have std::atomic<T*> m_p_next. Producers never
+/// block, pop() can return nullptr while a producer is in the middle of push
+template <typename T>
+class mpsc_queue_t
+{
+public:
+	mpsc_queue_t() : m_p_head{&this->m_stub}, m_p_tail{&this->m_stub} {}
+	~mpsc_queue_t() {}
+
+	void push(T* p_node)
+	{
+		p_node->m_p_next.store(nullptr, std::memory_order_relaxed);
+		auto* p_previous =
+			this->m_p_head.exchange(p_node, std::memory_order_acq_rel);
+		p_previous->m_p_next.store(p_node, std::memory_order_release);
+	}
+
+	T* pop()
+	{
+		auto* p_tail = this->m_p_tail;
+		auto* p_next = p_tail->m_p_next.load(std::memory_order_acquire);
+
+		if (p_tail == &this->m_stub)
+		{
+			if (!p_next)
+				return nullptr;
+
+			this->m_p_tail = p_next;
+			p_tail = p_next;
+			p_next = p_next->m_p_next.load(std::memory_order_acquire);
+		}
+
+		if (p_next)
+		{
+			this->m_p_tail = p_next;
+			return p_tail;
+		}
+
+		if (p_tail != this->m_p_head.load(std::memory_order_acquire))
+			return nullptr;
+
+		this->push(&this->m_stub);
+
+		p_next = p_tail->m_p_next.load(std::memory_order_acquire);
+
+		if (p_next)
+		{
+			this->m_p_tail = p_next;
+			return p_tail;
+		}
+
+		return nullptr;
+	}
+
+private:
+	std::atomic<T*> m_p_head;
+	T* m_p_tail;
+	T m_stub;
+};
+
+/// @brief rendered tile on its way to image_writer_t, tile without job is the
+/// signal to stop the writer and m_tile_index = -1 is a checkpoint to save
+struct output_tile_t
+{
+	output_tile_t() : m_p_next{}, m_tile_index{} {}
+	output_tile_t(const std::shared_ptr<render_job_t>& p_job,
+		accumulation_buffer_t&& checkpoint) :
+		m_p_next{},
+		m_p_job{p_job}, m_tile_index{-1}, m_checkpoint{std::move(checkpoint)}
+	{
+	}
+	output_tile_t(const std::shared_ptr<render_job_t>& p_job, int tile_index) :
+		m_p_next{}, m_p_job{p_job}, m_tile_index{tile_index}
+	{
+		const auto& tile = p_job->get_tile(tile_index);
+		this->m_colors.resize(
+			static_cast<std::size_t>(tile.m_width) * tile.m_height);
+	}
+	~output_tile_t() {}
+
+	std::atomic<output_tile_t*> m_p_next;
+	std::shared_ptr<render_job_t> m_p_job;
+	int m_tile_index;
+	std::vector<glm::dvec3> m_colors;
+	accumulation_buffer_t m_checkpoint;
+};
+
+/// @brief output stage on its own thread. Render threads push finished tiles
+/// into a lock-free queue and go on, the writer converts them to 8 bit and
+/// streams every band (row of tiles) to the file as soon as all bands above
+/// it are written, so encoding and disk I/O overlap with rendering
+class image_writer_t
+{
+public:
+	image_writer_t() : m_queued_count{}, m_unwritten_job_count{} {}
+	~image_writer_t() { this->stop(); }
+
+	void start()
+	{
+		if (!this->m_thread.joinable())
+			this->m_thread = std::thread(&image_writer_t::worker, this);
+	}
+
+	// writes everything that is already queued and exits
+	void stop()
+	{
+		if (!this->m_thread.joinable())
+			return;
+
+		this->push(new output_tile_t());
+		this->m_thread.join();
+	}
+
+	// called for every submitted job, so wait() knows what is in flight
+	void begin() { this->m_unwritten_job_count.fetch_add(1); }
+
+	void push(output_tile_t* p_tile)
+	{
+		this->m_queue.push(p_tile);
+		this->m_queued_count.fetch_add(1, std::memory_order_release);
+		this->m_queued_count.notify_one();
+	}
+
+	// blocks until all begun jobs are written
+	void wait()
+	{
+		while (auto count = this->m_unwritten_job_count.load())
+			this->m_unwritten_job_count.wait(count);
+	}
+
+private:
+	struct output_state_t
+	{
+		output_state_t() :
+			m_is_initialized{}, m_received_tile_count{}, m_next_band{}
+		{
+		}
+		~output_state_t() {}
+
+		bool m_is_initialized;
+		int m_received_tile_count;
+
+		// whole image for post processing (denoiser, feature buffers)
+		std::vector<glm::dvec3> m_frame;
+
+		// kOutputType_Stream
+		image_ppm_t m_image;
+		std::vector<std::uint8_t> m_pixels;
+		// tiles which are not received yet for every band
+		std::vector<int> m_band_tile_counts;
+		int m_next_band;
+
+		// kOutputType_Mapped
+		image_mapped_ppm_t m_mapped_image;
+	};
+
+	void worker()
+	{
+		trace_get().set_thread_name("writer");
+
+		while (true)
+		{
+			auto count = this->m_queued_count.load(std::memory_order_acquire);
+
+			if (!count)
+			{
+				this->m_queued_count.wait(0);
+				continue;
+			}
+
+			auto* p_tile = this->m_queue.pop();
+
+			// producer didn't finish its push yet
+			if (!p_tile)
+			{
+				std::this_thread::yield();
+				continue;
+			}
+
+			this->m_queued_count.fetch_sub(1, std::memory_order_relaxed);
+
+			if (!p_tile->m_p_job)
+			{
+				delete p_tile;
+				return;
+			}
+
+			if (p_tile->m_tile_index < 0)
+			{
+				trace_span_t span("save checkpoint", "output");
+
+				p_tile->m_checkpoint.save(
+					p_tile->m_p_job->get_settings().m_checkpoint_file_name);
+			}
+			else
+			{
+				trace_span_t span(
+					"write tile", "output", "tile", p_tile->m_tile_index);
+
+				this->write_tile(*p_tile);
+			}
+
+			delete p_tile;
+		}
+	}
+
+	void write_tile(const output_tile_t& output)
+	{
+		auto& job = *output.m_p_job;
+		const auto& settings = job.get_settings();
+		const auto& tile = job.get_tile(output.m_tile_index);
+		auto& state = this->m_states[&job];
+
+		if (!job.is_post_processing())
+		{
+			this->write_colors(state, job, output.m_tile_index,
+				output.m_colors.data(), tile.m_width);
+
+			if (++state.m_received_tile_count == job.get_tile_count())
+				this->finish_job(job);
+
+			return;
+		}
+
+		// post processing needs neighbours from other tiles, so the image is
+		// collected first and written at once
+		if (state.m_frame.empty())
+		{
+			state.m_frame.resize(
+				static_cast<std::size_t>(settings.m_width) * settings.m_height);
+		}
+
+		for (int y = 0; y < tile.m_height; ++y)
+		{
+			std::copy(output.m_colors.begin() + y * tile.m_width,
+				output.m_colors.begin() + (y + 1) * tile.m_width,
+				state.m_frame.begin() +
+					static_cast<std::size_t>(tile.m_y + y) * settings.m_width +
+					tile.m_x);
+		}
+
+		if (++state.m_received_tile_count < job.get_tile_count())
+			return;
+
+		this->post_process(state, job);
+
+		for (int tile_index = 0; tile_index < job.get_tile_count();
+			 ++tile_index)
+		{
+			const auto& frame_tile = job.get_tile(tile_index);
+
+			this->write_colors(state, job, tile_index,
+				state.m_frame.data() +
+					static_cast<std::size_t>(frame_tile.m_y) *
+						settings.m_width +
+					frame_tile.m_x,
+				settings.m_width);
+		}
+
+		this->finish_job(job);
+	}
+
+	void finish_job(render_job_t& job)
+	{
+		if (job.get_settings().m_is_output_cost)
+			this->write_cost(job);
+
+		if (job.get_settings().m_output_type != eOutputType::kOutputType_Memory)
+		{
+			std::cout << job.get_output_file_name() << " was created ("
+					  << job.get_elapsed().count() << " ms";
+
+			if (job.is_progressive())
+				std::cout << ", " << job.get_sample_count() << " samples";
+
+			std::cout << ")" << std::endl;
+		}
+
+		this->m_states.erase(&job);
+		job.mark_written();
+
+		this->m_unwritten_job_count.fetch_sub(1);
+		this->m_unwritten_job_count.notify_all();
+	}
+
+	// both see the crop only, pixels outside of it have no features
+	void post_process(output_state_t& state, const render_job_t& job)
+	{
+		trace_span_t span("post process", "output");
+
+		const auto& settings = job.get_settings();
+		auto crop = job.get_crop();
+
+		std::vector<glm::dvec3> frame(
+			static_cast<std::size_t>(crop.m_width) * crop.m_height);
+		std::vector<render_features_t> features(frame.size());
+
+		for (int y = 0; y < crop.m_height; ++y)
+		{
+			auto offset = static_cast<std::size_t>(crop.m_y + y) *
+					settings.m_width +
+				crop.m_x;
+
+			std::copy_n(state.m_frame.begin() + offset, crop.m_width,
+				frame.begin() + static_cast<std::size_t>(y) * crop.m_width);
+			std::copy_n(job.get_features().begin() + offset, crop.m_width,
+				features.begin() + static_cast<std::size_t>(y) * crop.m_width);
+		}
+
+		if (settings.m_is_output_features)
+		{
+			this->write_features(job.get_output_file_name(), features,
+				crop.m_width, crop.m_height);
+		}
+
+		if (!settings.m_is_use_denoiser)
+			return;
+
+		auto scale = 1.0 / settings.m_samples_per_pixel;
+
+		for (auto& color : frame)
+			color *= scale;
+
+		denoiser_t denoiser;
+		denoiser.denoise(
+			frame.data(), features.data(), crop.m_width, crop.m_height);
+
+		for (int y = 0; y < crop.m_height; ++y)
+		{
+			auto offset = static_cast<std::size_t>(crop.m_y + y) *
+					settings.m_width +
+				crop.m_x;
+
+			for (int x = 0; x < crop.m_width; ++x)
+			{
+				state.m_frame[offset + x] =
+					frame[static_cast<std::size_t>(y) * crop.m_width + x] *
+					double(settings.m_samples_per_pixel);
+			}
+		}
+	}
+
+	// name.ppm -> name_normal.ppm, name_albedo.ppm and name_depth.ppm
+	// the file name without .ppm, for images written next to it
+	static std::string get_base_name(const std::string& file_name)
+	{
+		auto result = file_name;
+		auto extension_position = result.rfind(".ppm");
+
+		if (extension_position != std::string::npos)
+			result.erase(extension_position);
+
+		return result;
+	}
+
+	void write_features(const std::string& file_name,
+		const std::vector<render_features_t>& features, int width, int height)
+	{
+		auto base_name = get_base_name(file_name);
+
+		double max_depth{};
+		for (const auto& feature : features)
+		{
+			if (feature.m_depth < render_features_t::kMissDepth)
+				max_depth = (std::max)(max_depth, double(feature.m_depth));
+		}
+
+		image_ppm_t normal_image(width, height);
+		image_ppm_t albedo_image(width, height);
+		image_ppm_t depth_image(width, height);
+
+		normal_image.open((base_name + "_normal.ppm").c_str());
+		albedo_image.open((base_name + "_albedo.ppm").c_str());
+		depth_image.open((base_name + "_depth.ppm").c_str());
+
+		for (const auto& feature : features)
+		{
+			normal_image.write(
+				draw_normal(glm::dvec3(feature.m_normal)), 1);
+			albedo_image.write(glm::dvec3(feature.m_albedo), 1);
+
+			auto depth = feature.m_depth < render_features_t::kMissDepth &&
+					max_depth > 0.0
+				? 1.0 - feature.m_depth / max_depth
+				: 0.0;
+
+			depth_image.write(glm::dvec3(depth, depth, depth), 1);
+		}
+	}
+
+	// costs of the output rectangle scaled by the 99th percentile, so a few
+	// extreme pixels don't make the rest of the map dark blue, and colored
+	// by the jet color map
+	void write_cost(const render_job_t& job)
+	{
+		trace_span_t span("write cost", "output");
+
+		const auto& settings = job.get_settings();
+		const auto& costs = job.get_costs();
+		auto rect = job.get_output_rect();
+
+		std::vector<float> rect_costs;
+		rect_costs.reserve(
+			static_cast<std::size_t>(rect.m_width) * rect.m_height);
+
+		for (int y = rect.m_y; y < rect.m_y + rect.m_height; ++y)
+		{
+			auto offset = static_cast<std::size_t>(y) * settings.m_width;
+
+			rect_costs.insert(rect_costs.end(),
+				costs.begin() + offset + rect.m_x,
+				costs.begin() + offset + rect.m_x + rect.m_width);
+		}
+
+		auto sorted_costs = rect_costs;
+		auto percentile = sorted_costs.begin() + sorted_costs.size() * 99 / 100;
+		std::nth_element(sorted_costs.begin(), percentile, sorted_costs.end());
+
+		auto max_cost = sorted_costs.empty()
+			? 0.0
+			: double(
+				  *std::max_element(sorted_costs.begin(), sorted_costs.end()));
+		auto scale = percentile != sorted_costs.end() && *percentile > 0.0f
+			? 1.0 / *percentile
+			: 0.0;
+
+		auto file_name = get_base_name(job.get_output_file_name()) + "_cost.ppm";
+
+		image_ppm_t image(rect.m_width, rect.m_height);
+		image.open(file_name.c_str());
+
+		for (auto cost : rect_costs)
+			image.write(draw_jet((std::min)(1.0, cost * scale)), 1);
+
+		std::cout << file_name << " was created ("
+				  << (settings.m_cost_metric == eCostMetric::kCostMetric_Rays
+							 ? "rays"
+							 : "ns")
+				  << " per pixel: 99% " << (scale > 0.0 ? 1.0 / scale : 0.0)
+				  << ", max " << max_cost << ")" << std::endl;
+	}
+
+	// p_colors is the first pixel of the tile, rows are row_stride apart
+	void write_colors(output_state_t& state, render_job_t& job,
+		int tile_index, const glm::dvec3* p_colors, int row_stride)
+	{
+		switch (job.get_settings().m_output_type)
+		{
+		case eOutputType::kOutputType_Stream:
+		{
+			this->write_tile_stream(state, job, tile_index, p_colors, row_stride);
+			break;
+		}
+		case eOutputType::kOutputType_Mapped:
+		{
+			this->write_tile_mapped(state, job, tile_index, p_colors, row_stride);
+			break;
+		}
+		case eOutputType::kOutputType_Memory:
+		{
+			this->write_tile_memory(job, tile_index, p_colors, row_stride);
+			break;
+		}
+		default:
+		{
+			break;
+		}
+		}
+
+		state.m_is_initialized = true;
+	}
+
+	void write_tile_stream(output_state_t& state, const render_job_t& job,
+		int tile_index, const glm::dvec3* p_colors, int row_stride)
+	{
+		const auto& settings = job.get_settings();
+		const auto& tile = job.get_tile(tile_index);
+		auto output_rect = job.get_output_rect();
+		auto tile_size = (std::max)(1, settings.m_tile_size);
+		auto band_count = (settings.m_height + tile_size - 1) / tile_size;
+
+		if (!state.m_is_initialized)
+		{
+			state.m_image.set_width(output_rect.m_width);
+			state.m_image.set_height(output_rect.m_height);
+			state.m_image.open(job.get_output_file_name().c_str());
+			state.m_pixels.resize(
+				static_cast<std::size_t>(output_rect.m_width) *
+				output_rect.m_height * 3);
+
+			// bands outside of the crop have no tiles and are black
+			state.m_band_tile_counts.assign(band_count, 0);
+
+			for (int i = 0; i < job.get_tile_count(); ++i)
+				++state.m_band_tile_counts[job.get_tile(i).m_y / tile_size];
+		}
+
+		for (int y = 0; y < tile.m_height; ++y)
+		{
+			auto offset = (static_cast<std::size_t>(
+								  tile.m_y + y - output_rect.m_y) *
+								  output_rect.m_width +
+							  tile.m_x - output_rect.m_x) *
+				3;
+
+			image_quantize(
+				reinterpret_cast<const double*>(p_colors + y * row_stride),
+				state.m_pixels.data() + offset,
+				static_cast<std::size_t>(tile.m_width) * 3,
+				settings.m_samples_per_pixel,
+				settings.m_is_use_gamma_correction);
+		}
+
+		--state.m_band_tile_counts[tile.m_y / tile_size];
+
+		while (state.m_next_band < band_count &&
+			!state.m_band_tile_counts[state.m_next_band])
+		{
+			// rows of the band which are in the output
+			auto first_row = (std::max)(
+				state.m_next_band * tile_size, output_rect.m_y);
+			auto row_count = (std::min)((state.m_next_band + 1) * tile_size,
+								 output_rect.m_y + output_rect.m_height) -
+				first_row;
+
+			if (row_count > 0)
+			{
+				state.m_image.write(state.m_pixels.data() +
+						static_cast<std::size_t>(first_row - output_rect.m_y) *
+							output_rect.m_width * 3,
+					static_cast<std::size_t>(row_count) * output_rect.m_width);
+			}
+
+			++state.m_next_band;
+		}
+	}
+
+	// no intermediate frame at all, rows of the tile are quantized straight
+	// into the mapped file
+	void write_tile_mapped(output_state_t& state, const render_job_t& job,
+		int tile_index, const glm::dvec3* p_colors, int row_stride)
+	{
+		const auto& settings = job.get_settings();
+		const auto& tile = job.get_tile(tile_index);
+		auto output_rect = job.get_output_rect();
+
+		// the new file is filled by zeros, so pixels outside of the crop are
+		// black
+		if (!state.m_is_initialized)
+		{
+			state.m_mapped_image.open(job.get_output_file_name().c_str(),
+				output_rect.m_width, output_rect.m_height);
+		}
+
+		if (!state.m_mapped_image.is_opened())
+			return;
+
+		for (int y = 0; y < tile.m_height; ++y)
+		{
+			image_quantize(
+				reinterpret_cast<const double*>(p_colors + y * row_stride),
+				state.m_mapped_image.get_pixels(tile.m_x - output_rect.m_x,
+					tile.m_y + y - output_rect.m_y),
+				static_cast<std::size_t>(tile.m_width) * 3,
+				settings.m_samples_per_pixel,
+				settings.m_is_use_gamma_correction);
+		}
+	}
+
+	void write_tile_memory(render_job_t& job, int tile_index,
+		const glm::dvec3* p_colors, int row_stride)
+	{
+		const auto& settings = job.get_settings();
+		const auto& tile = job.get_tile(tile_index);
+		auto output_rect = job.get_output_rect();
+
+		for (int y = 0; y < tile.m_height; ++y)
+		{
+			image_quantize(
+				reinterpret_cast<const double*>(p_colors + y * row_stride),
+				job.get_pixels(
+					tile.m_x - output_rect.m_x, tile.m_y + y - output_rect.m_y),
+				static_cast<std::size_t>(tile.m_width) * 3,
+				settings.m_samples_per_pixel,
+				settings.m_is_use_gamma_correction);
+		}
+	}
+
+private:
+	std::atomic<std::uint32_t> m_queued_count;
+	std::atomic<std::uint32_t> m_unwritten_job_count;
+	mpsc_queue_t<output_tile_t> m_queue;
+	std::thread m_thread;
+	std::unordered_map<const render_job_t*, output_state_t> m_states;
+};
+
+/// @brief one pool of threads for all submitted jobs. Tiles of all jobs are
+/// in the same queue ordered by job priority and then by submission order, so
+/// when the current job runs out of tiles idle workers take tiles of the next
+/// one instead of waiting for the slowest tile
+class render_scheduler_t
+{
+public:
+	render_scheduler_t() :
+		m_is_running{}, m_is_pin_threads{}, m_active_job_count{},
+		m_submitted_job_count{}
+	{
+	}
+	~render_scheduler_t() { this->stop(); }
+
+	// with is_pin_threads the i-th worker runs on the i-th core only, tiles
+	// are allocated by the workers which render them
+	void start(int thread_count, bool is_pin_threads = false)
+	{
+		if (this->m_is_running)
+			return;
+
+		this->m_is_running = true;
+		this->m_is_pin_threads = is_pin_threads;
+
+		this->m_writer.start();
+
+		for (int i = 0; i < (std::max)(1, thread_count); ++i)
+			this->m_threads.emplace_back(&render_scheduler_t::worker, this, i);
+	}
+
+	// workers finish all queued tiles before exit
+	void stop()
+	{
+		{
+			std::lock_guard<std::mutex> lock(this->m_mutex);
+			this->m_is_running = false;
+		}
+
+		this->m_has_work.notify_all();
+
+		for (auto& thread : this->m_threads)
+			thread.join();
+
+		this->m_threads.clear();
+
+		this->m_writer.stop();
+	}
+
+	std::shared_ptr<render_job_t> submit(
+		const std::shared_ptr<render_job_t>& p_job)
+	{
+		if (!p_job || !p_job->get_tile_count())
+			return p_job;
+
+		// tiles which already have all samples from the checkpoint
+		std::vector<int> done_tiles;
+
+		{
+			std::lock_guard<std::mutex> lock(this->m_mutex);
+
+			auto job_order = this->m_submitted_job_count++;
+
+			for (int tile_index = 0; tile_index < p_job->get_tile_count();
+				 ++tile_index)
+			{
+				if (p_job->is_tile_done(tile_index))
+				{
+					done_tiles.push_back(tile_index);
+				}
+				else
+				{
+					this->m_queue.push(
+						work_item_t(p_job, job_order, tile_index, 0));
+				}
+			}
+
+			++this->m_active_job_count;
+		}
+
+		this->m_writer.begin();
+		this->m_has_work.notify_all();
+
+		for (auto tile_index : done_tiles)
+		{
+			p_job->mark_started();
+			p_job->render_tile_features(tile_index);
+
+			auto* p_output = new output_tile_t(p_job, tile_index);
+			p_job->get_tile_colors(tile_index, p_output->m_colors.data());
+
+			this->complete_tile(p_output);
+		}
+
+		return p_job;
+	}
+
+	// blocks until all submitted jobs are rendered and written
+	void wait()
+	{
+		{
+			std::unique_lock<std::mutex> lock(this->m_mutex);
+			this->m_is_idle.wait(
+				lock, [this] { return !this->m_active_job_count; });
+		}
+
+		this->m_writer.wait();
+	}
+
+	int get_thread_count() const
+	{
+		return static_cast<int>(this->m_threads.size());
+	}
+
+private:
+	struct work_item_t
+	{
+		work_item_t() : m_job_order{}, m_tile_index{}, m_pass{} {}
+		work_item_t(const std::shared_ptr<render_job_t>& p_job,
+			std::uint64_t job_order, int tile_index, int pass) :
+			m_p_job{p_job},
+			m_job_order{job_order}, m_tile_index{tile_index}, m_pass{pass}
+		{
+		}
+
+		// std::priority_queue pops the "biggest" item first
+		bool operator<(const work_item_t& item) const
+		{
+			if (this->m_p_job->get_priority() != item.m_p_job->get_priority())
+				return this->m_p_job->get_priority() <
+					item.m_p_job->get_priority();
+
+			if (this->m_job_order != item.m_job_order)
+				return this->m_job_order > item.m_job_order;
+
+			// the whole image gets the pass before the next one starts
+			if (this->m_pass != item.m_pass)
+				return this->m_pass > item.m_pass;
+
+			return this->m_tile_index > item.m_tile_index;
+		}
+
+		std::shared_ptr<render_job_t> m_p_job;
+		std::uint64_t m_job_order;
+		int m_tile_index;
+		int m_pass;
+	};
+
+	void worker(int thread_index)
+	{
+		trace_get().set_thread_name("render " + std::to_string(thread_index));
+
+		if (this->m_is_pin_threads && !render_pin_thread(thread_index))
+		{
+			std::cout << "failed to pin render thread " << thread_index
+					  << std::endl;
+		}
+
+		while (true)
+		{
+			work_item_t item;
+
+			{
+				std::unique_lock<std::mutex> lock(this->m_mutex);
+				this->m_has_work.wait(lock, [this] {
+					return !this->m_is_running || !this->m_queue.empty();
+				});
+
+				if (this->m_queue.empty())
+					return;
+
+				item = this->m_queue.top();
+				this->m_queue.pop();
+			}
+
+			auto& job = *item.m_p_job;
+
+			// the coarse image goes first, so there is a whole frame however
+			// short the budget is
+			if (job.is_progressive() && !item.m_pass)
+			{
+				job.render_tile_features(item.m_tile_index);
+				job.render_tile_preview(item.m_tile_index);
+
+				{
+					std::lock_guard<std::mutex> lock(this->m_mutex);
+					++item.m_pass;
+					this->m_queue.push(item);
+				}
+
+				this->m_has_work.notify_one();
+				continue;
+			}
+
+			if (job.is_over_budget())
+			{
+				auto* p_output =
+					new output_tile_t(item.m_p_job, item.m_tile_index);
+				job.get_tile_colors(
+					item.m_tile_index, p_output->m_colors.data());
+
+				this->complete_tile(p_output);
+				continue;
+			}
+
+			auto sample_from = job.get_tile_sample(item.m_tile_index);
+			auto sample_to = job.get_tile_pass_end(item.m_tile_index);
+
+			auto* p_output = new output_tile_t(item.m_p_job, item.m_tile_index);
+
+			if (!item.m_pass)
+				job.render_tile_features(item.m_tile_index);
+
+			job.render_tile(item.m_tile_index, sample_from, sample_to,
+				p_output->m_colors.data());
+
+			if (job.is_accumulating())
+			{
+				if (!job.accumulate_tile(item.m_tile_index,
+						p_output->m_colors.data(), sample_to - sample_from))
+				{
+					delete p_output;
+
+					{
+						std::lock_guard<std::mutex> lock(this->m_mutex);
+						++item.m_pass;
+						this->m_queue.push(item);
+					}
+
+					this->m_has_work.notify_one();
+
+					if (job.is_checkpoint_due())
+					{
+						this->m_writer.push(new output_tile_t(item.m_p_job,
+							job.get_accumulation_snapshot()));
+					}
+
+					continue;
+				}
+
+				job.get_tile_colors(
+					item.m_tile_index, p_output->m_colors.data());
+			}
+
+			this->complete_tile(p_output);
+		}
+	}
+
+	// tile has all its samples, the last tile of the job also saves the
+	// final checkpoint before its output, so wait() returns after both
+	void complete_tile(output_tile_t* p_output)
+	{
+		auto p_job = p_output->m_p_job;
+		auto is_last_tile = p_job->finish_tile();
+
+		if (!p_job->get_settings().m_checkpoint_file_name.empty() &&
+			(is_last_tile || p_job->is_checkpoint_due()))
+		{
+			this->m_writer.push(
+				new output_tile_t(p_job, p_job->get_accumulation_snapshot()));
+		}
+
+		this->m_writer.push(p_output);
+
+		if (is_last_tile)
+		{
+			{
+				std::lock_guard<std::mutex> lock(this->m_mutex);
+				--this->m_active_job_count;
+			}
+
+			this->m_is_idle.notify_all();
+		}
+	}
+
+private:
+	bool m_is_running;
+	bool m_is_pin_threads;
+	int m_active_job_count;
+	std::uint64_t m_submitted_job_count;
+	std::mutex m_mutex;
+	std::condition_variable m_has_work;
+	std::condition_variable m_is_idle;
+	std::priority_queue<work_item_t> m_queue;
+	std::vector<std::thread> m_threads;
+	image_writer_t m_writer;
+};
+
+/* distributed */
+
+// sockets are POSIX only for now, on windows everything is rendered by
+// render_scheduler_t of the process
+#ifndef _WIN32
+
+enum class eNetMessageType : std::uint32_t
+{
+	// coordinator -> worker: settings, camera and entities of the job
+	kNetMessageType_Scene,
+	// coordinator -> worker: tile and sample range to render
+	kNetMessageType_Unit,
+	// worker -> coordinator: the unit and float sums of its samples
+	kNetMessageType_Result,
+	// coordinator -> worker: exit
+	kNetMessageType_Quit,
+	// client -> render_server_t: render_request_t
+	kNetMessageType_RenderRequest,
+	// render_server_t -> client: status, width, height and RGB8 pixels
+	kNetMessageType_RenderResponse,
+
+	kNetMessageType_Unknown = 0xffffffff
+};
+
+/// @brief typed payload which is sent with its type and size in front of it.
+/// Values are stored in the host byte order, coordinator and workers are the
+/// same executable on machines of the same architecture
+class net_message_t
+{
+public:
+	net_message_t() :
+		m_type{eNetMessageType::kNetMessageType_Unknown}, m_read_offset{}
+	{
+	}
+	net_message_t(eNetMessageType type) : m_type{type}, m_read_offset{} {}
+	~net_message_t() {}
+
+	eNetMessageType get_type() const { return this->m_type; }
+	void set_type(eNetMessageType type) { this->m_type = type; }
+
+	std::vector<std::uint8_t>& get_data() { return this->m_data; }
+	const std::vector<std::uint8_t>& get_data() const { return this->m_data; }
+
+	template <typename T>
+	void write(const T& value)
+	{
+		static_assert(std::is_trivially_copyable_v<T>);
+		this->write(&value, sizeof(T));
+	}
+
+	void write(const void* p_data, std::size_t size)
+	{
+		const auto* p_bytes = static_cast<const std::uint8_t*>(p_data);
+		this->m_data.insert(this->m_data.end(), p_bytes, p_bytes + size);
+	}
+
+	template <typename T>
+	bool read(T& value)
+	{
+		static_assert(std::is_trivially_copyable_v<T>);
+		return this->read(&value, sizeof(T));
+	}
+
+	bool read(void* p_data, std::size_t size)
+	{
+		if (this->m_data.size() - this->m_read_offset < size)
+			return false;
+
+		std::copy(this->m_data.begin() + this->m_read_offset,
+			this->m_data.begin() + this->m_read_offset + size,
+			static_cast<std::uint8_t*>(p_data));
+		this->m_read_offset += size;
+
+		return true;
+	}
+
+private:
+	eNetMessageType m_type;
+	std::size_t m_read_offset;
+	std::vector<std::uint8_t> m_data;
+};
+
+/// @brief blocking stream socket. Addresses are "unix:/path/to/socket" for
+/// local workers and "host:port" for TCP
+class net_socket_t
+{
+public:
+	net_socket_t() : m_handle{-1} {}
+	net_socket_t(int handle) : m_handle{handle} {}
+	net_socket_t(net_socket_t&& socket) noexcept :
+		m_handle{socket.m_handle}, m_unix_path{std::move(socket.m_unix_path)}
+	{
+		socket.m_handle = -1;
+		socket.m_unix_path.clear();
+	}
+	net_socket_t(const net_socket_t&) = delete;
+	~net_socket_t() { this->close(); }
+
+	net_socket_t& operator=(net_socket_t&& socket) noexcept
+	{
+		if (this != &socket)
+		{
+			this->close();
+			this->m_handle = socket.m_handle;
+			this->m_unix_path = std::move(socket.m_unix_path);
+			socket.m_handle = -1;
+			socket.m_unix_path.clear();
+		}
+
+		return *this;
+	}
+	net_socket_t& operator=(const net_socket_t&) = delete;
+
+	bool is_valid() const { return this->m_handle >= 0; }
+	int get_handle() const { return this->m_handle; }
+
+	// wakes up a thread blocked in receive() on this socket
+	void shutdown()
+	{
+		if (this->m_handle >= 0)
+			::shutdown(this->m_handle, SHUT_RDWR);
+	}
+
+	void close()
+	{
+		if (this->m_handle >= 0)
+		{
+			::close(this->m_handle);
+			this->m_handle = -1;
+		}
+
+		// listener owns its socket file
+		if (!this->m_unix_path.empty())
+		{
+			::unlink(this->m_unix_path.c_str());
+			this->m_unix_path.clear();
+		}
+	}
+
+	bool listen(const std::string& address)
+	{
+		this->close();
+
+		if (address.rfind(kUnixPrefix, 0) == 0)
+		{
+			sockaddr_un unix_address{};
+			if (!this->make_unix_address(address, unix_address))
+				return false;
+
+			::unlink(unix_address.sun_path);
+
+			this->m_handle = ::socket(AF_UNIX, SOCK_STREAM, 0);
+
+			if (this->m_handle < 0 ||
+				::bind(this->m_handle,
+					reinterpret_cast<const sockaddr*>(&unix_address),
+					sizeof(unix_address)) < 0 ||
+				::listen(this->m_handle, kBacklog) < 0)
+			{
+				std::cout << "failed to listen on " << address << std::endl;
+				this->close();
+				return false;
+			}
+
+			this->m_unix_path = unix_address.sun_path;
+
+			return true;
+		}
+
+		auto* p_addresses = this->resolve(address, true);
+
+		if (!p_addresses)
+			return false;
+
+		for (auto* p_address = p_addresses; p_address;
+			 p_address = p_address->ai_next)
+		{
+			this->m_handle = ::socket(p_address->ai_family,
+				p_address->ai_socktype, p_address->ai_protocol);
+
+			if (this->m_handle < 0)
+				continue;
+
+			int is_reuse = 1;
+			::setsockopt(this->m_handle, SOL_SOCKET, SO_REUSEADDR, &is_reuse,
+				sizeof(is_reuse));
+
+			if (::bind(this->m_handle, p_address->ai_addr,
+					p_address->ai_addrlen) == 0 &&
+				::listen(this->m_handle, kBacklog) == 0)
+			{
+				break;
+			}
+
+			this->close();
+		}
+
+		::freeaddrinfo(p_addresses);
+
+		if (!this->is_valid())
+			std::cout << "failed to listen on " << address << std::endl;
+
+		return this->is_valid();
+	}
+
+	bool connect(const std::string& address)
+	{
+		this->close();
+
+		if (address.rfind(kUnixPrefix, 0) == 0)
+		{
+			sockaddr_un unix_address{};
+			if (!this->make_unix_address(address, unix_address))
+				return false;
+
+			this->m_handle = ::socket(AF_UNIX, SOCK_STREAM, 0);
+
+			if (this->m_handle < 0 ||
+				::connect(this->m_handle,
+					reinterpret_cast<const sockaddr*>(&unix_address),
+					sizeof(unix_address)) < 0)
+			{
+				this->close();
+				return false;
+			}
+
+			return true;
+		}
+
+		auto* p_addresses = this->resolve(address, false);
+
+		if (!p_addresses)
+			return false;
+
+		for (auto* p_address = p_addresses; p_address;
+			 p_address = p_address->ai_next)
+		{
+			this->m_handle = ::socket(p_address->ai_family,
+				p_address->ai_socktype, p_address->ai_protocol);
+
+			if (this->m_handle < 0)
+				continue;
+
+			if (::connect(this->m_handle, p_address->ai_addr,
+					p_address->ai_addrlen) == 0)
+			{
+				// units and results are small and latency bound
+				int is_no_delay = 1;
+				::setsockopt(this->m_handle, IPPROTO_TCP, TCP_NODELAY,
+					&is_no_delay, sizeof(is_no_delay));
+				break;
+			}
+
+			this->close();
+		}
+
+		::freeaddrinfo(p_addresses);
+
+		return this->is_valid();
+	}
+
+	net_socket_t accept()
+	{
+		auto handle = ::accept(this->m_handle, nullptr, nullptr);
+
+		if (handle >= 0)
+		{
+			int is_no_delay = 1;
+			// fails harmlessly for unix sockets
+			::setsockopt(handle, IPPROTO_TCP, TCP_NODELAY, &is_no_delay,
+				sizeof(is_no_delay));
+		}
+
+		return net_socket_t(handle);
+	}
+
+	// receive() fails if a message doesn't arrive in time, so a hung peer
+	// can't block us forever in the middle of a message
+	void set_receive_timeout(double seconds)
+	{
+		timeval timeout{};
+		timeout.tv_sec = static_cast<time_t>(seconds);
+		timeout.tv_usec = static_cast<suseconds_t>(
+			(seconds - double(timeout.tv_sec)) * 1e6);
+
+		::setsockopt(this->m_handle, SOL_SOCKET, SO_RCVTIMEO, &timeout,
+			sizeof(timeout));
+	}
+
+	bool send(const net_message_t& message)
+	{
+		header_t header{};
+		header.m_type = static_cast<std::uint32_t>(message.get_type());
+		header.m_size = static_cast<std::uint32_t>(message.get_data().size());
+
+		return this->send_all(&header, sizeof(header)) &&
+			this->send_all(message.get_data().data(), message.get_data().size());
+	}
+
+	bool receive(net_message_t& message)
+	{
+		header_t header{};
+
+		if (!this->receive_all(&header, sizeof(header)) ||
+			header.m_size > kMaxMessageSize)
+		{
+			return false;
+		}
+
+		message = net_message_t(static_cast<eNetMessageType>(header.m_type));
+		message.get_data().resize(header.m_size);
+
+		return this->receive_all(message.get_data().data(), header.m_size);
+	}
+
+private:
+	struct header_t
+	{
+		std::uint32_t m_type;
+		std::uint32_t m_size;
+	};
+
+	bool make_unix_address(const std::string& address, sockaddr_un& result)
+	{
+		auto path = address.substr(std::strlen(kUnixPrefix));
+
+		if (path.empty() || path.size() >= sizeof(result.sun_path))
+		{
+			std::cout << "invalid unix socket path " << path << std::endl;
+			return false;
+		}
+
+		result.sun_family = AF_UNIX;
+		std::copy(path.begin(), path.end(), result.sun_path);
+
+		return true;
+	}
+
+	// "host:port", the host can be empty for listening on all interfaces
+	addrinfo* resolve(const std::string& address, bool is_passive)
+	{
+		auto separator = address.rfind(':');
+
+		if (separator == std::string::npos)
+		{
+			std::cout << "address " << address << " has no port" << std::endl;
+			return nullptr;
+		}
+
+		auto host = address.substr(0, separator);
+		auto port = address.substr(separator + 1);
+
+		addrinfo hints{};
+		hints.ai_family = AF_UNSPEC;
+		hints.ai_socktype = SOCK_STREAM;
+		hints.ai_flags = is_passive ? AI_PASSIVE : 0;
+
+		addrinfo* p_result{};
+
+		if (::getaddrinfo(host.empty() ? nullptr : host.c_str(), port.c_str(),
+				&hints, &p_result) != 0)
+		{
+			std::cout << "failed to resolve " << address << std::endl;
+			return nullptr;
+		}
+
+		return p_result;
+	}
+
+	bool send_all(const void* p_data, std::size_t size)
+	{
+		const auto* p_bytes = static_cast<const std::uint8_t*>(p_data);
+
+		while (size)
+		{
+			// dead peer must not kill us with SIGPIPE
+			auto sent = ::send(this->m_handle, p_bytes, size, MSG_NOSIGNAL);
+
+			if (sent < 0 && errno == EINTR)
+				continue;
+
+			if (sent <= 0)
+				return false;
+
+			p_bytes += sent;
+			size -= static_cast<std::size_t>(sent);
+		}
+
+		return true;
+	}
+
+	bool receive_all(void* p_data, std::size_t size)
+	{
+		auto* p_bytes = static_cast<std::uint8_t*>(p_data);
+
+		while (size)
+		{
+			auto received = ::recv(this->m_handle, p_bytes, size, 0);
+
+			if (received < 0 && errno == EINTR)
+				continue;
+
+			if (received <= 0)
+				return false;
+
+			p_bytes += received;
+			size -= static_cast<std::size_t>(received);
+		}
+
+		return true;
+	}
+
+private:
+	static constexpr const char* kUnixPrefix = "unix:";
+	static constexpr int kBacklog = 64;
+	static constexpr std::uint32_t kMaxMessageSize = 1u << 30;
+
+	int m_handle;
+	std::string m_unix_path;
+};
+
+// what a worker needs to render any tile of the job exactly like the
+// coordinator would: settings which affect samples, camera and live entities
+void net_write_scene(net_message_t& message, const render_job_t& job)
+{
+	const auto& settings = job.get_settings();
+
+	message.write(settings.m_width);
+	message.write(settings.m_height);
+	message.write(settings.m_samples_per_pixel);
+	message.write(settings.m_depth_count);
+	message.write(settings.m_tile_size);
+	message.write(settings.m_seed);
+	message.write(settings.m_mode);
+	message.write(settings.m_traversal_order);
+	message.write(settings.m_is_rasterize_primary);
+
+	// workers need the same tiles
+	for (const auto* p_rect : {&settings.m_crop, &settings.m_priority_region})
+	{
+		message.write(p_rect->m_x);
+		message.write(p_rect->m_y);
+		message.write(p_rect->m_width);
+		message.write(p_rect->m_height);
+	}
+
+	const auto& camera = job.get_camera();
+
+	message.write(camera.get_origin());
+	message.write(camera.get_lower_left_corner());
+	message.write(camera.get_horizontal());
+	message.write(camera.get_vertical());
+
+	const auto& world = job.get_world();
+	std::vector<int> slots;
+
+	message.write(world.get_accelerator());
+
+	for (int slot = 0; slot < world.get_slot_count(); ++slot)
+	{
+		if (world.get_type(slot) == eEntityType::kEntityType_Sphere)
+			slots.push_back(slot);
+	}
+
+	message.write(static_cast<std::uint32_t>(slots.size()));
+
+	for (auto slot : slots)
+	{
+		auto entity = world.get_entity(slot);
+		const auto& sphere_data = entity.get_sphere_data();
+		const auto& material = sphere_data.get_material();
+
+		message.write(sphere_data.is_draw_normal_map());
+		message.write(sphere_data.get_radius());
+		message.write(sphere_data.get_position());
+		message.write(sphere_data.get_color());
+		message.write(material.get_material_type());
+		message.write(material.get_refraction_index());
+		message.write(material.get_fuzz());
+		message.write(material.get_albedo());
+	}
+
+	// workers map the same scene file, so it must be on a shared path
+	const auto& p_mapped_scene = world.get_mapped_scene();
+	std::string mapped_scene_file_name;
+	std::uint64_t resident_budget{};
+
+	if (p_mapped_scene)
+	{
+		mapped_scene_file_name = p_mapped_scene->get_file_name();
+		resident_budget = p_mapped_scene->get_resident_budget();
+	}
+
+	message.write(static_cast<std::uint32_t>(mapped_scene_file_name.size()));
+	message.write(
+		mapped_scene_file_name.data(), mapped_scene_file_name.size());
+	message.write(resident_budget);
+}
+
+bool net_read_scene(net_message_t& message, world_t& world, camera_t& camera,
+	render_settings_t& settings)
+{
+	settings = render_settings_t();
+
+	bool result = message.read(settings.m_width) &&
+		message.read(settings.m_height) &&
+		message.read(settings.m_samples_per_pixel) &&
+		message.read(settings.m_depth_count) &&
+		message.read(settings.m_tile_size) && message.read(settings.m_seed) &&
+		message.read(settings.m_mode) &&
+		message.read(settings.m_traversal_order) &&
+		message.read(settings.m_is_rasterize_primary);
+
+	for (auto* p_rect : {&settings.m_crop, &settings.m_priority_region})
+	{
+		result = result && message.read(p_rect->m_x) &&
+			message.read(p_rect->m_y) && message.read(p_rect->m_width) &&
+			message.read(p_rect->m_height);
+	}
+
+	glm::dvec3 origin, lower_left_corner, horizontal, vertical;
+
+	result = result && message.read(origin) &&
+		message.read(lower_left_corner) && message.read(horizontal) &&
+		message.read(vertical);
+
+	camera.set_origin(origin);
+	camera.set_lower_left_corner(lower_left_corner);
+	camera.set_horizontal(horizontal);
+	camera.set_vertical(vertical);
+
+	auto accelerator = eAccelerator::kAccelerator_Unknown;
+	std::uint32_t entity_count{};
+
+	result = result && message.read(accelerator) &&
+		accelerator >= eAccelerator::kAccelerator_Linear &&
+		accelerator <= eAccelerator::kAccelerator_BVH &&
+		message.read(entity_count);
+
+	world.clear();
+
+	if (result)
+		world.set_accelerator(accelerator);
+
+	for (std::uint32_t i = 0; result && i < entity_count; ++i)
+	{
+		bool is_draw_normal_map{};
+		double radius{}, refraction_index{}, fuzz{};
+		glm::dvec3 position, color, albedo;
+		eMaterialType material_type{};
+
+		result = message.read(is_draw_normal_map) && message.read(radius) &&
+			message.read(position) && message.read(color) &&
+			message.read(material_type) && message.read(refraction_index) &&
+			message.read(fuzz) && message.read(albedo);
+
+		if (result)
+		{
+			world.add(entity_t(eEntityType::kEntityType_Sphere,
+				sphere_data_t(is_draw_normal_map, radius, position, color,
+					material_t(material_type, refraction_index, fuzz,
+						albedo))));
+		}
+	}
+
+	world.commit();
+
+	static constexpr std::uint32_t kMaxFileNameSize = 4096;
+
+	std::uint32_t mapped_scene_file_name_size{};
+	std::uint64_t resident_budget{};
+
+	result = result && message.read(mapped_scene_file_name_size) &&
+		mapped_scene_file_name_size <= kMaxFileNameSize;
+
+	std::string mapped_scene_file_name(mapped_scene_file_name_size, '\0');
+
+	result = result &&
+		message.read(
+			mapped_scene_file_name.data(), mapped_scene_file_name_size) &&
+		message.read(resident_budget);
+
+	if (result && !mapped_scene_file_name.empty())
+	{
+		auto p_mapped_scene = std::make_shared<mapped_scene_t>();
+
+		result = p_mapped_scene->open(mapped_scene_file_name.c_str(),
+			static_cast<std::size_t>(resident_budget));
+
+		world.set_mapped_scene(p_mapped_scene);
+	}
+
+	return result && settings.m_width > 0 && settings.m_height > 0;
+}
+
+/// @brief renders work units of render_coordinator_t. Every thread has its own
+/// connection and looks like a separate worker to the coordinator, so one
+/// worker process uses all cores of its machine
+class render_worker_t
+{
+public:
+	render_worker_t() {}
+	~render_worker_t() {}
+
+	// returns when the coordinator says quit or goes away, with
+	// is_pin_threads the i-th connection is rendered on the i-th core only
+	void run(
+		const std::string& address, int thread_count, bool is_pin_threads)
+	{
+		std::vector<std::thread> threads;
+
+		for (int i = 0; i < (std::max)(1, thread_count); ++i)
+		{
+			threads.emplace_back([this, &address, i, is_pin_threads]() {
+				if (is_pin_threads)
+					render_pin_thread(i);
+
+				this->run_connection(address);
+			});
+		}
+
+		for (auto& thread : threads)
+			thread.join();
+	}
+
+private:
+	void run_connection(const std::string& address)
+	{
+		net_socket_t socket;
+
+		// the coordinator may not listen yet when we are started together
+		for (int attempt = 0; attempt < kConnectAttemptCount; ++attempt)
+		{
+			if (socket.connect(address))
+				break;
+
+			std::this_thread::sleep_for(std::chrono::milliseconds(100));
+		}
+
+		if (!socket.is_valid())
+		{
+			std::cout << "worker failed to connect to " << address
+					  << std::endl;
+			return;
+		}
+
+		std::unique_ptr<render_job_t> p_job;
+		std::vector<glm::dvec3> colors;
+		net_message_t message;
+
+		while (socket.receive(message))
+		{
+			switch (message.get_type())
+			{
+			case eNetMessageType::kNetMessageType_Scene:
+			{
+				trace_span_t span("load scene", "scene");
+
+				world_t world;
+				camera_t camera;
+				render_settings_t settings;
+
+				if (!net_read_scene(message, world, camera, settings))
+					return;
+
+				p_job =
+					std::make_unique<render_job_t>(world, camera, settings, "");
+				break;
+			}
+			case eNetMessageType::kNetMessageType_Unit:
+			{
+				std::int32_t tile_index{}, sample_from{}, sample_to{};
+
+				if (!p_job || !message.read(tile_index) ||
+					!message.read(sample_from) || !message.read(sample_to) ||
+					tile_index < 0 || tile_index >= p_job->get_tile_count())
+				{
+					return;
+				}
+
+				const auto& tile = p_job->get_tile(tile_index);
+				colors.resize(
+					static_cast<std::size_t>(tile.m_width) * tile.m_height);
+
+				p_job->render_tile(
+					tile_index, sample_from, sample_to, colors.data());
+
+				net_message_t result(eNetMessageType::kNetMessageType_Result);
+				result.write(tile_index);
+				result.write(sample_from);
+				result.write(sample_to);
+
+				for (const auto& color : colors)
+				{
+					result.write(static_cast<float>(color.x));
+					result.write(static_cast<float>(color.y));
+					result.write(static_cast<float>(color.z));
+				}
+
+				if (!socket.send(result))
+					return;
+
+				break;
+			}
+			default:
+			{
+				return;
+			}
+			}
+		}
+	}
+
+private:
+	static constexpr int kConnectAttemptCount = 50;
+};
+
+/// @brief splits a job into work units (a tile and a range of its samples)
+/// and hands them to connected worker processes, results are merged exactly
+/// like passes rendered by render_scheduler_t and written by its own
+/// image_writer_t. Every sample is seeded from its pixel and index and colors
+/// travel as floats both from workers and from the coordinator itself, so the
+/// image doesn't depend on who rendered what. A worker which disconnects or
+/// doesn't answer in time loses its units to the others, without any workers
+/// the coordinator renders units itself. Workers may join at any moment
+class render_coordinator_t
+{
+public:
+	render_coordinator_t() : m_remaining_tile_count{}, m_unit_timeout{60.0} {}
+	~render_coordinator_t() { this->stop(); }
+
+	bool listen(const std::string& address)
+	{
+		if (!this->m_listener.listen(address))
+			return false;
+
+		this->m_writer.start();
+
+		return true;
+	}
+
+	// seconds a worker has to return a unit before it is dropped
+	void set_unit_timeout(double seconds) { this->m_unit_timeout = seconds; }
+
+	int get_worker_count() const
+	{
+		return static_cast<int>(this->m_workers.size());
+	}
+
+	// blocks until the job is rendered and written
+	void render(const std::shared_ptr<render_job_t>& p_job)
+	{
+		if (!p_job || !p_job->get_tile_count())
+			return;
+
+		p_job->mark_started();
+		this->m_writer.begin();
+
+		this->m_p_job = p_job;
+		this->m_remaining_tile_count = 0;
+		this->m_pending.clear();
+
+		for (int tile_index = 0; tile_index < p_job->get_tile_count();
+			 ++tile_index)
+		{
+			if (p_job->is_tile_done(tile_index))
+			{
+				p_job->render_tile_features(tile_index);
+
+				auto* p_output = new output_tile_t(p_job, tile_index);
+				p_job->get_tile_colors(tile_index, p_output->m_colors.data());
+
+				this->complete_tile(p_output);
+			}
+			else
+			{
+				this->m_pending.push_back(this->make_unit(tile_index));
+				++this->m_remaining_tile_count;
+			}
+		}
+
+		while (this->m_remaining_tile_count)
+		{
+			this->dispatch();
+
+			if (this->m_workers.empty())
+			{
+				this->render_locally();
+				this->accept_workers(0);
+				continue;
+			}
+
+			this->poll_workers();
+			this->drop_late_workers();
+		}
+
+		// the next job can get the same address, so its scene is sent anyway
+		for (auto& worker : this->m_workers)
+			worker.m_p_scene_job = nullptr;
+
+		this->m_p_job.reset();
+		this->m_writer.wait();
+	}
+
+	// tells workers to exit
+	void stop()
+	{
+		for (auto& worker : this->m_workers)
+			worker.m_socket.send(
+				net_message_t(eNetMessageType::kNetMessageType_Quit));
+
+		this->m_workers.clear();
+		this->m_listener.close();
+		this->m_writer.stop();
+	}
+
+private:
+	struct unit_t
+	{
+		unit_t() : m_tile_index{}, m_sample_from{}, m_sample_to{} {}
+
+		std::int32_t m_tile_index;
+		std::int32_t m_sample_from;
+		std::int32_t m_sample_to;
+		std::chrono::steady_clock::time_point m_sent_time;
+	};
+
+	struct worker_t
+	{
+		worker_t() : m_p_scene_job{} {}
+		worker_t(net_socket_t&& socket) :
+			m_socket{std::move(socket)}, m_p_scene_job{}
+		{
+		}
+
+		net_socket_t m_socket;
+		// units in the order they were sent, workers answer in that order
+		std::deque<unit_t> m_units;
+		// the job whose scene the worker has
+		const render_job_t* m_p_scene_job;
+	};
+
+	unit_t make_unit(int tile_index) const
+	{
+		unit_t result;
+		result.m_tile_index = tile_index;
+		result.m_sample_from = this->m_p_job->get_tile_sample(tile_index);
+		result.m_sample_to = this->m_p_job->get_tile_pass_end(tile_index);
+
+		return result;
+	}
+
+	void accept_workers(int timeout_ms)
+	{
+		pollfd listener{this->m_listener.get_handle(), POLLIN, 0};
+
+		while (::poll(&listener, 1, timeout_ms) > 0 &&
+			(listener.revents & POLLIN))
+		{
+			auto socket = this->m_listener.accept();
+
+			if (!socket.is_valid())
+				break;
+
+			socket.set_receive_timeout(this->m_unit_timeout);
+			this->m_workers.emplace_back(std::move(socket));
+
+			timeout_ms = 0;
+		}
+	}
+
+	// keeps kUnitsPerWorker units in flight on every worker, so it doesn't
+	// wait for the round trip between units
+	void dispatch()
+	{
+		for (std::size_t i = 0; i < this->m_workers.size();)
+		{
+			auto& worker = this->m_workers[i];
+			bool is_alive{true};
+
+			while (is_alive && !this->m_pending.empty() &&
+				worker.m_units.size() < kUnitsPerWorker)
+			{
+				if (worker.m_p_scene_job != this->m_p_job.get())
+				{
+					net_message_t scene(eNetMessageType::kNetMessageType_Scene);
+					net_write_scene(scene, *this->m_p_job);
+
+					is_alive = worker.m_socket.send(scene);
+					worker.m_p_scene_job = this->m_p_job.get();
+				}
+
+				auto unit = this->m_pending.front();
+				this->m_pending.pop_front();
+
+				net_message_t message(eNetMessageType::kNetMessageType_Unit);
+				message.write(unit.m_tile_index);
+				message.write(unit.m_sample_from);
+				message.write(unit.m_sample_to);
+
+				unit.m_sent_time = std::chrono::steady_clock::now();
+				worker.m_units.push_back(unit);
+
+				is_alive = is_alive && worker.m_socket.send(message);
+			}
+
+			if (is_alive)
+				++i;
+			else
+				this->drop_worker(i);
+		}
+	}
+
+	void poll_workers()
+	{
+		std::vector<pollfd> handles;
+		handles.push_back({this->m_listener.get_handle(), POLLIN, 0});
+
+		for (const auto& worker : this->m_workers)
+			handles.push_back({worker.m_socket.get_handle(), POLLIN, 0});
+
+		if (::poll(handles.data(), handles.size(), kPollTimeout) <= 0)
+			return;
+
+		// from the back, so dropping doesn't shift workers we didn't visit
+		for (auto i = this->m_workers.size(); i-- > 0;)
+		{
+			if (!handles[i + 1].revents)
+				continue;
+
+			auto& worker = this->m_workers[i];
+			net_message_t message;
+
+			if (!worker.m_socket.receive(message) ||
+				message.get_type() != eNetMessageType::kNetMessageType_Result ||
+				worker.m_units.empty())
+			{
+				this->drop_worker(i);
+				continue;
+			}
+
+			auto unit = worker.m_units.front();
+			std::int32_t tile_index{}, sample_from{}, sample_to{};
+
+			const auto& tile = this->m_p_job->get_tile(unit.m_tile_index);
+			std::vector<float> colors(
+				static_cast<std::size_t>(tile.m_width) * tile.m_height * 3);
+
+			if (!message.read(tile_index) || !message.read(sample_from) ||
+				!message.read(sample_to) || tile_index != unit.m_tile_index ||
+				sample_from != unit.m_sample_from ||
+				sample_to != unit.m_sample_to ||
+				!message.read(colors.data(), colors.size() * sizeof(float)))
+			{
+				this->drop_worker(i);
+				continue;
+			}
+
+			worker.m_units.pop_front();
+			this->merge_unit(unit, colors.data());
+		}
+
+		if (handles[0].revents & POLLIN)
+			this->accept_workers(0);
+	}
+
+	void drop_late_workers()
+	{
+		auto now = std::chrono::steady_clock::now();
+
+		for (auto i = this->m_workers.size(); i-- > 0;)
+		{
+			const auto& units = this->m_workers[i].m_units;
+
+			if (!units.empty() &&
+				std::chrono::duration<double>(now - units.front().m_sent_time)
+						.count() > this->m_unit_timeout)
+			{
+				this->drop_worker(i);
+			}
+		}
+	}
+
+	// units of the worker go back to the front of the queue
+	void drop_worker(std::size_t index)
+	{
+		auto& units = this->m_workers[index].m_units;
+
+		std::cout << "worker dropped, " << units.size()
+				  << " units are rendered again" << std::endl;
+
+		this->m_pending.insert(
+			this->m_pending.begin(), units.begin(), units.end());
+
+		this->m_workers.erase(this->m_workers.begin() + index);
+	}
+
+	void render_locally()
+	{
+		if (this->m_pending.empty())
+			return;
+
+		auto unit = this->m_pending.front();
+		this->m_pending.pop_front();
+
+		const auto& tile = this->m_p_job->get_tile(unit.m_tile_index);
+		std::vector<glm::dvec3> colors(
+			static_cast<std::size_t>(tile.m_width) * tile.m_height);
+
+		this->m_p_job->render_tile(unit.m_tile_index, unit.m_sample_from,
+			unit.m_sample_to, colors.data());
+
+		std::vector<float> float_colors;
+		float_colors.reserve(colors.size() * 3);
+
+		for (const auto& color : colors)
+		{
+			float_colors.push_back(static_cast<float>(color.x));
+			float_colors.push_back(static_cast<float>(color.y));
+			float_colors.push_back(static_cast<float>(color.z));
+		}
+
+		this->merge_unit(unit, float_colors.data());
+	}
+
+	// the same steps as render_scheduler_t::worker does after render_tile
+	void merge_unit(const unit_t& unit, const float* p_colors)
+	{
+		auto& job = *this->m_p_job;
+		auto* p_output = new output_tile_t(this->m_p_job, unit.m_tile_index);
+
+		for (auto& color : p_output->m_colors)
+		{
+			color = glm::dvec3(p_colors[0], p_colors[1], p_colors[2]);
+			p_colors += 3;
+		}
+
+		if (job.is_accumulating())
+		{
+			if (!job.accumulate_tile(unit.m_tile_index,
+					p_output->m_colors.data(),
+					unit.m_sample_to - unit.m_sample_from))
+			{
+				delete p_output;
+
+				this->m_pending.push_back(this->make_unit(unit.m_tile_index));
+
+				if (job.is_checkpoint_due())
+				{
+					this->m_writer.push(new output_tile_t(
+						this->m_p_job, job.get_accumulation_snapshot()));
+				}
+
+				return;
+			}
+
+			job.get_tile_colors(unit.m_tile_index, p_output->m_colors.data());
+		}
+
+		job.render_tile_features(unit.m_tile_index);
+
+		this->complete_tile(p_output);
+		--this->m_remaining_tile_count;
+	}
+
+	void complete_tile(output_tile_t* p_output)
+	{
+		auto p_job = p_output->m_p_job;
+		auto is_last_tile = p_job->finish_tile();
+
+		if (!p_job->get_settings().m_checkpoint_file_name.empty() &&
+			(is_last_tile || p_job->is_checkpoint_due()))
+		{
+			this->m_writer.push(
+				new output_tile_t(p_job, p_job->get_accumulation_snapshot()));
+		}
+
+		this->m_writer.push(p_output);
+	}
+
+private:
+	static constexpr std::size_t kUnitsPerWorker = 2;
+	// milliseconds
+	static constexpr int kPollTimeout = 100;
+
+	int m_remaining_tile_count;
+	double m_unit_timeout;
+	std::shared_ptr<render_job_t> m_p_job;
+	std::deque<unit_t> m_pending;
+	std::vector<worker_t> m_workers;
+	net_socket_t m_listener;
+	image_writer_t m_writer;
+};
+
+// starts this executable as a worker process, see main()
+bool render_spawn_local_worker(
+	const std::string& address, int thread_count, pid_t& pid)
+{
+	auto thread_count_text = std::to_string(thread_count);
+
+	std::string arguments[] = {
+		"simpleray", "--worker", address, thread_count_text};
+	char* p_arguments[] = {arguments[0].data(), arguments[1].data(),
+		arguments[2].data(), arguments[3].data(), nullptr};
+
+	if (::posix_spawn(&pid, "/proc/self/exe", nullptr, nullptr, p_arguments,
+			environ) != 0)
+	{
+		std::cout << "failed to spawn a worker" << std::endl;
+		return false;
+	}
+
+	return true;
+}
+
+#endif
+
+/* server */
+
+/// @brief built scenes (entities and their bvh) by scene id. A scene is built
+/// by its registered builder on the first request and stays in memory, when
+/// the scenes take more than the memory limit the least recently used ones
+/// are evicted. Jobs hold the world through shared_ptr, so an evicted scene
+/// lives until its last job is done
+class render_scene_cache_t
+{
+public:
+	using builder_t = std::function<void(world_t&)>;
+
+	render_scene_cache_t(std::size_t memory_limit) :
+		m_memory_usage{}, m_memory_limit{memory_limit}
+	{
+	}
+	~render_scene_cache_t() {}
+
+	void register_scene(const std::string& scene_id, builder_t builder)
+	{
+		std::lock_guard<std::mutex> lock(this->m_mutex);
+		this->m_builders[scene_id] = std::move(builder);
+	}
+
+	// nullptr for unknown scenes
+	std::shared_ptr<const world_t> get(const std::string& scene_id)
+	{
+		builder_t builder;
+
+		{
+			std::lock_guard<std::mutex> lock(this->m_mutex);
+
+			auto entry = this->m_entries.find(scene_id);
+
+			if (entry != this->m_entries.end())
+			{
+				this->m_lru.splice(
+					this->m_lru.begin(), this->m_lru, entry->second);
+				return entry->second->m_p_world;
+			}
+
+			auto found_builder = this->m_builders.find(scene_id);
+
+			if (found_builder == this->m_builders.end())
+				return nullptr;
+
+			builder = found_builder->second;
+		}
+
+		// other scenes are served while this one is built
+		trace_span_t span("load scene", "scene");
+		auto start_time = std::chrono::steady_clock::now();
+
+		auto p_world = std::make_shared<world_t>();
+		builder(*p_world);
+		p_world->commit();
+
+		std::cout << "scene " << scene_id << " was built ("
+				  << std::chrono::duration_cast<std::chrono::milliseconds>(
+						 std::chrono::steady_clock::now() - start_time)
+						 .count()
+				  << " ms, " << p_world->get_memory_usage() << " bytes)"
+				  << std::endl;
+
+		std::lock_guard<std::mutex> lock(this->m_mutex);
+
+		// somebody built it at the same time
+		auto entry = this->m_entries.find(scene_id);
+
+		if (entry != this->m_entries.end())
+			return entry->second->m_p_world;
+
+		this->m_lru.push_front(
+			{scene_id, p_world, p_world->get_memory_usage()});
+		this->m_entries[scene_id] = this->m_lru.begin();
+		this->m_memory_usage += this->m_lru.front().m_memory_usage;
+
+		// the requested scene stays even if it alone is over the limit
+		while (this->m_memory_usage > this->m_memory_limit &&
+			this->m_lru.size() > 1)
+		{
+			const auto& evicted = this->m_lru.back();
+
+			std::cout << "scene " << evicted.m_scene_id << " was evicted"
+					  << std::endl;
+
+			this->m_memory_usage -= evicted.m_memory_usage;
+			this->m_entries.erase(evicted.m_scene_id);
+			this->m_lru.pop_back();
+		}
+
+		return p_world;
+	}
+
+	std::size_t get_memory_usage() const
+	{
+		std::lock_guard<std::mutex> lock(this->m_mutex);
+		return this->m_memory_usage;
+	}
+
+private:
+	struct entry_t
+	{
+		std::string m_scene_id;
+		std::shared_ptr<const world_t> m_p_world;
+		std::size_t m_memory_usage;
+	};
+
+	mutable std::mutex m_mutex;
+	std::size_t m_memory_usage;
+	std::size_t m_memory_limit;
+	std::unordered_map<std::string, builder_t> m_builders;
+	// the most recently used scene is the first one
+	std::list<entry_t> m_lru;
+	std::unordered_map<std::string, std::list<entry_t>::iterator> m_entries;
+};
+
+#ifndef _WIN32
+
+/// @brief what a client of render_server_t asks for, the camera looks along -z
+/// like camera_t does and the aspect ratio comes from the resolution
+struct render_request_t
+{
+	render_request_t() :
+		m_origin{0.0, 0.0, 0.0}, m_viewport_height{2.0}, m_focal_length{1.0},
+		m_width{}, m_height{}, m_samples_per_pixel{1}, m_depth_count{50},
+		m_seed{}, m_is_use_gamma_correction{true}
+	{
+	}
+	~render_request_t() {}
+
+	void write(net_message_t& message) const
+	{
+		message.write(static_cast<std::uint32_t>(this->m_scene_id.size()));
+		message.write(this->m_scene_id.data(), this->m_scene_id.size());
+		message.write(this->m_origin);
+		message.write(this->m_viewport_height);
+		message.write(this->m_focal_length);
+		message.write(this->m_width);
+		message.write(this->m_height);
+		message.write(this->m_samples_per_pixel);
+		message.write(this->m_depth_count);
+		message.write(this->m_seed);
+		message.write(this->m_is_use_gamma_correction);
+	}
+
+	bool read(net_message_t& message)
+	{
+		std::uint32_t scene_id_size{};
+
+		if (!message.read(scene_id_size) || scene_id_size > kMaxSceneIdSize)
+			return false;
+
+		this->m_scene_id.resize(scene_id_size);
+
+		return message.read(this->m_scene_id.data(), scene_id_size) &&
+			message.read(this->m_origin) &&
+			message.read(this->m_viewport_height) &&
+			message.read(this->m_focal_length) && message.read(this->m_width) &&
+			message.read(this->m_height) &&
+			message.read(this->m_samples_per_pixel) &&
+			message.read(this->m_depth_count) && message.read(this->m_seed) &&
+			message.read(this->m_is_use_gamma_correction);
+	}
+
+	static constexpr std::uint32_t kMaxSceneIdSize = 256;
+
+	std::string m_scene_id;
+	glm::dvec3 m_origin;
+	double m_viewport_height;
+	double m_focal_length;
+	int m_width;
+	int m_height;
+	int m_samples_per_pixel;
+	int m_depth_count;
+	std::uint64_t m_seed;
+	bool m_is_use_gamma_correction;
+};
+
+enum class eRenderStatus : std::uint32_t
+{
+	kRenderStatus_Ok,
+	kRenderStatus_UnknownScene,
+	kRenderStatus_InvalidRequest,
+
+	kRenderStatus_Unknown = 0xffffffff
+};
+
+/// @brief daemon mode: requests from a local socket are rendered on the
+/// shared render_scheduler_t, so tiles of concurrent requests are mixed in
+/// one thread pool, and images go back in the response instead of files.
+/// Scenes come from render_scene_cache_t, so only the first request of a
+/// scene pays for building it
+class render_server_t
+{
+public:
+	render_server_t(render_scheduler_t& scheduler, render_scene_cache_t& scenes) :
+		m_is_running{}, m_request_count{}, m_scheduler{scheduler},
+		m_scenes{scenes}
+	{
+	}
+	~render_server_t() { this->stop(); }
+
+	bool start(const std::string& address)
+	{
+		if (this->m_is_running || !this->m_listener.listen(address))
+			return false;
+
+		this->m_is_running = true;
+		this->m_thread = std::thread(&render_server_t::accept_loop, this);
+
+		return true;
+	}
+
+	// drops connections, requests which are rendered right now finish first
+	void stop()
+	{
+		if (!this->m_is_running.exchange(false))
+			return;
+
+		this->m_thread.join();
+
+		// the accept loop is gone, so nobody adds or reaps connections now
+		for (auto& connection : this->m_connections)
+			connection.m_socket.shutdown();
+
+		for (auto& connection : this->m_connections)
+			connection.m_thread.join();
+
+		this->m_connections.clear();
+		this->m_listener.close();
+	}
+
+private:
+	struct connection_t
+	{
+		connection_t(net_socket_t&& socket) :
+			m_socket{std::move(socket)}, m_is_done{}
+		{
+		}
+
+		net_socket_t m_socket;
+		std::thread m_thread;
+		// set by the thread as the last thing it does, so it joins at once
+		std::atomic<bool> m_is_done;
+	};
+
+	void accept_loop()
+	{
+		while (this->m_is_running)
+		{
+			this->reap_connections();
+
+			pollfd listener{this->m_listener.get_handle(), POLLIN, 0};
+
+			if (::poll(&listener, 1, kPollTimeout) <= 0)
+				continue;
+
+			auto socket = this->m_listener.accept();
+
+			if (!socket.is_valid())
+				continue;
+
+			// registered before its thread starts, so stop() can't miss the
+			// socket and wait forever for a thread blocked in receive()
+			auto& connection = this->m_connections.emplace_back(
+				std::move(socket));
+			connection.m_thread =
+				std::thread(&render_server_t::serve, this, &connection);
+		}
+	}
+
+	// joins threads of closed connections, a long running daemon would keep
+	// a finished thread with its stack for every client it ever served
+	void reap_connections()
+	{
+		for (auto it = this->m_connections.begin();
+			 it != this->m_connections.end();)
+		{
+			if (it->m_is_done)
+			{
+				it->m_thread.join();
+				it = this->m_connections.erase(it);
+			}
+			else
+			{
+				++it;
+			}
+		}
+	}
+
+	void serve(connection_t* p_connection)
+	{
+		auto& socket = p_connection->m_socket;
+		net_message_t message;
+
+		while (this->m_is_running && socket.receive(message))
+		{
+			if (message.get_type() !=
+					eNetMessageType::kNetMessageType_RenderRequest ||
+				!socket.send(this->render(message)))
+			{
+				break;
+			}
+		}
+
+		p_connection->m_is_done = true;
+	}
+
+	net_message_t render(net_message_t& request_message)
+	{
+		net_message_t response(eNetMessageType::kNetMessageType_RenderResponse);
+		render_request_t request;
+
+		if (!request.read(request_message) || request.m_width <= 1 ||
+			request.m_height <= 1 || request.m_width > kMaxResolution ||
+			request.m_height > kMaxResolution ||
+			request.m_samples_per_pixel <= 0 ||
+			request.m_samples_per_pixel > kMaxSamplesPerPixel ||
+			request.m_depth_count <= 0 || request.m_depth_count > kMaxDepthCount)
+		{
+			response.write(eRenderStatus::kRenderStatus_InvalidRequest);
+			return response;
+		}
+
+		auto p_world = this->m_scenes.get(request.m_scene_id);
+
+		if (!p_world)
+		{
+			response.write(eRenderStatus::kRenderStatus_UnknownScene);
+			return response;
+		}
+
+		render_settings_t settings;
+		settings.m_width = request.m_width;
+		settings.m_height = request.m_height;
+		settings.m_samples_per_pixel = request.m_samples_per_pixel;
+		settings.m_depth_count = request.m_depth_count;
+		settings.m_seed = request.m_seed;
+		settings.m_is_use_gamma_correction = request.m_is_use_gamma_correction;
+		settings.m_mode = eRenderMode::kRenderMode_Materials;
+		settings.m_output_type = eOutputType::kOutputType_Memory;
+
+		auto name = request.m_scene_id + " #" +
+			std::to_string(this->m_request_count.fetch_add(1));
+
+		auto p_job = this->m_scheduler.submit(std::make_shared<render_job_t>(
+			std::move(p_world),
+			camera_t(request.m_origin,
+				double(request.m_width) / request.m_height,
+				request.m_viewport_height, request.m_focal_length),
+			settings, name.c_str()));
+
+		p_job->wait_written();
+
+		std::cout << name << " was rendered (" << p_job->get_elapsed().count()
+				  << " ms)" << std::endl;
+
+		response.write(eRenderStatus::kRenderStatus_Ok);
+		response.write(request.m_width);
+		response.write(request.m_height);
+		response.write(p_job->get_pixels().data(), p_job->get_pixels().size());
+
+		return response;
+	}
+
+private:
+	static constexpr int kMaxResolution = 16384;
+	static constexpr int kMaxSamplesPerPixel = 65536;
+	// every bounce is a frame of the recursive draw_with_materials(), a
+	// deeper request would overflow the stack of the render thread and take
+	// the daemon down with all other requests
+	static constexpr int kMaxDepthCount = 1024;
+	// milliseconds
+	static constexpr int kPollTimeout = 100;
+
+	std::atomic<bool> m_is_running;
+	std::atomic<std::uint64_t> m_request_count;
+	render_scheduler_t& m_scheduler;
+	render_scene_cache_t& m_scenes;
+	net_socket_t m_listener;
+	std::thread m_thread;
+	// owned by the accept loop while it runs, then by stop()
+	std::list<connection_t> m_connections;
+};
+
+// client side of render_server_t, pixels are RGB8 rows
+eRenderStatus render_server_request(net_socket_t& socket,
+	const render_request_t& request, int& width, int& height,
+	std::vector<std::uint8_t>& pixels)
+{
+	net_message_t message(eNetMessageType::kNetMessageType_RenderRequest);
+	request.write(message);
+
+	auto status = eRenderStatus::kRenderStatus_Unknown;
+
+	if (!socket.send(message) || !socket.receive(message) ||
+		message.get_type() != eNetMessageType::kNetMessageType_RenderResponse ||
+		!message.read(status) || status != eRenderStatus::kRenderStatus_Ok)
+	{
+		return status;
+	}
+
+	if (!message.read(width) || !message.read(height) || width <= 0 ||
+		height <= 0)
+	{
+		return eRenderStatus::kRenderStatus_Unknown;
+	}
+
+	pixels.resize(static_cast<std::size_t>(width) * height * 3);
+
+	if (!message.read(pixels.data(), pixels.size()))
+		return eRenderStatus::kRenderStatus_Unknown;
+
+	return status;
+}
+
+#endif
+
+struct global_vars_t
+{
+	global_vars_t() : m_is_pin_threads{} {}
+	~global_vars_t() {}
+
+	// render threads are pinned to cores, --pin-threads
+	bool m_is_pin_threads;
+	render_scheduler_t m_scheduler;
+};
+
+/* init */
+void init_window(global_vars_t& gvars) {}
+
+void init(global_vars_t& gvars)
+{
+	init_window(gvars);
+
+	gvars.m_scheduler.start(
+		static_cast<int>(std::thread::hardware_concurrency()),
+		gvars.m_is_pin_threads);
+}
+
+/* simulation */
+
+bool hit_sphere(const glm::dvec3& center, double radius, const ray_t& ray)
+{
+	auto oc = ray.get_origin() - center;
+
+	auto a = glm::dot(ray.get_direction(), ray.get_direction());
+	auto b = 2.0 * glm::dot(oc, ray.get_direction());
+	auto c = glm::dot(oc, oc) - radius * radius;
+
+	auto discriminant = (b * b) - (4 * a * c);
+
+	return (discriminant > 0);
+}
+
+void test_image(global_vars_t& gvars)
+{
+	std::cout << "writing test image" << std::endl;
+
+	image_ppm_t img(256, 256);
+
+	auto status = img.open("test1_gradient.ppm");
+
+	if (status)
+	{
+		auto total_size = img.get_width() * img.get_height();
+		for (int i = 1; i <= total_size; ++i)
+		{
+			img.write({double(i) / total_size, double(i) / total_size,
+				double(i) / total_size});
+		}
+	}
+
+	std::cout << "test.ppm was created" << std::endl;
+}
+
+void test_simple_ray(global_vars_t& gvars)
+{
+	auto aspect_ratio = 16.0 / 9.0;
+	auto width = 400;
+	auto height = width / aspect_ratio;
+
+	auto viewport_height = 2.0;
+	auto viewport_width = aspect_ratio * viewport_height;
+	auto focal_length = 1.0;
+
+	auto origin = glm::dvec3(0, 0, 0);
+
+	auto horizontal = glm::dvec3(viewport_width, 0, 0);
+	auto vertical = glm::dvec3(0, viewport_height, 0);
+	auto lower_left_corner = origin - (horizontal / 2.0) - (vertical / 2.0) -
+		glm::dvec3(0, 0, focal_length);
+
+	image_ppm_t img(width, height);
+
+	img.open("test2_background.ppm");
+
+	for (int j = height - 1; j >= 0; --j)
+	{
+		for (int i = 0; i < width; ++i)
+		{
+			auto u = double(i) / (width - 1);
+			auto v = double(j) / (height - 1);
+
+			ray_t ray(origin,
+				lower_left_corner + (u * horizontal) + (v * vertical) - origin);
+
+			auto norm_dir = glm::normalize(ray.get_direction());
+
+			auto t = 0.5 * (norm_dir.y + 1.0);
+
+			auto color = (1.0 - t) * glm::dvec3(1.0, 1.0, 1.0) +
+				t * glm::dvec3(0.5, 0.7, 1.0);
+
+			img.write(color);
+		}
+	}
+}
+
+void test_simple_sphere(global_vars_t& gvars)
+{
+	auto aspect_ratio = 16.0 / 9.0;
+	auto width = 400;
+	auto height = width / aspect_ratio;
+
+	auto viewport_height = 2.0;
+	auto viewport_width = aspect_ratio * viewport_height;
+	auto focal_length = 1.0;
+
+	auto origin = glm::dvec3(0, 0, 0);
+
+	auto horizontal = glm::dvec3(viewport_width, 0, 0);
+	auto vertical = glm::dvec3(0, viewport_height, 0);
+	auto lower_left_corner = origin - (horizontal / 2.0) - (vertical / 2.0) -
+		glm::dvec3(0, 0, focal_length);
+
+	image_ppm_t img(width, height);
+
+	img.open("test3_sphere.ppm");
+
+	for (int j = height - 1; j >= 0; --j)
+	{
+		for (int i = 0; i < width; ++i)
+		{
+			auto u = double(i) / (width - 1);
+			auto v = double(j) / (height - 1);
+
+			ray_t ray(origin,
+				lower_left_corner + (u * horizontal) + (v * vertical) - origin);
+
+			glm::dvec3 color;
+			if (hit_sphere({0, 0, -1}, 0.5, ray))
+			{
+				color = {1, 0, 0};
+			}
+			else
+			{
+				auto norm_dir = glm::normalize(ray.get_direction());
+
+				auto t = 0.5 * (norm_dir.y + 1.0);
+
+				color = (1.0 - t) * glm::dvec3(1.0, 1.0, 1.0) +
+					t * glm::dvec3(0.5, 0.7, 1.0);
+			}
+
+			img.write(color);
+		}
+	}
+}
+
+void test_world_sphere(global_vars_t& gvars)
+{
+	auto aspect_ratio = 16.0 / 9.0;
+	auto width = 400;
+	auto height = width / aspect_ratio;
+
+	auto viewport_height = 2.0;
+	auto viewport_width = aspect_ratio * viewport_height;
+	auto focal_length = 1.0;
+
+	auto origin = glm::dvec3(0, 0, 0);
+
+	auto horizontal = glm::dvec3(viewport_width, 0, 0);
+	auto vertical = glm::dvec3(0, viewport_height, 0);
+	auto lower_left_corner = origin - (horizontal / 2.0) - (vertical / 2.0) -
+		glm::dvec3(0, 0, focal_length);
+
+	world_t world;
+	world.add(entity_t(eEntityType::kEntityType_Sphere,
+		sphere_data_t(true, 0.5, {0.0, 0.0, -1.0}, {1.0, 0.0, 0.0})));
+
+	image_ppm_t img(width, height);
+
+	img.open("test4_world_sphere.ppm");
+
+	constexpr double inf = std::numeric_limits<double>::infinity();
+
+	for (int j = height - 1; j >= 0; --j)
+	{
+		for (int i = 0; i < width; ++i)
+		{
+			auto u = double(i) / (width - 1);
+			auto v = double(j) / (height - 1);
+
+			ray_t ray(origin,
+				lower_left_corner + (u * horizontal) + (v * vertical) - origin);
+
+			// it works only for one entity
+			for (const auto& entity : world.get_entities())
+			{
+				const auto& hit_result = world.hit(entity, ray, 0.0, inf);
+
+				if (hit_result.is_hitted())
+				{
+					if (hit_result.is_draw_normal_map())
+					{
+						img.write(draw_normal(hit_result.get_normal()));
+					}
+				}
+				else
+				{
+					auto t =
+						0.5 * (glm::normalize(ray.get_direction()).y + 1.0);
+					img.write(
+						draw_gradient(t, {1.0, 1.0, 1.0}, {0.5, 0.7, 1.0}));
+				}
+			}
+		}
+	}
+}
+
+void test_world_sphere_with_ground(global_vars_t& gvars)
+{
+	auto aspect_ratio = 16.0 / 9.0;
+	auto width = 400;
+	auto height = width / aspect_ratio;
+
+	auto viewport_height = 2.0;
+	auto viewport_width = aspect_ratio * viewport_height;
+	auto focal_length = 1.0;
+
+	auto origin = glm::dvec3(0, 0, 0);
+
+	auto horizontal = glm::dvec3(viewport_width, 0, 0);
+	auto vertical = glm::dvec3(0, viewport_height, 0);
+	auto lower_left_corner = origin - (horizontal / 2.0) - (vertical / 2.0) -
+		glm::dvec3(0, 0, focal_length);
+
+	world_t world;
+	world.add(entity_t(eEntityType::kEntityType_Sphere,
+		sphere_data_t(false, 100.0, {0.0, -100.8, -1.0}, {0.0, 1.0, 0.0})));
+	world.add(entity_t(eEntityType::kEntityType_Sphere,
+		sphere_data_t(true, 0.5, {0.0, 0.0, -1.0}, {1.0, 0.0, 0.0})));
+
+	image_ppm_t img(width, height);
+
+	img.open("test5_world_sphere_with_ground.ppm");
+
+	glm::dvec3 output_color;
+
+	for (int j = height - 1; j >= 0; --j)
+	{
+		for (int i = 0; i < width; ++i)
+		{
+			auto u = double(i) / (width - 1);
+			auto v = double(j) / (height - 1);
+
+			ray_t ray(origin,
+				lower_left_corner + (u * horizontal) + (v * vertical) - origin);
+
+			bool is_hitted{};
+
+			for (const auto& entity : world.get_entities())
+			{
+				const auto& hit_result =
+					world.hit(entity, ray, 0.0, kInfinityDouble);
+
+				if (hit_result.is_hitted())
+				{
+					is_hitted = true;
+					output_color += draw_normal(hit_result.get_normal());
+					break;
+				}
+			}
+
+			if (!is_hitted)
+			{
+				auto t = 0.5 * (glm::normalize(ray.get_direction()).y + 1.0);
+				output_color =
+					draw_gradient(t, {1.0, 1.0, 1.0}, {0.5, 0.7, 1.0});
+			}
+
+			img.write(output_color);
+		}
+	}
+}
+
+void test_world_sphere_with_ground_new_aspect_ratio(global_vars_t& gvars)
+{
+	auto aspect_ratio = 4.0 / 3.0;
+	auto width = 400;
+	auto height = width / aspect_ratio;
+
+	auto viewport_height = 2.0;
+	auto viewport_width = aspect_ratio * viewport_height;
+	auto focal_length = 1.0;
+
+	auto origin = glm::dvec3(0, 0, 0);
+
+	auto horizontal = glm::dvec3(viewport_width, 0, 0);
+	auto vertical = glm::dvec3(0, viewport_height, 0);
+	auto lower_left_corner = origin - (horizontal / 2.0) - (vertical / 2.0) -
+		glm::dvec3(0, 0, focal_length);
+
+	world_t world;
+	world.add(entity_t(eEntityType::kEntityType_Sphere,
+		sphere_data_t(false, 100.0, {0.0, -100.8, -1.0}, {0.0, 1.0, 0.0})));
+	world.add(entity_t(eEntityType::kEntityType_Sphere,
+		sphere_data_t(true, 0.5, {0.0, 0.0, -1.0}, {1.0, 0.0, 0.0})));
+
+	image_ppm_t img(width, height);
+
+	img.open("test5_world_sphere_with_ground_new_ratio.ppm");
+
+	glm::dvec3 output_color;
+
+	for (int j = height - 1; j >= 0; --j)
+	{
+		for (int i = 0; i < width; ++i)
+		{
+			auto u = double(i) / (width - 1);
+			auto v = double(j) / (height - 1);
+
+			ray_t ray(origin,
+				lower_left_corner + (u * horizontal) + (v * vertical) - origin);
+
+			bool is_hitted{};
+
+			for (const auto& entity : world.get_entities())
+			{
+				const auto& hit_result =
+					world.hit(entity, ray, 0.0, kInfinityDouble);
+
+				if (hit_result.is_hitted())
+				{
+					is_hitted = true;
+					output_color += draw_normal(hit_result.get_normal());
+					break;
+				}
+			}
+
+			if (!is_hitted)
+			{
+				auto t = 0.5 * (glm::normalize(ray.get_direction()).y + 1.0);
+				output_color =
+					draw_gradient(t, {1.0, 1.0, 1.0}, {0.5, 0.7, 1.0});
+			}
+
+			img.write(output_color);
+		}
+	}
+}
+
+void test_world_camera_antialiasing(global_vars_t& gvars)
+{
+	auto aspect_ratio = 16.0 / 9.0;
+	auto width = 400;
+	auto height = width / aspect_ratio;
+	auto viewport_height = 2.0;
+
+	render_settings_t settings;
+	settings.m_width = width;
+	settings.m_height = static_cast<int>(height);
+	settings.m_samples_per_pixel = 100;
+	settings.m_mode = eRenderMode::kRenderMode_NormalMap;
+
+	world_t world;
+	world.add(entity_t(eEntityType::kEntityType_Sphere,
+		sphere_data_t(true, 0.5, {0.0, 0.0, -1.0}, {1.0, 0.0, 0.0})));
+	world.add(entity_t(eEntityType::kEntityType_Sphere,
+		sphere_data_t(false, 100.0, {0.0, -100.5, -1.0}, {0.0, 1.0, 0.0})));
+
+	world.commit();
+
+	gvars.m_scheduler.submit(std::make_shared<render_job_t>(world,
+		camera_t({0.0, 0.0, 0.0}, aspect_ratio, viewport_height), settings,
+		"test6_world_camera.ppm"));
+}
+
+void test_world_camera_antialiasing_diffuse(global_vars_t& gvars)
+{
+	auto aspect_ratio = 16.0 / 9.0;
+	auto width = 400;
+	auto height = width / aspect_ratio;
+	auto viewport_height = 2.0;
+
+	render_settings_t settings;
+	settings.m_width = width;
+	settings.m_height = static_cast<int>(height);
+	settings.m_samples_per_pixel = 100;
+	settings.m_depth_count = 50;
+	settings.m_mode = eRenderMode::kRenderMode_Diffuse;
+
+	world_t world;
+	world.add(entity_t(eEntityType::kEntityType_Sphere,
+		sphere_data_t(true, 0.5, {0.0, 0.0, -1.0}, {1.0, 0.0, 0.0})));
+	world.add(entity_t(eEntityType::kEntityType_Sphere,
+		sphere_data_t(false, 100.0, {0.0, -100.5, -1.0}, {0.0, 1.0, 0.0})));
+
+	world.commit();
+
+	gvars.m_scheduler.submit(std::make_shared<render_job_t>(world,
+		camera_t({0.0, 0.0, 0.0}, aspect_ratio, viewport_height), settings,
+		"test7_world_camera_diffuse.ppm"));
+}
+
+void test_world_camera_antialiasing_diffuse_with_gamma_correction(
+	global_vars_t& gvars)
+{
+	auto aspect_ratio = 16.0 / 9.0;
+	auto width = 400;
+	auto height = width / aspect_ratio;
+	auto viewport_height = 2.0;
+
+	render_settings_t settings;
+	settings.m_width = width;
+	settings.m_height = static_cast<int>(height);
+	settings.m_samples_per_pixel = 100;
+	settings.m_depth_count = 50;
+	settings.m_is_use_gamma_correction = true;
+	settings.m_mode = eRenderMode::kRenderMode_Diffuse;
+
+	world_t world;
+	world.add(entity_t(eEntityType::kEntityType_Sphere,
+		sphere_data_t(true, 0.5, {0.0, 0.0, -1.0}, {1.0, 0.0, 0.0})));
+	world.add(entity_t(eEntityType::kEntityType_Sphere,
+		sphere_data_t(false, 100.0, {0.0, -100.5, -1.0}, {0.0, 1.0, 0.0})));
+
+	world.commit();
+
+	gvars.m_scheduler.submit(std::make_shared<render_job_t>(world,
+		camera_t({0.0, 0.0, 0.0}, aspect_ratio, viewport_height), settings,
+		"test7_world_camera_diffuse_with_gamma_correction.ppm"));
+}
+
+void test_world_camera_antialiasing_diffuse_lambert_with_gamma_correction(
+	global_vars_t& gvars)
+{
+	auto aspect_ratio = 16.0 / 9.0;
+	auto width = 400;
+	auto height = width / aspect_ratio;
+	auto viewport_height = 2.0;
+
+	render_settings_t settings;
+	settings.m_width = width;
+	settings.m_height = static_cast<int>(height);
+	settings.m_samples_per_pixel = 100;
+	settings.m_depth_count = 50;
+	settings.m_is_use_gamma_correction = true;
+	settings.m_mode = eRenderMode::kRenderMode_DiffuseLambert;
+
+	world_t world;
+	world.add(entity_t(eEntityType::kEntityType_Sphere,
+		sphere_data_t(true, 0.5, {0.0, 0.0, -1.0}, {1.0, 0.0, 0.0})));
+	world.add(entity_t(eEntityType::kEntityType_Sphere,
+		sphere_data_t(false, 100.0, {0.0, -100.5, -1.0}, {0.0, 1.0, 0.0})));
+
+	world.commit();
+
+	gvars.m_scheduler.submit(std::make_shared<render_job_t>(world,
+		camera_t({0.0, 0.0, 0.0}, aspect_ratio, viewport_height), settings,
+		"test7_world_camera_diffuse_lambert_with_gamma_correction.ppm"));
+}
+
+// just diffuse no metal
+void test_world_camera_antialiasing_materials_with_gamma_correction(
+	global_vars_t& gvars)
+{
+	auto aspect_ratio = 16.0 / 9.0;
+	auto width = 400;
+	auto height = width / aspect_ratio;
+	auto viewport_height = 2.0;
+
+	render_settings_t settings;
+	settings.m_width = width;
+	settings.m_height = static_cast<int>(height);
+	settings.m_samples_per_pixel = 100;
+	settings.m_depth_count = 50;
+	settings.m_is_use_gamma_correction = true;
+	settings.m_mode = eRenderMode::kRenderMode_Materials;
+
+	world_t world;
+	world.add(entity_t(eEntityType::kEntityType_Sphere,
+		sphere_data_t(true, 0.5, {0.0, 0.0, -1.0}, {1.0, 0.0, 0.0},
+			material_t(eMaterialType::kMaterialType_Diffuse,
+				glm::dvec3(0.7, 0.3, 0.3)))));
+	world.add(entity_t(eEntityType::kEntityType_Sphere,
+		sphere_data_t(false, 100.0, {0.0, -100.5, -1.0}, {0.0, 1.0, 0.0},
+			material_t(eMaterialType::kMaterialType_Diffuse,
+				glm::dvec3(0.8, 0.8, 0.0)))));
+
+	world.commit();
+
+	gvars.m_scheduler.submit(std::make_shared<render_job_t>(world,
+		camera_t({0.0, 0.0, 0.0}, aspect_ratio, viewport_height), settings,
+		"test8_world_camera_materials_with_gamma_correction.ppm"));
+}
+
+void test_world_camera_antialiasing_materials2_with_gamma_correction(
+	global_vars_t& gvars)
+{
+	auto aspect_ratio = 16.0 / 9.0;
+	auto width = 400;
+	auto height = width / aspect_ratio;
+	auto viewport_height = 2.0;
+
+	render_settings_t settings;
+	settings.m_width = width;
+	settings.m_height = static_cast<int>(height);
+	settings.m_samples_per_pixel = 100;
+	settings.m_depth_count = 50;
+	settings.m_is_use_gamma_correction = true;
+	settings.m_mode = eRenderMode::kRenderMode_Materials;
+
+	world_t world;
+	world.add(entity_t(eEntityType::kEntityType_Sphere,
+		sphere_data_t(true, 0.5, {0.0, 0.0, -1.0}, {1.0, 0.0, 0.0},
+			material_t(eMaterialType::kMaterialType_Metal,
+				glm::dvec3(0.7, 0.3, 0.3)))));
+	world.add(entity_t(eEntityType::kEntityType_Sphere,
+		sphere_data_t(false, 100.0, {0.0, -100.5, -1.0}, {0.0, 1.0, 0.0},
+			material_t(eMaterialType::kMaterialType_Diffuse,
+				glm::dvec3(0.8, 0.8, 0.0)))));
+
+	world.commit();
+
+	gvars.m_scheduler.submit(std::make_shared<render_job_t>(world,
+		camera_t({0.0, 0.0, 0.0}, aspect_ratio, viewport_height), settings,
+		"test8_world_camera_materials2_with_gamma_correction.ppm"));
+}
+
+void test_world_camera_antialiasing_materials3_with_gamma_correction(
+	global_vars_t& gvars)
+{
+	auto aspect_ratio = 16.0 / 9.0;
+	auto width = 400;
+	auto height = width / aspect_ratio;
+	auto viewport_height = 2.0;
+
+	render_settings_t settings;
+	settings.m_width = width;
+	settings.m_height = static_cast<int>(height);
+	settings.m_samples_per_pixel = 100;
+	settings.m_depth_count = 50;
+	settings.m_is_use_gamma_correction = true;
+	settings.m_mode = eRenderMode::kRenderMode_Materials;
+
+	world_t world;
+	world.add(entity_t(eEntityType::kEntityType_Sphere,
+		sphere_data_t(true, 0.5, {0.0, 0.0, -1.0}, {1.0, 0.0, 0.0},
+			material_t(eMaterialType::kMaterialType_Metal,
+				glm::dvec3(0.7, 0.3, 0.3)))));
+
+	world.add(entity_t(eEntityType::kEntityType_Sphere,
+		sphere_data_t(true, 0.5, {1.2, 0.0, -1.0}, {1.0, 0.0, 0.0},
+			material_t(eMaterialType::kMaterialType_Diffuse,
+				glm::dvec3(0.8, 0.2, 0.2)))));
+
+	world.add(entity_t(eEntityType::kEntityType_Sphere,
+		sphere_data_t(true, 0.5, {-1.2, 0.0, -1.0}, {1.0, 0.0, 0.0},
+			material_t(eMaterialType::kMaterialType_Diffuse,
+				glm::dvec3(0.2, 0.2, 0.8)))));
+
+	world.add(entity_t(eEntityType::kEntityType_Sphere,
+		sphere_data_t(false, 100.0, {0.0, -100.5, -1.0}, {0.0, 1.0, 0.0},
+			material_t(eMaterialType::kMaterialType_Diffuse,
+				glm::dvec3(0.8, 0.8, 0.0)))));
+
+	world.commit();
+
+	gvars.m_scheduler.submit(std::make_shared<render_job_t>(world,
+		camera_t({0.0, 0.0, 0.0}, aspect_ratio, viewport_height), settings,
+		"test8_world_camera_materials3_with_gamma_correction.ppm"));
+}
+
+void test_world_camera_antialiasing_materials4_with_gamma_correction(
+	global_vars_t& gvars)
+{
+	auto aspect_ratio = 16.0 / 9.0;
+	auto width = 400;
+	auto height = width / aspect_ratio;
+	auto viewport_height = 2.0;
+
+	render_settings_t settings;
+	settings.m_width = width;
+	settings.m_height = static_cast<int>(height);
+	settings.m_samples_per_pixel = 100;
+	settings.m_depth_count = 50;
+	settings.m_is_use_gamma_correction = true;
+	settings.m_mode = eRenderMode::kRenderMode_Materials;
+
+	world_t world;
+	world.add(entity_t(eEntityType::kEntityType_Sphere,
+		sphere_data_t(true, 0.5, {0.0, 0.0, -1.0}, {1.0, 0.0, 0.0},
+			material_t(eMaterialType::kMaterialType_Metal, 0.5,
+				glm::dvec3(0.7, 0.3, 0.3)))));
+
+	world.add(entity_t(eEntityType::kEntityType_Sphere,
+		sphere_data_t(true, 0.5, {1.2, 0.0, -1.0}, {1.0, 0.0, 0.0},
+			material_t(eMaterialType::kMaterialType_Diffuse,
+				glm::dvec3(0.8, 0.2, 0.2)))));
+
+	world.add(entity_t(eEntityType::kEntityType_Sphere,
+		sphere_data_t(true, 0.5, {-1.2, 0.0, -1.0}, {1.0, 0.0, 0.0},
+			material_t(eMaterialType::kMaterialType_Diffuse,
+				glm::dvec3(0.2, 0.2, 0.8)))));
+
+	world.add(entity_t(eEntityType::kEntityType_Sphere,
+		sphere_data_t(false, 100.0, {0.0, -100.5, -1.0}, {0.0, 1.0, 0.0},
+			material_t(eMaterialType::kMaterialType_Diffuse,
+				glm::dvec3(0.8, 0.8, 0.0)))));
+
+	world.commit();
+
+	gvars.m_scheduler.submit(std::make_shared<render_job_t>(world,
+		camera_t({0.0, 0.0, 0.0}, aspect_ratio, viewport_height), settings,
+		"test8_world_camera_materials4_with_gamma_correction.ppm"));
+}
+
+void test_world_camera_antialiasing_materials_refraction_with_gamma_correction(
+	global_vars_t& gvars)
+{
+	auto aspect_ratio = 16.0 / 9.0;
+	auto width = 400;
+	auto height = width / aspect_ratio;
+	auto viewport_height = 2.0;
+
+	render_settings_t settings;
+	settings.m_width = width;
+	settings.m_height = static_cast<int>(height);
+	settings.m_samples_per_pixel = 100;
+	settings.m_depth_count = 50;
+	settings.m_is_use_gamma_correction = true;
+	settings.m_mode = eRenderMode::kRenderMode_Materials;
+	// glass and fuzzy metal are the expensive ones
+	settings.m_is_output_cost = true;
+	settings.m_cost_metric = eCostMetric::kCostMetric_Rays;
+
+	world_t world;
+	world.add(entity_t(eEntityType::kEntityType_Sphere,
+		sphere_data_t(true, 0.5, {0.0, 0.0, -1.0}, {1.0, 0.0, 0.0},
+			material_t(eMaterialType::kMaterialType_Metal, 0.5,
+				glm::dvec3(0.7, 0.3, 0.3)))));
+
+	world.add(entity_t(eEntityType::kEntityType_Sphere,
+		sphere_data_t(true, 0.5, {1.2, 0.0, -1.0}, {1.0, 0.0, 0.0},
+			material_t(eMaterialType::kMaterialType_Diffuse,
+				glm::dvec3(0.8, 0.2, 0.2)))));
+
+	world.add(entity_t(eEntityType::kEntityType_Sphere,
+		sphere_data_t(true, 0.5, {-1.2, 0.0, -1.0}, {1.0, 0.0, 0.0},
+			material_t(eMaterialType::kMaterialType_Dielectric, 1.5, 0.0,
+				glm::dvec3(0.2, 0.2, 0.8)))));
+
+	world.add(entity_t(eEntityType::kEntityType_Sphere,
+		sphere_data_t(false, 100.0, {0.0, -100.5, -1.0}, {0.0, 1.0, 0.0},
+			material_t(eMaterialType::kMaterialType_Diffuse,
+				glm::dvec3(0.8, 0.8, 0.0)))));
+
+	world.commit();
+
+	gvars.m_scheduler.submit(std::make_shared<render_job_t>(world,
+		camera_t({0.0, 0.0, 0.0}, aspect_ratio, viewport_height), settings,
+		"test8_world_camera_materials_refraction_with_gamma_correction.ppm"));
+}
+
+// big image which is written through the memory mapped output, the same
+// scene as materials4 but with a few samples per pixel
+void test_world_camera_mapped_output(global_vars_t& gvars)
+{
+	auto aspect_ratio = 16.0 / 9.0;
+	auto width = 1920;
+	auto height = width / aspect_ratio;
+	auto viewport_height = 2.0;
+
+	render_settings_t settings;
+	settings.m_width = width;
+	settings.m_height = static_cast<int>(height);
+	settings.m_samples_per_pixel = 4;
+	settings.m_depth_count = 50;
+	settings.m_is_use_gamma_correction = true;
+	settings.m_mode = eRenderMode::kRenderMode_Materials;
+	settings.m_output_type = eOutputType::kOutputType_Mapped;
+
+	world_t world;
+	world.add(entity_t(eEntityType::kEntityType_Sphere,
+		sphere_data_t(true, 0.5, {0.0, 0.0, -1.0}, {1.0, 0.0, 0.0},
+			material_t(eMaterialType::kMaterialType_Metal, 0.5,
+				glm::dvec3(0.7, 0.3, 0.3)))));
+
+	world.add(entity_t(eEntityType::kEntityType_Sphere,
+		sphere_data_t(true, 0.5, {1.2, 0.0, -1.0}, {1.0, 0.0, 0.0},
+			material_t(eMaterialType::kMaterialType_Diffuse,
+				glm::dvec3(0.8, 0.2, 0.2)))));
+
+	world.add(entity_t(eEntityType::kEntityType_Sphere,
+		sphere_data_t(true, 0.5, {-1.2, 0.0, -1.0}, {1.0, 0.0, 0.0},
+			material_t(eMaterialType::kMaterialType_Diffuse,
+				glm::dvec3(0.2, 0.2, 0.8)))));
+
+	world.add(entity_t(eEntityType::kEntityType_Sphere,
+		sphere_data_t(false, 100.0, {0.0, -100.5, -1.0}, {0.0, 1.0, 0.0},
+			material_t(eMaterialType::kMaterialType_Diffuse,
+				glm::dvec3(0.8, 0.8, 0.0)))));
+
+	world.commit();
+
+	gvars.m_scheduler.submit(std::make_shared<render_job_t>(world,
+		camera_t({0.0, 0.0, 0.0}, aspect_ratio, viewport_height), settings,
+		"test9_world_camera_mapped_output.ppm"));
+}
+
+// refraction scene rendered in passes of 10 samples with a checkpoint every
+// second. If the process is killed the next run continues from the checkpoint,
+// after a complete run you can raise m_samples_per_pixel to add samples to the
+// existing image, delete the checkpoint to render from scratch
+void test_world_camera_checkpoint(global_vars_t& gvars)
+{
+	auto aspect_ratio = 16.0 / 9.0;
+	auto width = 400;
+	auto height = width / aspect_ratio;
+	auto viewport_height = 2.0;
+
+	render_settings_t settings;
+	settings.m_width = width;
+	settings.m_height = static_cast<int>(height);
+	settings.m_samples_per_pixel = 100;
+	settings.m_samples_per_pass = 10;
+	settings.m_depth_count = 50;
+	settings.m_is_use_gamma_correction = true;
+	settings.m_mode = eRenderMode::kRenderMode_Materials;
+	settings.m_checkpoint_file_name = "test10_world_camera_checkpoint.bin";
+	settings.m_checkpoint_interval = 1.0;
+
+	world_t world;
+	world.add(entity_t(eEntityType::kEntityType_Sphere,
+		sphere_data_t(true, 0.5, {0.0, 0.0, -1.0}, {1.0, 0.0, 0.0},
+			material_t(eMaterialType::kMaterialType_Metal, 0.5,
+				glm::dvec3(0.7, 0.3, 0.3)))));
+
+	world.add(entity_t(eEntityType::kEntityType_Sphere,
+		sphere_data_t(true, 0.5, {1.2, 0.0, -1.0}, {1.0, 0.0, 0.0},
+			material_t(eMaterialType::kMaterialType_Diffuse,
+				glm::dvec3(0.8, 0.2, 0.2)))));
+
+	world.add(entity_t(eEntityType::kEntityType_Sphere,
+		sphere_data_t(true, 0.5, {-1.2, 0.0, -1.0}, {1.0, 0.0, 0.0},
+			material_t(eMaterialType::kMaterialType_Dielectric, 1.5, 0.0,
+				glm::dvec3(0.2, 0.2, 0.8)))));
+
+	world.add(entity_t(eEntityType::kEntityType_Sphere,
+		sphere_data_t(false, 100.0, {0.0, -100.5, -1.0}, {0.0, 1.0, 0.0},
+			material_t(eMaterialType::kMaterialType_Diffuse,
+				glm::dvec3(0.8, 0.8, 0.0)))));
+
+	world.commit();
+
+	gvars.m_scheduler.submit(std::make_shared<render_job_t>(world,
+		camera_t({0.0, 0.0, 0.0}, aspect_ratio, viewport_height), settings,
+		"test10_world_camera_checkpoint.ppm"));
 }
 
-void test_world_sphere_with_ground(global_vars_t& gvars)
+// materials4 scene with 8 samples per pixel and the denoiser, compare it with
+// test8_world_camera_materials4_with_gamma_correction.ppm (100 samples). The
+// features the denoiser was guided by are written next to it
+void test_world_camera_denoiser(global_vars_t& gvars)
 {
 	auto aspect_ratio = 16.0 / 9.0;
 	auto width = 400;
 	auto height = width / aspect_ratio;
-
 	auto viewport_height = 2.0;
-	auto viewport_width = aspect_ratio * viewport_height;
-	auto focal_length = 1.0;
 
-	auto origin = glm::dvec3(0, 0, 0);
-
-	auto horizontal = glm::dvec3(viewport_width, 0, 0);
-	auto vertical = glm::dvec3(0, viewport_height, 0);
-	auto lower_left_corner = origin - (horizontal / 2.0) - (vertical / 2.0) -
-		glm::dvec3(0, 0, focal_length);
+	render_settings_t settings;
+	settings.m_width = width;
+	settings.m_height = static_cast<int>(height);
+	settings.m_samples_per_pixel = 8;
+	settings.m_depth_count = 50;
+	settings.m_is_use_gamma_correction = true;
+	settings.m_is_use_denoiser = true;
+	settings.m_is_output_features = true;
+	settings.m_mode = eRenderMode::kRenderMode_Materials;
 
 	world_t world;
 	world.add(entity_t(eEntityType::kEntityType_Sphere,
-		sphere_data_t(false, 100.0, {0.0, -100.8, -1.0}, {0.0, 1.0, 0.0})));
-	world.add(entity_t(eEntityType::kEntityType_Sphere,
-		sphere_data_t(true, 0.5, {0.0, 0.0, -1.0}, {1.0, 0.0, 0.0})));
-
-	image_ppm_t img(width, height);
-
-	img.open("test5_world_sphere_with_ground.ppm");
-
-	glm::dvec3 output_color;
-
-	for (int j = height - 1; j >= 0; --j)
-	{
-		for (int i = 0; i < width; ++i)
-		{
-			auto u = double(i) / (width - 1);
-			auto v = double(j) / (height - 1);
-
-			ray_t ray(origin,
-				lower_left_corner + (u * horizontal) + (v * vertical) - origin);
+		sphere_data_t(true, 0.5, {0.0, 0.0, -1.0}, {1.0, 0.0, 0.0},
+			material_t(eMaterialType::kMaterialType_Metal, 0.5,
+				glm::dvec3(0.7, 0.3, 0.3)))));
 
-			bool is_hitted{};
+	world.add(entity_t(eEntityType::kEntityType_Sphere,
+		sphere_data_t(true, 0.5, {1.2, 0.0, -1.0}, {1.0, 0.0, 0.0},
+			material_t(eMaterialType::kMaterialType_Diffuse,
+				glm::dvec3(0.8, 0.2, 0.2)))));
 
-			for (const auto& entity : world.get_entities())
-			{
-				const auto& hit_result =
-					world.hit(entity, ray, 0.0, kInfinityDouble);
+	world.add(entity_t(eEntityType::kEntityType_Sphere,
+		sphere_data_t(true, 0.5, {-1.2, 0.0, -1.0}, {1.0, 0.0, 0.0},
+			material_t(eMaterialType::kMaterialType_Diffuse,
+				glm::dvec3(0.2, 0.2, 0.8)))));
 
-				if (hit_result.is_hitted())
-				{
-					is_hitted = true;
-					output_color += draw_normal(hit_result.get_normal());
-					break;
-				}
-			}
+	world.add(entity_t(eEntityType::kEntityType_Sphere,
+		sphere_data_t(false, 100.0, {0.0, -100.5, -1.0}, {0.0, 1.0, 0.0},
+			material_t(eMaterialType::kMaterialType_Diffuse,
+				glm::dvec3(0.8, 0.8, 0.0)))));
 
-			if (!is_hitted)
-			{
-				auto t = 0.5 * (glm::normalize(ray.get_direction()).y + 1.0);
-				output_color =
-					draw_gradient(t, {1.0, 1.0, 1.0}, {0.5, 0.7, 1.0});
-			}
+	world.commit();
 
-			img.write(output_color);
-		}
-	}
+	gvars.m_scheduler.submit(std::make_shared<render_job_t>(world,
+		camera_t({0.0, 0.0, 0.0}, aspect_ratio, viewport_height), settings,
+		"test11_world_camera_denoiser.ppm"));
 }
 
-void test_world_sphere_with_ground_new_aspect_ratio(global_vars_t& gvars)
+// look-dev loop on the materials4 scene: the first job remembers which
+// entities every tile depends on, then the metal sphere gets another material
+// and the right sphere is moved, and only tiles which see them are rendered
+// again
+void test_world_camera_incremental(global_vars_t& gvars)
 {
-	auto aspect_ratio = 4.0 / 3.0;
+	auto aspect_ratio = 16.0 / 9.0;
 	auto width = 400;
 	auto height = width / aspect_ratio;
-
 	auto viewport_height = 2.0;
-	auto viewport_width = aspect_ratio * viewport_height;
-	auto focal_length = 1.0;
-
-	auto origin = glm::dvec3(0, 0, 0);
 
-	auto horizontal = glm::dvec3(viewport_width, 0, 0);
-	auto vertical = glm::dvec3(0, viewport_height, 0);
-	auto lower_left_corner = origin - (horizontal / 2.0) - (vertical / 2.0) -
-		glm::dvec3(0, 0, focal_length);
+	render_settings_t settings;
+	settings.m_width = width;
+	settings.m_height = static_cast<int>(height);
+	settings.m_samples_per_pixel = 100;
+	settings.m_depth_count = 50;
+	settings.m_is_use_gamma_correction = true;
+	settings.m_is_track_dependencies = true;
+	settings.m_mode = eRenderMode::kRenderMode_Materials;
 
 	world_t world;
+	auto metal_sphere = world.add(entity_t(eEntityType::kEntityType_Sphere,
+		sphere_data_t(true, 0.5, {0.0, 0.0, -1.0}, {1.0, 0.0, 0.0},
+			material_t(eMaterialType::kMaterialType_Metal, 0.5,
+				glm::dvec3(0.7, 0.3, 0.3)))));
+
+	auto right_sphere = world.add(entity_t(eEntityType::kEntityType_Sphere,
+		sphere_data_t(true, 0.5, {1.2, 0.0, -1.0}, {1.0, 0.0, 0.0},
+			material_t(eMaterialType::kMaterialType_Diffuse,
+				glm::dvec3(0.8, 0.2, 0.2)))));
+
 	world.add(entity_t(eEntityType::kEntityType_Sphere,
-		sphere_data_t(false, 100.0, {0.0, -100.8, -1.0}, {0.0, 1.0, 0.0})));
-	world.add(entity_t(eEntityType::kEntityType_Sphere,
-		sphere_data_t(true, 0.5, {0.0, 0.0, -1.0}, {1.0, 0.0, 0.0})));
+		sphere_data_t(true, 0.5, {-1.2, 0.0, -1.0}, {1.0, 0.0, 0.0},
+			material_t(eMaterialType::kMaterialType_Diffuse,
+				glm::dvec3(0.2, 0.2, 0.8)))));
 
-	image_ppm_t img(width, height);
+	world.add(entity_t(eEntityType::kEntityType_Sphere,
+		sphere_data_t(false, 100.0, {0.0, -100.5, -1.0}, {0.0, 1.0, 0.0},
+			material_t(eMaterialType::kMaterialType_Diffuse,
+				glm::dvec3(0.8, 0.8, 0.0)))));
 
-	img.open("test5_world_sphere_with_ground_new_ratio.ppm");
+	world.commit();
 
-	glm::dvec3 output_color;
+	camera_t camera({0.0, 0.0, 0.0}, aspect_ratio, viewport_height);
 
-	for (int j = height - 1; j >= 0; --j)
-	{
-		for (int i = 0; i < width; ++i)
-		{
-			auto u = double(i) / (width - 1);
-			auto v = double(j) / (height - 1);
+	auto p_job = gvars.m_scheduler.submit(std::make_shared<render_job_t>(
+		world, camera, settings, "test12_world_camera_incremental.ppm"));
 
-			ray_t ray(origin,
-				lower_left_corner + (u * horizontal) + (v * vertical) - origin);
+	// the edit is applied to the finished image
+	gvars.m_scheduler.wait();
 
-			bool is_hitted{};
+	world.set_material(metal_sphere,
+		material_t(eMaterialType::kMaterialType_Metal, 0.0,
+			glm::dvec3(0.8, 0.8, 0.8)));
 
-			for (const auto& entity : world.get_entities())
-			{
-				const auto& hit_result =
-					world.hit(entity, ray, 0.0, kInfinityDouble);
+	p_job = gvars.m_scheduler.submit(std::make_shared<render_job_t>(*p_job,
+		world, camera, "test12_world_camera_incremental_material.ppm"));
 
-				if (hit_result.is_hitted())
-				{
-					is_hitted = true;
-					output_color += draw_normal(hit_result.get_normal());
-					break;
-				}
-			}
+	gvars.m_scheduler.wait();
 
-			if (!is_hitted)
-			{
-				auto t = 0.5 * (glm::normalize(ray.get_direction()).y + 1.0);
-				output_color =
-					draw_gradient(t, {1.0, 1.0, 1.0}, {0.5, 0.7, 1.0});
-			}
+	world.set_sphere_position(right_sphere, {1.2, 0.3, -1.2});
+	world.commit();
 
-			img.write(output_color);
-		}
-	}
+	gvars.m_scheduler.submit(std::make_shared<render_job_t>(*p_job, world,
+		camera, "test12_world_camera_incremental_position.ppm"));
 }
 
-void test_world_camera_antialiasing(global_vars_t& gvars)
+// material tuning with a static camera: the first job keeps the first hit of
+// every sample, the next one only changes materials so it reuses them and
+// starts every path from the second bounce
+void test_world_camera_first_hit_cache(global_vars_t& gvars)
 {
 	auto aspect_ratio = 16.0 / 9.0;
 	auto width = 400;
 	auto height = width / aspect_ratio;
 	auto viewport_height = 2.0;
-	gvars.m_camera = camera_t({0.0, 0.0, 0.0}, aspect_ratio, viewport_height);
-	gvars.m_samples_per_pixel = 100;
+
+	render_settings_t settings;
+	settings.m_width = width;
+	settings.m_height = static_cast<int>(height);
+	settings.m_samples_per_pixel = 100;
+	settings.m_depth_count = 50;
+	settings.m_is_use_gamma_correction = true;
+	settings.m_is_cache_first_hits = true;
+	settings.m_mode = eRenderMode::kRenderMode_Materials;
 
 	world_t world;
 	world.add(entity_t(eEntityType::kEntityType_Sphere,
-		sphere_data_t(true, 0.5, {0.0, 0.0, -1.0}, {1.0, 0.0, 0.0})));
-	world.add(entity_t(eEntityType::kEntityType_Sphere,
-		sphere_data_t(false, 100.0, {0.0, -100.5, -1.0}, {0.0, 1.0, 0.0})));
-
-	image_ppm_t img(width, height);
+		sphere_data_t(true, 0.5, {0.0, 0.0, -1.0}, {1.0, 0.0, 0.0},
+			material_t(eMaterialType::kMaterialType_Metal, 0.5,
+				glm::dvec3(0.7, 0.3, 0.3)))));
 
-	img.open("test6_world_camera.ppm");
+	world.add(entity_t(eEntityType::kEntityType_Sphere,
+		sphere_data_t(true, 0.5, {1.2, 0.0, -1.0}, {1.0, 0.0, 0.0},
+			material_t(eMaterialType::kMaterialType_Diffuse,
+				glm::dvec3(0.8, 0.2, 0.2)))));
 
-	for (int j = height - 1; j >= 0; --j)
-	{
-		for (int i = 0; i < width; ++i)
-		{
-			glm::dvec3 output_color(0.0, 0.0, 0.0);
+	auto left_sphere = world.add(entity_t(eEntityType::kEntityType_Sphere,
+		sphere_data_t(true, 0.5, {-1.2, 0.0, -1.0}, {1.0, 0.0, 0.0},
+			material_t(eMaterialType::kMaterialType_Diffuse,
+				glm::dvec3(0.2, 0.2, 0.8)))));
 
-			for (int sample_index = 0; sample_index < gvars.m_samples_per_pixel;
-				 ++sample_index)
-			{
-				auto u = (double(i) + math_random_double()) / (width - 1);
-				auto v = (double(j) + math_random_double()) / (height - 1);
+	auto ground = world.add(entity_t(eEntityType::kEntityType_Sphere,
+		sphere_data_t(false, 100.0, {0.0, -100.5, -1.0}, {0.0, 1.0, 0.0},
+			material_t(eMaterialType::kMaterialType_Diffuse,
+				glm::dvec3(0.8, 0.8, 0.0)))));
 
-				const auto& ray = gvars.m_camera.get_ray(u, v);
+	world.commit();
 
-				bool is_hitted{};
+	camera_t camera({0.0, 0.0, 0.0}, aspect_ratio, viewport_height);
 
-				for (const auto& entity : world.get_entities())
-				{
-					const auto& hit_result =
-						world.hit(entity, ray, 0.0, kInfinityDouble);
+	auto p_job = gvars.m_scheduler.submit(std::make_shared<render_job_t>(
+		world, camera, settings, "test13_world_camera_first_hit_cache.ppm"));
 
-					if (hit_result.is_hitted())
-					{
-						is_hitted = true;
-						output_color += draw_normal(hit_result.get_normal());
-						break;
-					}
-				}
+	gvars.m_scheduler.wait();
 
-				if (!is_hitted)
-				{
-					auto t =
-						0.5 * (glm::normalize(ray.get_direction()).y + 1.0);
-					output_color +=
-						draw_gradient(t, {1.0, 1.0, 1.0}, {0.5, 0.7, 1.0});
-				}
-			}
+	world.set_material(left_sphere,
+		material_t(eMaterialType::kMaterialType_Dielectric, 1.5, 0.0,
+			glm::dvec3(0.2, 0.2, 0.8)));
+	world.set_material(ground,
+		material_t(eMaterialType::kMaterialType_Diffuse,
+			glm::dvec3(0.5, 0.5, 0.5)));
 
-			img.write(output_color, gvars.m_samples_per_pixel);
-		}
-	}
+	gvars.m_scheduler.submit(std::make_shared<render_job_t>(*p_job, world,
+		camera, "test13_world_camera_first_hit_cache_materials.ppm"));
 }
 
-void test_world_camera_antialiasing_diffuse(global_vars_t& gvars)
+// the materials4 scene rendered by three local worker processes with two
+// threads each, connected through a unix socket, in passes of 25 samples.
+// Across machines use a "host:port" address and start workers by hand with
+// simpleray --worker host:port
+void test_world_camera_distributed(global_vars_t& gvars)
 {
+#ifndef _WIN32
 	auto aspect_ratio = 16.0 / 9.0;
 	auto width = 400;
 	auto height = width / aspect_ratio;
 	auto viewport_height = 2.0;
 
-	gvars.m_camera = camera_t({0.0, 0.0, 0.0}, aspect_ratio, viewport_height);
-	gvars.m_samples_per_pixel = 100;
-	gvars.m_depth_count = 50;
+	render_settings_t settings;
+	settings.m_width = width;
+	settings.m_height = static_cast<int>(height);
+	settings.m_samples_per_pixel = 100;
+	settings.m_samples_per_pass = 25;
+	settings.m_depth_count = 50;
+	settings.m_is_use_gamma_correction = true;
+	settings.m_mode = eRenderMode::kRenderMode_Materials;
 
 	world_t world;
 	world.add(entity_t(eEntityType::kEntityType_Sphere,
-		sphere_data_t(true, 0.5, {0.0, 0.0, -1.0}, {1.0, 0.0, 0.0})));
+		sphere_data_t(true, 0.5, {0.0, 0.0, -1.0}, {1.0, 0.0, 0.0},
+			material_t(eMaterialType::kMaterialType_Metal, 0.5,
+				glm::dvec3(0.7, 0.3, 0.3)))));
+
 	world.add(entity_t(eEntityType::kEntityType_Sphere,
-		sphere_data_t(false, 100.0, {0.0, -100.5, -1.0}, {0.0, 1.0, 0.0})));
+		sphere_data_t(true, 0.5, {1.2, 0.0, -1.0}, {1.0, 0.0, 0.0},
+			material_t(eMaterialType::kMaterialType_Diffuse,
+				glm::dvec3(0.8, 0.2, 0.2)))));
 
-	image_ppm_t img(width, height);
+	world.add(entity_t(eEntityType::kEntityType_Sphere,
+		sphere_data_t(true, 0.5, {-1.2, 0.0, -1.0}, {1.0, 0.0, 0.0},
+			material_t(eMaterialType::kMaterialType_Diffuse,
+				glm::dvec3(0.2, 0.2, 0.8)))));
 
-	img.open("test7_world_camera_diffuse.ppm");
+	world.add(entity_t(eEntityType::kEntityType_Sphere,
+		sphere_data_t(false, 100.0, {0.0, -100.5, -1.0}, {0.0, 1.0, 0.0},
+			material_t(eMaterialType::kMaterialType_Diffuse,
+				glm::dvec3(0.8, 0.8, 0.0)))));
 
-	for (int j = height - 1; j >= 0; --j)
-	{
-		for (int i = 0; i < width; ++i)
-		{
-			glm::dvec3 output_color(0.0, 0.0, 0.0);
+	world.commit();
 
-			for (int sample_index = 0; sample_index < gvars.m_samples_per_pixel;
-				 ++sample_index)
-			{
-				auto u = (double(i) + math_random_double()) / (width - 1);
-				auto v = (double(j) + math_random_double()) / (height - 1);
+	auto address = "unix:" +
+		(std::filesystem::temp_directory_path() / "simpleray_test14.sock")
+			.string();
 
-				const auto& ray = gvars.m_camera.get_ray(u, v);
+	render_coordinator_t coordinator;
 
-				bool is_hitted{};
+	if (!coordinator.listen(address))
+		return;
 
-				output_color += draw_diffuse(ray, world, gvars.m_depth_count);
-			}
+	std::vector<pid_t> workers;
 
-			img.write(output_color, gvars.m_samples_per_pixel);
-		}
+	for (int i = 0; i < 3; ++i)
+	{
+		pid_t pid{};
+
+		if (render_spawn_local_worker(address, 2, pid))
+			workers.push_back(pid);
 	}
+
+	coordinator.render(std::make_shared<render_job_t>(world,
+		camera_t({0.0, 0.0, 0.0}, aspect_ratio, viewport_height), settings,
+		"test14_world_camera_distributed.ppm"));
+
+	coordinator.stop();
+
+	for (auto pid : workers)
+		::waitpid(pid, nullptr, 0);
+#endif
 }
 
-void test_world_camera_antialiasing_diffuse_with_gamma_correction(
-	global_vars_t& gvars)
+void build_scene_materials4(world_t& world)
 {
-	auto aspect_ratio = 16.0 / 9.0;
-	auto width = 400;
-	auto height = width / aspect_ratio;
-	auto viewport_height = 2.0;
+	world.add(entity_t(eEntityType::kEntityType_Sphere,
+		sphere_data_t(true, 0.5, {0.0, 0.0, -1.0}, {1.0, 0.0, 0.0},
+			material_t(eMaterialType::kMaterialType_Metal, 0.5,
+				glm::dvec3(0.7, 0.3, 0.3)))));
 
-	gvars.m_camera = camera_t({0.0, 0.0, 0.0}, aspect_ratio, viewport_height);
-	gvars.m_samples_per_pixel = 100;
-	gvars.m_depth_count = 50;
+	world.add(entity_t(eEntityType::kEntityType_Sphere,
+		sphere_data_t(true, 0.5, {1.2, 0.0, -1.0}, {1.0, 0.0, 0.0},
+			material_t(eMaterialType::kMaterialType_Diffuse,
+				glm::dvec3(0.8, 0.2, 0.2)))));
 
-	world_t world;
 	world.add(entity_t(eEntityType::kEntityType_Sphere,
-		sphere_data_t(true, 0.5, {0.0, 0.0, -1.0}, {1.0, 0.0, 0.0})));
+		sphere_data_t(true, 0.5, {-1.2, 0.0, -1.0}, {1.0, 0.0, 0.0},
+			material_t(eMaterialType::kMaterialType_Diffuse,
+				glm::dvec3(0.2, 0.2, 0.8)))));
+
 	world.add(entity_t(eEntityType::kEntityType_Sphere,
-		sphere_data_t(false, 100.0, {0.0, -100.5, -1.0}, {0.0, 1.0, 0.0})));
+		sphere_data_t(false, 100.0, {0.0, -100.5, -1.0}, {0.0, 1.0, 0.0},
+			material_t(eMaterialType::kMaterialType_Diffuse,
+				glm::dvec3(0.8, 0.8, 0.0)))));
+}
 
-	image_ppm_t img(width, height);
+void build_scene_materials_refraction(world_t& world)
+{
+	world.add(entity_t(eEntityType::kEntityType_Sphere,
+		sphere_data_t(true, 0.5, {0.0, 0.0, -1.0}, {1.0, 0.0, 0.0},
+			material_t(eMaterialType::kMaterialType_Metal, 0.5,
+				glm::dvec3(0.7, 0.3, 0.3)))));
 
-	img.open("test7_world_camera_diffuse_with_gamma_correction.ppm");
+	world.add(entity_t(eEntityType::kEntityType_Sphere,
+		sphere_data_t(true, 0.5, {1.2, 0.0, -1.0}, {1.0, 0.0, 0.0},
+			material_t(eMaterialType::kMaterialType_Diffuse,
+				glm::dvec3(0.8, 0.2, 0.2)))));
 
-	for (int j = height - 1; j >= 0; --j)
-	{
-		for (int i = 0; i < width; ++i)
-		{
-			glm::dvec3 output_color(0.0, 0.0, 0.0);
+	world.add(entity_t(eEntityType::kEntityType_Sphere,
+		sphere_data_t(true, 0.5, {-1.2, 0.0, -1.0}, {1.0, 0.0, 0.0},
+			material_t(eMaterialType::kMaterialType_Dielectric, 1.5, 0.0,
+				glm::dvec3(0.2, 0.2, 0.8)))));
 
-			for (int sample_index = 0; sample_index < gvars.m_samples_per_pixel;
-				 ++sample_index)
-			{
-				auto u = (double(i) + math_random_double()) / (width - 1);
-				auto v = (double(j) + math_random_double()) / (height - 1);
+	world.add(entity_t(eEntityType::kEntityType_Sphere,
+		sphere_data_t(false, 100.0, {0.0, -100.5, -1.0}, {0.0, 1.0, 0.0},
+			material_t(eMaterialType::kMaterialType_Diffuse,
+				glm::dvec3(0.8, 0.8, 0.0)))));
+}
+
+// sphere_count small spheres on a jittered grid (one per unit cell) around
+// the origin on a big ground sphere, their materials are picked from
+// kMaterialCount random ones, 80% diffuse, 15% metal and 5% glass. The same
+// seed gives the same scene
+void build_scene_random_spheres(
+	world_t& world, int sphere_count, std::uint64_t seed)
+{
+	static constexpr double kRadius = 0.2;
+	static constexpr int kMaterialCount = 256;
 
-				const auto& ray = gvars.m_camera.get_ray(u, v);
+	trace_span_t span("build scene", "scene", "spheres", sphere_count);
 
-				bool is_hitted{};
+	random_generator_t generator;
+	generator.seed(seed);
 
-				output_color += draw_diffuse(ray, world, gvars.m_depth_count);
-			}
+	std::uniform_real_distribution<double> random(0.0, 1.0);
+	std::uniform_int_distribution<int> random_material(0, kMaterialCount - 1);
 
-			img.write(output_color, gvars.m_samples_per_pixel, true);
+	std::vector<material_t> materials;
+
+	for (int i = 0; i < kMaterialCount; ++i)
+	{
+		auto choice = random(generator);
+
+		if (choice < 0.8)
+		{
+			materials.emplace_back(eMaterialType::kMaterialType_Diffuse,
+				glm::dvec3(random(generator) * random(generator),
+					random(generator) * random(generator),
+					random(generator) * random(generator)));
+		}
+		else if (choice < 0.95)
+		{
+			materials.emplace_back(eMaterialType::kMaterialType_Metal,
+				0.5 * random(generator),
+				glm::dvec3(0.5 + 0.5 * random(generator),
+					0.5 + 0.5 * random(generator),
+					0.5 + 0.5 * random(generator)));
+		}
+		else
+		{
+			materials.emplace_back(eMaterialType::kMaterialType_Dielectric,
+				1.5, 0.0, glm::dvec3(1.0, 1.0, 1.0));
 		}
 	}
-}
-
-void test_world_camera_antialiasing_diffuse_lambert_with_gamma_correction(
-	global_vars_t& gvars)
-{
-	auto aspect_ratio = 16.0 / 9.0;
-	auto width = 400;
-	auto height = width / aspect_ratio;
-	auto viewport_height = 2.0;
 
-	gvars.m_camera = camera_t({0.0, 0.0, 0.0}, aspect_ratio, viewport_height);
-	gvars.m_samples_per_pixel = 100;
-	gvars.m_depth_count = 50;
+	world.reserve(static_cast<std::size_t>(sphere_count) + 1);
 
-	world_t world;
-	world.add(entity_t(eEntityType::kEntityType_Sphere,
-		sphere_data_t(true, 0.5, {0.0, 0.0, -1.0}, {1.0, 0.0, 0.0})));
 	world.add(entity_t(eEntityType::kEntityType_Sphere,
-		sphere_data_t(false, 100.0, {0.0, -100.5, -1.0}, {0.0, 1.0, 0.0})));
-
-	image_ppm_t img(width, height);
+		sphere_data_t(false, 1000.0, {0.0, -1000.0, 0.0}, {0.0, 1.0, 0.0},
+			material_t(eMaterialType::kMaterialType_Diffuse,
+				glm::dvec3(0.5, 0.5, 0.5)))));
 
-	img.open("test7_world_camera_diffuse_lambert_with_gamma_correction.ppm");
+	auto side = static_cast<int>(std::ceil(std::sqrt(double(sphere_count))));
 
-	for (int j = height - 1; j >= 0; --j)
+	for (int i = 0; i < sphere_count; ++i)
 	{
-		for (int i = 0; i < width; ++i)
-		{
-			glm::dvec3 output_color(0.0, 0.0, 0.0);
+		glm::dvec3 position(i % side - side / 2 + 0.9 * random(generator),
+			kRadius, i / side - side / 2 + 0.9 * random(generator));
 
-			for (int sample_index = 0; sample_index < gvars.m_samples_per_pixel;
-				 ++sample_index)
-			{
-				auto u = (double(i) + math_random_double()) / (width - 1);
-				auto v = (double(j) + math_random_double()) / (height - 1);
+		world.add(entity_t(eEntityType::kEntityType_Sphere,
+			sphere_data_t(false, kRadius, position, {1.0, 0.0, 0.0},
+				materials[random_material(generator)])));
+	}
+}
 
-				const auto& ray = gvars.m_camera.get_ray(u, v);
+// looks along -z over the field of build_scene_random_spheres from its near
+// edge, so far rows go down to the horizon
+camera_t make_camera_random_spheres(int sphere_count, double aspect_ratio)
+{
+	auto side = std::ceil(std::sqrt(double(sphere_count)));
 
-				bool is_hitted{};
+	return camera_t({0.0, 1.0, side / 2 + 2.0}, aspect_ratio, 2.0);
+}
 
-				output_color +=
-					draw_diffuse_with_lambert(ray, world, gvars.m_depth_count);
-			}
+// scenes which render_server_t knows by id
+void register_scenes(render_scene_cache_t& scenes)
+{
+	scenes.register_scene("materials4", build_scene_materials4);
+	scenes.register_scene(
+		"materials_refraction", build_scene_materials_refraction);
 
-			img.write(output_color, gvars.m_samples_per_pixel, true);
-		}
+	// random_spheres_1000 ... random_spheres_1000000, the camera of
+	// make_camera_random_spheres() sees the whole field
+	for (int sphere_count = 1000; sphere_count <= 1000000; sphere_count *= 10)
+	{
+		scenes.register_scene(
+			"random_spheres_" + std::to_string(sphere_count),
+			[sphere_count](world_t& world) {
+				build_scene_random_spheres(world, sphere_count, 1);
+			});
 	}
 }
 
-// just diffuse no metal
-void test_world_camera_antialiasing_materials_with_gamma_correction(
-	global_vars_t& gvars)
+// requests to render_server_t running in this process, the memory limit
+// fits one scene only, so the last request builds materials4 again
+void test_world_camera_server(global_vars_t& gvars)
 {
-	auto aspect_ratio = 16.0 / 9.0;
-	auto width = 400;
-	auto height = width / aspect_ratio;
-	auto viewport_height = 2.0;
+#ifndef _WIN32
+	auto address = "unix:" +
+		(std::filesystem::temp_directory_path() / "simpleray_test15.sock")
+			.string();
 
-	gvars.m_camera = camera_t({0.0, 0.0, 0.0}, aspect_ratio, viewport_height);
-	gvars.m_samples_per_pixel = 100;
-	gvars.m_depth_count = 50;
+	render_scene_cache_t scenes(2 * 1024);
+	register_scenes(scenes);
 
-	world_t world;
-	world.add(entity_t(eEntityType::kEntityType_Sphere,
-		sphere_data_t(true, 0.5, {0.0, 0.0, -1.0}, {1.0, 0.0, 0.0},
-			material_t(eMaterialType::kMaterialType_Diffuse,
-				glm::dvec3(0.7, 0.3, 0.3)))));
-	world.add(entity_t(eEntityType::kEntityType_Sphere,
-		sphere_data_t(false, 100.0, {0.0, -100.5, -1.0}, {0.0, 1.0, 0.0},
-			material_t(eMaterialType::kMaterialType_Diffuse,
-				glm::dvec3(0.8, 0.8, 0.0)))));
+	render_server_t server(gvars.m_scheduler, scenes);
 
-	image_ppm_t img(width, height);
+	if (!server.start(address))
+		return;
 
-	img.open("test8_world_camera_materials_with_gamma_correction.ppm");
+	net_socket_t socket;
 
-	for (int j = height - 1; j >= 0; --j)
+	if (!socket.connect(address))
+		return;
+
+	render_request_t request;
+	request.m_width = 400;
+	request.m_height = 225;
+	request.m_samples_per_pixel = 100;
+	request.m_depth_count = 50;
+
+	const std::pair<const char*, glm::dvec3> kViews[] = {
+		{"materials4", {0.0, 0.0, 0.0}},
+		{"materials4", {0.0, 0.5, 0.5}},
+		{"materials_refraction", {0.0, 0.0, 0.0}},
+		{"materials4", {0.5, 0.0, 0.0}}};
+
+	for (int i = 0; i < static_cast<int>(std::size(kViews)); ++i)
 	{
-		for (int i = 0; i < width; ++i)
-		{
-			glm::dvec3 output_color(0.0, 0.0, 0.0);
+		request.m_scene_id = kViews[i].first;
+		request.m_origin = kViews[i].second;
 
-			for (int sample_index = 0; sample_index < gvars.m_samples_per_pixel;
-				 ++sample_index)
-			{
-				auto u = (double(i) + math_random_double()) / (width - 1);
-				auto v = (double(j) + math_random_double()) / (height - 1);
+		int width{};
+		int height{};
+		std::vector<std::uint8_t> pixels;
 
-				const auto& ray = gvars.m_camera.get_ray(u, v);
+		if (render_server_request(socket, request, width, height, pixels) !=
+			eRenderStatus::kRenderStatus_Ok)
+		{
+			std::cout << "request for " << request.m_scene_id << " failed"
+					  << std::endl;
+			continue;
+		}
 
-				bool is_hitted{};
+		auto file_name =
+			"test15_world_camera_server_" + std::to_string(i) + ".ppm";
 
-				output_color +=
-					draw_with_materials(ray, world, gvars.m_depth_count);
-			}
+		image_ppm_t image(width, height);
 
-			img.write(output_color, gvars.m_samples_per_pixel, true);
+		if (image.open(file_name.c_str()))
+		{
+			image.write(pixels.data(), pixels.size() / 3);
+			std::cout << "image " << file_name << " was created" << std::endl;
 		}
 	}
+
+	// a path this deep would overflow the stack of a render thread
+	request.m_depth_count = 10000000;
+
+	int width{};
+	int height{};
+	std::vector<std::uint8_t> pixels;
+
+	if (render_server_request(socket, request, width, height, pixels) !=
+		eRenderStatus::kRenderStatus_InvalidRequest)
+	{
+		std::cout << "request with depth " << request.m_depth_count
+				  << " wasn't rejected" << std::endl;
+	}
+
+	socket.close();
+	server.stop();
+#endif
 }
 
-void test_world_camera_antialiasing_materials2_with_gamma_correction(
-	global_vars_t& gvars)
+// the same scene with a 0.1 s budget (about the coarse preview) and a 2 s
+// one, m_samples_per_pixel is only the upper limit here
+void test_world_camera_time_budget(global_vars_t& gvars)
 {
 	auto aspect_ratio = 16.0 / 9.0;
 	auto width = 400;
 	auto height = width / aspect_ratio;
 	auto viewport_height = 2.0;
 
-	gvars.m_camera = camera_t({0.0, 0.0, 0.0}, aspect_ratio, viewport_height);
-	gvars.m_samples_per_pixel = 100;
-	gvars.m_depth_count = 50;
-
-	world_t world;
-	world.add(entity_t(eEntityType::kEntityType_Sphere,
-		sphere_data_t(true, 0.5, {0.0, 0.0, -1.0}, {1.0, 0.0, 0.0},
-			material_t(eMaterialType::kMaterialType_Metal,
-				glm::dvec3(0.7, 0.3, 0.3)))));
-	world.add(entity_t(eEntityType::kEntityType_Sphere,
-		sphere_data_t(false, 100.0, {0.0, -100.5, -1.0}, {0.0, 1.0, 0.0},
-			material_t(eMaterialType::kMaterialType_Diffuse,
-				glm::dvec3(0.8, 0.8, 0.0)))));
-
-	image_ppm_t img(width, height);
-
-	img.open("test8_world_camera_materials2_with_gamma_correction.ppm");
+	render_settings_t settings;
+	settings.m_width = width;
+	settings.m_height = static_cast<int>(height);
+	settings.m_samples_per_pixel = 4096;
+	settings.m_samples_per_pass = 16;
+	settings.m_depth_count = 50;
+	settings.m_is_use_gamma_correction = true;
+	settings.m_mode = eRenderMode::kRenderMode_Materials;
 
-	for (int j = height - 1; j >= 0; --j)
-	{
-		for (int i = 0; i < width; ++i)
-		{
-			glm::dvec3 output_color(0.0, 0.0, 0.0);
+	auto p_world = std::make_shared<world_t>();
+	build_scene_materials4(*p_world);
+	p_world->commit();
 
-			for (int sample_index = 0; sample_index < gvars.m_samples_per_pixel;
-				 ++sample_index)
-			{
-				auto u = (double(i) + math_random_double()) / (width - 1);
-				auto v = (double(j) + math_random_double()) / (height - 1);
-
-				const auto& ray = gvars.m_camera.get_ray(u, v);
+	settings.m_time_budget = 0.1;
 
-				bool is_hitted{};
+	gvars.m_scheduler.submit(std::make_shared<render_job_t>(p_world,
+		camera_t({0.0, 0.0, 0.0}, aspect_ratio, viewport_height), settings,
+		"test16_world_camera_time_budget_short.ppm"));
 
-				output_color +=
-					draw_with_materials(ray, world, gvars.m_depth_count);
-			}
+	settings.m_time_budget = 2.0;
 
-			img.write(output_color, gvars.m_samples_per_pixel, true);
-		}
-	}
+	gvars.m_scheduler.submit(std::make_shared<render_job_t>(p_world,
+		camera_t({0.0, 0.0, 0.0}, aspect_ratio, viewport_height), settings,
+		"test16_world_camera_time_budget.ppm"));
 }
 
-void test_world_camera_antialiasing_materials3_with_gamma_correction(
-	global_vars_t& gvars)
+// the metal sphere of materials4 only: the crop window as its own image and
+// the whole image with the rest left black, the top half of the sphere is
+// rendered first
+void test_world_camera_crop(global_vars_t& gvars)
 {
 	auto aspect_ratio = 16.0 / 9.0;
 	auto width = 400;
 	auto height = width / aspect_ratio;
 	auto viewport_height = 2.0;
 
-	gvars.m_camera = camera_t({0.0, 0.0, 0.0}, aspect_ratio, viewport_height);
-	gvars.m_samples_per_pixel = 100;
-	gvars.m_depth_count = 50;
-
-	world_t world;
-	world.add(entity_t(eEntityType::kEntityType_Sphere,
-		sphere_data_t(true, 0.5, {0.0, 0.0, -1.0}, {1.0, 0.0, 0.0},
-			material_t(eMaterialType::kMaterialType_Metal,
-				glm::dvec3(0.7, 0.3, 0.3)))));
+	render_settings_t settings;
+	settings.m_width = width;
+	settings.m_height = static_cast<int>(height);
+	settings.m_samples_per_pixel = 100;
+	settings.m_depth_count = 50;
+	settings.m_is_use_gamma_correction = true;
+	settings.m_mode = eRenderMode::kRenderMode_Materials;
+	settings.m_crop = render_tile_t(140, 50, 120, 120);
+	settings.m_priority_region = render_tile_t(140, 50, 120, 60);
 
-	world.add(entity_t(eEntityType::kEntityType_Sphere,
-		sphere_data_t(true, 0.5, {1.2, 0.0, -1.0}, {1.0, 0.0, 0.0},
-			material_t(eMaterialType::kMaterialType_Diffuse,
-				glm::dvec3(0.8, 0.2, 0.2)))));
+	auto p_world = std::make_shared<world_t>();
+	build_scene_materials4(*p_world);
+	p_world->commit();
 
-	world.add(entity_t(eEntityType::kEntityType_Sphere,
-		sphere_data_t(true, 0.5, {-1.2, 0.0, -1.0}, {1.0, 0.0, 0.0},
-			material_t(eMaterialType::kMaterialType_Diffuse,
-				glm::dvec3(0.2, 0.2, 0.8)))));
+	settings.m_is_crop_output = true;
 
-	world.add(entity_t(eEntityType::kEntityType_Sphere,
-		sphere_data_t(false, 100.0, {0.0, -100.5, -1.0}, {0.0, 1.0, 0.0},
-			material_t(eMaterialType::kMaterialType_Diffuse,
-				glm::dvec3(0.8, 0.8, 0.0)))));
+	gvars.m_scheduler.submit(std::make_shared<render_job_t>(p_world,
+		camera_t({0.0, 0.0, 0.0}, aspect_ratio, viewport_height), settings,
+		"test17_world_camera_crop.ppm"));
 
-	image_ppm_t img(width, height);
+	settings.m_is_crop_output = false;
 
-	img.open("test8_world_camera_materials3_with_gamma_correction.ppm");
+	gvars.m_scheduler.submit(std::make_shared<render_job_t>(p_world,
+		camera_t({0.0, 0.0, 0.0}, aspect_ratio, viewport_height), settings,
+		"test17_world_camera_crop_full.ppm"));
+}
 
-	for (int j = height - 1; j >= 0; --j)
-	{
-		for (int i = 0; i < width; ++i)
-		{
-			glm::dvec3 output_color(0.0, 0.0, 0.0);
+void test_world_camera_random_spheres(global_vars_t& gvars)
+{
+	static constexpr int kSphereCount = 10000;
 
-			for (int sample_index = 0; sample_index < gvars.m_samples_per_pixel;
-				 ++sample_index)
-			{
-				auto u = (double(i) + math_random_double()) / (width - 1);
-				auto v = (double(j) + math_random_double()) / (height - 1);
+	auto aspect_ratio = 16.0 / 9.0;
+	auto width = 400;
+	auto height = width / aspect_ratio;
 
-				const auto& ray = gvars.m_camera.get_ray(u, v);
+	render_settings_t settings;
+	settings.m_width = width;
+	settings.m_height = static_cast<int>(height);
+	settings.m_samples_per_pixel = 16;
+	settings.m_depth_count = 50;
+	settings.m_is_use_gamma_correction = true;
+	settings.m_mode = eRenderMode::kRenderMode_Materials;
+
+	auto p_world = std::make_shared<world_t>();
+	build_scene_random_spheres(*p_world, kSphereCount, 1);
+	p_world->commit();
+
+	gvars.m_scheduler.submit(std::make_shared<render_job_t>(p_world,
+		make_camera_random_spheres(kSphereCount, aspect_ratio), settings,
+		"test18_world_camera_random_spheres.ppm"));
+}
 
-				bool is_hitted{};
+// the field of test18 traced through grid_t, the image is the same
+void test_world_camera_grid(global_vars_t& gvars)
+{
+	static constexpr int kSphereCount = 10000;
 
-				output_color +=
-					draw_with_materials(ray, world, gvars.m_depth_count);
-			}
+	auto aspect_ratio = 16.0 / 9.0;
+	auto width = 400;
+	auto height = width / aspect_ratio;
 
-			img.write(output_color, gvars.m_samples_per_pixel, true);
-		}
-	}
+	render_settings_t settings;
+	settings.m_width = width;
+	settings.m_height = static_cast<int>(height);
+	settings.m_samples_per_pixel = 16;
+	settings.m_depth_count = 50;
+	settings.m_is_use_gamma_correction = true;
+	settings.m_mode = eRenderMode::kRenderMode_Materials;
+
+	auto p_world = std::make_shared<world_t>();
+	p_world->set_accelerator(eAccelerator::kAccelerator_Grid);
+	build_scene_random_spheres(*p_world, kSphereCount, 1);
+	p_world->commit();
+
+	gvars.m_scheduler.submit(std::make_shared<render_job_t>(p_world,
+		make_camera_random_spheres(kSphereCount, aspect_ratio), settings,
+		"test20_world_camera_grid.ppm"));
 }
 
-void test_world_camera_antialiasing_materials4_with_gamma_correction(
-	global_vars_t& gvars)
+// the field of test18 with primary visibility rasterized, the image is the
+// same
+void test_world_camera_rasterized_primary(global_vars_t& gvars)
 {
+	static constexpr int kSphereCount = 10000;
+
 	auto aspect_ratio = 16.0 / 9.0;
 	auto width = 400;
 	auto height = width / aspect_ratio;
-	auto viewport_height = 2.0;
 
-	gvars.m_camera = camera_t({0.0, 0.0, 0.0}, aspect_ratio, viewport_height);
-	gvars.m_samples_per_pixel = 100;
-	gvars.m_depth_count = 50;
-
-	world_t world;
-	world.add(entity_t(eEntityType::kEntityType_Sphere,
-		sphere_data_t(true, 0.5, {0.0, 0.0, -1.0}, {1.0, 0.0, 0.0},
-			material_t(eMaterialType::kMaterialType_Metal, 0.5,
-				glm::dvec3(0.7, 0.3, 0.3)))));
+	render_settings_t settings;
+	settings.m_width = width;
+	settings.m_height = static_cast<int>(height);
+	settings.m_samples_per_pixel = 16;
+	settings.m_depth_count = 50;
+	settings.m_is_use_gamma_correction = true;
+	settings.m_mode = eRenderMode::kRenderMode_Materials;
+	settings.m_is_rasterize_primary = true;
+
+	auto p_world = std::make_shared<world_t>();
+	build_scene_random_spheres(*p_world, kSphereCount, 1);
+	p_world->commit();
+
+	gvars.m_scheduler.submit(std::make_shared<render_job_t>(p_world,
+		make_camera_random_spheres(kSphereCount, aspect_ratio), settings,
+		"test21_world_camera_rasterized_primary.ppm"));
+}
 
-	world.add(entity_t(eEntityType::kEntityType_Sphere,
-		sphere_data_t(true, 0.5, {1.2, 0.0, -1.0}, {1.0, 0.0, 0.0},
-			material_t(eMaterialType::kMaterialType_Diffuse,
-				glm::dvec3(0.8, 0.2, 0.2)))));
+// shadow rays from the points of the field of test18 seen by the camera to a
+// point light and to a directional one, world_t::occluded() has to agree with
+// world_t::hit() on every accelerator
+void test_world_occluded(global_vars_t& gvars)
+{
+	static constexpr int kSphereCount = 10000;
+	static constexpr int kWidth = 160;
+	static constexpr int kHeight = 90;
+	static constexpr double kBias = 0.001;
 
-	world.add(entity_t(eEntityType::kEntityType_Sphere,
-		sphere_data_t(true, 0.5, {-1.2, 0.0, -1.0}, {1.0, 0.0, 0.0},
-			material_t(eMaterialType::kMaterialType_Diffuse,
-				glm::dvec3(0.2, 0.2, 0.8)))));
+	const glm::dvec3 light_position(0.0, 10.0, 0.0);
+	const glm::dvec3 light_direction(-1.0, 0.5, 1.0);
 
-	world.add(entity_t(eEntityType::kEntityType_Sphere,
-		sphere_data_t(false, 100.0, {0.0, -100.5, -1.0}, {0.0, 1.0, 0.0},
-			material_t(eMaterialType::kMaterialType_Diffuse,
-				glm::dvec3(0.8, 0.8, 0.0)))));
+	auto camera =
+		make_camera_random_spheres(kSphereCount, double(kWidth) / kHeight);
 
-	image_ppm_t img(width, height);
+	for (auto accelerator :
+		{eAccelerator::kAccelerator_Linear, eAccelerator::kAccelerator_Grid,
+			eAccelerator::kAccelerator_BVH})
+	{
+		world_t world;
+		world.set_accelerator(accelerator);
+		build_scene_random_spheres(world, kSphereCount, 1);
+		world.commit();
 
-	img.open("test8_world_camera_materials4_with_gamma_correction.ppm");
+		int ray_count{};
+		int occluded_count{};
+		int mismatch_count{};
 
-	for (int j = height - 1; j >= 0; --j)
-	{
-		for (int i = 0; i < width; ++i)
+		for (int y = 0; y < kHeight; ++y)
 		{
-			glm::dvec3 output_color(0.0, 0.0, 0.0);
-
-			for (int sample_index = 0; sample_index < gvars.m_samples_per_pixel;
-				 ++sample_index)
+			for (int x = 0; x < kWidth; ++x)
 			{
-				auto u = (double(i) + math_random_double()) / (width - 1);
-				auto v = (double(j) + math_random_double()) / (height - 1);
+				auto primary = world.hit(
+					camera.get_ray(double(x) / (kWidth - 1),
+						double(y) / (kHeight - 1)),
+					kBias, kInfinityDouble);
 
-				const auto& ray = gvars.m_camera.get_ray(u, v);
+				if (!primary.is_hitted())
+					continue;
 
-				bool is_hitted{};
+				auto origin = primary.get_point();
 
-				output_color +=
-					draw_with_materials(ray, world, gvars.m_depth_count);
-			}
+				// the point light is at t = 1, the directional one is at
+				// the infinity
+				ray_t rays[] = {ray_t(origin, light_position - origin),
+					ray_t(origin, light_direction)};
+				double t_maxes[] = {1.0, kInfinityDouble};
+
+				for (int i = 0; i < 2; ++i)
+				{
+					bool is_occluded =
+						world.occluded(rays[i], kBias, t_maxes[i]);
+
+					++ray_count;
+					occluded_count += is_occluded ? 1 : 0;
 
-			img.write(output_color, gvars.m_samples_per_pixel, true);
+					if (is_occluded !=
+						world.hit(rays[i], kBias, t_maxes[i]).is_hitted())
+					{
+						++mismatch_count;
+					}
+				}
+			}
 		}
+
+		std::cout << "occluded: accelerator "
+				  << static_cast<int>(accelerator) << ", " << ray_count
+				  << " shadow rays, " << occluded_count << " occluded, "
+				  << mismatch_count << " mismatches" << std::endl;
 	}
 }
 
-void test_world_camera_antialiasing_materials_refraction_with_gamma_correction(
-	global_vars_t& gvars)
+// the field of test18 ten times bigger, written to a scene file and rendered
+// from it with a resident budget of a few treelets, so they are paged in and
+// dropped all the time
+void test_world_camera_out_of_core(global_vars_t& gvars)
 {
-	auto aspect_ratio = 16.0 / 9.0;
-	auto width = 400;
-	auto height = width / aspect_ratio;
-	auto viewport_height = 2.0;
+	static constexpr int kSphereCount = 100000;
+	static constexpr std::size_t kResidentBudget = 1024 * 1024;
 
-	gvars.m_camera = camera_t({0.0, 0.0, 0.0}, aspect_ratio, viewport_height);
-	gvars.m_samples_per_pixel = 100;
-	gvars.m_depth_count = 50;
+	auto file_name =
+		(std::filesystem::temp_directory_path() / "simpleray_test19.scene")
+			.string();
 
-	world_t world;
-	world.add(entity_t(eEntityType::kEntityType_Sphere,
-		sphere_data_t(true, 0.5, {0.0, 0.0, -1.0}, {1.0, 0.0, 0.0},
-			material_t(eMaterialType::kMaterialType_Metal, 0.5,
-				glm::dvec3(0.7, 0.3, 0.3)))));
+	{
+		world_t world;
+		build_scene_random_spheres(world, kSphereCount, 1);
 
-	world.add(entity_t(eEntityType::kEntityType_Sphere,
-		sphere_data_t(true, 0.5, {1.2, 0.0, -1.0}, {1.0, 0.0, 0.0},
-			material_t(eMaterialType::kMaterialType_Diffuse,
-				glm::dvec3(0.8, 0.2, 0.2)))));
+		if (!world.write_scene_file(file_name.c_str()))
+			return;
+	}
 
-	world.add(entity_t(eEntityType::kEntityType_Sphere,
-		sphere_data_t(true, 0.5, {-1.2, 0.0, -1.0}, {1.0, 0.0, 0.0},
-			material_t(eMaterialType::kMaterialType_Dielectric, 1.5, 0.0,
-				glm::dvec3(0.2, 0.2, 0.8)))));
+	auto p_scene = std::make_shared<mapped_scene_t>();
 
-	world.add(entity_t(eEntityType::kEntityType_Sphere,
-		sphere_data_t(false, 100.0, {0.0, -100.5, -1.0}, {0.0, 1.0, 0.0},
-			material_t(eMaterialType::kMaterialType_Diffuse,
-				glm::dvec3(0.8, 0.8, 0.0)))));
+	if (!p_scene->open(file_name.c_str(), kResidentBudget))
+		return;
 
-	image_ppm_t img(width, height);
+	auto p_world = std::make_shared<world_t>();
+	p_world->set_mapped_scene(p_scene);
 
-	img.open(
-		"test8_world_camera_materials_refraction_with_gamma_correction.ppm");
+	auto aspect_ratio = 16.0 / 9.0;
+	auto width = 400;
+	auto height = width / aspect_ratio;
 
-	for (int j = height - 1; j >= 0; --j)
-	{
-		for (int i = 0; i < width; ++i)
-		{
-			glm::dvec3 output_color(0.0, 0.0, 0.0);
+	render_settings_t settings;
+	settings.m_width = width;
+	settings.m_height = static_cast<int>(height);
+	settings.m_samples_per_pixel = 16;
+	settings.m_depth_count = 50;
+	settings.m_is_use_gamma_correction = true;
+	settings.m_mode = eRenderMode::kRenderMode_Materials;
 
-			for (int sample_index = 0; sample_index < gvars.m_samples_per_pixel;
-				 ++sample_index)
-			{
-				auto u = (double(i) + math_random_double()) / (width - 1);
-				auto v = (double(j) + math_random_double()) / (height - 1);
+	auto p_job = gvars.m_scheduler.submit(std::make_shared<render_job_t>(
+		p_world, make_camera_random_spheres(kSphereCount, aspect_ratio),
+		settings, "test19_world_camera_out_of_core.ppm"));
 
-				const auto& ray = gvars.m_camera.get_ray(u, v);
+	p_job->wait_written();
 
-				bool is_hitted{};
+	auto statistics = p_scene->get_statistics();
 
-				output_color +=
-					draw_with_materials(ray, world, gvars.m_depth_count);
-			}
+	std::cout << "out of core: " << statistics.m_treelet_count
+			  << " treelets, file " << statistics.m_file_size / (1024 * 1024)
+			  << " MB, resident " << statistics.m_resident_size / 1024
+			  << " KB, " << statistics.m_fault_count << " faults, "
+			  << statistics.m_hit_count << " hits, "
+			  << statistics.m_eviction_count << " evictions" << std::endl;
+}
 
-			img.write(output_color, gvars.m_samples_per_pixel, true);
-		}
+// simpleray --benchmark [max sphere count] [linear|grid|bvh]: build time of
+// the scene and of its acceleration structure, quality of the bvh, memory and
+// rays per second of build_scene_random_spheres from 10 spheres up to the max
+// one, every size renders the same small image
+void benchmark_random_spheres(
+	global_vars_t& gvars, int max_sphere_count, eAccelerator accelerator)
+{
+	render_settings_t settings;
+	settings.m_width = 320;
+	settings.m_height = 180;
+	settings.m_samples_per_pixel = 4;
+	settings.m_depth_count = 8;
+	settings.m_mode = eRenderMode::kRenderMode_Materials;
+	settings.m_output_type = eOutputType::kOutputType_Memory;
+
+	std::cout << "spheres, scene ms, build ms, sah cost, memory MB, bytes per "
+				 "sphere, render ms, Mrays/s"
+			  << std::endl;
+
+	for (std::int64_t sphere_count = 10; sphere_count <= max_sphere_count;
+		 sphere_count *= 10)
+	{
+		auto start_time = std::chrono::steady_clock::now();
+
+		auto p_world = std::make_shared<world_t>();
+		p_world->set_accelerator(accelerator);
+		build_scene_random_spheres(
+			*p_world, static_cast<int>(sphere_count), 1);
+
+		auto build_start_time = std::chrono::steady_clock::now();
+
+		p_world->commit();
+
+		auto end_time = std::chrono::steady_clock::now();
+		auto scene_time = std::chrono::duration<double, std::milli>(
+			build_start_time - start_time)
+							  .count();
+		auto build_time = std::chrono::duration<double, std::milli>(
+			end_time - build_start_time)
+							  .count();
+		auto memory_usage = p_world->get_memory_usage();
+
+		auto p_job = gvars.m_scheduler.submit(std::make_shared<render_job_t>(
+			p_world,
+			make_camera_random_spheres(static_cast<int>(sphere_count),
+				double(settings.m_width) / settings.m_height),
+			settings, "benchmark"));
+
+		p_job->wait_written();
+
+		auto render_time = p_job->get_elapsed().count();
+
+		std::cout << sphere_count << ", " << scene_time << ", " << build_time
+				  << ", " << p_world->get_sah_cost() << ", "
+				  << memory_usage / (1024.0 * 1024.0) << ", "
+				  << memory_usage / sphere_count << ", " << render_time << ", "
+				  << (render_time
+							 ? p_job->get_ray_count() / (1000.0 * render_time)
+							 : 0.0)
+				  << std::endl;
 	}
 }
 
@@ -1670,6 +11253,23 @@ void update(global_vars_t& gvars)
 
 	test_world_camera_antialiasing_materials_refraction_with_gamma_correction(
 		gvars);
+
+	test_world_camera_mapped_output(gvars);
+	test_world_camera_checkpoint(gvars);
+	test_world_camera_denoiser(gvars);
+	test_world_camera_incremental(gvars);
+	test_world_camera_first_hit_cache(gvars);
+	test_world_camera_distributed(gvars);
+	test_world_camera_server(gvars);
+	test_world_camera_time_budget(gvars);
+	test_world_camera_crop(gvars);
+	test_world_camera_random_spheres(gvars);
+	test_world_camera_out_of_core(gvars);
+	test_world_camera_grid(gvars);
+	test_world_camera_rasterized_primary(gvars);
+	test_world_occluded(gvars);
+
+	gvars.m_scheduler.wait();
 }
 
 /* deinit */
@@ -1677,12 +11277,140 @@ void deinit_window(global_vars_t& gvars) {}
 
 void deinit(global_vars_t& gvars)
 {
+	gvars.m_scheduler.stop();
+
 	deinit_window(gvars);
 }
 
-int main()
+int main(int argc, char** argv)
 {
+	// --pin-threads anywhere in the arguments pins render threads to cores,
+	// --trace <file> writes the trace_t of the run there, the rest of the
+	// arguments are parsed without them
+	bool is_pin_threads{};
+	std::string trace_file_name;
+	int arg_count{1};
+
+	for (int i = 1; i < argc; ++i)
+	{
+		std::string argument = argv[i];
+
+		if (argument == "--pin-threads")
+			is_pin_threads = true;
+		else if (argument == "--trace" && i + 1 < argc)
+			trace_file_name = argv[++i];
+		else
+			argv[arg_count++] = argv[i];
+	}
+
+	argc = arg_count;
+
+	// threads are joined before it is written
+	auto write_trace = [&trace_file_name]() {
+		if (!trace_file_name.empty())
+			trace_get().write(trace_file_name);
+	};
+
+	if (!trace_file_name.empty())
+	{
+		trace_get().start();
+		trace_get().set_thread_name("main");
+	}
+
+#ifndef _WIN32
+	// simpleray --worker <address> [thread count] renders units of
+	// render_coordinator_t until it says quit
+	if (argc >= 3 && std::string(argv[1]) == "--worker")
+	{
+		render_worker_t worker;
+		worker.run(argv[2],
+			argc >= 4 ? std::atoi(argv[3])
+					  : static_cast<int>(std::thread::hardware_concurrency()),
+			is_pin_threads);
+
+		write_trace();
+
+		return 0;
+	}
+
+	// simpleray --server <address> [memory limit in MB] renders requests
+	// until SIGINT or SIGTERM
+	if (argc >= 3 && std::string(argv[1]) == "--server")
+	{
+		// signals are taken by sigwait below, not by the render threads
+		sigset_t signals;
+		sigemptyset(&signals);
+		sigaddset(&signals, SIGINT);
+		sigaddset(&signals, SIGTERM);
+		pthread_sigmask(SIG_BLOCK, &signals, nullptr);
+
+		global_vars_t gvars;
+		gvars.m_is_pin_threads = is_pin_threads;
+
+		init(gvars);
+
+		render_scene_cache_t scenes(
+			(argc >= 4 ? std::strtoull(argv[3], nullptr, 10) : 1024) << 20);
+		register_scenes(scenes);
+
+		render_server_t server(gvars.m_scheduler, scenes);
+
+		if (server.start(argv[2]))
+		{
+			std::cout << "listening on " << argv[2] << std::endl;
+
+			int signal{};
+			sigwait(&signals, &signal);
+
+			server.stop();
+		}
+
+		deinit(gvars);
+
+		write_trace();
+
+		return 0;
+	}
+#endif
+
+	if (argc >= 2 && std::string(argv[1]) == "--benchmark")
+	{
+		auto accelerator = eAccelerator::kAccelerator_BVH;
+
+		if (argc >= 4)
+		{
+			std::string name = argv[3];
+
+			if (name == "linear")
+				accelerator = eAccelerator::kAccelerator_Linear;
+			else if (name == "grid")
+				accelerator = eAccelerator::kAccelerator_Grid;
+			else if (name != "bvh")
+			{
+				std::cout << "unknown accelerator " << name
+						  << ", expected linear, grid or bvh" << std::endl;
+
+				return 1;
+			}
+		}
+
+		global_vars_t gvars;
+		gvars.m_is_pin_threads = is_pin_threads;
+
+		init(gvars);
+
+		benchmark_random_spheres(
+			gvars, argc >= 3 ? std::atoi(argv[2]) : 1000000, accelerator);
+
+		deinit(gvars);
+
+		write_trace();
+
+		return 0;
+	}
+
 	global_vars_t gvars;
+	gvars.m_is_pin_threads = is_pin_threads;
 
 	init(gvars);
 
@@ -1690,5 +11418,7 @@ int main()
 
 	deinit(gvars);
 
+	write_trace();
+
 	return 0;
 }